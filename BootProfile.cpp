@@ -0,0 +1,76 @@
+/*
+ * BootProfile.cpp
+ *
+ * Records when each startup stage finished, counted from app start, so the console
+ * can show where boot time goes. Stages are marked from both setup() and the
+ * task that brings up the radio, so each mark also records the core it ran on.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "BootProfile.h"
+#include "Logger.h"
+
+BootProfile::Stage BootProfile::stages[BOOT_PROFILE_STAGES];
+std::atomic<uint32_t> BootProfile::stageCount(0);
+
+/*
+ * Note that a stage just finished. micros() counts from when the app started
+ * so the times include nothing from the bootloader. Marks past
+ * BOOT_PROFILE_STAGES are ignored.
+ */
+void BootProfile::mark(const char *stage)
+{
+    uint32_t now = micros();
+    uint32_t idx = stageCount.fetch_add(1, std::memory_order_relaxed);
+    if (idx >= BOOT_PROFILE_STAGES) return;
+
+    stages[idx].name = stage;
+    stages[idx].micros = now;
+    stages[idx].core = xPortGetCoreID();
+}
+
+/*
+ * List the stages in the order they were marked. The step is the time since
+ * the previous stage on the same core, which is what that stage cost.
+ */
+void BootProfile::print()
+{
+    uint32_t count = stageCount.load(std::memory_order_relaxed);
+    if (count > BOOT_PROFILE_STAGES) count = BOOT_PROFILE_STAGES;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t prev = 0;
+        for (int j = i - 1; j >= 0; j--)
+        {
+            if (stages[j].core == stages[i].core)
+            {
+                prev = stages[j].micros;
+                break;
+            }
+        }
+        Logger::console("%s: at %ius (+%ius) on core %i", stages[i].name, stages[i].micros,
+                        stages[i].micros - prev, stages[i].core);
+    }
+    if (count == 0) Logger::console("No boot stages recorded");
+}
@@ -0,0 +1,53 @@
+/*
+ * BootProfile.h
+ *
+ * Records when each startup stage finished, counted from app start, so the console
+ * can show where boot time goes. Stages are marked from both setup() and the
+ * task that brings up the radio, so each mark also records the core it ran on.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef BOOTPROFILE_H_
+#define BOOTPROFILE_H_
+
+#include <Arduino.h>
+#include <atomic>
+#include "config.h"
+
+class BootProfile {
+public:
+    static void mark(const char *stage);
+    static void print();
+
+private:
+    struct Stage {
+        const char *name;
+        uint32_t micros;
+        uint8_t core;
+    };
+
+    static Stage stages[BOOT_PROFILE_STAGES];
+    static std::atomic<uint32_t> stageCount;
+};
+
+#endif /* BOOTPROFILE_H_ */
@@ -0,0 +1,207 @@
+/*
+ * BusStats.cpp
+ *
+ * Per-ID traffic statistics and bus load, see BusStats.h
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "BusStats.h"
+#include <math.h>
+#include "FrameTable.h"
+#include "Logger.h"
+
+extern FrameTable frameTable;
+
+BusStats::BusStats()
+{
+    reset();
+}
+
+void BusStats::reset()
+{
+    memset(entries, 0, sizeof(entries));
+    memset(&load, 0, sizeof(load));
+    windowStart = millis();
+    windowBits = 0;
+    windowStuffedBits = 0;
+    windowFrames = 0;
+}
+
+/*
+ * The period statistics use Welford's method so neither the samples nor a sum
+ * of squares that grows without bound are needed.
+ */
+void BusStats::processFrame(CAN_FRAME &frame, int entry)
+{
+    windowBits += frameBits(frame, false);
+    windowStuffedBits += frameBits(frame, true);
+    windowFrames++;
+
+    const LatestFrame *latest = frameTable.get(entry);
+    if (!latest) return;
+    Entry &stats = entries[entry];
+    //a new ID, or the table was cleared and the entry belongs to another ID now
+    if (stats.count == 0 || latest->count == 1)
+    {
+        memset(&stats, 0, sizeof(stats));
+        stats.firstMillis = millis();
+        stats.dlcMin = latest->length;
+    }
+    else
+    {
+        float period = latest->micros - stats.lastMicros;
+        float delta = period - stats.periodMean;
+        stats.periodMean += delta / stats.count; //frames before this one, so periods including this one
+        stats.periodM2 += delta * (period - stats.periodMean);
+    }
+    stats.count++;
+    stats.lastMicros = latest->micros;
+    if (latest->changed) stats.changes++;
+    if (latest->length < stats.dlcMin) stats.dlcMin = latest->length;
+    if (latest->length > stats.dlcMax) stats.dlcMax = latest->length;
+}
+
+void BusStats::loop()
+{
+    uint32_t elapsed = millis() - windowStart;
+    if (elapsed < BUS_LOAD_WINDOW) return;
+
+    float capacity = (float)settings.CAN0Speed * elapsed / 1000;
+    if (capacity > 0)
+    {
+        load.minLoad = windowBits / capacity;
+        load.maxLoad = windowStuffedBits / capacity;
+        if (load.maxLoad > load.peakLoad) load.peakLoad = load.maxLoad;
+    }
+    load.framesPerSecond = (uint64_t)windowFrames * 1000 / elapsed;
+    windowStart += elapsed;
+    windowBits = 0;
+    windowStuffedBits = 0;
+    windowFrames = 0;
+}
+
+bool BusStats::getStats(int entry, IdStats &stats)
+{
+    const LatestFrame *latest = frameTable.get(entry);
+    if (!latest || entries[entry].count == 0) return false;
+    const Entry &e = entries[entry];
+    float seconds = (millis() - e.firstMillis) / 1000.0f;
+
+    stats.id = latest->id;
+    stats.count = e.count;
+    stats.changes = e.changes;
+    stats.periodMean = e.periodMean;
+    stats.periodStdDev = (e.count > 2) ? sqrtf(e.periodM2 / (e.count - 2)) : 0;
+    stats.dlcMin = e.dlcMin;
+    stats.dlcMax = e.dlcMax;
+    stats.frameRate = (seconds > 0) ? e.count / seconds : 0;
+    stats.changeRate = (seconds > 0) ? e.changes / seconds : 0;
+    return true;
+}
+
+void BusStats::getLoad(BusLoad &load)
+{
+    load = this->load;
+}
+
+void BusStats::printAll()
+{
+    IdStats stats;
+    int count = 0;
+
+    Logger::console("Bus load %f-%f%% (peak %f%%), %i frames/s", load.minLoad * 100, load.maxLoad * 100,
+                    load.peakLoad * 100, load.framesPerSecond);
+    for (int i = 0; i < frameTable.getCount(); i++)
+    {
+        if (!getStats(i, stats)) continue;
+        Logger::console("%X: %i frames, period %fus sd %fus, DLC %i-%i, %f changes/s", stats.id & 0x7FFFFFFF, stats.count,
+                        stats.periodMean, stats.periodStdDev, stats.dlcMin, stats.dlcMax, stats.changeRate);
+        count++;
+    }
+    if (count == 0) Logger::console("No frames yet");
+}
+
+static int putUInt32(uint8_t *buffer, uint32_t val)
+{
+    buffer[0] = (uint8_t)val;
+    buffer[1] = (uint8_t)(val >> 8);
+    buffer[2] = (uint8_t)(val >> 16);
+    buffer[3] = (uint8_t)(val >> 24);
+    return 4;
+}
+
+/*
+ * Bus load in tenths of a percent without and with stuff bits, the peak and
+ * frames per second, then the number of IDs and per ID: ID (bit 31 for 29 bit
+ * IDs), frame count, mean and standard deviation of the period in
+ * microseconds, DLC min and max and the number of data changes. All little
+ * endian. IDs that don't fit in room are left out and not counted.
+ */
+int BusStats::writeBinary(uint8_t *buffer, int room)
+{
+    const int idLength = 22;
+    IdStats stats;
+    int len = 0;
+
+    if (room < 12) return 0;
+    uint16_t permille[3] = {(uint16_t)(load.minLoad * 1000), (uint16_t)(load.maxLoad * 1000), (uint16_t)(load.peakLoad * 1000)};
+    for (int i = 0; i < 3; i++)
+    {
+        buffer[len++] = permille[i] & 0xFF;
+        buffer[len++] = permille[i] >> 8;
+    }
+    len += putUInt32(&buffer[len], load.framesPerSecond);
+    int countPos = len;
+    len += 2;
+
+    uint16_t count = 0;
+    for (int i = 0; i < frameTable.getCount() && len + idLength <= room; i++)
+    {
+        if (!getStats(i, stats)) continue;
+        len += putUInt32(&buffer[len], stats.id);
+        len += putUInt32(&buffer[len], stats.count);
+        len += putUInt32(&buffer[len], (uint32_t)stats.periodMean);
+        len += putUInt32(&buffer[len], (uint32_t)stats.periodStdDev);
+        buffer[len++] = stats.dlcMin;
+        buffer[len++] = stats.dlcMax;
+        len += putUInt32(&buffer[len], stats.changes);
+        count++;
+    }
+    buffer[countPos] = count & 0xFF;
+    buffer[countPos + 1] = count >> 8;
+    return len;
+}
+
+/*
+ * SOF to end of frame plus the three bit interframe space: 47 bits for an 11
+ * bit ID and 67 for a 29 bit one, plus the data. Stuffing adds a bit after
+ * every five equal ones from SOF through the CRC, at worst one per four bits
+ * after the first.
+ */
+uint32_t BusStats::frameBits(const CAN_FRAME &frame, bool worstStuffing)
+{
+    uint32_t dataBits = frame.rtr ? 0 : 8 * ((frame.length > 8) ? 8 : frame.length);
+    uint32_t bits = (frame.extended ? 67 : 47) + dataBits;
+    if (worstStuffing) bits += ((frame.extended ? 54 : 34) + dataBits - 1) / 4;
+    return bits;
+}
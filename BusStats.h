@@ -0,0 +1,92 @@
+/*
+ * BusStats.h
+ *
+ * Per-ID traffic statistics and the bus load, updated with a constant amount
+ * of work per frame.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef BUSSTATS_H_
+#define BUSSTATS_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include <esp32_can.h>
+
+struct IdStats {
+    uint32_t id;            //bit 31 set for a 29 bit ID
+    uint32_t count;
+    uint32_t changes;       //frames whose data differed from the one before
+    float periodMean;       //microseconds between frames
+    float periodStdDev;
+    uint8_t dlcMin;
+    uint8_t dlcMax;
+    float frameRate;        //frames per second since the ID was first seen
+    float changeRate;       //data changes per second
+};
+
+//over the last complete BUS_LOAD_WINDOW, as a fraction of CAN0Speed
+struct BusLoad {
+    float minLoad;          //without stuff bits
+    float maxLoad;          //with as many stuff bits as the frames could have
+    float peakLoad;         //highest maxLoad since the last reset
+    uint32_t framesPerSecond;
+};
+
+class BusStats {
+public:
+    BusStats();
+    void reset();
+    //entry is the frame's FrameTable entry, -1 counts the frame toward the bus load only
+    void processFrame(CAN_FRAME &frame, int entry);
+    //closes the load window every BUS_LOAD_WINDOW ms
+    void loop();
+    bool getStats(int entry, IdStats &stats);
+    void getLoad(BusLoad &load);
+    void printAll();
+    //GVRET PROTO_GET_BUS_STATS reply, see the implementation. Returns the bytes written
+    int writeBinary(uint8_t *buffer, int room);
+    //bits on the wire including the interframe space, with no or worst case stuffing
+    static uint32_t frameBits(const CAN_FRAME &frame, bool worstStuffing);
+
+private:
+    struct Entry {
+        uint32_t count;
+        uint32_t firstMillis;
+        uint32_t lastMicros;
+        uint32_t changes;
+        float periodMean;   //Welford's running mean and sum of squared differences
+        float periodM2;
+        uint8_t dlcMin;
+        uint8_t dlcMax;
+    };
+
+    Entry entries[FRAME_TABLE_SIZE];
+    uint32_t windowStart;   //millis()
+    uint32_t windowBits;
+    uint32_t windowStuffedBits;
+    uint32_t windowFrames;
+    BusLoad load;
+};
+
+#endif /* BUSSTATS_H_ */
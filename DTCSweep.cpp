@@ -0,0 +1,310 @@
+/*
+ * DTCSweep.cpp
+ *
+ * Reads every ECU's DTCs at once, see DTCSweep.h
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "DTCSweep.h"
+#include "PIDPoller.h"
+#include "UDSReader.h"
+#include "UDSStreamer.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "obd2_codes.h"
+
+extern PIDPoller pidPoller;
+extern UDSReader udsReader;
+extern UDSStreamer udsStreamer;
+
+MetricCounter dtcSweeps("dtc.sweeps");
+MetricHistogram dtcSweepTime("dtc.sweep_us");
+
+#define NRC_RESPONSE_PENDING    0x78
+
+static const char *flagNames[] = {"stored", "pending", "permanent", "uds"};
+
+DTCSweep::DTCSweep()
+{
+    state = Idle;
+    count = 0;
+    responders = 0;
+}
+
+void DTCSweep::setup()
+{
+    state = Idle;
+    for (int i = 0; i < 8; i++) channels[i].begin(0x7E0 + i, 0x7E8 + i, buffers[i], DTC_SWEEP_BUFFER);
+}
+
+/*
+ * The services go out one after another, an ECU drops a request it is still
+ * working on when the next one arrives. The first waits the whole
+ * PID_RESPONSE_TIMEOUT since nobody knows which ECUs are there. The rest are
+ * over as soon as those ECUs answered.
+ */
+void DTCSweep::loop(bool busy)
+{
+    TRACE_SCOPE("dtc_sweep");
+
+    if (state == Waiting)
+    {
+        bool allIn = serviceIdx > 0 && (answered & responders) == responders;
+        if (!allIn && (int32_t)(micros() - deadline) <= 0) return;
+        if (serviceIdx == 0) responders = answered;
+        serviceIdx++;
+        state = (serviceIdx < serviceCount) ? Ready : Done;
+        if (state == Done) dtcSweepTime.record(micros() - startMicros);
+        return;
+    }
+    if (state != Ready || busy || !settings.CAN0_Enabled) return;
+    sendService();
+}
+
+bool DTCSweep::processFrame(CAN_FRAME &frame)
+{
+    if (state != Waiting || frame.id < 0x7E8 || frame.id > 0x7EF || frame.extended) return false;
+    uint8_t ecu = frame.id - 0x7E8;
+
+    //only answers to the service asked for, a late answer to someone else is left alone
+    uint8_t service = services[serviceIdx];
+    uint8_t type = frame.data.byte[0] >> 4;
+    const uint8_t *start = (type == 0) ? &frame.data.byte[1] : &frame.data.byte[2];
+    if ((type == 0 || type == 1) && start[0] != service + 0x40 && !(start[0] == UDS_NEG_RESP && start[1] == service))
+        return false;
+
+    switch (channels[ecu].processFrame(frame))
+    {
+    case ISOTP_IGNORED:
+        return false;
+    case ISOTP_CONSUMED:
+        //a long answer that started in time gets to finish
+        if ((int32_t)(micros() + PID_RESPONSE_TIMEOUT - deadline) > 0) deadline = micros() + PID_RESPONSE_TIMEOUT;
+        return true;
+    case ISOTP_OVERFLOW:
+        LOG_DEBUG("DTC answer from ECU %i doesn't fit", ecu);
+        answered |= 1 << ecu;
+        return true;
+    case ISOTP_COMPLETE:
+        handleResponse(ecu, channels[ecu].getMessage(), channels[ecu].getLength());
+        return true;
+    }
+    return false;
+}
+
+void DTCSweep::yieldToClient()
+{
+    if (state != Waiting) return;
+    for (int i = 0; i < 8; i++) channels[i].reset();
+    state = Ready;
+}
+
+bool DTCSweep::start(bool uds)
+{
+    if (state != Idle) return false;
+    serviceCount = 0;
+    services[serviceCount++] = OBDII_SHOW_STORED_DTC;
+    services[serviceCount++] = OBDII_SHOW_PENDING_DTC;
+    services[serviceCount++] = OBDII_PERM_DTC;
+    if (uds) services[serviceCount++] = UDS_READ_DTC;
+    serviceIdx = 0;
+    count = 0;
+    truncated = false;
+    responders = 0;
+    state = Ready;
+    startMicros = micros();
+    dtcSweeps.inc();
+    return true;
+}
+
+bool DTCSweep::isBusy()
+{
+    return state != Idle;
+}
+
+bool DTCSweep::isActive()
+{
+    return state == Waiting;
+}
+
+bool DTCSweep::isDone()
+{
+    return state == Done;
+}
+
+int DTCSweep::getCount()
+{
+    return count;
+}
+
+const DTCEntry &DTCSweep::getEntry(int idx)
+{
+    return entries[idx];
+}
+
+uint8_t DTCSweep::getResponders()
+{
+    return responders;
+}
+
+void DTCSweep::release()
+{
+    for (int i = 0; i < 8; i++) channels[i].reset();
+    state = Idle;
+}
+
+String DTCSweep::toText(const char *lineEnding)
+{
+    String text = String();
+    char buff[48];
+
+    for (int i = 0; i < count; i++)
+    {
+        const DTCEntry &entry = entries[i];
+        char code[6];
+        formatCode(entry.code, code);
+        sprintf(buff, "%03X %s", 0x7E8 + entry.ecu, code);
+        text.concat(buff);
+        if (entry.failureType)
+        {
+            sprintf(buff, "-%02X", entry.failureType);
+            text.concat(buff);
+        }
+        for (int f = 0; f < 4; f++)
+        {
+            if (!(entry.flags & (1 << f))) continue;
+            text.concat(" ");
+            text.concat(flagNames[f]);
+        }
+        if (entry.flags & DTC_UDS)
+        {
+            sprintf(buff, ":%02X", entry.status);
+            text.concat(buff);
+        }
+        text.concat(lineEnding);
+    }
+    if (truncated)
+    {
+        text.concat("MORE");
+        text.concat(lineEnding);
+    }
+    return text;
+}
+
+void DTCSweep::formatCode(uint16_t code, char *text)
+{
+    static const char letters[] = "PCBU";
+    sprintf(text, "%c%04X", letters[code >> 14], code & 0x3FFF);
+}
+
+void DTCSweep::sendService()
+{
+    uint8_t service = services[serviceIdx];
+    CAN_FRAME frame;
+    frame.id = 0x7DF;
+    frame.length = 8;
+    frame.rtr = 0;
+    frame.extended = 0;
+    for (int i = 0; i < 8; i++) frame.data.byte[i] = 0xAA;
+    frame.data.byte[0] = 1;
+    frame.data.byte[1] = service;
+    if (service == UDS_READ_DTC)
+    {
+        frame.data.byte[0] = 3;
+        frame.data.byte[2] = 0x02; //report DTCs by status mask
+        frame.data.byte[3] = DTC_SWEEP_STATUS_MASK;
+    }
+    //every ECU drops what it was working on, ask the others to ask again
+    pidPoller.yieldToClient();
+    udsReader.yieldToClient();
+    udsStreamer.yieldToClient();
+    if (!CAN0.sendFrame(frame)) return;
+    for (int i = 0; i < 8; i++) channels[i].reset();
+    answered = 0;
+    deadline = micros() + PID_RESPONSE_TIMEOUT;
+    state = Waiting;
+}
+
+/*
+ * Modes 03/07/0A answer with a count and two bytes per DTC, 0x19 02 with
+ * the status availability mask and then three bytes and a status per DTC.
+ */
+void DTCSweep::handleResponse(uint8_t ecu, const uint8_t *message, uint16_t length)
+{
+    uint8_t service = services[serviceIdx];
+    if (message[0] == UDS_NEG_RESP)
+    {
+        if (length >= 3 && message[2] == NRC_RESPONSE_PENDING)
+        {
+            deadline = micros() + ELM_PENDING_TIMEOUT;
+            return;
+        }
+        answered |= 1 << ecu;
+        return;
+    }
+    answered |= 1 << ecu;
+
+    if (service == UDS_READ_DTC)
+    {
+        for (int pos = 3; pos + 4 <= length; pos += 4)
+        {
+            add(ecu, (message[pos] << 8) | message[pos + 1], message[pos + 2], DTC_UDS, message[pos + 3]);
+        }
+        return;
+    }
+    uint8_t flag = (service == OBDII_SHOW_STORED_DTC) ? DTC_STORED :
+                   (service == OBDII_SHOW_PENDING_DTC) ? DTC_PENDING : DTC_PERMANENT;
+    //some ECUs leave out the count, then every byte pair is a DTC
+    int pos = (length >= 2 && length == 2 + 2 * message[1]) ? 2 : 1;
+    for (; pos + 2 <= length; pos += 2)
+    {
+        uint16_t code = (message[pos] << 8) | message[pos + 1];
+        if (code) add(ecu, code, 0, flag, 0); //0000 pads out a frame
+    }
+}
+
+//the same code from the same ECU is one entry, whichever services reported it
+void DTCSweep::add(uint8_t ecu, uint16_t code, uint8_t failureType, uint8_t flag, uint8_t status)
+{
+    for (int i = 0; i < count; i++)
+    {
+        DTCEntry &entry = entries[i];
+        if (entry.ecu != ecu || entry.code != code) continue;
+        if (failureType && !entry.failureType) entry.failureType = failureType;
+        entry.flags |= flag;
+        if (flag == DTC_UDS) entry.status = status;
+        return;
+    }
+    if (count == DTC_SWEEP_MAX)
+    {
+        truncated = true;
+        return;
+    }
+    DTCEntry &entry = entries[count++];
+    entry.ecu = ecu;
+    entry.code = code;
+    entry.failureType = failureType;
+    entry.flags = flag;
+    entry.status = status;
+}
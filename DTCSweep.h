@@ -0,0 +1,103 @@
+/*
+ * DTCSweep.h
+ *
+ * Reads the DTCs of every ECU at once: Modes 03, 07 and 0A and optionally
+ * UDS 0x19 go out functionally on 7DF, the answers are reassembled side by
+ * side and merged into one list.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef DTCSWEEP_H_
+#define DTCSWEEP_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include <esp32_can.h>
+#include "IsoTp.h"
+
+//where a DTC was reported, an entry merges all of them
+#define DTC_STORED      1 //Mode 03
+#define DTC_PENDING     2 //Mode 07
+#define DTC_PERMANENT   4 //Mode 0A
+#define DTC_UDS         8 //UDS 0x19, status holds its status byte
+
+struct DTCEntry {
+    uint8_t ecu;        //0-7 for 7E8-7EF
+    uint16_t code;      //the two bytes OBDII reports, P0133 is 0x0133
+    uint8_t failureType; //third byte of a UDS DTC, 0 for OBDII ones
+    uint8_t flags;
+    uint8_t status;
+};
+
+class DTCSweep {
+public:
+    DTCSweep();
+    void setup();
+    //busy while another requester has the bus, nothing is sent then
+    void loop(bool busy);
+    //true if the frame answered the sweep
+    bool processFrame(CAN_FRAME &frame);
+    //the ELM327 client sent a request of its own. The service in flight is asked again afterward
+    void yieldToClient();
+    //ask every ECU for its stored, pending and permanent DTCs, and with uds also 0x19. Fails while a sweep runs
+    bool start(bool uds);
+    //a sweep is running or its results haven't been released yet
+    bool isBusy();
+    //a request is on the bus, other requesters should hold off
+    bool isActive();
+    bool isDone();
+    int getCount();
+    const DTCEntry &getEntry(int idx);
+    //bit n set if ECU n answered
+    uint8_t getResponders();
+    void release();
+    //one line per DTC: ECU code and where it was reported, e.g. 7E8 P0420 stored pending
+    String toText(const char *lineEnding);
+    //P0133, C0300, B1000 or U0100 into text, which needs 6 bytes
+    static void formatCode(uint16_t code, char *text);
+
+private:
+    enum State {
+        Idle, Ready, Waiting, Done
+    };
+
+    IsoTpChannel channels[8];
+    uint8_t buffers[8][DTC_SWEEP_BUFFER];
+    uint8_t services[4];
+    int serviceCount;
+    int serviceIdx;
+    uint8_t responders;     //ECUs that answered the first service, the others are only waited for then
+    uint8_t answered;       //ECUs that answered the service in flight
+    DTCEntry entries[DTC_SWEEP_MAX];
+    int count;
+    bool truncated;         //more DTCs than DTC_SWEEP_MAX
+    State state;
+    uint32_t deadline;
+    uint32_t startMicros;
+
+    void sendService();
+    void handleResponse(uint8_t ecu, const uint8_t *message, uint16_t length);
+    void add(uint8_t ecu, uint16_t code, uint8_t failureType, uint8_t flag, uint8_t status);
+};
+
+#endif /* DTCSWEEP_H_ */
@@ -31,6 +31,17 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
 #include "ELM327_Emulator.h"
+#include "PeriodicSender.h"
+#include "PIDPoller.h"
+#include "UDSReader.h"
+#include "UDSStreamer.h"
+#include "DTCSweep.h"
+#include "SignalDB.h"
+#include "FrameTable.h"
+#include "TriggerEngine.h"
+#include "Player.h"
+#include "Metrics.h"
+#include "Trace.h"
 #include <esp32_can.h>
 #include "config.h"
 #ifdef BLUETOOTH
@@ -42,9 +53,19 @@ BluetoothSerial SerialBT;
 #include <ESPmDNS.h>
 #include <ArduinoOTA.h>
 extern WiFiClient clientNodes[MAX_CLIENTS];
+WiFiUDP feedUDP;
 #endif
 
 extern EEPROMSettings settings;
+extern PeriodicSender periodicSender;
+extern PIDPoller pidPoller;
+extern UDSReader udsReader;
+extern UDSStreamer udsStreamer;
+extern DTCSweep dtcSweep;
+extern SignalDB signalDB;
+extern FrameTable frameTable;
+extern TriggerEngine triggerEngine;
+extern Player player;
 
 CAN_FRAME stmBuff[NUM_STM_BUFFER];
 int stmWriteIdx = 0;
@@ -53,6 +74,13 @@ int stmReadIdx = 0;
 uint32_t passFilter[NUM_PASS_FILTERS];
 uint32_t passMask[NUM_PASS_FILTERS];
 
+MetricCounter elmCommands("elm.commands");
+MetricCounter elmBytesOut("elm.bytes_out");
+MetricCounter stmDrops("elm.stm_drops");
+MetricHistogram ecuResponseTime("elm.ecu_response_us");
+MetricCounter elmNoData("elm.no_data");
+MetricCounter feedDrops("elm.feed_drops");
+
 //192,168.0.10 - our IP address
 //port 35000 - listen on this port
 
@@ -69,12 +97,31 @@ void ELM327Emu::setup() {
     tickCounter = 0;
     ibWritePtr = 0;
     stmActive = false;
+    requestId = 0x7E0;
+    awaitingReply = false;
+    awaitingUDS = false;
+    awaitingDTCs = false;
+    feedFormat = 0;
+    feedLength = 0;
+    datagramLength = 0;
+    lastFeedFlush = 0;
+    monitorInterval = 0;
+    for (int i = 0; i < 8; i++) feedPIDs[i] = 0xFFFFFFFF;
+    for (int i = 0; i < SIGNAL_MAX / 32; i++) feedSignals[i] = 0xFFFFFFFF;
+    for (int i = 0; i < FEED_UDP_SUBSCRIBERS; i++) feedPort[i] = 0;
 
     for (int i = 0; i < NUM_PASS_FILTERS; i++)
     {
         passFilter[i] = 0;
         passMask[i] = 0;
     }
+}
+
+/*
+ * Starting the Bluetooth stack takes far longer than the rest of startup so it
+ * is kept out of setup() and run from a separate task.
+ */
+void ELM327Emu::setupBluetooth() {
 #ifdef BLUETOOTH
     SerialBT.begin(settings.btName);
 #endif
@@ -97,6 +144,7 @@ void ELM327Emu::processByte(int incoming) {
 
 void ELM327Emu::loop()
 {
+    TRACE_SCOPE("elm_loop");
 #ifdef BLUETOOTH
     int incoming;
     while (SerialBT.available()) {
@@ -104,10 +152,63 @@ void ELM327Emu::loop()
         processByte(incoming);
     }
 #endif
+    if (awaitingReply && (int32_t)(micros() - replyDeadline) > 0)
+    {
+        elmNoData.inc();
+        String retString = String("NO DATA");
+        retString.concat(bLineFeed ? "\r\n" : "\r");
+        finishReply(retString);
+    }
+    if (awaitingUDS && udsReader.isDone(UDSReader::Elm))
+    {
+        String retString = udsReader.toText(bLineFeed ? "\r\n" : "\r");
+        udsReader.release();
+        awaitingUDS = false;
+        finishReply(retString);
+    }
+    if ((feedLength || datagramLength) &&
+        (micros() - lastFeedFlush > FEED_FLUSH_INTERVAL || feedLength > FEED_BUFF_SIZE / 2 || datagramLength > FEED_BUFF_SIZE / 2))
+    {
+        TRACE_SCOPE("elm_feed");
+        flushFeed();
+    }
+    if (monitorInterval && millis() - lastMonitor >= monitorInterval)
+    {
+        lastMonitor = millis();
+        sendLatestFrames();
+    }
+    if (awaitingDTCs && dtcSweep.isDone())
+    {
+        const char *lineEnding = bLineFeed ? "\r\n" : "\r";
+        String retString = dtcSweep.toText(lineEnding);
+        retString.concat(dtcSweep.getResponders() ? "OK" : "NO DATA");
+        retString.concat(lineEnding);
+        dtcSweep.release();
+        awaitingDTCs = false;
+        finishReply(retString);
+    }
 }
 
 void ELM327Emu::processFrame(CAN_FRAME &frame)
 {
+    TRACE_SCOPE("elm_frame");
+    uint32_t latency;
+    if (pidProfiler.frameReceived(frame, latency)) ecuResponseTime.record(latency);
+    PIDValue decoded[3]; //a single frame holds at most three PIDs
+    int count = pidDecoder.processFrame(frame, decoded, 3);
+    if (count) sendFeed(decoded, count);
+    StreamValue values[UDS_STREAM_MAX_PARTS];
+    int streamed = udsStreamer.decode(frame, values, UDS_STREAM_MAX_PARTS);
+    if (streamed) sendStreamFeed(values, streamed);
+    uint8_t changed[SIGNAL_MAX];
+    int changes = signalDB.processFrame(frame, changed, SIGNAL_MAX);
+    if (changes) sendSignalFeed(changed, changes);
+    //an answer to the poller or the UDS reader isn't the client's, even if the client is waiting too.
+    //Neither is a periodic frame
+    bool claimed = streamed || pidPoller.processFrame(frame) || udsReader.processFrame(frame) ||
+                   udsStreamer.processFrame(frame) || dtcSweep.processFrame(frame);
+    if (awaitingReply && !claimed && frame.id >= 0x7E8 && frame.id <= 0x7EF) processReply(frame);
+
 #ifdef BLUETOOTH
     String retString = String();
     //Logger::debug("Id: %x", frame.id);
@@ -124,6 +225,7 @@ void ELM327Emu::processFrame(CAN_FRAME &frame)
                     stmBuff[stmWriteIdx] = frame;
                     stmWriteIdx = newIdx;
                 }
+                else stmDrops.inc();
             //}
         //}
     //}
@@ -146,10 +248,10 @@ void ELM327Emu::processFrame(CAN_FRAME &frame)
             }
             /*
             if (Logger::isDebug()) {
-                Logger::debug("In: %s", incomingBuffer);
+                LOG_DEBUG("In: %s", incomingBuffer);
                 char buff[150];
                 retString.toCharArray(buff, 150);
-                Logger::debug("Out: %s", buff);
+                LOG_DEBUG("Out: %s", buff);
             } */
             SerialBT.print(retString);
             //stmActive = false;
@@ -163,26 +265,34 @@ void ELM327Emu::processFrame(CAN_FRAME &frame)
 *   But, for reference, this cmd processes the command in incomingBuffer
 */
 void ELM327Emu::processCmd() {
+    TRACE_SCOPE("elm_cmd");
+    awaitingReply = false; //a new line abandons a request that is still waiting, like an ELM327 does
+    if (awaitingUDS)
+    {
+        udsReader.release();
+        awaitingUDS = false;
+    }
+    if (awaitingDTCs)
+    {
+        dtcSweep.release();
+        awaitingDTCs = false;
+    }
+    if (monitorInterval)
+    {
+        frameTable.setActive(FrameTable::ElmMonitor, false);
+        monitorInterval = 0;
+    }
     String retString = processELMCmd(incomingBuffer);            
+    elmCommands.inc();
+    sendString(retString);
 #ifdef BLUETOOTH
-    SerialBT.print(retString);
     if (Logger::isDebug()) {
-        Logger::debug("In: %s", incomingBuffer);
+        LOG_DEBUG("In: %s", incomingBuffer);
         char buff[150];
         retString.toCharArray(buff, 150);
-        Logger::debug("Out: %s", buff);
-    }
-    
-#else
-    for(int i = 0; i < MAX_CLIENTS; i++)
-    {
-        if (clientNodes[i] && clientNodes[i].connected())
-        {
-            clientNodes[i].print(retString);
-        }
+        LOG_DEBUG("Out: %s", buff);
     }
-#endif    
-
+#endif
 }
 
 String ELM327Emu::processELMCmd(char *cmd) {
@@ -197,8 +307,9 @@ String ELM327Emu::processELMCmd(char *cmd) {
             retString.concat(lineEnding);
             retString.concat("ELM327 v1.3a");
         }
-        else if (!strncmp(cmd, "atsh",4)) { //set header address
-            //ignore this - just say OK
+        else if (!strncmp(cmd, "atsh",4)) { //set header address, the ID requests are sent to
+            uint32_t id = strtoul(cmd + 4, 0, 16);
+            if (id > 0 && id <= 0x7FF) requestId = id;
             retString.concat("OK");
         }
         else if (!strncmp(cmd, "ate",3)) { //turn echo on/off
@@ -308,36 +419,402 @@ String ELM327Emu::processELMCmd(char *cmd) {
                 {
                     passFilter[i] = strtol(id, 0, 16);
                     passMask[i] = strtol(mask, 0, 16);
-                    Logger::debug("ID: %x Mask: %x", passFilter[i], passMask[i]);
+                    LOG_DEBUG("ID: %x Mask: %x", passFilter[i], passMask[i]);
                     break;
                 }
             }
             retString.concat("OK");
         } 
-    }
-    else { //if no AT then assume it is a PID request. This takes the form of four bytes which form the alpha hex digit encoding for two bytes
-        //there should be four or six characters here forming the ascii representation of the PID request. Easiest for now is to turn the ascii into
-        //a 16 bit number and mask off to get the bytes
-        if (strlen(cmd) == 4) {
-            uint32_t valu = strtol((char *) cmd, NULL, 16); //the pid format is always in hex
-            uint8_t pidnum = (uint8_t)(valu & 0xFF);
-            uint8_t mode = (uint8_t)((valu >> 8) & 0xFF);
-            Logger::debug("Mode: %i, PID: %i", mode, pidnum);
-
+        //Periodic frames. IDs above 7FF are sent extended. Periods are in microseconds
+        if (!strncmp(cmd, "stxpa", 5)) { //add: stxpa<id>,<data>,<period>  returns the slot number
             CAN_FRAME frame;
-            frame.id = 0x7E0;
-            frame.length=8;
-            frame.rtr = 0;
-            frame.extended = 0;
-            frame.data.byte[0] = 2;
-            frame.data.byte[1] = mode;
-            frame.data.byte[2] = pidnum;
-            frame.data.byte[3] = 0xAA;
-            frame.data.s2 = 0xAAAA;
-            frame.data.s3 = 0xAAAA;
-
-            CAN0.sendFrame(frame);
+            char *id = strtok((char *)(cmd + 5), ",");
+            char *data = strtok(NULL, ",");
+            char *period = strtok(NULL, ",");
+            int slot = -1;
+            if (period && parseFrame(id, data, frame)) slot = periodicSender.addFrame(frame, strtoul(period, 0, 10));
+            if (slot > -1) retString.concat(String(slot));
+            else retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxpu", 5)) { //update: stxpu<slot>,<id>,<data>,<period>
+            CAN_FRAME frame;
+            char *slot = strtok((char *)(cmd + 5), ",");
+            char *id = strtok(NULL, ",");
+            char *data = strtok(NULL, ",");
+            char *period = strtok(NULL, ",");
+            if (period && parseFrame(id, data, frame) &&
+                periodicSender.updateFrame(atoi(slot), frame, strtoul(period, 0, 10))) retString.concat("OK");
+            else retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxpd", 5)) { //remove: stxpd<slot>
+            if (periodicSender.removeFrame(atoi(cmd + 5))) retString.concat("OK");
+            else retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxpc", 5)) { //remove all periodic frames
+            periodicSender.clear();
+            retString.concat("OK");
+        }
+        else if (!strncmp(cmd, "stxlatc", 7)) { //forget all recorded ECU response latencies
+            pidProfiler.reset();
+            retString.concat("OK");
         }
+        else if (!strncmp(cmd, "stxlat", 6)) { //ECU response latency per ECU/mode/PID. See PIDProfiler::toText()
+            retString.concat(pidProfiler.toText(lineEnding.c_str()));
+            retString.concat("OK");
+        }
+        else if (!strncmp(cmd, "stxdec", 6)) { //decoded Mode 01 values, stxdec<pid> for one PID. See PIDDecoder::toText()
+            retString.concat(pidDecoder.toText(lineEnding.c_str(), cmd[6] ? (int)strtol(cmd + 6, 0, 16) : -1));
+            retString.concat("OK");
+        }
+        else if (!strncmp(cmd, "stxsubu", 7)) { //stxsubu<port> also send the feed to this client's address as UDP, port 0 stops it
+            if (subscribeUDP(strtoul(cmd + 7, 0, 10))) retString.concat("OK");
+            else retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxsub", 6)) { //decoded value feed: stxsub<c|b|0>[,<pid>,<pid>...] CSV, binary or off
+            char format = cmd[6];
+            if (format == 'c' || format == 'b' || format == '0')
+            {
+                char *pid = strtok(cmd + 7, ",");
+                for (int i = 0; i < 8; i++) feedPIDs[i] = pid ? 0 : 0xFFFFFFFF; //no list means every PID
+                for (; pid; pid = strtok(NULL, ","))
+                {
+                    uint8_t num = strtoul(pid, 0, 16);
+                    feedPIDs[num >> 5] |= 1ul << (num & 31);
+                }
+                feedFormat = (format == '0') ? 0 : format;
+                retString.concat("OK");
+            }
+            else retString.concat("?");
+        }
+        //Device side polling of Mode 01 PIDs, see PIDPoller. The plan is saved in settings
+        else if (!strncmp(cmd, "stxpolla", 8)) { //add or change: stxpolla<pid>,<period ms>[,<priority 0-3>]
+            char *pid = strtok(cmd + 8, ",");
+            char *period = strtok(NULL, ",");
+            char *priority = strtok(NULL, ",");
+            if (pid && period && pidPoller.setPID(strtoul(pid, 0, 16), strtoul(period, 0, 10), priority ? atoi(priority) : 1))
+                retString.concat("OK");
+            else retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxpolld", 8)) { //remove: stxpolld<pid>
+            if (pidPoller.removePID(strtoul(cmd + 8, 0, 16))) retString.concat("OK");
+            else retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxpollc", 8)) { //empty the plan
+            pidPoller.clear();
+            retString.concat("OK");
+        }
+        else if (!strncmp(cmd, "stxpollb", 8)) { //stxpollb<requests per second>, 0 stops polling
+            int budget = atoi(cmd + 8);
+            if (budget >= 0 && budget <= 255 && pidPoller.setBudget(budget)) retString.concat("OK");
+            else retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxpolli", 8)) { //stxpolli<id> 7DF for every ECU or 7E0-7E7
+            if (pidPoller.setRequestId(strtoul(cmd + 8, 0, 16))) retString.concat("OK");
+            else retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxpolls", 8)) { //stats, see PIDPoller::toText()
+            retString.concat(pidPoller.toText(lineEnding.c_str()));
+            retString.concat("OK");
+        }
+        else if (!strncmp(cmd, "stxudsr", 7)) { //UDS 0x22 read: stxudsr<ecu 0-7>,<did>[:<length>],... one DID:value line each
+            uint16_t dids[UDS_MAX_DIDS];
+            uint16_t lengths[UDS_MAX_DIDS];
+            int count = 0;
+            char *ecu = strtok(cmd + 7, ",");
+            for (char *did = strtok(NULL, ","); did && count < UDS_MAX_DIDS; did = strtok(NULL, ","))
+            {
+                char *length = strchr(did, ':');
+                dids[count] = strtoul(did, 0, 16);
+                lengths[count++] = length ? strtoul(length + 1, 0, 10) : 0;
+            }
+            if (ecu && isdigit(ecu[0]) && udsReader.start(UDSReader::Elm, atoi(ecu), dids, lengths, count))
+            {
+                awaitingUDS = true;
+                return retString; //the results and the prompt go out once all DIDs are read, see loop()
+            }
+            retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxdtc", 6)) { //DTCs of all ECUs: stxdtc, stxdtcu adds UDS 0x19. See DTCSweep::toText()
+            if (dtcSweep.start(cmd[6] == 'u'))
+            {
+                awaitingDTCs = true;
+                return retString; //the list and the prompt go out once every ECU answered, see loop()
+            }
+            retString.concat("?");
+        }
+        //ECU side streaming with 0x2C/0x2A, see UDSStreamer. The values go out on the stxsub feed
+        else if (!strncmp(cmd, "stxstra", 7)) { //stxstra<ecu 0-7>,<rate 1-3>,<did>:<position>:<size>,... answers the stream number
+            StreamPart parts[UDS_STREAM_MAX_PARTS];
+            int count = 0;
+            char *ecu = strtok(cmd + 7, ",");
+            char *rate = strtok(NULL, ",");
+            for (char *part = strtok(NULL, ","); part && count < UDS_STREAM_MAX_PARTS; part = strtok(NULL, ","))
+            {
+                char *position = strchr(part, ':');
+                char *size = position ? strchr(position + 1, ':') : NULL;
+                if (!size) break;
+                parts[count].did = strtoul(part, 0, 16);
+                parts[count].position = strtoul(position + 1, 0, 10);
+                parts[count++].size = strtoul(size + 1, 0, 10);
+            }
+            int stream = (ecu && rate && isdigit(ecu[0])) ? udsStreamer.start(atoi(ecu), atoi(rate), parts, count) : -1;
+            if (stream != -1)
+            {
+                char buff[8];
+                sprintf(buff, "%i", stream);
+                retString.concat(buff);
+                retString.concat(lineEnding);
+                retString.concat("OK");
+            }
+            else retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxstrd", 7)) { //stop a stream: stxstrd<stream>
+            if (udsStreamer.stop(atoi(cmd + 7))) retString.concat("OK");
+            else retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxstrs", 7)) { //streams, see UDSStreamer::toText()
+            retString.concat(udsStreamer.toText(lineEnding.c_str()));
+            retString.concat("OK");
+        }
+        //DBC style signals, see SignalDB. Changed values go out on the stxsub feed
+        else if (!strncmp(cmd, "stxsiga", 7)) { //stxsiga<id>,<start bit>,<length>,<l|b>[s],<scale>,<offset>,<name> answers the index
+            SignalDef def;
+            char *id = strtok(cmd + 7, ",");
+            char *start = strtok(NULL, ",");
+            char *length = strtok(NULL, ",");
+            char *order = strtok(NULL, ",");
+            char *scale = strtok(NULL, ",");
+            char *offset = strtok(NULL, ",");
+            char *name = strtok(NULL, ",");
+            int idx = -1;
+            if (name && (order[0] == 'l' || order[0] == 'b'))
+            {
+                memset(&def, 0, sizeof(def));
+                //8 hex digits make a 29 bit ID, as in candump
+                def.id = strtoul(id, 0, 16) | ((strlen(id) > 3) ? SIG_EXTENDED : 0);
+                def.startBit = atoi(start);
+                def.length = atoi(length);
+                def.flags = ((order[0] == 'b') ? SIG_BIG_ENDIAN : 0) | ((order[1] == 's') ? SIG_SIGNED : 0);
+                def.scale = atof(scale);
+                def.offset = atof(offset);
+                strncpy(def.name, name, SIGNAL_NAME_LEN - 1);
+                idx = signalDB.add(def);
+            }
+            if (idx != -1)
+            {
+                char buff[8];
+                sprintf(buff, "%i", idx);
+                retString.concat(buff);
+                retString.concat(lineEnding);
+                retString.concat("OK");
+            }
+            else retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxsigc", 7)) { //remove all signals
+            signalDB.clear();
+            retString.concat("OK");
+        }
+        else if (!strncmp(cmd, "stxsigw", 7)) { //store the signals in flash
+            if (signalDB.save()) retString.concat("OK");
+            else retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxsigl", 7)) { //definitions, see SignalDB::defsToText()
+            retString.concat(signalDB.defsToText(lineEnding.c_str()));
+            retString.concat("OK");
+        }
+        else if (!strncmp(cmd, "stxsigv", 7)) { //latest values, see SignalDB::valuesToText()
+            retString.concat(signalDB.valuesToText(lineEnding.c_str()));
+            retString.concat("OK");
+        }
+        else if (!strncmp(cmd, "stxsigs", 7)) { //signals the feed carries: stxsigs[<idx>,<idx>...], no list means all
+            char *idx = strtok(cmd + 7, ",");
+            for (int i = 0; i < SIGNAL_MAX / 32; i++) feedSignals[i] = idx ? 0 : 0xFFFFFFFF;
+            for (; idx; idx = strtok(NULL, ","))
+            {
+                int num = atoi(idx);
+                if (num >= 0 && num < SIGNAL_MAX) feedSignals[num >> 5] |= 1ul << (num & 31);
+            }
+            retString.concat("OK");
+        }
+        //Capture around an event, see TriggerEngine. The capture is pulled with GVRET's PROTO_GET_CAPTURE.
+        //Adding a trigger answers its index:
+        //stxtrgi<id> the ID shows up
+        //stxtrgb<id>,<mask>,<value> the data bytes are like value where mask has bits set
+        //stxtrgs<signal>,<>|<>,<threshold> a SignalDB signal goes over or under the threshold
+        //stxtrgd a frame carrying DTCs
+        else if (!strncmp(cmd, "stxtrg", 6) && cmd[6] && strchr("ibsd", cmd[6])) {
+            TriggerDef def;
+            CAN_FRAME mask;
+            CAN_FRAME value;
+            int idx = -1;
+            memset(&def, 0, sizeof(def));
+            if (cmd[6] == 'i')
+            {
+                def.type = TriggerDef::Id;
+                if (parseFrame(cmd + 7, (char *)"", mask))
+                {
+                    def.id = mask.id | (mask.extended ? TRIGGER_EXTENDED : 0);
+                    idx = triggerEngine.add(def);
+                }
+            }
+            else if (cmd[6] == 'b')
+            {
+                char *id = strtok(cmd + 7, ",");
+                char *maskStr = strtok(NULL, ",");
+                char *valueStr = strtok(NULL, ",");
+                if (parseFrame(id, maskStr, mask) && parseFrame(id, valueStr, value) && mask.length == value.length)
+                {
+                    def.type = TriggerDef::Data;
+                    def.id = mask.id | (mask.extended ? TRIGGER_EXTENDED : 0);
+                    def.length = mask.length;
+                    memcpy(def.mask, mask.data.bytes, mask.length);
+                    memcpy(def.value, value.data.bytes, value.length);
+                    idx = triggerEngine.add(def);
+                }
+            }
+            else if (cmd[6] == 's')
+            {
+                char *signal = strtok(cmd + 7, ",");
+                char *compare = strtok(NULL, ",");
+                char *threshold = strtok(NULL, ",");
+                if (threshold && (compare[0] == '>' || compare[0] == '<'))
+                {
+                    def.type = TriggerDef::Signal;
+                    def.signal = atoi(signal);
+                    def.above = compare[0] == '>';
+                    def.threshold = atof(threshold);
+                    idx = triggerEngine.add(def);
+                }
+            }
+            else
+            {
+                def.type = TriggerDef::DTC;
+                idx = triggerEngine.add(def);
+            }
+            if (idx != -1)
+            {
+                char buff[8];
+                sprintf(buff, "%i", idx);
+                retString.concat(buff);
+                retString.concat(lineEnding);
+                retString.concat("OK");
+            }
+            else retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxtrgc", 7)) { //remove all triggers and the capture
+            triggerEngine.clear();
+            retString.concat("OK");
+        }
+        else if (!strncmp(cmd, "stxtrgw", 7)) { //stxtrgw<ms before>,<ms after> the capture window
+            char *pre = strtok(cmd + 7, ",");
+            char *post = strtok(NULL, ",");
+            if (post && triggerEngine.setWindow(atoi(pre), atoi(post))) retString.concat("OK");
+            else retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxtrgr", 7)) { //drop the capture and watch again
+            triggerEngine.rearm();
+            retString.concat("OK");
+        }
+        else if (!strncmp(cmd, "stxtrgl", 7)) { //triggers and the state, see TriggerEngine::toText()
+            retString.concat(triggerEngine.toText(lineEnding.c_str()));
+            retString.concat("OK");
+        }
+        //Log playback onto the bus with the recorded timing, see Player. Logs are uploaded with GVRET's PROTO_PLAYBACK_UPLOAD
+        else if (!strncmp(cmd, "stxplayf", 8)) { //stxplayf<id>,<mask>[,x] only play matching IDs, x leaves them out instead
+            char *id = strtok(cmd + 8, ",");
+            char *mask = strtok(NULL, ",");
+            char *exclude = strtok(NULL, ",");
+            int idx = -1;
+            if (mask)
+            {
+                uint32_t filterId = strtoul(id, 0, 16);
+                if (filterId > 0x7FF) filterId |= PLAYBACK_EXTENDED;
+                idx = player.addFilter(filterId, strtoul(mask, 0, 16), exclude && exclude[0] == 'x');
+            }
+            if (idx != -1)
+            {
+                char buff[8];
+                sprintf(buff, "%i", idx);
+                retString.concat(buff);
+                retString.concat(lineEnding);
+                retString.concat("OK");
+            }
+            else retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxplayc", 8)) { //remove the ID filters
+            player.clearFilters();
+            retString.concat("OK");
+        }
+        //stxplayu<speed %>[,l] plays the upload, stxplayr<seconds>,<speed %>[,l] the end of the flight recording. l loops
+        else if (!strncmp(cmd, "stxplayu", 8) || !strncmp(cmd, "stxplayr", 8)) {
+            bool recording = cmd[7] == 'r';
+            char *seconds = recording ? strtok(cmd + 8, ",") : NULL;
+            char *speed = strtok(recording ? NULL : cmd + 8, ",");
+            char *repeat = strtok(NULL, ",");
+            if (speed && player.start(recording ? Player::Recording : Player::Upload, seconds ? atoi(seconds) : 0,
+                                      atoi(speed), repeat && repeat[0] == 'l')) retString.concat("OK");
+            else retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxplays", 8)) { //stop playing
+            player.stop();
+            retString.concat("OK");
+        }
+        else if (!strncmp(cmd, "stxplayl", 8)) { //filters and the jitter report, see Player::toText()
+            retString.concat(player.toText(lineEnding.c_str()));
+            retString.concat("OK");
+        }
+        //Newest frame per ID, see FrameTable. Lines are like STM's: ID then data, all in hex
+        else if (!strncmp(cmd, "stxcm", 5)) { //coalesced monitor: stxcm<ms> the newest frame of each ID seen, every ms. A new line stops it
+            int interval = atoi(cmd + 5);
+            if (interval >= MONITOR_MIN_INTERVAL && interval <= 60000)
+            {
+                frameTable.setActive(FrameTable::ElmMonitor, true);
+                frameTable.markAll(FrameTable::ElmMonitor);
+                monitorInterval = interval;
+                lastMonitor = millis() - interval; //everything seen so far goes out right away
+                return retString; //no prompt, like STM
+            }
+            retString.concat("?");
+        }
+        else if (!strncmp(cmd, "stxsnap", 7)) { //snapshot: stxsnap[<id>] one line per ID: frame count age in ms
+            char buff[48];
+            uint32_t now = micros();
+            const LatestFrame *frame = cmd[7] ? frameTable.find(strtoul(cmd + 7, 0, 16), strlen(cmd + 7) > 3) : frameTable.get(0);
+            if (!frame) retString.concat("NO DATA");
+            else
+            {
+                for (int i = 1; frame; frame = cmd[7] ? NULL : frameTable.get(i++))
+                {
+                    formatFrame(*frame, buff);
+                    sprintf(buff + strlen(buff), " %u %u", (unsigned int)frame->count, (unsigned int)((now - frame->micros) / 1000));
+                    retString.concat(buff);
+                    retString.concat(lineEnding);
+                }
+                retString.concat("OK");
+            }
+        }
+        else if (!strncmp(cmd, "stxmet", 6)) { //runtime metrics, one per line. See Metric::toText()
+            retString.concat(Metric::toText(lineEnding.c_str()));
+            retString.concat("OK");
+        }
+        else if (!strncmp(cmd, "stxps", 5)) { //stats, one line per slot: slot id period sent missed avgjitter maxjitter
+            PeriodicStats stats;
+            char buff[80];
+            for (int i = 0; i < MAX_PERIODIC_FRAMES; i++)
+            {
+                if (!periodicSender.getStats(i, stats)) continue;
+                sprintf(buff, "%i %X %u %u %u %u %u", i, (unsigned int)stats.id, (unsigned int)stats.period,
+                        (unsigned int)stats.sent, (unsigned int)stats.missed, (unsigned int)stats.jitterAvg,
+                        (unsigned int)stats.jitterMax);
+                retString.concat(buff);
+                retString.concat(lineEnding);
+            }
+            retString.concat("OK");
+        }
+    }
+    else { //if no AT then assume it is a request: two hex digits per byte, mode/service first
+        if (sendRequest(cmd)) return retString; //the prompt goes out with the reply, see processReply()
+        if (strlen(cmd) > 0) retString.concat("?");
     }
 
     retString.concat(lineEnding);
@@ -346,31 +823,458 @@ String ELM327Emu::processELMCmd(char *cmd) {
     return retString;
 }
 
-void ELM327Emu::sendOBDReply(CAN_FRAME &frame)
+PIDProfiler &ELM327Emu::getPIDProfiler()
+{
+    return pidProfiler;
+}
+
+PIDDecoder &ELM327Emu::getPIDDecoder()
+{
+    return pidDecoder;
+}
+
+bool ELM327Emu::isAwaitingReply()
+{
+    return awaitingReply;
+}
+
+/*
+ * Fill in a frame from the hex ID and payload strings used by the extended ST commands.
+ * IDs above 0x7FF are treated as extended. The payload is up to 8 bytes, two hex digits each.
+ */
+bool ELM327Emu::parseFrame(char *idStr, char *dataStr, CAN_FRAME &frame)
+{
+    if (!idStr || !dataStr) return false;
+    int dataLen = strlen(dataStr);
+    if ((dataLen & 1) || dataLen > 16) return false;
+
+    frame.id = strtoul(idStr, 0, 16);
+    frame.extended = (frame.id > 0x7FF);
+    frame.rtr = 0;
+    frame.length = dataLen / 2;
+    for (int i = 0; i < frame.length; i++)
+    {
+        char hex[3] = {dataStr[i * 2], dataStr[i * 2 + 1], 0};
+        frame.data.bytes[i] = strtoul(hex, 0, 16);
+    }
+    return true;
+}
+
+/*
+ * Send a request typed as hex digits, "010C" or "22F190", as a single frame. An odd digit at the
+ * end is the ELM327 count of replies to wait for. It is ignored, the first complete reply ends the request.
+ */
+bool ELM327Emu::sendRequest(char *cmd)
 {
+    int digits = strlen(cmd);
+    if (digits & 1) digits--;
+    if (digits < 2 || digits > 14) return false;
+    for (int i = 0; i < digits; i++) if (!isxdigit(cmd[i])) return false;
+
+    CAN_FRAME frame;
+    frame.id = requestId;
+    frame.length = 8;
+    frame.rtr = 0;
+    frame.extended = 0;
+    frame.data.byte[0] = digits / 2;
+    for (int i = 1; i < 8; i++) frame.data.byte[i] = 0xAA;
+    for (int i = 0; i < digits / 2; i++)
+    {
+        char hex[3] = {cmd[i * 2], cmd[i * 2 + 1], 0};
+        frame.data.byte[i + 1] = strtoul(hex, 0, 16);
+        requestBytes[i] = frame.data.byte[i + 1];
+    }
+    requestLength = digits / 2;
+    LOG_DEBUG("Mode: %i, PID: %i", frame.data.byte[1], frame.data.byte[2]);
+
+    awaitingReply = true;
+    replyLength = 0;
+    pidPoller.yieldToClient();
+    udsReader.yieldToClient();
+    udsStreamer.yieldToClient();
+    dtcSweep.yieldToClient();
+    replyDeadline = micros() + PID_RESPONSE_TIMEOUT;
+    CAN0.sendFrame(frame);
+    pidProfiler.requestSent(frame.data.byte[1], frame.data.byte[2]);
+    return true;
+}
+
+/*
+ * Pass an ECU reply to the waiting request on to the client the way an ELM327 with CAN auto
+ * formatting prints it. A multi frame reply gets a flow control frame back and prints as its
+ * total length then one numbered line per frame. With headers on every frame is printed raw.
+ */
+void ELM327Emu::processReply(CAN_FRAME &frame)
+{
+    const char *lineEnding = bLineFeed ? "\r\n" : "\r";
     String retString = String();
-    char buff[30];
+    char buff[12];
+    uint8_t type = frame.data.byte[0] >> 4;
+    int first, count; //where this frame's part of the payload starts and how long it is
 
-    if (bHeader) { //ID and length only sent when other side has requested headers.
+    if (type == 0) //single frame
+    {
+        first = 1;
+        count = frame.data.byte[0] & 0xF;
+        if (count == 0 || count > 7 || !answersRequest(&frame.data.byte[1], count)) return;
+        replyLength = 0;
+    }
+    else if (type == 1) //first frame
+    {
+        first = 2;
+        count = 6;
+        if (!answersRequest(&frame.data.byte[2], count)) return;
+        replyId = frame.id;
+        replyLength = ((frame.data.byte[0] & 0xF) << 8) | frame.data.byte[1];
+        replyReceived = 0;
+        replySeq = 1;
+
+        CAN_FRAME flow; //clear to send the rest, no block limit or gap
+        flow.id = frame.id - 8;
+        flow.length = 8;
+        flow.rtr = 0;
+        flow.extended = 0;
+        flow.data.byte[0] = 0x30;
+        flow.data.byte[1] = 0;
+        flow.data.byte[2] = 0;
+        for (int i = 3; i < 8; i++) flow.data.byte[i] = 0xAA;
+        CAN0.sendFrame(flow);
+
+        if (!bHeader)
+        {
+            sprintf(buff, "%03X", replyLength);
+            retString.concat(buff);
+            retString.concat(lineEnding);
+        }
+    }
+    else if (type == 2 && replyLength && frame.id == replyId && (frame.data.byte[0] & 0xF) == (replySeq & 0xF))
+    {
+        first = 1;
+        count = 7;
+        replySeq++;
+    }
+    else return;
+
+    if (replyLength)
+    {
+        if (count > replyLength - replyReceived) count = replyLength - replyReceived;
+        replyReceived += count;
+    }
+
+    if (bHeader)
+    {
         sprintf(buff, "%03X", frame.id);
         retString.concat(buff);
-        sprintf(buff, "%02X", frame.data.byte[0]);
+        first = 0;
+    }
+    else if (replyLength)
+    {
+        sprintf(buff, "%X:", (replySeq - 1) & 0xF);
         retString.concat(buff);
     }
-    for (int i = 1; i < 8; i++) 
+    for (int i = first; i < 1 + (type == 1) + count; i++)
     {
         sprintf(buff, "%02X", frame.data.byte[i]);
         retString.concat(buff);
     }
+    retString.concat(lineEnding);
+
+    //the ECU needs more time (negative response 78) or there are frames still to come
+    if ((type == 0 && count >= 3 && frame.data.byte[1] == 0x7F && frame.data.byte[3] == 0x78) ||
+        (replyLength && replyReceived < replyLength))
+    {
+        replyDeadline = micros() + ((type == 0) ? ELM_PENDING_TIMEOUT : PID_RESPONSE_TIMEOUT);
+        sendString(retString);
+        return;
+    }
+    finishReply(retString);
+}
+
+/*
+ * Whether the start of a reply belongs to the request the client waits on: the
+ * positive response to its service, with one of its PIDs for modes 01 and 09,
+ * or a negative response to it. Anything else is someone else's answer, such as
+ * a late one to PIDPoller.
+ */
+bool ELM327Emu::answersRequest(const uint8_t *payload, int length)
+{
+    if (payload[0] == 0x7F) return length >= 2 && payload[1] == requestBytes[0];
+    if (payload[0] != requestBytes[0] + 0x40) return false;
+    if ((requestBytes[0] == 0x01 || requestBytes[0] == 0x09) && requestLength > 1)
+    {
+        if (length < 2) return false;
+        for (int i = 1; i < requestLength; i++) if (payload[1] == requestBytes[i]) return true;
+        return false;
+    }
+    return true;
+}
+
+//Send the last of a reply with the prompt after it
+void ELM327Emu::finishReply(String &retString)
+{
+    awaitingReply = false;
+    retString.concat(">");
+    sendString(retString);
+}
+
+void ELM327Emu::sendString(const String &str)
+{
+    if (feedLength) flushFeed(); //values that came in before a reply go out ahead of it
+    elmBytesOut.inc(str.length());
+#ifdef BLUETOOTH
+    SerialBT.print(str);
+#else
+    for(int i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (clientNodes[i] && clientNodes[i].connected())
+        {
+            clientNodes[i].print(str);
+        }
+    }
+#endif
+}
+
+void ELM327Emu::sendBytes(const uint8_t *data, size_t length)
+{
+    elmBytesOut.inc(length);
 #ifdef BLUETOOTH
-    SerialBT.print(retString);
+    SerialBT.write(data, length);
 #else
     for(int i = 0; i < MAX_CLIENTS; i++)
     {
         if (clientNodes[i] && clientNodes[i].connected())
         {
-            clientNodes[i].print(retString);
+            clientNodes[i].write(data, length);
         }
     }
 #endif
 }
+
+/*
+ * Queue freshly decoded values for the client that subscribed with stxsub and
+ * for the stxsubu addresses. CSV lines are millis,ECU,PID,value. Binary records
+ * are laid out as described at PID_FEED_MAGIC. Bitfields are left out, they
+ * aren't values a display can show.
+ */
+void ELM327Emu::sendFeed(const PIDValue *values, int count)
+{
+    uint8_t record[12];
+
+    for (int i = 0; i < count && i < 3; i++)
+    {
+        const PIDValue &value = values[i];
+        if ((value.flags & PID_BITFIELD) || !(feedPIDs[value.pid >> 5] & (1ul << (value.pid & 31)))) continue;
+        if (feedFormat == 'c')
+        {
+            char buff[48];
+            sprintf(buff, "%u,%03X,%02X,%.2f%s", (unsigned int)value.millis, value.ecu, value.pid, value.value,
+                    bLineFeed ? "\r\n" : "\r");
+            queueFeedLine(buff);
+        }
+        record[0] = PID_FEED_MAGIC;
+        record[1] = value.ecu - 0x7E8;
+        record[2] = value.pid;
+        record[3] = value.flags;
+        memcpy(&record[4], &value.value, 4); //the ESP32 is little endian too
+        for (int b = 0; b < 4; b++) record[8 + b] = (uint8_t)(value.millis >> (8 * b));
+        queueFeedRecord(record);
+    }
+}
+
+/*
+ * Values from periodic frames go out like decoded PIDs: CSV lines are
+ * millis,ECU,DID,raw value in hex and binary records are laid out as
+ * described at STREAM_FEED_MAGIC.
+ */
+void ELM327Emu::sendStreamFeed(const StreamValue *values, int count)
+{
+    uint8_t record[12];
+
+    for (int i = 0; i < count && i < UDS_STREAM_MAX_PARTS; i++)
+    {
+        const StreamValue &value = values[i];
+        if (feedFormat == 'c')
+        {
+            char buff[48];
+            sprintf(buff, "%u,%03X,%04X,%X%s", (unsigned int)value.millis, 0x7E8 + value.ecu, value.did,
+                    (unsigned int)value.raw, bLineFeed ? "\r\n" : "\r");
+            queueFeedLine(buff);
+        }
+        record[0] = STREAM_FEED_MAGIC;
+        record[1] = value.ecu;
+        record[2] = value.did >> 8;
+        record[3] = value.did & 0xFF;
+        for (int b = 0; b < 4; b++) record[4 + b] = (uint8_t)(value.raw >> (8 * b));
+        for (int b = 0; b < 4; b++) record[8 + b] = (uint8_t)(value.millis >> (8 * b));
+        queueFeedRecord(record);
+    }
+}
+
+/*
+ * Signals whose value changed in a frame. CSV lines are millis,S<index>,name,value
+ * and binary records are laid out as described at SIGNAL_FEED_MAGIC.
+ */
+void ELM327Emu::sendSignalFeed(const uint8_t *signals, int count)
+{
+    uint8_t record[12];
+    SignalDef def;
+    SignalValue value;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (!(feedSignals[signals[i] >> 5] & (1ul << (signals[i] & 31)))) continue;
+        if (!signalDB.getDef(signals[i], def) || !signalDB.getValue(signals[i], value)) continue;
+        if (feedFormat == 'c')
+        {
+            char buff[64];
+            sprintf(buff, "%u,S%i,%s,%g%s", (unsigned int)value.millis, signals[i], def.name, value.value,
+                    bLineFeed ? "\r\n" : "\r");
+            queueFeedLine(buff);
+        }
+        record[0] = SIGNAL_FEED_MAGIC;
+        record[1] = signals[i];
+        record[2] = 0;
+        record[3] = 0;
+        memcpy(&record[4], &value.value, 4);
+        for (int b = 0; b < 4; b++) record[8 + b] = (uint8_t)(value.millis >> (8 * b));
+        queueFeedRecord(record);
+    }
+}
+
+/*
+ * The feeds are filled from processFrame() and sent from loop(), like GVRET's
+ * serialBuffer, so a frame never waits on a slow client or on UDP. What
+ * doesn't fit before the next flush is dropped and counted.
+ */
+void ELM327Emu::queueFeedLine(const char *line)
+{
+    int length = strlen(line);
+    if (feedLength + length > FEED_BUFF_SIZE)
+    {
+        feedDrops.inc();
+        return;
+    }
+    memcpy(&feedBuffer[feedLength], line, length);
+    feedLength += length;
+}
+
+void ELM327Emu::queueFeedRecord(const uint8_t *record)
+{
+    if (feedFormat == 'b')
+    {
+        if (feedLength + 12 > FEED_BUFF_SIZE) feedDrops.inc();
+        else
+        {
+            memcpy(&feedBuffer[feedLength], record, 12);
+            feedLength += 12;
+        }
+    }
+#ifndef BLUETOOTH
+    bool subscribed = false;
+    for (int i = 0; i < FEED_UDP_SUBSCRIBERS; i++) subscribed |= (feedPort[i] != 0);
+    if (!subscribed) return;
+    if (datagramLength + 12 > FEED_BUFF_SIZE) feedDrops.inc();
+    else
+    {
+        memcpy(&datagramBuffer[datagramLength], record, 12);
+        datagramLength += 12;
+    }
+#endif
+}
+
+//One write to the client and one datagram per stxsubu address with everything queued since the last flush
+void ELM327Emu::flushFeed()
+{
+    if (feedLength) sendBytes(feedBuffer, feedLength);
+#ifndef BLUETOOTH
+    for (int i = 0; i < FEED_UDP_SUBSCRIBERS && datagramLength; i++)
+    {
+        if (!feedPort[i]) continue;
+        feedUDP.beginPacket(feedAddr[i], feedPort[i]);
+        feedUDP.write(datagramBuffer, datagramLength);
+        feedUDP.endPacket();
+    }
+#endif
+    feedLength = 0;
+    datagramLength = 0;
+    lastFeedFlush = micros();
+}
+
+/*
+ * The frames that came in since the last batch of the coalesced monitor, only
+ * the newest of each ID. A slow link gets current data this way rather than a
+ * backlog of old frames.
+ */
+void ELM327Emu::sendLatestFrames()
+{
+    String lines = String();
+    char buff[32];
+
+    for (int idx = frameTable.nextPending(FrameTable::ElmMonitor, 0); idx != -1;
+         idx = frameTable.nextPending(FrameTable::ElmMonitor, idx + 1))
+    {
+        formatFrame(*frameTable.get(idx), buff);
+        lines.concat(buff);
+        lines.concat(bLineFeed ? "\r\n" : "\r");
+        frameTable.markSent(FrameTable::ElmMonitor, idx);
+    }
+    if (lines.length()) sendString(lines);
+}
+
+//STM style: 3 hex digits of ID for 11 bit frames, 8 for 29 bit ones, then the data
+void ELM327Emu::formatFrame(const LatestFrame &frame, char *buff)
+{
+    if (frame.id >> 31) buff += sprintf(buff, "%08X", (unsigned int)(frame.id & 0x7FFFFFFF));
+    else buff += sprintf(buff, "%03X", (unsigned int)frame.id);
+    for (int d = 0; d < frame.length; d++) buff += sprintf(buff, "%02X", frame.data[d]);
+}
+
+/*
+ * Add the connected client's address with the given port to the UDP feed or,
+ * with port 0, take it off again. Not available over Bluetooth.
+ */
+bool ELM327Emu::subscribeUDP(uint16_t port)
+{
+#ifndef BLUETOOTH
+    for (int c = 0; c < MAX_CLIENTS; c++)
+    {
+        if (!clientNodes[c] || !clientNodes[c].connected()) continue;
+        IPAddress addr = clientNodes[c].remoteIP();
+        int freeIdx = -1;
+        for (int i = 0; i < FEED_UDP_SUBSCRIBERS; i++)
+        {
+            if (feedPort[i] && feedAddr[i] == addr)
+            {
+                feedPort[i] = port; //changes the port or, with 0, unsubscribes
+                return true;
+            }
+            if (!feedPort[i] && freeIdx == -1) freeIdx = i;
+        }
+        if (!port) return true;
+        if (freeIdx == -1) return false;
+        feedAddr[freeIdx] = addr;
+        feedPort[freeIdx] = port;
+        return true;
+    }
+#endif
+    return false;
+}
+
+void ELM327Emu::sendOBDReply(CAN_FRAME &frame)
+{
+    String retString = String();
+    char buff[30];
+
+    if (bHeader) { //ID and length only sent when other side has requested headers.
+        sprintf(buff, "%03X", frame.id);
+        retString.concat(buff);
+        sprintf(buff, "%02X", frame.data.byte[0]);
+        retString.concat(buff);
+    }
+    for (int i = 1; i < 8; i++) 
+    {
+        sprintf(buff, "%02X", frame.data.byte[i]);
+        retString.concat(buff);
+    }
+    sendString(retString);
+}
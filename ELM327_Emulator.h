@@ -54,16 +54,34 @@ AT RV (adapter voltage) - Send something like 14.4V
 #include "config.h"
 #include "Logger.h"
 #include <esp32_can.h>
+#include "PIDProfiler.h"
+#include "PIDDecoder.h"
+#include "UDSStreamer.h"
+#include "FrameTable.h"
+
+//Decoded value feed records from stxsubb and in stxsubu datagrams, 12 bytes little endian:
+//0xD1, ECU (0-7 for 7E8-7EF), PID, flags, float value, uint32 millis
+#define PID_FEED_MAGIC  0xD1
+//Streamed values (stxstra) in the same feed, also 12 bytes: 0xD2, ECU, DID (big endian),
+//uint32 raw value, uint32 millis
+#define STREAM_FEED_MAGIC   0xD2
+//Signal values (stxsigs) in the same feed, 12 bytes: 0xD3, signal index, two zero bytes,
+//float value, uint32 millis
+#define SIGNAL_FEED_MAGIC   0xD3
 
 class ELM327Emu {
 public:
 
     ELM327Emu();
     void setup(); //initialization on start up
+    void setupBluetooth(); //slow, done by the radio setup task after setup()
     void loop();
     void processByte(int incoming);
     void sendOBDReply(CAN_FRAME &frame);
     void processFrame(CAN_FRAME &frame);
+    PIDProfiler &getPIDProfiler();
+    PIDDecoder &getPIDDecoder();
+    bool isAwaitingReply();
 
 private:
     char incomingBuffer[128]; //storage for one incoming line
@@ -74,9 +92,52 @@ private:
     int ibWritePtr;
     int currReply;
     bool stmActive;
+    PIDProfiler pidProfiler;
+    PIDDecoder pidDecoder;
+    char feedFormat; //decoded value feed: 'c' CSV, 'b' binary, 0 off
+    uint32_t feedPIDs[8]; //bit per PID the feed carries
+    uint32_t feedSignals[SIGNAL_MAX / 32]; //bit per signal the feed carries
+    IPAddress feedAddr[FEED_UDP_SUBSCRIBERS]; //stxsubu subscribers, binary records only
+    uint16_t feedPort[FEED_UDP_SUBSCRIBERS]; //0 for an unused entry
+    uint8_t feedBuffer[FEED_BUFF_SIZE]; //CSV lines or binary records for the client, sent from loop()
+    int feedLength;
+    uint8_t datagramBuffer[FEED_BUFF_SIZE]; //binary records for the stxsubu addresses
+    int datagramLength;
+    uint32_t lastFeedFlush; //micros()
+    uint16_t monitorInterval; //stxcm rate in ms, 0 while the coalesced monitor is off
+    uint32_t lastMonitor; //millis() the last batch of frames went out
 
     void processCmd();
+    //state of the request a client is waiting on. The prompt goes out once the reply is complete
+    uint32_t requestId; //ID requests are sent to, set with ATSH
+    uint8_t requestBytes[7]; //the request waited on, service first
+    uint8_t requestLength;
+    bool awaitingReply;
+    bool awaitingUDS; //an stxudsr read is running, the prompt goes out with its results
+    bool awaitingDTCs; //an stxdtc sweep is running, likewise
+    uint32_t replyDeadline; //micros() value after which the request is answered with NO DATA
+    uint32_t replyId; //ECU a multi frame reply is coming from
+    uint16_t replyLength;
+    uint16_t replyReceived;
+    uint8_t replySeq; //sequence number the next consecutive frame should carry
+
     String processELMCmd(char *cmd);
+    bool parseFrame(char *idStr, char *dataStr, CAN_FRAME &frame);
+    bool sendRequest(char *cmd);
+    void processReply(CAN_FRAME &frame);
+    bool answersRequest(const uint8_t *payload, int length);
+    void finishReply(String &retString);
+    void sendString(const String &str);
+    void sendBytes(const uint8_t *data, size_t length);
+    void sendFeed(const PIDValue *values, int count);
+    void sendStreamFeed(const StreamValue *values, int count);
+    void sendSignalFeed(const uint8_t *signals, int count);
+    void queueFeedLine(const char *line);
+    void queueFeedRecord(const uint8_t *record);
+    void flushFeed();
+    void sendLatestFrames();
+    static void formatFrame(const LatestFrame &frame, char *buff);
+    bool subscribeUDP(uint16_t port);
 };
 
 
@@ -0,0 +1,151 @@
+/*
+ * FrameTable.cpp
+ *
+ * Newest frame per CAN ID, see FrameTable.h
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "FrameTable.h"
+#include "Metrics.h"
+
+MetricCounter frameTableFull("frametable.full");
+MetricCounter frameTableCoalesced("frametable.coalesced");
+
+static_assert((FRAME_TABLE_EXT_SLOTS & (FRAME_TABLE_EXT_SLOTS - 1)) == 0, "FRAME_TABLE_EXT_SLOTS must be a power of two");
+static_assert(FRAME_TABLE_EXT_SLOTS >= 2 * FRAME_TABLE_SIZE, "the 29 bit ID hash must stay at most half full");
+static_assert(FRAME_TABLE_SIZE < 0xFFFF, "FRAME_TABLE_SIZE too large for the 16 bit index");
+
+FrameTable::FrameTable()
+{
+    activeConsumers = 0;
+    clear();
+}
+
+void FrameTable::clear()
+{
+    used = 0;
+    memset(standardIdx, 0, sizeof(standardIdx));
+    memset(extendedIdx, 0, sizeof(extendedIdx));
+}
+
+int FrameTable::processFrame(CAN_FRAME &frame)
+{
+    LatestFrame *entry = lookup(frame.id, frame.extended, true);
+    if (!entry)
+    {
+        frameTableFull.inc();
+        return -1;
+    }
+    //a consumer still holding the previous frame gets this one instead
+    if (entry->pending) frameTableCoalesced.inc();
+    uint8_t length = (frame.length > 8) ? 8 : frame.length;
+    entry->changed = entry->count == 0 || length != entry->length || memcmp(entry->data, frame.data.bytes, length);
+    entry->micros = micros();
+    entry->count++;
+    entry->length = length;
+    memcpy(entry->data, frame.data.bytes, length);
+    entry->pending = activeConsumers;
+    return entry - entries;
+}
+
+int FrameTable::getCount()
+{
+    return used;
+}
+
+const LatestFrame *FrameTable::get(int idx)
+{
+    if (idx < 0 || idx >= used) return NULL;
+    return &entries[idx];
+}
+
+const LatestFrame *FrameTable::find(uint32_t id, bool extended)
+{
+    return lookup(id, extended, false);
+}
+
+void FrameTable::setActive(Consumer consumer, bool active)
+{
+    if (active) activeConsumers |= 1 << consumer;
+    else
+    {
+        activeConsumers &= ~(1 << consumer);
+        for (int i = 0; i < used; i++) entries[i].pending &= ~(1 << consumer);
+    }
+}
+
+void FrameTable::markAll(Consumer consumer)
+{
+    for (int i = 0; i < used; i++) entries[i].pending |= 1 << consumer;
+}
+
+int FrameTable::nextPending(Consumer consumer, int from)
+{
+    for (int i = (from < 0) ? 0 : from; i < used; i++)
+    {
+        if (entries[i].pending & (1 << consumer)) return i;
+    }
+    return -1;
+}
+
+void FrameTable::markSent(Consumer consumer, int idx)
+{
+    if (idx >= 0 && idx < used) entries[idx].pending &= ~(1 << consumer);
+}
+
+/*
+ * 11 bit IDs index a table directly. 29 bit ones go through an open addressed
+ * hash kept at most half full, like PIDDecoder's. Entries are handed out in
+ * the order IDs first show up and stay until clear().
+ */
+LatestFrame *FrameTable::lookup(uint32_t id, bool extended, bool add)
+{
+    uint16_t *slot;
+
+    if (!extended)
+    {
+        slot = &standardIdx[id & 0x7FF];
+    }
+    else
+    {
+        uint32_t key = id | 1ul << 31;
+        uint32_t idx = ((key * 2654435761ul) >> 16) & (FRAME_TABLE_EXT_SLOTS - 1);
+        for (;;)
+        {
+            slot = &extendedIdx[idx];
+            if (!*slot || extendedKeys[idx] == key) break;
+            idx = (idx + 1) & (FRAME_TABLE_EXT_SLOTS - 1);
+        }
+        if (!*slot && add && used < FRAME_TABLE_SIZE) extendedKeys[idx] = key;
+    }
+
+    if (*slot) return &entries[*slot - 1];
+    if (!add || used >= FRAME_TABLE_SIZE) return NULL;
+
+    LatestFrame &entry = entries[used++];
+    entry.id = extended ? (id | 1ul << 31) : id;
+    entry.count = 0;
+    entry.pending = 0;
+    *slot = used;
+    return &entry;
+}
@@ -0,0 +1,79 @@
+/*
+ * FrameTable.h
+ *
+ * The newest frame seen for every CAN ID, so a slow client can be sent
+ * current data at its own pace instead of a backlog of stale frames.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FRAMETABLE_H_
+#define FRAMETABLE_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include <esp32_can.h>
+
+struct LatestFrame {
+    uint32_t id;        //bit 31 set for a 29 bit ID, the way GVRET sends IDs
+    uint32_t micros;    //when it was received
+    uint32_t count;     //frames seen with this ID
+    uint8_t length;
+    uint8_t data[8];
+    uint8_t pending;    //bit per consumer that hasn't been sent this version yet
+    bool changed;       //the data differs from the frame before, always true for the first one
+};
+
+class FrameTable {
+public:
+    //clients that take the newest frames at their own rate
+    enum Consumer {
+        ElmMonitor, GvretMonitor, GvretSnapshot
+    };
+
+    FrameTable();
+    void clear();
+    //returns the frame's entry or -1 if the table is full
+    int processFrame(CAN_FRAME &frame);
+    int getCount();
+    const LatestFrame *get(int idx);
+    const LatestFrame *find(uint32_t id, bool extended);
+    //only active consumers are marked pending when a frame comes in
+    void setActive(Consumer consumer, bool active);
+    //marks every entry pending for the consumer, for a full picture first
+    void markAll(Consumer consumer);
+    //first entry at or after from that is pending for the consumer, -1 if there is none
+    int nextPending(Consumer consumer, int from);
+    void markSent(Consumer consumer, int idx);
+
+private:
+    LatestFrame entries[FRAME_TABLE_SIZE];
+    int used;
+    uint8_t activeConsumers;
+    uint16_t standardIdx[2048];                 //entry + 1 per 11 bit ID, 0 if not seen
+    uint32_t extendedKeys[FRAME_TABLE_EXT_SLOTS];
+    uint16_t extendedIdx[FRAME_TABLE_EXT_SLOTS]; //entry + 1, 0 for an empty slot
+
+    LatestFrame *lookup(uint32_t id, bool extended, bool add);
+};
+
+#endif /* FRAMETABLE_H_ */
@@ -0,0 +1,218 @@
+/*
+ * IsoTp.cpp
+ *
+ * One ISO-TP conversation with an ECU, see IsoTp.h
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "IsoTp.h"
+#include "Metrics.h"
+
+MetricCounter isoTpOverflows("isotp.overflows");
+
+IsoTpChannel::IsoTpChannel()
+{
+    txId = 0;
+    rxId = 0;
+    buffer = NULL;
+    bufferSize = 0;
+    reset();
+}
+
+void IsoTpChannel::begin(uint32_t tx, uint32_t rx, uint8_t *buff, uint16_t size)
+{
+    txId = tx;
+    rxId = rx;
+    buffer = buff;
+    bufferSize = size;
+    reset();
+}
+
+void IsoTpChannel::reset()
+{
+    rxLength = 0;
+    rxReceived = 0;
+    txLength = 0;
+    txWaitFlow = false;
+}
+
+bool IsoTpChannel::send(const uint8_t *data, uint16_t length)
+{
+    uint8_t frame[8];
+
+    if (length == 0 || length > 0xFFF) return false;
+    if (length <= 7)
+    {
+        frame[0] = length;
+        memcpy(&frame[1], data, length);
+        sendFrame(frame, length + 1);
+        txLength = 0;
+        return true;
+    }
+    frame[0] = 0x10 | (length >> 8);
+    frame[1] = length & 0xFF;
+    memcpy(&frame[2], data, 6);
+    sendFrame(frame, 8);
+    txData = data;
+    txLength = length;
+    txOffset = 6;
+    txSeq = 1;
+    txWaitFlow = true;
+    return true;
+}
+
+/*
+ * One consecutive frame per call at most, so a long request with no
+ * separation time asked for doesn't run the transmit queue over.
+ */
+void IsoTpChannel::loop()
+{
+    if (!txLength || txWaitFlow || (int32_t)(micros() - txNext) < 0) return;
+
+    uint8_t frame[8];
+    int count = txLength - txOffset;
+    if (count > 7) count = 7;
+    frame[0] = 0x20 | (txSeq++ & 0xF);
+    memcpy(&frame[1], &txData[txOffset], count);
+    sendFrame(frame, count + 1);
+    txOffset += count;
+    txNext = micros() + txSeparation;
+    if (txOffset >= txLength) txLength = 0;
+    else if (txBlockLeft && --txBlockLeft == 0) txWaitFlow = true;
+}
+
+IsoTpResult IsoTpChannel::processFrame(CAN_FRAME &frame)
+{
+    if (frame.id != rxId || frame.extended || frame.length < 1) return ISOTP_IGNORED;
+    const uint8_t *bytes = frame.data.bytes;
+
+    switch (bytes[0] >> 4)
+    {
+    case 0: //single frame
+    {
+        int length = bytes[0] & 0xF;
+        if (length == 0 || length > frame.length - 1 || length > bufferSize) return ISOTP_IGNORED;
+        memcpy(buffer, &bytes[1], length);
+        rxLength = 0;
+        rxReceived = length;
+        return ISOTP_COMPLETE;
+    }
+    case 1: //first frame, ask for the rest
+    {
+        uint16_t length = ((bytes[0] & 0xF) << 8) | bytes[1];
+        if (frame.length < 8 || length < 8) return ISOTP_IGNORED;
+        if (length > bufferSize)
+        {
+            sendFlow(0x32);
+            rxLength = 0;
+            isoTpOverflows.inc();
+            return ISOTP_OVERFLOW;
+        }
+        memcpy(buffer, &bytes[2], 6);
+        rxLength = length;
+        rxReceived = 6;
+        rxSeq = 1;
+        sendFlow(0x30);
+        return ISOTP_CONSUMED;
+    }
+    case 2: //consecutive frame
+    {
+        if (!rxLength || (bytes[0] & 0xF) != (rxSeq & 0xF)) return ISOTP_IGNORED;
+        int count = rxLength - rxReceived;
+        if (count > 7) count = 7;
+        if (count > frame.length - 1) return ISOTP_IGNORED;
+        memcpy(&buffer[rxReceived], &bytes[1], count);
+        rxReceived += count;
+        rxSeq++;
+        if (rxReceived < rxLength) return ISOTP_CONSUMED;
+        rxLength = 0;
+        return ISOTP_COMPLETE;
+    }
+    case 3: //flow control for what is being sent
+        if (!txLength || !txWaitFlow || frame.length < 3) return ISOTP_IGNORED;
+        switch (bytes[0] & 0xF)
+        {
+        case 0: //clear to send
+            txWaitFlow = false;
+            txBlockLeft = bytes[1];
+            //separation time: 0-7F milliseconds, F1-F9 hundreds of microseconds, anything else the maximum
+            if (bytes[2] <= 0x7F) txSeparation = bytes[2] * 1000ul;
+            else if (bytes[2] >= 0xF1 && bytes[2] <= 0xF9) txSeparation = (bytes[2] - 0xF0) * 100ul;
+            else txSeparation = 127000;
+            txNext = micros();
+            return ISOTP_CONSUMED;
+        case 1: //wait
+            return ISOTP_CONSUMED;
+        default: //overflow, the request is too long for the ECU
+            txLength = 0;
+            txWaitFlow = false;
+            isoTpOverflows.inc();
+            return ISOTP_OVERFLOW;
+        }
+    }
+    return ISOTP_IGNORED;
+}
+
+bool IsoTpChannel::isSending()
+{
+    return txLength != 0;
+}
+
+bool IsoTpChannel::isReceiving()
+{
+    return rxLength != 0;
+}
+
+const uint8_t *IsoTpChannel::getMessage()
+{
+    return buffer;
+}
+
+uint16_t IsoTpChannel::getLength()
+{
+    return rxReceived;
+}
+
+uint32_t IsoTpChannel::getRxId()
+{
+    return rxId;
+}
+
+//frames are padded to 8 bytes like every ELM327 sends them
+void IsoTpChannel::sendFrame(const uint8_t *data, int length)
+{
+    CAN_FRAME frame;
+    frame.id = txId;
+    frame.length = 8;
+    frame.rtr = 0;
+    frame.extended = 0;
+    for (int i = 0; i < 8; i++) frame.data.byte[i] = (i < length) ? data[i] : 0xAA;
+    CAN0.sendFrame(frame);
+}
+
+//no block limit and no gap, the device takes frames as fast as the ECU sends them
+void IsoTpChannel::sendFlow(uint8_t status)
+{
+    uint8_t flow[3] = {status, 0, 0};
+    sendFrame(flow, 3);
+}
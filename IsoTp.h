@@ -0,0 +1,84 @@
+/*
+ * IsoTp.h
+ *
+ * One ISO 15765-2 (ISO-TP) conversation with an ECU: sends a request as a
+ * single frame or as a first frame plus consecutive frames paced by the ECU's
+ * flow control, and reassembles the ECU's answer, sending flow control for it.
+ * Several channels can run side by side, one per ECU answering.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ISOTP_H_
+#define ISOTP_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include <esp32_can.h>
+
+enum IsoTpResult {
+    ISOTP_IGNORED,      //not for this channel
+    ISOTP_CONSUMED,     //part of a message or flow control
+    ISOTP_COMPLETE,     //a whole message is in, see getMessage()
+    ISOTP_OVERFLOW      //either side's message didn't fit, the transfer was dropped
+};
+
+class IsoTpChannel {
+public:
+    IsoTpChannel();
+    //frames go out on txId and are expected back on rxId, messages are reassembled into buffer
+    void begin(uint32_t txId, uint32_t rxId, uint8_t *buffer, uint16_t size);
+    //send a message, anything over 7 bytes starts with a first frame. data must stay valid until isSending() is false
+    bool send(const uint8_t *data, uint16_t length);
+    //sends consecutive frames when the ECU's flow control allows
+    void loop();
+    IsoTpResult processFrame(CAN_FRAME &frame);
+    bool isSending();
+    //a first frame came in and the rest of the message hasn't yet
+    bool isReceiving();
+    const uint8_t *getMessage();
+    uint16_t getLength();
+    uint32_t getRxId();
+    void reset();
+
+private:
+    uint32_t txId;
+    uint32_t rxId;
+    uint8_t *buffer;
+    uint16_t bufferSize;
+    uint16_t rxLength;      //length of the message being received, 0 when idle
+    uint16_t rxReceived;
+    uint8_t rxSeq;          //sequence number the next consecutive frame carries
+    const uint8_t *txData;
+    uint16_t txLength;      //0 when nothing is being sent
+    uint16_t txOffset;
+    uint8_t txSeq;
+    bool txWaitFlow;        //waiting for the ECU's flow control
+    uint8_t txBlockLeft;    //consecutive frames until the next flow control, 0 for no limit
+    uint32_t txSeparation;  //microseconds between consecutive frames
+    uint32_t txNext;        //micros() the next consecutive frame may go at
+
+    void sendFrame(const uint8_t *data, int length);
+    void sendFlow(uint8_t status);
+};
+
+#endif /* ISOTP_H_ */
@@ -27,14 +27,26 @@
 #include "Logger.h"
 #include "config.h"
 #include "EEPROM.h"
+#include "Metrics.h"
 
 Logger::LogLevel Logger::logLevel = Logger::Info;
 uint32_t Logger::lastLogTime = 0;
+Logger::LogRecord Logger::ring[LOG_RING_SIZE];
+std::atomic<uint32_t> Logger::writePos(0);
+uint32_t Logger::readPos = 0;
+std::atomic<uint32_t> Logger::dropped(0);
+TaskHandle_t Logger::taskHandle = NULL;
+
+static const char *levelNames[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+
+MetricCounter logMessages("log.messages");
+MetricCounter logDropped("log.dropped");
 
 /*
  * Output a debug message with a variable amount of parameters.
- * printf() style, see Logger::log()
+ * printf() style, see Logger::formatRecord()
  *
+ * Prefer the LOG_DEBUG() etc. macros in Logger.h over calling these directly.
  */
 void Logger::debug(const char *message, ...)
 {
@@ -44,13 +56,13 @@ void Logger::debug(const char *message, ...)
 
     va_list args;
     va_start(args, message);
-    Logger::log(Debug, message, args);
+    Logger::enqueue(Debug, message, args);
     va_end(args);
 }
 
 /*
  * Output a info message with a variable amount of parameters
- * printf() style, see Logger::log()
+ * printf() style, see Logger::formatRecord()
  */
 void Logger::info(const char *message, ...)
 {
@@ -60,13 +72,13 @@ void Logger::info(const char *message, ...)
 
     va_list args;
     va_start(args, message);
-    Logger::log(Info, message, args);
+    Logger::enqueue(Info, message, args);
     va_end(args);
 }
 
 /*
  * Output a warning message with a variable amount of parameters
- * printf() style, see Logger::log()
+ * printf() style, see Logger::formatRecord()
  */
 void Logger::warn(const char *message, ...)
 {
@@ -76,13 +88,13 @@ void Logger::warn(const char *message, ...)
 
     va_list args;
     va_start(args, message);
-    Logger::log(Warn, message, args);
+    Logger::enqueue(Warn, message, args);
     va_end(args);
 }
 
 /*
  * Output a error message with a variable amount of parameters
- * printf() style, see Logger::log()
+ * printf() style, see Logger::formatRecord()
  */
 void Logger::error(const char *message, ...)
 {
@@ -92,22 +104,37 @@ void Logger::error(const char *message, ...)
 
     va_list args;
     va_start(args, message);
-    Logger::log(Error, message, args);
+    Logger::enqueue(Error, message, args);
     va_end(args);
 }
 
 /*
  * Output a console message with a variable amount of parameters
- * printf() style, see Logger::logMessage()
+ * printf() style, see Logger::formatRecord()
+ *
+ * Console output answers something the user just typed so it is written
+ * immediately instead of going through the deferred ring.
  */
 void Logger::console(const char *message, ...)
 {
     va_list args;
     va_start(args, message);
-    Logger::logMessage(message, args);
+    Logger::log(Off, message, args);
     va_end(args);
 }
 
+/*
+ * Start the background task that drains the log ring. Until this has been
+ * called all messages are written synchronously.
+ */
+void Logger::setup()
+{
+    for (uint32_t i = 0; i < LOG_RING_SIZE; i++) ring[i].sequence.store(i, std::memory_order_relaxed);
+    writePos.store(0, std::memory_order_relaxed);
+    readPos = 0;
+    //runs on the protocol core at low priority so it never competes with loop() for CPU time
+    xTaskCreatePinnedToCore(logTask, "Logger", 4096, NULL, 1, &taskHandle, 0);
+}
 
 void Logger::loop()
 {
@@ -138,71 +165,167 @@ uint32_t Logger::getLastLogTime()
 }
 
 /*
- * Returns if debug log level is enabled. This can be used in time critical
- * situations to prevent unnecessary string concatenation (if the message won't
- * be logged in the end).
- *
- * Example:
- * if (Logger::isDebug()) {
- *    Logger::debug("current time: %d", millis());
- * }
+ * Return how many messages have been thrown away because the ring was full.
  */
-boolean Logger::isDebug()
+uint32_t Logger::getDroppedCount()
 {
-    return logLevel == Debug;
+    return logDropped.get();
 }
 
 /*
- * Output a log message (called by debug(), info(), warn(), error(), console())
- *
- * Supports printf() like syntax:
- *
- * %% - outputs a '%' character
- * %s - prints the next parameter as string
- * %d - prints the next parameter as decimal
- * %f - prints the next parameter as double float
- * %x - prints the next parameter as hex value
- * %X - prints the next parameter as hex value with '0x' added before
- * %b - prints the next parameter as binary value
- * %B - prints the next parameter as binary value with '0b' added before
- * %l - prints the next parameter as long
- * %c - prints the next parameter as a character
- * %t - prints the next parameter as boolean ('T' or 'F')
- * %T - prints the next parameter as boolean ('true' or 'false')
+ * Compare the cost of a synchronous log call (format and write to the UART
+ * right away) with a deferred one (capture into the ring) and print the
+ * average CPU cycles per call for both.
+ */
+void Logger::benchmark()
+{
+    const int iterations = 16;
+    LogLevel oldLevel = logLevel;
+    uint32_t start, syncCycles, deferredCycles;
+
+    logLevel = Info;
+    start = ESP.getCycleCount();
+    for (int i = 0; i < iterations; i++) logNow(Info, "Log benchmark %i: %X %s", i, start, "synchronous");
+    syncCycles = (ESP.getCycleCount() - start) / iterations;
+
+    start = ESP.getCycleCount();
+    for (int i = 0; i < iterations; i++) info("Log benchmark %i: %X %s", i, start, "deferred");
+    deferredCycles = (ESP.getCycleCount() - start) / iterations;
+    logLevel = oldLevel;
+
+    console("Cycles per log call - synchronous: %i, deferred: %i", syncCycles, deferredCycles);
+}
+
+/*
+ * Format and write a message right away from the calling context.
+ * Level Off is used for console output and leaves out the timestamp and level.
  */
 void Logger::log(LogLevel level, const char *format, va_list args)
 {
+    LogRecord record;
+    char buffer[LOG_LINE_SIZE];
+
+    record.format = format;
+    record.timestamp = millis();
+    record.level = level;
+    if (level != Off) lastLogTime = record.timestamp;
+    capture(record, format, args);
+    Serial.write((uint8_t *)buffer, formatRecord(buffer, sizeof(buffer), record));
+}
+
+void Logger::logNow(LogLevel level, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    log(level, format, args);
+    va_end(args);
+}
+
+/*
+ * Claim the next slot of the ring, capture the message into it and publish it
+ * to the log task. Producers only ever do a compare and swap on writePos so
+ * this is safe to call from any task. If the ring is full the message is
+ * counted as dropped instead of waiting for room.
+ */
+void Logger::enqueue(LogLevel level, const char *format, va_list args)
+{
+    LogRecord *record;
+    uint32_t pos;
+
     lastLogTime = millis();
-    Serial.print(lastLogTime);
-    Serial.print(" - ");
-
-    switch (level) {
-    case Debug:
-        Serial.print("DEBUG");
-        break;
-
-    case Info:
-        Serial.print("INFO");
-        break;
-
-    case Warn:
-        Serial.print("WARNING");
-        break;
-
-    case Error:
-        Serial.print("ERROR");
-        break;
-    case Off:
-        break;
+    logMessages.inc();
+    if (taskHandle == NULL) { //nothing would drain the ring yet
+        log(level, format, args);
+        return;
+    }
+
+    pos = writePos.load(std::memory_order_relaxed);
+    for (;;) {
+        record = &ring[pos & (LOG_RING_SIZE - 1)];
+        int32_t diff = (int32_t)(record->sequence.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (writePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            logDropped.inc();
+            return;
+        } else {
+            pos = writePos.load(std::memory_order_relaxed);
+        }
     }
 
-    Serial.print(": ");
+    record->format = format;
+    record->timestamp = lastLogTime;
+    record->level = level;
+    capture(*record, format, args);
+    record->sequence.store(pos + 1, std::memory_order_release);
+}
+
+/*
+ * Pull the raw arguments the format string refers to out of the va_list.
+ * Strings are copied since the caller's buffer may be gone by the time the
+ * record is formatted. They are truncated if the record runs out of room.
+ */
+void Logger::capture(LogRecord &record, const char *format, va_list args)
+{
+    uint8_t argCount = 0;
+
+    record.stringLen = 0;
+    for (; *format != 0; ++format) {
+        if (*format != '%') {
+            continue;
+        }
+        ++format;
+        if (*format == '\0') {
+            break;
+        }
+        if (argCount >= LOG_MAX_ARGS) {
+            break;
+        }
 
-    logMessage(format, args);
+        LogArg &arg = record.args[argCount];
+        switch (*format) {
+        case 's': {
+            const char *str = va_arg(args, const char *);
+            uint16_t room = LOG_STRING_SPACE - record.stringLen;
+            if (str == NULL || room == 0) {
+                arg.i = -1;
+                break;
+            }
+            size_t len = strnlen(str, room - 1);
+            memcpy(&record.strings[record.stringLen], str, len);
+            record.strings[record.stringLen + len] = 0;
+            arg.i = record.stringLen;
+            record.stringLen += len + 1;
+            break;
+        }
+        case 'f':
+            arg.f = va_arg(args, double);
+            break;
+        case 'l':
+            arg.l = va_arg(args, long);
+            break;
+        case 'd':
+        case 'i':
+        case 'x':
+        case 'X':
+        case 'c':
+        case 't':
+        case 'T':
+            arg.i = va_arg(args, int);
+            break;
+        default: //'%%' and unknown conversions don't consume an argument
+            continue;
+        }
+        argCount++;
+    }
 }
 
 /*
- * Output a log message (called by log(), console())
+ * Turn a captured record into a line of text, returning its length.
+ * The output always ends in CR LF and is truncated to fit size.
  *
  * Supports printf() like syntax:
  *
@@ -217,92 +340,106 @@ void Logger::log(LogLevel level, const char *format, va_list args)
  * %t - prints the next parameter as boolean ('T' or 'F')
  * %T - prints the next parameter as boolean ('true' or 'false')
  */
-void Logger::logMessage(const char *format, va_list args)
+uint16_t Logger::formatRecord(char *out, uint16_t size, LogRecord &record)
 {
-    uint8_t buffer[200];
-    uint8_t buffLen = 0;
-    uint8_t writeLen;
-    for (; *format != 0; ++format) {
-        if (*format == '%') {
-            ++format;
-
-            if (*format == '\0') {
-                break;
-            }
-
-            if (*format == '%') {
-                buffer[buffLen++] = *format;
-                continue;
-            }
-
-            if (*format == 's') {
-                register char *s = (char *) va_arg(args, int);
-                writeLen = sprintf((char*)&buffer[buffLen], "%s", s);
-                buffLen += writeLen;
-                continue;
-            }
-
-            if (*format == 'd' || *format == 'i') {
-                writeLen = sprintf((char*)&buffer[buffLen], "%i", va_arg(args, int));
-                buffLen += writeLen;
-                continue;
-            }
-
-            if (*format == 'f') {
-                writeLen = sprintf((char*)&buffer[buffLen], "%.2f", va_arg(args, double));
-                buffLen += writeLen;
-                continue;
-            }
-
-            if (*format == 'x') {
-                writeLen = sprintf((char*)&buffer[buffLen], "%X", va_arg(args, int));
-                buffLen += writeLen;
-                continue;
-            }
-
-            if (*format == 'X') {
-                writeLen = sprintf((char*)&buffer[buffLen], "0x%X", va_arg(args, int));
-                buffLen += writeLen;
-                continue;
-            }
-
-            if (*format == 'l') {
-                writeLen = sprintf((char*)&buffer[buffLen], "%ld", va_arg(args, long));
-                buffLen += writeLen;
-                continue;
-            }
-
-            if (*format == 'c') {
-                writeLen = sprintf((char*)&buffer[buffLen], "%c", va_arg(args, int));
-                buffLen += writeLen;
-                continue;
-            }
+    const char *format = record.format;
+    uint16_t limit = size - 2; //always leave room for the line ending
+    uint16_t len = 0;
+    uint8_t argIdx = 0;
+    int written;
+
+    if (record.level != Off) {
+        written = snprintf(out, limit, "%lu - %s: ", (unsigned long)record.timestamp, levelNames[record.level]);
+        len = (written < limit) ? written : limit - 1;
+    }
 
-            if (*format == 't') {
-                if (va_arg(args, int) == 1) {
-                    buffer[buffLen++] = 'T';
-                } else {
-                    buffer[buffLen++] = 'F';
-                }
-                continue;
-            }
+    for (; *format != 0 && len < limit - 1; ++format) {
+        if (*format != '%') {
+            out[len++] = *format;
+            continue;
+        }
+        ++format;
+        if (*format == '\0') {
+            break;
+        }
+        if (*format == '%') {
+            out[len++] = '%';
+            continue;
+        }
+        if (argIdx >= LOG_MAX_ARGS) {
+            break;
+        }
 
-            if (*format == 'T') {
-                if (va_arg(args, int) == 1) {
-                    writeLen = sprintf((char*)&buffer[buffLen], "TRUE");
-                    buffLen += writeLen;
-                } else {
-                    writeLen = sprintf((char*)&buffer[buffLen], "FALSE");
-                    buffLen += writeLen;
-                }
-                continue;
-            }
+        LogArg &arg = record.args[argIdx];
+        char *dest = out + len;
+        uint16_t room = limit - len;
+        switch (*format) {
+        case 's':
+            written = snprintf(dest, room, "%s", (arg.i < 0) ? "" : &record.strings[arg.i]);
+            break;
+        case 'd':
+        case 'i':
+            written = snprintf(dest, room, "%i", arg.i);
+            break;
+        case 'f':
+            written = snprintf(dest, room, "%.2f", arg.f);
+            break;
+        case 'x':
+            written = snprintf(dest, room, "%X", arg.i);
+            break;
+        case 'X':
+            written = snprintf(dest, room, "0x%X", arg.i);
+            break;
+        case 'l':
+            written = snprintf(dest, room, "%ld", arg.l);
+            break;
+        case 'c':
+            written = snprintf(dest, room, "%c", arg.i);
+            break;
+        case 't':
+            written = snprintf(dest, room, "%c", (arg.i == 1) ? 'T' : 'F');
+            break;
+        case 'T':
+            written = snprintf(dest, room, "%s", (arg.i == 1) ? "TRUE" : "FALSE");
+            break;
+        default:
+            continue;
+        }
+        argIdx++;
+        if (written > 0) {
+            len += (written < room) ? written : room - 1;
         }
-        else buffer[buffLen++] = *format;
     }
-    buffer[buffLen++] = '\r';
-    buffer[buffLen++] = '\n';
-    Serial.write(buffer, buffLen);
+    out[len++] = '\r';
+    out[len++] = '\n';
+    return len;
 }
 
+/*
+ * Background task that formats queued records and writes them to the serial
+ * port. Once the ring has been drained it reports how many messages were
+ * dropped since the last report, then sleeps until more arrive.
+ */
+void Logger::logTask(void *)
+{
+    char buffer[LOG_LINE_SIZE];
+
+    for (;;) {
+        LogRecord &record = ring[readPos & (LOG_RING_SIZE - 1)];
+        if (record.sequence.load(std::memory_order_acquire) == readPos + 1) {
+            uint16_t len = formatRecord(buffer, sizeof(buffer), record);
+            record.sequence.store(readPos + LOG_RING_SIZE, std::memory_order_release);
+            readPos++;
+            Serial.write((uint8_t *)buffer, len);
+            continue;
+        }
 
+        uint32_t lost = dropped.exchange(0, std::memory_order_relaxed);
+        if (lost > 0) {
+            int len = snprintf(buffer, sizeof(buffer), "%lu - WARNING: %lu log messages dropped\r\n",
+                               (unsigned long)millis(), (unsigned long)lost);
+            Serial.write((uint8_t *)buffer, len);
+        }
+        vTaskDelay(LOG_TASK_IDLE_MS / portTICK_PERIOD_MS);
+    }
+}
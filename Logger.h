@@ -28,6 +28,7 @@
 #define LOGGER_H_
 
 #include <Arduino.h>
+#include <atomic>
 #include "config.h"
 
 
@@ -44,15 +45,95 @@ public:
     static void setLoglevel(LogLevel);
     static LogLevel getLogLevel();
     static uint32_t getLastLogTime();
-    static boolean isDebug();
+    //guards work that is only done to produce a debug message. Always false when debug isn't compiled in
+    static boolean isDebug() {
+        return LOG_MIN_LEVEL <= Debug && logLevel == Debug;
+    }
+    //true if a message at this level would be output
+    static bool isEnabled(LogLevel level) {
+        return LOG_MIN_LEVEL <= level && logLevel <= level;
+    }
+    static void setup();
     static void loop();
+    static uint32_t getDroppedCount();
+    static void benchmark();
 private:
+    //one captured argument. Strings are copied into the record and referenced by offset
+    union LogArg {
+        int i;
+        long l;
+        double f;
+    };
+
+    //everything needed to format a message later. sequence orders the slot within the ring
+    struct LogRecord {
+        std::atomic<uint32_t> sequence;
+        const char *format;
+        uint32_t timestamp;
+        uint8_t level;
+        uint8_t stringLen;
+        LogArg args[LOG_MAX_ARGS];
+        char strings[LOG_STRING_SPACE];
+    };
+
     static LogLevel logLevel;
     static uint32_t lastLogTime;
+    static LogRecord ring[LOG_RING_SIZE];
+    static std::atomic<uint32_t> writePos;
+    static uint32_t readPos;
+    static std::atomic<uint32_t> dropped;
+    static TaskHandle_t taskHandle;
 
     static void log(LogLevel, const char *format, va_list);
-    static void logMessage(const char *format, va_list args);
+    static void logNow(LogLevel, const char *format, ...);
+    static void enqueue(LogLevel, const char *format, va_list);
+    static void capture(LogRecord &record, const char *format, va_list args);
+    static uint16_t formatRecord(char *out, uint16_t size, LogRecord &record);
+    static void logTask(void *);
 };
 
+/*
+ * Compile time checks for log format strings. countArgs() returns how many
+ * arguments a format consumes or -1 if it uses a conversion formatRecord()
+ * doesn't support. argCounter() is only ever used inside sizeof so it needs
+ * no definition and never evaluates its arguments.
+ */
+namespace LogFormat {
+    constexpr bool isConversion(char c) {
+        return c == 's' || c == 'd' || c == 'i' || c == 'f' || c == 'x' || c == 'X' ||
+               c == 'l' || c == 'c' || c == 't' || c == 'T';
+    }
+
+    constexpr int countArgs(const char *format, int count = 0) {
+        return (*format == 0) ? count
+               : (*format != '%') ? countArgs(format + 1, count)
+               : (format[1] == '%') ? countArgs(format + 2, count)
+               : isConversion(format[1]) ? countArgs(format + 2, count + 1)
+               : -1;
+    }
+
+    template<typename... Args> char (&argCounter(const Args &...))[sizeof...(Args) + 1];
+}
+
+/*
+ * Preferred way to log from anywhere timing matters. The format string is
+ * checked at compile time, sites below LOG_MIN_LEVEL compile to nothing and
+ * sites filtered out by the runtime log level don't evaluate their arguments.
+ *
+ * Example:
+ * LOG_DEBUG("Mode: %i, PID: %i", mode, pid);
+ */
+#define LOG_AT_LEVEL(level, func, format, ...) do { \
+        static_assert(LogFormat::countArgs(format) >= 0, "log format uses a conversion Logger doesn't support"); \
+        static_assert(LogFormat::countArgs(format) == sizeof(LogFormat::argCounter(__VA_ARGS__)) - 1, \
+                      "log format and argument count don't match"); \
+        if (Logger::isEnabled(level)) func(format, ##__VA_ARGS__); \
+    } while (0)
+
+#define LOG_DEBUG(format, ...) LOG_AT_LEVEL(Logger::Debug, Logger::debug, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) LOG_AT_LEVEL(Logger::Info, Logger::info, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...) LOG_AT_LEVEL(Logger::Warn, Logger::warn, format, ##__VA_ARGS__)
+#define LOG_ERROR(format, ...) LOG_AT_LEVEL(Logger::Error, Logger::error, format, ##__VA_ARGS__)
+
 #endif /* LOGGER_H_ */
 
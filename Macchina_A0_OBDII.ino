@@ -31,10 +31,24 @@
 #include "config.h"
 #include <esp32_can.h>
 #include <SPI.h>
-#include "EEPROM.h"
+#include "SettingsStore.h"
 #include "Logger.h"
 #include "SerialConsole.h"
 #include "ELM327_Emulator.h"
+#include "PeriodicSender.h"
+#include "PIDPoller.h"
+#include "UDSReader.h"
+#include "UDSStreamer.h"
+#include "DTCSweep.h"
+#include "SignalDB.h"
+#include "FrameTable.h"
+#include "BusStats.h"
+#include "Recorder.h"
+#include "TriggerEngine.h"
+#include "Player.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "BootProfile.h"
 #include <iso-tp.h>
 #include "obd2_codes.h"
 
@@ -43,6 +57,7 @@
 #include <WiFiMulti.h>
 #include <ESPmDNS.h>
 #include <ArduinoOTA.h>
+#include "OTAUpdater.h"
 #endif
 
 byte i = 0;
@@ -50,10 +65,27 @@ byte i = 0;
 byte serialBuffer[WIFI_BUFF_SIZE];
 int serialBufferLength = 0; //not creating a ring buffer. The buffer should be large enough to never overflow
 uint32_t lastFlushMicros = 0;
+uint16_t gvretCoalesceMs = 0; //PROTO_SET_COALESCE interval, 0 sends every frame
+uint32_t lastCoalesceMillis = 0;
+bool gvretSnapshotPending = false; //PROTO_GET_SNAPSHOT frames still to go out
+RecorderCursor gvretExport; //PROTO_GET_RECORDING frames still to go out while it is active
+int gvretCapturePos = -1; //next PROTO_GET_CAPTURE frame to go out, -1 if none is pending
 uint32_t lastBroadcast = 0;
 EEPROMSettings settings;
+SettingsStore settingsStore;
 SerialConsole console;
 ELM327Emu elmEmulator;
+PeriodicSender periodicSender;
+PIDPoller pidPoller;
+UDSReader udsReader;
+UDSStreamer udsStreamer;
+DTCSweep dtcSweep;
+SignalDB signalDB;
+FrameTable frameTable;
+BusStats busStats;
+Recorder recorder;
+TriggerEngine triggerEngine;
+Player player;
 
 #ifndef BLUETOOTH
 WiFiClient clientNodes[MAX_CLIENTS];
@@ -63,55 +95,52 @@ WiFiServer wifiServer(35000);
 WiFiServer savvyServer(23);
 WiFiUDP wifiUDPServer;
 IPAddress broadcastAddr(255, 255, 255, 255);
-int OTAcount = 0;
+OTAUpdater otaUpdater(wifiClient);
+TaskHandle_t otaTaskHandle = NULL; //set while a background firmware download is running
 #endif
 
+MetricCounter canRxFrames("can.rx_frames");
+MetricCounter canTxFrames("can.tx_frames");
+MetricGauge serialBufferHighWater("gvret.buffer_hwm");
+MetricCounter gvretBytesOut("gvret.bytes_out");
+MetricCounter gvretBufferDiscards("gvret.buffer_discards");
+MetricCounter socketWriteStalls("gvret.write_stalls");
+MetricHistogram socketWriteTime("gvret.write_us");
+//time since the previous CAN poll when a frame is picked up, kept apart while an OTA download runs
+MetricHistogram canPollGap("can.poll_gap_us");
+MetricHistogram otaCanPollGap("ota.can_poll_gap_us");
+
 bool test = false;
 uint8_t testcount = 0;
 bool isWifiConnected = false;
+volatile bool radioReady = false; //set once radioSetupTask has brought up WiFi or Bluetooth
 
 void execOTA();
+void printOTAStatus();
+void applyOTA();
 
 template<class T> inline Print &operator <<(Print &obj, T arg) {
   obj.print(arg);
   return obj;
 }
 
-//initializes all the system EEPROM values. Chances are this should be broken out a bit but
-//there is only one checksum check for all of them so it's simple to do it all here.
+//Loads settings from flash through the settings store. Migrated or defaulted settings are
+//written back in the background so nothing here waits on flash.
 void loadSettings()
 {
   Logger::console("Loading settings....");
 
-  if (!EEPROM.begin(1024))
+  switch (settingsStore.begin())
   {
-    Serial.println("Could not initialize EEPROM!"); delay(1000000);
-    return;
-  }
-
-  EEPROM.readBytes(0, &settings, sizeof(settings));
-
-  if (settings.version != EEPROM_VER) { //if settings are not the current version then erase them and set defaults
+  case SettingsStore::Loaded:
+    Logger::console("Using stored settings");
+    break;
+  case SettingsStore::Migrated:
+    Logger::console("Migrated stored settings to version %X", EEPROM_VER);
+    break;
+  case SettingsStore::Defaults:
     Logger::console("Resetting to factory defaults");
-    settings.version = EEPROM_VER;
-    settings.CAN0Speed = 500000;
-    settings.CAN0_Enabled = true;
-    settings.valid = 0; //not used right now
-    settings.logLevel = 1; //info instead of debug
-    strcpy(settings.softSSID, "MACCHINAOBD2");
-    settings.softWPA2KEY[0] = 0; //no password by default
-    settings.softAPMode = 1; //create an AP by default
-    settings.wifiChannel = 13;
-    settings.wifiTxPower = 78; //19.5dB tx power - the max. Values are in quarter dB
-    strcpy(settings.clientSSID, "YOURAP");
-    strcpy(settings.clientWPA2KEY, "Password");
-    strcpy(settings.btName, "MACCHINAOBDII");
-    EEPROM.writeBytes(0, &settings, sizeof(settings));
-    EEPROM.commit();
-  } else {
-    Logger::console("Using stored values from EEPROM");
-    if (settings.wifiChannel > 15 || settings.wifiChannel < 1) settings.wifiChannel = 13;
-    if (settings.wifiTxPower < 8 || settings.wifiTxPower > 78) settings.wifiTxPower = 78;
+    break;
   }
 
   Logger::setLoglevel((Logger::LogLevel)settings.logLevel);
@@ -122,13 +151,52 @@ void setPromiscuousMode()
   CAN0.watchFor();
 }
 
-void setup()
+//Brings up the softAP, the station connection or Bluetooth. That takes anywhere from a few hundred
+//milliseconds to seconds so it runs in its own task while loop() is already handling CAN traffic.
+void radioSetupTask(void *)
 {
-  //delay(5000); //just for testing. Don't use in production
+#ifndef BLUETOOTH
+  if (settings.softAPMode)
+  {
+    WiFi.mode(WIFI_AP);
+    //the softAP sometimes comes up on the default 192.168.4.1 instead. Redo the config rather
+    //than rebooting so CAN handling isn't interrupted
+    for (int attempt = 0; attempt < SOFTAP_RETRIES; attempt++)
+    {
+      WiFi.softAPConfig(IPAddress(192, 168, 0, 10), IPAddress(192, 168, 0, 10), IPAddress(255, 255, 255, 0));
+      WiFi.softAP((const char *)settings.softSSID, (const char *)settings.softWPA2KEY, settings.wifiChannel);
+      if (!(WiFi.softAPIP().toString() == String("192.168.4.1"))) break;
+      vTaskDelay(100 / portTICK_PERIOD_MS);
+    }
+    WiFi.setTxPower((wifi_power_t)settings.wifiTxPower);
+    //Logger::console("Tx Power: %i", WiFi.getTxPower());
+  }
+  else
+  {
+    WiFi.mode(WIFI_STA);
+    WiFi.begin((const char *)settings.clientSSID, (const char *)settings.clientWPA2KEY);
+    WiFi.setTxPower((wifi_power_t)settings.wifiTxPower);
+  }
+  BootProfile::mark("wifi_started");
+#else
+  elmEmulator.setupBluetooth();
+  BootProfile::mark("bluetooth_started");
+#endif
+  radioReady = true;
+  vTaskDelete(NULL);
+}
 
+//Startup is staged so frames are read and handled within milliseconds of reset. Everything
+//CAN, ELM327 and GVRET need is set up here and the radio comes up in parallel afterward.
+//BOOTTIME on the console shows when each stage finished.
+void setup()
+{
   Serial.begin(115200);
+  Logger::setup();
+  BootProfile::mark("serial");
 
   loadSettings();
+  BootProfile::mark("settings");
 
   Serial.print("Build number: ");
   Serial.println(CFG_BUILD_NUM);
@@ -150,25 +218,20 @@ void setup()
   CAN1.disable();
 
   setPromiscuousMode();
-
-#ifndef BLUETOOTH
-  if (settings.softAPMode)
-  {
-    WiFi.mode(WIFI_AP);
-    WiFi.softAPConfig(IPAddress(192, 168, 0, 10), IPAddress(192, 168, 0, 10), IPAddress(255, 255, 255, 0));
-    WiFi.softAP((const char *)settings.softSSID, (const char *)settings.softWPA2KEY, settings.wifiChannel);
-    WiFi.setTxPower((wifi_power_t)settings.wifiTxPower);
-    //Logger::console("Tx Power: %i", WiFi.getTxPower());
-  }
-  else
-  {
-    WiFi.mode(WIFI_STA);
-    WiFi.begin((const char *)settings.clientSSID, (const char *)settings.clientWPA2KEY);
-    WiFi.setTxPower((wifi_power_t)settings.wifiTxPower);
-  }
-#endif
+  BootProfile::mark("can");
 
   elmEmulator.setup();
+  periodicSender.setup();
+  pidPoller.setup();
+  udsReader.setup();
+  udsStreamer.setup();
+  dtcSweep.setup();
+  signalDB.setup();
+  recorder.setup();
+  player.setup();
+  BootProfile::mark("engines");
+
+  xTaskCreatePinnedToCore(radioSetupTask, "Radio", 4096, NULL, 1, NULL, 0);
 
   Serial.print("Done with init\n");
 }
@@ -184,12 +247,21 @@ uint8_t checksumCalc(uint8_t *buffer, int length)
   return valu;
 }
 
-void sendFrameToWiFi(CAN_FRAME &frame, int whichBus)
+//Append a 32 bit value to the outgoing buffer in the little endian order GVRET uses everywhere
+void bufferUInt32(uint32_t val)
+{
+  serialBuffer[serialBufferLength++] = (uint8_t)(val & 0xFF);
+  serialBuffer[serialBufferLength++] = (uint8_t)(val >> 8);
+  serialBuffer[serialBufferLength++] = (uint8_t)(val >> 16);
+  serialBuffer[serialBufferLength++] = (uint8_t)(val >> 24);
+}
+
+void sendFrameToWiFi(CAN_FRAME &frame, int whichBus, uint32_t now)
 {
+  TRACE_SCOPE("gvret_frame");
   uint8_t buff[40];
   uint8_t writtenBytes;
   uint8_t temp;
-  uint32_t now = micros();
 
   if (frame.extended) frame.id |= 1 << 31;
   serialBuffer[serialBufferLength++] = 0xF1;
@@ -209,9 +281,131 @@ void sendFrameToWiFi(CAN_FRAME &frame, int whichBus)
   //temp = checksumCalc(buff, 11 + frame.length);
   temp = 0;
   serialBuffer[serialBufferLength++] = temp;
+  serialBufferHighWater.setMax(serialBufferLength);
   //Serial.write(buff, 12 + frame.length);
 }
 
+//Queue the frames pending for a coalesced consumer as regular frames with the time each was
+//received. Returns false if the buffer filled up first, the rest stay pending for the next call
+bool bufferLatestFrames(FrameTable::Consumer consumer)
+{
+  CAN_FRAME frame;
+
+  for (int idx = frameTable.nextPending(consumer, 0); idx != -1; idx = frameTable.nextPending(consumer, idx + 1))
+  {
+    if (serialBufferLength + 20 > WIFI_BUFF_SIZE - 40) return false;
+    const LatestFrame *latest = frameTable.get(idx);
+    frame.id = latest->id & 0x7FFFFFFF;
+    frame.extended = (latest->id >> 31) != 0;
+    frame.length = latest->length;
+    memcpy(frame.data.bytes, latest->data, latest->length);
+    sendFrameToWiFi(frame, 0, latest->micros);
+    frameTable.markSent(consumer, idx);
+  }
+  return true;
+}
+
+//Queue recorded frames for PROTO_GET_RECORDING, stamped with the low 32 bits of their recording time.
+//Stops when the buffer fills up or the next frame isn't in flash yet, and ends with F1 27 and the
+//number of frames once they are all out
+void bufferRecordedFrames()
+{
+  CAN_FRAME frame;
+  uint64_t time;
+
+  while (serialBufferLength + 20 <= WIFI_BUFF_SIZE - 40)
+  {
+    Recorder::ReadResult result = recorder.next(gvretExport, frame, time);
+    if (result == Recorder::Wait) return;
+    if (result == Recorder::Done)
+    {
+      serialBuffer[serialBufferLength++] = 0xF1;
+      serialBuffer[serialBufferLength++] = PROTO_GET_RECORDING;
+      bufferUInt32(gvretExport.frames);
+      return;
+    }
+    sendFrameToWiFi(frame, 0, (uint32_t)time);
+  }
+}
+
+//Queue the frames of a trigger capture, then F1 28 with the trigger that fired, the frame count and
+//where the triggering frame is among them. Pulling the capture arms the triggers again
+void bufferCapture()
+{
+  CAN_FRAME frame;
+
+  for (; gvretCapturePos < triggerEngine.getCaptureCount(); gvretCapturePos++)
+  {
+    if (serialBufferLength + 20 > WIFI_BUFF_SIZE - 40) return;
+    const CapturedFrame *captured = triggerEngine.getCaptured(gvretCapturePos);
+    frame.id = captured->id & ~TRIGGER_EXTENDED;
+    frame.extended = (captured->id & TRIGGER_EXTENDED) != 0;
+    frame.length = captured->length;
+    memcpy(frame.data.bytes, captured->data, captured->length);
+    sendFrameToWiFi(frame, 0, captured->micros);
+  }
+  if (serialBufferLength + 7 > WIFI_BUFF_SIZE) return;
+  serialBuffer[serialBufferLength++] = 0xF1;
+  serialBuffer[serialBufferLength++] = PROTO_GET_CAPTURE;
+  serialBuffer[serialBufferLength++] = triggerEngine.getFiredTrigger();
+  serialBuffer[serialBufferLength++] = triggerEngine.getCaptureCount() & 0xFF;
+  serialBuffer[serialBufferLength++] = triggerEngine.getCaptureCount() >> 8;
+  serialBuffer[serialBufferLength++] = triggerEngine.getTriggerPosition() & 0xFF;
+  serialBuffer[serialBufferLength++] = triggerEngine.getTriggerPosition() >> 8;
+  triggerEngine.rearm();
+  gvretCapturePos = -1;
+}
+
+//F1 2A, playing, frames uploaded (2), sent (4), late (4), jitter avg and max in us (4 each)
+void bufferPlaybackStatus()
+{
+  PlayerStats stats;
+
+  player.getStats(stats);
+  serialBuffer[serialBufferLength++] = 0xF1;
+  serialBuffer[serialBufferLength++] = PROTO_PLAYBACK;
+  serialBuffer[serialBufferLength++] = stats.playing ? 1 : 0;
+  serialBuffer[serialBufferLength++] = stats.uploaded & 0xFF;
+  serialBuffer[serialBufferLength++] = stats.uploaded >> 8;
+  bufferUInt32(stats.sent);
+  bufferUInt32(stats.late);
+  bufferUInt32(stats.jitterAvg);
+  bufferUInt32(stats.jitterMax);
+}
+
+//values longer than UDS_MAX_DID_DATA only keep their start
+int keptLength(const UDSRecord &record)
+{
+  return (record.length < UDS_MAX_DID_DATA) ? record.length : UDS_MAX_DID_DATA;
+}
+
+//Results of a UDS read started with PROTO_UDS_READ: ECU, count, then per DID the DID (big endian),
+//status (0 read, FF no answer, else the negative response code), value length and value.
+//Waits for a later loop() if the buffer can't take all of it right now
+void bufferUDSResult()
+{
+  int length = 4;
+  for (int d = 0; d < udsReader.getCount(); d++) length += 4 + keptLength(udsReader.getRecord(d));
+  if (serialBufferLength + length > WIFI_BUFF_SIZE) return;
+
+  serialBuffer[serialBufferLength++] = 0xF1;
+  serialBuffer[serialBufferLength++] = PROTO_UDS_READ;
+  serialBuffer[serialBufferLength++] = udsReader.getECU();
+  serialBuffer[serialBufferLength++] = udsReader.getCount();
+  for (int d = 0; d < udsReader.getCount(); d++)
+  {
+    const UDSRecord &record = udsReader.getRecord(d);
+    int valueLength = keptLength(record);
+    serialBuffer[serialBufferLength++] = record.did >> 8;
+    serialBuffer[serialBufferLength++] = record.did & 0xFF;
+    serialBuffer[serialBufferLength++] = record.status;
+    serialBuffer[serialBufferLength++] = valueLength;
+    memcpy(&serialBuffer[serialBufferLength], record.data, valueLength);
+    serialBufferLength += valueLength;
+  }
+  udsReader.release();
+}
+
 //very cut down version of the one from ESP32RET. Just the bare minumum support
 void processIncomingByte(uint8_t in_byte)
 {
@@ -221,6 +415,19 @@ void processIncomingByte(uint8_t in_byte)
   static int step = 0;
   static STATE state = IDLE;
   static uint32_t build_int;
+  static uint32_t build_period;
+  static int periodic_slot;
+  static uint8_t periodic_op;
+  static uint8_t uds_ecu;
+  static int uds_count;
+  static uint16_t uds_dids[UDS_MAX_DIDS];
+  static uint16_t uds_lengths[UDS_MAX_DIDS];
+  static uint16_t coalesce_ms;
+  static uint16_t recording_seconds;
+  static uint8_t playback_op;
+  static uint16_t playback_speed;
+  static uint16_t playback_seconds;
+  static uint8_t playback_flags;
   uint32_t busSpeed = 0;
   uint32_t now = micros();
 
@@ -318,6 +525,102 @@ void processIncomingByte(uint8_t in_byte)
           step = 0;
           buff[0] = 0xF1;
           break;
+        case PROTO_SET_PERIODIC:
+          state = SETUP_PERIODIC;
+          step = 0;
+          break;
+        case PROTO_GET_PERIODIC_STATS:
+          {
+            PeriodicStats stats;
+            int countPos;
+            //each entry is 25 bytes, make sure the whole reply fits before starting it
+            if (serialBufferLength + 3 + MAX_PERIODIC_FRAMES * 25 > WIFI_BUFF_SIZE)
+            {
+              state = IDLE;
+              break;
+            }
+            serialBuffer[serialBufferLength++] = 0xF1;
+            serialBuffer[serialBufferLength++] = PROTO_GET_PERIODIC_STATS;
+            countPos = serialBufferLength++;
+            serialBuffer[countPos] = 0;
+            for (int s = 0; s < MAX_PERIODIC_FRAMES; s++)
+            {
+              if (!periodicSender.getStats(s, stats)) continue;
+              serialBuffer[serialBufferLength++] = s;
+              bufferUInt32(stats.extended ? (stats.id | 1ul << 31) : stats.id);
+              bufferUInt32(stats.period);
+              bufferUInt32(stats.sent);
+              bufferUInt32(stats.missed);
+              bufferUInt32(stats.jitterAvg);
+              bufferUInt32(stats.jitterMax);
+              serialBuffer[countPos]++;
+            }
+          }
+          state = IDLE;
+          break;
+        case PROTO_GET_METRICS:
+          {
+            int len = Metric::writeBinary(&serialBuffer[serialBufferLength + 2], WIFI_BUFF_SIZE - serialBufferLength - 2);
+            if (len > 0)
+            {
+              serialBuffer[serialBufferLength++] = 0xF1;
+              serialBuffer[serialBufferLength++] = PROTO_GET_METRICS;
+              serialBufferLength += len;
+            }
+          }
+          state = IDLE;
+          break;
+        case PROTO_UDS_READ:
+          state = UDS_READ;
+          step = 0;
+          break;
+        case PROTO_SET_COALESCE:
+          state = SET_COALESCE;
+          step = 0;
+          break;
+        case PROTO_GET_BUS_STATS:
+          {
+            //an empty ID list if the buffer is too full, see BusStats::writeBinary()
+            int len = busStats.writeBinary(&serialBuffer[serialBufferLength + 2], WIFI_BUFF_SIZE - serialBufferLength - 2);
+            if (len > 0)
+            {
+              serialBuffer[serialBufferLength++] = 0xF1;
+              serialBuffer[serialBufferLength++] = PROTO_GET_BUS_STATS;
+              serialBufferLength += len;
+            }
+          }
+          state = IDLE;
+          break;
+        case PROTO_GET_RECORDING:
+          state = GET_RECORDING;
+          step = 0;
+          break;
+        case PROTO_PLAYBACK_UPLOAD:
+          state = PLAYBACK_UPLOAD;
+          step = 0;
+          break;
+        case PROTO_PLAYBACK:
+          state = PLAYBACK_CONTROL;
+          step = 0;
+          break;
+        case PROTO_GET_CAPTURE:
+          //F1 28 FF 0 0 0 0 while nothing has been captured
+          if (triggerEngine.getState() == TriggerEngine::Captured) gvretCapturePos = 0;
+          else
+          {
+            serialBuffer[serialBufferLength++] = 0xF1;
+            serialBuffer[serialBufferLength++] = PROTO_GET_CAPTURE;
+            serialBuffer[serialBufferLength++] = 0xFF;
+            for (int c = 0; c < 4; c++) serialBuffer[serialBufferLength++] = 0;
+          }
+          state = IDLE;
+          break;
+        case PROTO_GET_SNAPSHOT:
+          //the newest frame of every ID goes out as regular frames, then F1 25 with the count
+          frameTable.markAll(FrameTable::GvretSnapshot);
+          gvretSnapshotPending = true;
+          state = IDLE;
+          break;
       }
       break;
     case BUILD_CAN_FRAME:
@@ -361,7 +664,7 @@ void processIncomingByte(uint8_t in_byte)
             build_out_frame.rtr = 0;
             if (out_bus == 0)
             {
-              CAN0.sendFrame(build_out_frame);
+              if (CAN0.sendFrame(build_out_frame)) canTxFrames.inc();
             }
             if (out_bus == 1)
             {
@@ -468,9 +771,8 @@ void processIncomingByte(uint8_t in_byte)
           CAN1.disable();
 
           state = IDLE;
-          //now, write out the new canbus settings to EEPROM
-          EEPROM.writeBytes(0, &settings, sizeof(settings));
-          EEPROM.commit();
+          //the new canbus settings get written out in the background
+          settingsStore.markDirty();
           //setPromiscuousMode();
           break;
       }
@@ -485,32 +787,276 @@ void processIncomingByte(uint8_t in_byte)
     case SETUP_EXT_BUSES: //setup enable/listenonly/speed for SWCAN, Enable/Speed for LIN1, LIN2
       state = IDLE;
       break;
+    case SETUP_PERIODIC:
+      //slot (0xFF = new), op (0 = add/update, 1 = remove), period in us (4), id (4), bus, length, data, checksum
+      switch (step)
+      {
+        case 0:
+          periodic_slot = (in_byte == 0xFF) ? -1 : in_byte;
+          break;
+        case 1:
+          periodic_op = in_byte;
+          break;
+        case 2:
+          build_period = in_byte;
+          break;
+        case 3:
+          build_period |= in_byte << 8;
+          break;
+        case 4:
+          build_period |= in_byte << 16;
+          break;
+        case 5:
+          build_period |= (uint32_t)in_byte << 24;
+          break;
+        case 6:
+          build_out_frame.id = in_byte;
+          break;
+        case 7:
+          build_out_frame.id |= in_byte << 8;
+          break;
+        case 8:
+          build_out_frame.id |= in_byte << 16;
+          break;
+        case 9:
+          build_out_frame.id |= (uint32_t)in_byte << 24;
+          if (build_out_frame.id & 1ul << 31)
+          {
+            build_out_frame.id &= 0x7FFFFFFF;
+            build_out_frame.extended = true;
+          } else build_out_frame.extended = false;
+          break;
+        case 10:
+          out_bus = in_byte & 3;
+          break;
+        case 11:
+          build_out_frame.length = in_byte & 0xF;
+          if (build_out_frame.length > 8) build_out_frame.length = 8;
+          break;
+        default:
+          if (step < build_out_frame.length + 12)
+          {
+            build_out_frame.data.bytes[step - 12] = in_byte;
+          }
+          else
+          {
+            //checksum byte, ignored here just like for regular frames
+            state = IDLE;
+            build_out_frame.rtr = 0;
+            if (periodic_op == 1)
+            {
+              if (!periodicSender.removeFrame(periodic_slot)) periodic_slot = -1;
+            }
+            else if (out_bus != 0) periodic_slot = -1; //only CAN0 is wired up on this hardware
+            else if (periodic_slot == -1)
+            {
+              periodic_slot = periodicSender.addFrame(build_out_frame, build_period);
+            }
+            else if (!periodicSender.updateFrame(periodic_slot, build_out_frame, build_period))
+            {
+              periodic_slot = -1;
+            }
+            serialBuffer[serialBufferLength++] = 0xF1;
+            serialBuffer[serialBufferLength++] = PROTO_SET_PERIODIC;
+            serialBuffer[serialBufferLength++] = (periodic_slot == -1) ? 0xFF : periodic_slot;
+          }
+          break;
+      }
+      step++;
+      break;
+    case UDS_READ:
+      //ECU (0-7), count, per DID the DID (big endian) and its length (0 if unknown), checksum.
+      //The results come back by themselves once read, see bufferUDSResult()
+      if (step == 0) uds_ecu = in_byte;
+      else if (step == 1) uds_count = (in_byte > UDS_MAX_DIDS) ? UDS_MAX_DIDS : in_byte;
+      else if (step < 2 + uds_count * 3)
+      {
+        int d = (step - 2) / 3;
+        if ((step - 2) % 3 == 0) uds_dids[d] = in_byte << 8;
+        else if ((step - 2) % 3 == 1) uds_dids[d] |= in_byte;
+        else uds_lengths[d] = in_byte;
+      }
+      else
+      {
+        state = IDLE;
+        if (!udsReader.start(UDSReader::Gvret, uds_ecu, uds_dids, uds_lengths, uds_count))
+        {
+          //busy with another read or nonsense asked for
+          serialBuffer[serialBufferLength++] = 0xF1;
+          serialBuffer[serialBufferLength++] = PROTO_UDS_READ;
+          serialBuffer[serialBufferLength++] = 0xFF;
+          serialBuffer[serialBufferLength++] = 0;
+        }
+      }
+      step++;
+      break;
+    case SET_COALESCE:
+      //interval in ms (2 bytes), checksum. Frames then go out as the newest one per ID once per
+      //interval instead of all of them, 0 goes back to every frame. Answers with the interval in use
+      if (step == 0) coalesce_ms = in_byte;
+      else if (step == 1) coalesce_ms |= in_byte << 8;
+      else
+      {
+        state = IDLE;
+        gvretCoalesceMs = coalesce_ms;
+        if (gvretCoalesceMs && gvretCoalesceMs < MONITOR_MIN_INTERVAL) gvretCoalesceMs = MONITOR_MIN_INTERVAL;
+        frameTable.setActive(FrameTable::GvretMonitor, gvretCoalesceMs != 0);
+        if (gvretCoalesceMs) frameTable.markAll(FrameTable::GvretMonitor);
+        lastCoalesceMillis = millis();
+        serialBuffer[serialBufferLength++] = 0xF1;
+        serialBuffer[serialBufferLength++] = PROTO_SET_COALESCE;
+        serialBuffer[serialBufferLength++] = gvretCoalesceMs & 0xFF;
+        serialBuffer[serialBufferLength++] = gvretCoalesceMs >> 8;
+      }
+      step++;
+      break;
+    case GET_RECORDING:
+      //seconds (2 bytes), checksum. The frames of the last seconds of the flight recording go out as
+      //regular frames, 0 sends all of it. F1 27 with the number of frames follows the last one
+      if (step == 0) recording_seconds = in_byte;
+      else if (step == 1) recording_seconds |= in_byte << 8;
+      else
+      {
+        state = IDLE;
+        if (!recorder.startExport(gvretExport, recording_seconds))
+        {
+          serialBuffer[serialBufferLength++] = 0xF1;
+          serialBuffer[serialBufferLength++] = PROTO_GET_RECORDING;
+          bufferUInt32(0);
+        }
+      }
+      step++;
+      break;
+    case PLAYBACK_UPLOAD:
+      //time in us (4), id (4), bus, length, data, checksum. Adds a frame to the log played with
+      //PROTO_PLAYBACK, only the gaps between the times count. No answer, the status has the count
+      if (step == 0) build_int = in_byte;
+      else if (step < 4) build_int |= (uint32_t)in_byte << (8 * step);
+      else if (step == 4) build_out_frame.id = in_byte;
+      else if (step < 8) build_out_frame.id |= (uint32_t)in_byte << (8 * (step - 4));
+      else if (step == 8) out_bus = in_byte & 3;
+      else if (step == 9)
+      {
+        build_out_frame.length = in_byte & 0xF;
+        if (build_out_frame.length > 8) build_out_frame.length = 8;
+      }
+      else if (step < build_out_frame.length + 10) build_out_frame.data.bytes[step - 10] = in_byte;
+      else
+      {
+        state = IDLE;
+        build_out_frame.extended = (build_out_frame.id >> 31) != 0;
+        build_out_frame.id &= 0x7FFFFFFF;
+        build_out_frame.rtr = 0;
+        if (out_bus == 0) player.addUpload(build_out_frame, build_int); //only CAN0 is wired up on this hardware
+      }
+      step++;
+      break;
+    case PLAYBACK_CONTROL:
+      //op, speed in percent (2), seconds (2), flags, checksum. Ops: 0 status, 1 play the upload,
+      //2 play the last seconds of the flight recording (0 = all of it), 3 stop, 4 clear the upload.
+      //Flag 1 plays in a loop. Always answers with the status
+      if (step == 0) playback_op = in_byte;
+      else if (step == 1) playback_speed = in_byte;
+      else if (step == 2) playback_speed |= in_byte << 8;
+      else if (step == 3) playback_seconds = in_byte;
+      else if (step == 4) playback_seconds |= in_byte << 8;
+      else if (step == 5) playback_flags = in_byte;
+      else
+      {
+        state = IDLE;
+        if (playback_op == 1) player.start(Player::Upload, 0, playback_speed, playback_flags & 1);
+        else if (playback_op == 2) player.start(Player::Recording, playback_seconds, playback_speed, playback_flags & 1);
+        else if (playback_op == 3) player.stop();
+        else if (playback_op == 4) player.clearUpload();
+        bufferPlaybackStatus();
+      }
+      step++;
+      break;
   }
 }
 
 void loop()
 {
+  TRACE_SCOPE("loop");
   CAN_FRAME incoming;
   int in_byte;
-
+  static bool gotFirstFrame = false;
+  static uint32_t lastPollMicros = 0;
+
+  periodicSender.loop();
+  pidPoller.loop(elmEmulator.isAwaitingReply() || udsReader.isActive() || udsStreamer.isActive() || dtcSweep.isActive());
+  udsReader.loop(elmEmulator.isAwaitingReply() || udsStreamer.isActive() || dtcSweep.isActive());
+  udsStreamer.loop(elmEmulator.isAwaitingReply() || udsReader.isActive() || dtcSweep.isActive());
+  dtcSweep.loop(elmEmulator.isAwaitingReply() || udsReader.isActive() || udsStreamer.isActive());
+  if (udsReader.isDone(UDSReader::Gvret)) bufferUDSResult();
+  busStats.loop();
+  recorder.loop();
+  triggerEngine.loop();
+  player.loop();
+
+  uint32_t pollMicros = micros();
   if (CAN0.available() > 0) {
+    TRACE_SCOPE("can_read");
     CAN0.read(incoming);
+#ifndef BLUETOOTH
+    if (otaTaskHandle) otaCanPollGap.record(pollMicros - lastPollMicros);
+    else
+#endif
+      canPollGap.record(pollMicros - lastPollMicros);
+    if (!gotFirstFrame)
+    {
+      BootProfile::mark("first_frame");
+      gotFirstFrame = true;
+    }
+    canRxFrames.inc();
+    int entry = frameTable.processFrame(incoming);
+    busStats.processFrame(incoming, entry);
+    recorder.processFrame(incoming, entry);
+    triggerEngine.processFrame(incoming);
     elmEmulator.processFrame(incoming);
 #ifndef BLUETOOTH
-    sendFrameToWiFi(incoming, 0);
+    if (!gvretCoalesceMs) sendFrameToWiFi(incoming, 0, micros());
 #endif
   }
+  lastPollMicros = pollMicros;
+
+#ifndef BLUETOOTH
+  if (gvretCoalesceMs && millis() - lastCoalesceMillis >= gvretCoalesceMs)
+  {
+    TRACE_SCOPE("gvret_coalesce");
+    bufferLatestFrames(FrameTable::GvretMonitor);
+    lastCoalesceMillis = millis();
+  }
+  if (gvretSnapshotPending && bufferLatestFrames(FrameTable::GvretSnapshot) && serialBufferLength + 4 <= WIFI_BUFF_SIZE)
+  {
+    serialBuffer[serialBufferLength++] = 0xF1;
+    serialBuffer[serialBufferLength++] = PROTO_GET_SNAPSHOT;
+    serialBuffer[serialBufferLength++] = frameTable.getCount() & 0xFF;
+    serialBuffer[serialBufferLength++] = frameTable.getCount() >> 8;
+    gvretSnapshotPending = false;
+  }
+  if (gvretExport.active) bufferRecordedFrames();
+  if (gvretCapturePos != -1) bufferCapture();
+#endif
 
-  while (Serial.available() > 0) {
-    in_byte = Serial.read();
-    console.rcvCharacter((uint8_t) in_byte);
+  if (Serial.available() > 0) {
+    TRACE_SCOPE("console");
+    while (Serial.available() > 0) {
+      in_byte = Serial.read();
+      console.rcvCharacter((uint8_t) in_byte);
+    }
   }
 
 #ifndef BLUETOOTH
   bool needServerInit = false;
 
-  if (!isWifiConnected)
+  if (!radioReady)
   {
+    //radioSetupTask is still bringing WiFi up
+  }
+  else if (!isWifiConnected)
+  {
+    TRACE_SCOPE("wifi_setup");
     if (WiFi.isConnected())
     {
       Serial.print("Wifi now connected to SSID ");
@@ -519,6 +1065,7 @@ void loop()
       Serial.println(WiFi.localIP());
       Serial.print("RSSI: ");
       Serial.println(WiFi.RSSI());
+      BootProfile::mark("wifi_connected");
       needServerInit = true;
     }
     if (settings.softAPMode)
@@ -529,6 +1076,7 @@ void loop()
       Serial.println(WiFi.softAPIP());
       if (WiFi.softAPIP().toString() == String("192.168.4.1"))
       {
+        //radioSetupTask already retried the config so this is a last resort
         Serial.println("Got wrong address. Forcing a reset to fix it.");
         WiFi.softAPdisconnect();
         ESP.restart();
@@ -576,6 +1124,7 @@ void loop()
       });
 
       ArduinoOTA.begin();
+      BootProfile::mark("servers");
       Serial.println("OBDII Server Started, OTA Server Started");
     }
   }
@@ -583,6 +1132,7 @@ void loop()
   {
     if (wifiServer.hasClient())
     {
+      TRACE_SCOPE("elm_accept");
       for (i = 0; i < MAX_CLIENTS; i++)
       {
         if (!clientNodes[i])
@@ -602,6 +1152,7 @@ void loop()
 
     if (savvyServer.hasClient())
     {
+      TRACE_SCOPE("savvy_accept");
       if (!savvyClient)
       {
         savvyClient = savvyServer.available();
@@ -623,6 +1174,7 @@ void loop()
       {
         if (clientNodes[i].connected())
         {
+          TRACE_SCOPE("elm_client_read");
           //get data from the telnet client and push it to input processing
           while (clientNodes[i].available())
           {
@@ -649,6 +1201,7 @@ void loop()
     {
       if (savvyClient.connected())
       {
+        TRACE_SCOPE("savvy_client_read");
         //get data from the telnet client and push it to input processing
         while (savvyClient.available())
         {
@@ -666,12 +1219,18 @@ void loop()
         Serial.println(" dropped.");
         savvyClient.stop();
         savvyClient = 0;
+        gvretCoalesceMs = 0;
+        gvretSnapshotPending = false;
+        gvretExport.active = false;
+        gvretCapturePos = -1;
+        frameTable.setActive(FrameTable::GvretMonitor, false);
       }
     }
   }
 
   if (isWifiConnected && ((micros() - lastBroadcast) > 1000000ul)) //every second send out a broadcast ping
   {
+    TRACE_SCOPE("broadcast");
     uint8_t buff[4] = {0x1C, 0xEF, 0xAC, 0xED};
     lastBroadcast = micros();
     wifiUDPServer.beginPacket(broadcastAddr, 17222);
@@ -682,13 +1241,21 @@ void loop()
   //If the max time has passed or the buffer is almost filled then send buffered data out
   if ((micros() - lastFlushMicros > SER_BUFF_FLUSH_INTERVAL) || (serialBufferLength > (WIFI_BUFF_SIZE - 40)) ) {
     if (serialBufferLength > 0) {
+      TRACE_SCOPE("flush");
       if (isWifiConnected)
       {
         if (savvyClient && savvyClient.connected())
         {
-          savvyClient.write(serialBuffer, serialBufferLength);
+          uint32_t writeStart = micros();
+          size_t written = savvyClient.write(serialBuffer, serialBufferLength);
+          uint32_t writeTime = micros() - writeStart;
+          socketWriteTime.record(writeTime);
+          gvretBytesOut.inc(written);
+          if (written < (size_t)serialBufferLength || writeTime > SOCKET_STALL_US) socketWriteStalls.inc();
         }
+        else gvretBufferDiscards.inc();
       }
+      else gvretBufferDiscards.inc();
       serialBufferLength = 0;
       lastFlushMicros = micros();
     }
@@ -696,217 +1263,100 @@ void loop()
 
 #endif
 #ifndef BLUETOOTH
-  ArduinoOTA.handle();
-#else
+  {
+    TRACE_SCOPE("ota_handle");
+    ArduinoOTA.handle();
+  }
   elmEmulator.loop();
+#else
+  if (radioReady) elmEmulator.loop();
 #endif
 }
 
 #ifndef BLUETOOTH
-// Utility to extract header value from headers
-String getHeaderValue(String header, String headerName)
+//Downloads firmware below loop()'s priority so CAN, logging and clients keep their full rate.
+//The softAP stays up next to the station connection, which moves it to the client AP's channel.
+void otaTask(void *)
 {
-  return header.substring(strlen(headerName.c_str()));
-}
-
-void onOTAProgress(uint32_t progress, size_t fullSize)
-{
-  //esp_task_wdt_reset();
-  // printf("%u of %u bytes written to memory...\n", progress, fullSize);
-  if (OTAcount++ == 10)
-  {
-    printf("..%u\n", progress);
-    OTAcount = 0;
-  }
-  else printf("..%u", progress);
-}
-
-void execOTA()
-{
-  //can't do this over softAP mode so try to connect to the set up AP if possible.
   if (settings.softAPMode)
   {
-    Logger::console("Attempting to connect to an AP to get an internet connection.");
-    WiFi.softAPdisconnect();
-    WiFi.mode(WIFI_STA);
+    Logger::console("Connecting to %s to get an internet connection", settings.clientSSID);
+    WiFi.mode(WIFI_AP_STA);
     WiFi.begin((const char *)settings.clientSSID, (const char *)settings.clientWPA2KEY);
-    delay(10000);
+    uint32_t start = millis();
+    while (WiFi.status() != WL_CONNECTED && millis() - start < OTA_WIFI_TIMEOUT) vTaskDelay(100 / portTICK_PERIOD_MS);
   }
+
   if (WiFi.status() == WL_CONNECTED)
   {
-    Serial << "\n\n\n******* WIFI STATUS..connected to local Access Point:" << WiFi.SSID() << " as IP:" << WiFi.localIP() << " signal strength:" << WiFi.RSSI() << "dBm *******\n\n";
-    Serial << "We have a wireless connection...Initiating Wireless Over-the-Air Firmware Update...\n\n";
+    Logger::console("Fetching http://%s:%i%s at up to %iKB/s", settings.otaHost, settings.otaPort, settings.otaPath, settings.otaRateLimit);
+    otaCanPollGap.reset();
+    otaUpdater.setServer(settings.otaHost, settings.otaPort, settings.otaPath);
+    otaUpdater.setRateLimit(settings.otaRateLimit * 1024ul);
+    OTAUpdater::Result result = otaUpdater.run();
+    if (result == OTAUpdater::Success)
+      Logger::console("Firmware downloaded, %i bytes with %i reconnects. OTAAPPLY to boot it", otaUpdater.getBytesWritten(), otaUpdater.getReconnects());
+    else
+      Logger::console("OTA firmware update failed: %s. Check above for details.", OTAUpdater::getResultName(result));
   }
-  else
+  else Logger::console("You must have a wireless connection to do an OTA firmware update");
+
+  //leave the station connection again, the softAP keeps its clients
+  if (settings.softAPMode)
   {
-    Serial << "\n\nYou must have a wireless connection to do OTA firmware update...\n\n";
-    delay(4000);
-    return;
+    WiFi.disconnect();
+    WiFi.mode(WIFI_AP);
   }
+  otaTaskHandle = NULL;
+  vTaskDelete(NULL);
+}
 
-  int contentLength = 0;
-  bool isValidContentType = false;
-  String host = "www.macchina.cc"; // Host => bucket-name.s3.region.amazonaws.com
-  int port = 80; // Non https. For HTTPS 443. As of today, HTTPS doesn't work.
-  String bin = "/Macchina_A0_OBDII.ino.esp32.bin"; // bin file name with a slash in front.
-
-  //esp_task_wdt_reset();        //Feed our watchdog
-  Update.onProgress(onOTAProgress);
-
-  Serial.println("Connecting to AWS server: " + String(host)); // Connect to S3
-
-  if (wifiClient.connect(host.c_str(), port))
+void execOTA()
+{
+  if (otaTaskHandle)
   {
-    //Serial.println("Searching for: " + String(bin)); //Connection succeeded -fetching the binary
-    wifiClient.print(String("GET ") + bin + " HTTP/1.1\r\n" +
-                     "Host: " + host + "\r\n" +
-                     "Cache-Control: no-cache\r\n" +
-                     "Connection: close\r\n\r\n");  // Get the contents of the bin file
-
-    unsigned long timeout = millis();
-    while (wifiClient.available() == 0)
-    {
-      if (millis() - timeout > 5000)
-      {
-        Serial.println("Client Timeout !");
-        wifiClient.stop();
-        return;
-      }
-    }
-    // Once the response is available,
-    // check stuff
-
-    /*
-      Response Structure
-      HTTP/1.1 200 OK
-      x-amz-id-2: NVKxnU1aIQMmpGKhSwpCBh8y2JPbak18QLIfE+OiUDOos+7UftZKjtCFqrwsGOZRN5Zee0jpTd0=
-      x-amz-request-id: 2D56B47560B764EC
-      Date: Wed, 14 Jun 2017 03:33:59 GMT
-      Last-Modified: Fri, 02 Jun 2017 14:50:11 GMT
-      ETag: "d2afebbaaebc38cd669ce36727152af9"
-      Accept-Ranges: bytes
-      Content-Type: application/octet-stream
-      Content-Length: 357280
-      Server: AmazonS3
-
-      {{BIN FILE CONTENTS}}
-
-    */
-    while (wifiClient.available())
-    {
-      String line = wifiClient.readStringUntil('\n');// read line till /n
-      line.trim();// remove space, to check if the line is end of headers
-
-      // if the the line is empty,this is end of headers break the while and feed the
-      // remaining `client` to the Update.writeStream();
-
-      if (!line.length()) {
-        break;
-      }
-
-
-      // Check if the HTTP Response is 200 else break and Exit Update
-
-      if (line.startsWith("HTTP/1.1"))
-      {
-        if (line.indexOf("200") < 0)
-        {
-          Serial.println("FAIL...Got a non 200 status code from server. Exiting OTA Update.");
-          break;
-        }
-      }
-
-      // extract headers here
-      // Start with content length
-
-      if (line.startsWith("Content-Length: "))
-      {
-        contentLength = atoi((getHeaderValue(line, "Content-Length: ")).c_str());
-        Serial.println("              ...Server indicates " + String(contentLength) + " byte file size\n");
-      }
-
-      if (line.startsWith("Content-Type: "))
-      {
-        String contentType = getHeaderValue(line, "Content-Type: ");
-        Serial.println("\n              ...Server indicates correct " + contentType + " payload.\n");
-        if (contentType == "application/octet-stream")
-        {
-          isValidContentType = true;
-        }
-      }
-    } //end while client available
+    Logger::console("A firmware download is already running, OTASTATUS shows how far along it is");
+    return;
   }
-  else
+  if (!settings.softAPMode && WiFi.status() != WL_CONNECTED)
   {
-    // Connect to S3 failed
-    Serial.println("Connection to " + String(host) + " failed. Please check your setup");
+    Logger::console("You must have a wireless connection to do an OTA firmware update");
+    return;
   }
+  xTaskCreatePinnedToCore(otaTask, "OTA", 8192, NULL, OTA_TASK_PRIORITY, &otaTaskHandle, 0);
+}
 
-  // Check what is the contentLength and if content type is `application/octet-stream`
-  //Serial.println("File length: " + String(contentLength) + ", Valid Content Type flag:" + String(isValidContentType));
-
-  // check contentLength and content type
-  if (contentLength && isValidContentType) // Check if there is enough to OTA Update
-  {
-    bool canBegin = Update.begin(contentLength);
-    if (canBegin)
-    {
-      Serial << "We have space for the update...starting transfer... \n\n";
-      // delay(1100);
-      size_t written = Update.writeStream(wifiClient);
-
-      if (written == contentLength)
-      {
-        Serial.println("\nWrote " + String(written) + " bytes to memory...");
-      }
-      else
-      {
-        Serial.println("\n********** FAILED - Wrote:" + String(written) + " of " + String(contentLength) + ". We'll try again...********\n\n" );
-        execOTA();
-      }
-
-      if (Update.end())
-      {
-        //  Serial.println("OTA file transfer completed!");
-        if (Update.isFinished())
-        {
-          Serial.println("Rebooting new firmware...\n");
-          WiFi.disconnect();
-          delay(1000);
-          ESP.restart();
-        }
-        else Serial.println("FAILED...update not finished? Something went wrong!");
-
-      }
-      else
-      {
-        Serial.println("Error Occurred. Error #: " + String(Update.getError()));
-        execOTA();
-      }
-    } //end if can begin
-    else {
-      // not enough space to begin OTA
-      // Understand the partitions and space availability
-
-      Serial.println("Not enough space to begin OTA");
-      wifiClient.flush();
-    }
-  } //End contentLength && isValidContentType
-  else
+//Boot the downloaded image. Settings are written out first since the restart skips the write-behind delay.
+void applyOTA()
+{
+  if (!otaUpdater.apply())
   {
-    Serial.println("There was no content in the response");
-    //wifiClient.flush();
+    Logger::console("No downloaded firmware to apply, UPDATE fetches it first");
+    return;
   }
-  Serial.println("End of OTA firmware update routine. Apparently it failed. Check above for reasons.");
-  //if we were in softAP mode then re-enter it again before leaving
-  if (settings.softAPMode)
+  Logger::console("Rebooting into the new firmware...");
+  settingsStore.commitNow();
+  WiFi.disconnect();
+  delay(1000);
+  ESP.restart();
+}
+
+void printOTAStatus()
+{
+  static const char *stateNames[] = {"idle", "downloading", "ready, OTAAPPLY to boot it", "failed"};
+  OTAUpdater::State state = otaUpdater.getState();
+  Logger::console("OTA %s", stateNames[state]);
+  if (state == OTAUpdater::Failed) Logger::console("Reason: %s", OTAUpdater::getResultName(otaUpdater.getLastResult()));
+  if (state != OTAUpdater::Idle)
   {
-    Logger::console("Returing to softAP mode");
-    WiFi.disconnect();
-    WiFi.mode(WIFI_AP);
-    WiFi.softAPConfig(IPAddress(192, 168, 0, 10), IPAddress(192, 168, 0, 10), IPAddress(255, 255, 255, 0));
-    WiFi.softAP((const char *)settings.softSSID, (const char *)settings.softWPA2KEY);
-    isWifiConnected = false; //probably have to do this to make it re-setup the sockets
+    uint32_t total = otaUpdater.getImageSize();
+    Logger::console("%i of %i bytes (%i%%) in %is, %iB/s, %i reconnects", otaUpdater.getBytesWritten(), total,
+                    total ? (int)((uint64_t)otaUpdater.getBytesWritten() * 100 / total) : 0,
+                    otaUpdater.getElapsedMillis() / 1000, otaUpdater.getBytesPerSecond(), otaUpdater.getReconnects());
   }
-} //End execOTA()
+  Logger::console("CAN poll gap without OTA: p50 %ius p99 %ius max %ius over %i frames", canPollGap.getPercentile(50),
+                  canPollGap.getPercentile(99), canPollGap.getMax(), canPollGap.getCount());
+  Logger::console("CAN poll gap during OTA:  p50 %ius p99 %ius max %ius over %i frames", otaCanPollGap.getPercentile(50),
+                  otaCanPollGap.getPercentile(99), otaCanPollGap.getMax(), otaCanPollGap.getCount());
+}
 #endif
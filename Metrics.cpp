@@ -0,0 +1,234 @@
+/*
+ * Metrics.cpp
+ *
+ * Runtime counters, gauges and latency histograms. Every metric is a global
+ * object that links itself into a registry when constructed so modules only
+ * have to declare the ones they update. Updates are single relaxed atomic
+ * operations and are safe to do from any task.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "Metrics.h"
+#include "Logger.h"
+
+//constant initialized so it is valid before any metric constructor runs, whatever the link order
+Metric *Metric::head = NULL;
+
+/*
+ * Metrics are global objects so this runs during static initialization.
+ * They are appended so listings come out in declaration order per module.
+ */
+Metric::Metric(const char *name, Type type)
+{
+    this->name = name;
+    this->type = type;
+    next = NULL;
+
+    Metric **link = &head;
+    while (*link) link = &(*link)->next;
+    *link = this;
+}
+
+Metric *Metric::getFirst()
+{
+    return head;
+}
+
+int Metric::count()
+{
+    int total = 0;
+    for (Metric *metric = head; metric; metric = metric->next) total++;
+    return total;
+}
+
+void Metric::printAll()
+{
+    for (Metric *metric = head; metric; metric = metric->next)
+    {
+        switch (metric->type)
+        {
+        case Counter:
+            Logger::console("%s: %i", metric->name, ((MetricCounter *)metric)->get());
+            break;
+        case Gauge:
+            Logger::console("%s: %i", metric->name, ((MetricGauge *)metric)->get());
+            break;
+        case Histogram:
+        {
+            MetricHistogram *hist = (MetricHistogram *)metric;
+            Logger::console("%s: count %i p50 %ius p90 %ius p99 %ius max %ius", metric->name, hist->getCount(),
+                            hist->getPercentile(50), hist->getPercentile(90), hist->getPercentile(99), hist->getMax());
+            break;
+        }
+        }
+    }
+}
+
+/*
+ * One metric per line as "name value" or, for histograms,
+ * "name count p50 p90 p99 max" with latencies in microseconds.
+ */
+String Metric::toText(const char *lineEnding)
+{
+    String retString = String();
+    char buff[80];
+
+    for (Metric *metric = head; metric; metric = metric->next)
+    {
+        switch (metric->type)
+        {
+        case Counter:
+            sprintf(buff, "%s %u", metric->name, (unsigned int)((MetricCounter *)metric)->get());
+            break;
+        case Gauge:
+            sprintf(buff, "%s %u", metric->name, (unsigned int)((MetricGauge *)metric)->get());
+            break;
+        case Histogram:
+        {
+            MetricHistogram *hist = (MetricHistogram *)metric;
+            sprintf(buff, "%s %u %u %u %u %u", metric->name, (unsigned int)hist->getCount(),
+                    (unsigned int)hist->getPercentile(50), (unsigned int)hist->getPercentile(90),
+                    (unsigned int)hist->getPercentile(99), (unsigned int)hist->getMax());
+            break;
+        }
+        }
+        retString.concat(buff);
+        retString.concat(lineEnding);
+    }
+    return retString;
+}
+
+static int putUInt32(uint8_t *buffer, uint32_t val)
+{
+    buffer[0] = (uint8_t)(val & 0xFF);
+    buffer[1] = (uint8_t)(val >> 8);
+    buffer[2] = (uint8_t)(val >> 16);
+    buffer[3] = (uint8_t)(val >> 24);
+    return 4;
+}
+
+/*
+ * Binary form used by the GVRET PROTO_GET_METRICS reply. Starts with the number of
+ * metrics, then per metric: type, name length, name, and either the 32 bit value
+ * or for histograms count, p50, p90, p99 and max. All values are little endian.
+ * Returns the number of bytes written or 0 if it wouldn't fit in room.
+ */
+int Metric::writeBinary(uint8_t *buffer, int room)
+{
+    int len = 1;
+
+    for (Metric *metric = head; metric; metric = metric->next)
+    {
+        len += 2 + strlen(metric->name) + ((metric->type == Histogram) ? 20 : 4);
+    }
+    if (len > room) return 0;
+
+    len = 0;
+    buffer[len++] = count();
+    for (Metric *metric = head; metric; metric = metric->next)
+    {
+        uint8_t nameLen = strlen(metric->name);
+        buffer[len++] = metric->type;
+        buffer[len++] = nameLen;
+        memcpy(&buffer[len], metric->name, nameLen);
+        len += nameLen;
+        switch (metric->type)
+        {
+        case Counter:
+            len += putUInt32(&buffer[len], ((MetricCounter *)metric)->get());
+            break;
+        case Gauge:
+            len += putUInt32(&buffer[len], ((MetricGauge *)metric)->get());
+            break;
+        case Histogram:
+        {
+            MetricHistogram *hist = (MetricHistogram *)metric;
+            len += putUInt32(&buffer[len], hist->getCount());
+            len += putUInt32(&buffer[len], hist->getPercentile(50));
+            len += putUInt32(&buffer[len], hist->getPercentile(90));
+            len += putUInt32(&buffer[len], hist->getPercentile(99));
+            len += putUInt32(&buffer[len], hist->getMax());
+            break;
+        }
+        }
+    }
+    return len;
+}
+
+void Metric::resetAll()
+{
+    for (Metric *metric = head; metric; metric = metric->next)
+    {
+        switch (metric->type)
+        {
+        case Counter:
+            ((MetricCounter *)metric)->reset();
+            break;
+        case Gauge:
+            ((MetricGauge *)metric)->reset();
+            break;
+        case Histogram:
+            ((MetricHistogram *)metric)->reset();
+            break;
+        }
+    }
+}
+
+MetricHistogram::MetricHistogram(const char *name) : Metric(name, Histogram), maximum(0)
+{
+    for (int i = 0; i < METRIC_HIST_BUCKETS; i++) buckets[i].store(0, std::memory_order_relaxed);
+}
+
+uint32_t MetricHistogram::getCount()
+{
+    uint32_t total = 0;
+    for (int i = 0; i < METRIC_HIST_BUCKETS; i++) total += buckets[i].load(std::memory_order_relaxed);
+    return total;
+}
+
+uint32_t MetricHistogram::getPercentile(uint8_t percent)
+{
+    uint32_t total = getCount();
+    if (total == 0) return 0;
+
+    //rank of the sample we're after, rounded up so p99 of 10 samples is the 10th
+    uint32_t rank = (uint32_t)(((uint64_t)total * percent + 99) / 100);
+    uint32_t seen = 0;
+    for (int i = 0; i < METRIC_HIST_BUCKETS; i++)
+    {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+        {
+            if (i == METRIC_HIST_BUCKETS - 1) return getMax();
+            uint32_t upper = (i == 0) ? 0 : (1ul << i) - 1;
+            return (upper < getMax()) ? upper : getMax();
+        }
+    }
+    return getMax();
+}
+
+void MetricHistogram::reset()
+{
+    for (int i = 0; i < METRIC_HIST_BUCKETS; i++) buckets[i].store(0, std::memory_order_relaxed);
+    maximum.store(0, std::memory_order_relaxed);
+}
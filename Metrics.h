@@ -0,0 +1,117 @@
+/*
+ * Metrics.h
+ *
+ * Runtime counters, gauges and latency histograms. Every metric is a global
+ * object that links itself into a registry when constructed so modules only
+ * have to declare the ones they update. Updates are single relaxed atomic
+ * operations and are safe to do from any task.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <Arduino.h>
+#include <atomic>
+#include "config.h"
+
+class Metric {
+public:
+    enum Type {
+        Counter = 0, Gauge = 1, Histogram = 2
+    };
+
+    Metric(const char *name, Type type);
+    const char *getName() { return name; }
+    Type getType() { return type; }
+    Metric *getNext() { return next; }
+
+    static Metric *getFirst();
+    static int count();
+    static void printAll();
+    static String toText(const char *lineEnding);
+    static int writeBinary(uint8_t *buffer, int room);
+    static void resetAll();
+
+private:
+    const char *name;
+    Type type;
+    Metric *next;
+
+    static Metric *head;
+};
+
+//Monotonic event count
+class MetricCounter : public Metric {
+public:
+    MetricCounter(const char *name) : Metric(name, Counter), value(0) {}
+    void inc(uint32_t amount = 1) { value.fetch_add(amount, std::memory_order_relaxed); }
+    uint32_t get() { return value.load(std::memory_order_relaxed); }
+    void reset() { value.store(0, std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint32_t> value;
+};
+
+//Current level of something. setMax() turns it into a high-water mark
+class MetricGauge : public Metric {
+public:
+    MetricGauge(const char *name) : Metric(name, Gauge), value(0) {}
+    void set(uint32_t newValue) { value.store(newValue, std::memory_order_relaxed); }
+    void setMax(uint32_t newValue) {
+        uint32_t old = value.load(std::memory_order_relaxed);
+        while (newValue > old && !value.compare_exchange_weak(old, newValue, std::memory_order_relaxed)) {}
+    }
+    uint32_t get() { return value.load(std::memory_order_relaxed); }
+    void reset() { value.store(0, std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint32_t> value;
+};
+
+/*
+ * Distribution of a latency in microseconds. Bucket 0 holds zero, bucket n holds
+ * values from 2^(n-1) to 2^n - 1 and the last bucket also takes everything larger.
+ * Percentiles are reported as the upper bound of the bucket they fall in.
+ */
+class MetricHistogram : public Metric {
+public:
+    MetricHistogram(const char *name);
+    void record(uint32_t micros) {
+        int bucket = micros ? 32 - __builtin_clz(micros) : 0;
+        if (bucket >= METRIC_HIST_BUCKETS) bucket = METRIC_HIST_BUCKETS - 1;
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        uint32_t old = maximum.load(std::memory_order_relaxed);
+        while (micros > old && !maximum.compare_exchange_weak(old, micros, std::memory_order_relaxed)) {}
+    }
+    uint32_t getCount();
+    uint32_t getMax() { return maximum.load(std::memory_order_relaxed); }
+    uint32_t getPercentile(uint8_t percent);
+    void reset();
+
+private:
+    std::atomic<uint32_t> buckets[METRIC_HIST_BUCKETS];
+    std::atomic<uint32_t> maximum;
+};
+
+#endif /* METRICS_H_ */
@@ -0,0 +1,507 @@
+/*
+ * OTAUpdater.cpp
+ *
+ * Downloads a firmware image over HTTP straight into the OTA partition. When the
+ * connection drops the download picks up from the last byte written to flash with
+ * an HTTP Range request instead of starting over. A SHA-256 of the image is kept
+ * while writing and checked against <path>.sha256 on the server if it has one.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "OTAUpdater.h"
+#include <Update.h>
+#include "Logger.h"
+
+OTAUpdater::OTAUpdater(Client &client) : client(client)
+{
+    host = NULL;
+    port = 80;
+    path = NULL;
+    timeout = OTA_READ_TIMEOUT;
+    retryDelay = OTA_RETRY_DELAY;
+    offset = 0;
+    imageSize = 0;
+    reconnects = 0;
+    lastPercent = 0;
+    rateLimit = 0;
+    nextReadMicros = 0;
+    startMillis = 0;
+    endMillis = 0;
+    begun = false;
+    cancelRequested = false;
+    state = Idle;
+    lastResult = Success;
+    target = NULL;
+}
+
+void OTAUpdater::setServer(const char *host, uint16_t port, const char *path)
+{
+    this->host = host;
+    this->port = port;
+    this->path = path;
+}
+
+void OTAUpdater::setTimeout(uint32_t timeoutMillis)
+{
+    timeout = timeoutMillis;
+}
+
+void OTAUpdater::setRetryDelay(uint32_t delayMillis)
+{
+    retryDelay = delayMillis;
+}
+
+/*
+ * Cap the download rate. Reads are paced so the data waits in the TCP
+ * receive window, which throttles the server too, and flash writes are
+ * spread out instead of coming in bursts.
+ */
+void OTAUpdater::setRateLimit(uint32_t bytesPerSecond)
+{
+    rateLimit = bytesPerSecond;
+}
+
+/*
+ * Download the image and write it to the OTA partition. Dropped or stalled
+ * connections are resumed from the last byte written until OTA_MAX_RETRIES
+ * attempts in a row make no progress. Blocks until done, run it from a task
+ * to keep everything else going. The running firmware stays the boot
+ * partition until apply() is called.
+ */
+OTAUpdater::Result OTAUpdater::run()
+{
+    uint8_t expected[32];
+    uint8_t actual[32];
+    Result result = Success;
+    uint32_t failures = 0;
+
+    offset = 0;
+    imageSize = 0;
+    reconnects = 0;
+    lastPercent = 0;
+    begun = false;
+    cancelRequested = false;
+    startMillis = millis();
+    nextReadMicros = micros();
+    target = esp_ota_get_next_update_partition(NULL);
+    state = Downloading;
+
+    Result digestResult = fetchDigest(expected);
+    for (uint32_t attempt = 0; digestResult == ConnectFailed && attempt < OTA_MAX_RETRIES && !cancelRequested; attempt++)
+    {
+        Logger::console("Could not reach %s, retrying", host);
+        delay(retryDelay);
+        digestResult = fetchDigest(expected);
+    }
+    bool haveDigest = (digestResult == Success);
+    if (!haveDigest) Logger::warn("No %s.sha256 on the server, relying on the image checksum alone", path);
+
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, 0);
+
+    for (;;)
+    {
+        uint32_t before = offset;
+        result = transfer();
+        if (result != Success && result != ConnectFailed) break;
+        if (begun && offset == imageSize) break;
+        if (cancelRequested)
+        {
+            result = Cancelled;
+            break;
+        }
+
+        if (offset > before) failures = 0;
+        else if (++failures > OTA_MAX_RETRIES)
+        {
+            result = TooManyRetries;
+            break;
+        }
+        reconnects++;
+        if (begun) Logger::console("Connection lost at %i of %i bytes, resuming", offset, imageSize);
+        else Logger::console("Could not reach %s, retrying", host);
+        delay(retryDelay);
+    }
+
+    mbedtls_sha256_finish_ret(&sha, actual);
+    mbedtls_sha256_free(&sha);
+    endMillis = millis();
+
+    if (result == Success && haveDigest && memcmp(expected, actual, sizeof(actual))) result = DigestMismatch;
+    if (result != Success)
+    {
+        if (begun) Update.abort();
+        return finish(result);
+    }
+
+    if (!haveDigest)
+    {
+        char hex[65];
+        for (int i = 0; i < 32; i++) sprintf(&hex[i * 2], "%02x", actual[i]);
+        Logger::console("Image SHA-256 %s", hex);
+    }
+
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    if (!Update.end())
+    {
+        Logger::error("Image rejected: %s", Update.errorString());
+        return finish(ImageInvalid);
+    }
+    //Update.end() makes the new image the boot partition right away. Point it back at the
+    //running firmware so a reset before apply() still boots what is running now
+    esp_ota_set_boot_partition(running);
+    return finish(Success);
+}
+
+OTAUpdater::Result OTAUpdater::finish(Result result)
+{
+    lastResult = result;
+    state = (result == Success) ? Ready : Failed;
+    return result;
+}
+
+/*
+ * Ask a running update to stop. It is aborted at the next chunk or retry and
+ * run() returns Cancelled.
+ */
+void OTAUpdater::cancel()
+{
+    cancelRequested = true;
+}
+
+/*
+ * Make the downloaded image the boot partition. Takes effect on the next
+ * restart, which is left to the caller.
+ */
+bool OTAUpdater::apply()
+{
+    if (state != Ready || !target) return false;
+    return esp_ota_set_boot_partition(target) == ESP_OK;
+}
+
+OTAUpdater::State OTAUpdater::getState()
+{
+    return state;
+}
+
+OTAUpdater::Result OTAUpdater::getLastResult()
+{
+    return lastResult;
+}
+
+uint32_t OTAUpdater::getElapsedMillis()
+{
+    if (state == Idle) return 0;
+    return ((state == Downloading) ? millis() : endMillis) - startMillis;
+}
+
+/*
+ * Average download rate so far, including time spent reconnecting.
+ */
+uint32_t OTAUpdater::getBytesPerSecond()
+{
+    uint32_t elapsed = getElapsedMillis();
+    return elapsed ? (uint32_t)((uint64_t)offset * 1000 / elapsed) : 0;
+}
+
+uint32_t OTAUpdater::getBytesWritten()
+{
+    return offset;
+}
+
+uint32_t OTAUpdater::getImageSize()
+{
+    return imageSize;
+}
+
+uint32_t OTAUpdater::getReconnects()
+{
+    return reconnects;
+}
+
+const char *OTAUpdater::getResultName(Result result)
+{
+    switch (result)
+    {
+    case Success: return "success";
+    case ConnectFailed: return "could not connect";
+    case HttpError: return "bad response from server";
+    case NoSpace: return "image too large for the OTA partition";
+    case WriteFailed: return "flash write failed";
+    case DigestMismatch: return "SHA-256 mismatch";
+    case ImageInvalid: return "image failed verification";
+    case TooManyRetries: return "too many retries without progress";
+    case Cancelled: return "cancelled";
+    }
+    return "unknown";
+}
+
+/*
+ * One connection worth of download, asking for everything from offset on.
+ * Returns Success when the connection ended, whether or not the image is
+ * complete, ConnectFailed if it is worth trying again, and anything else if
+ * the update has to be abandoned.
+ */
+OTAUpdater::Result OTAUpdater::transfer()
+{
+    Response response;
+    uint32_t total;
+    uint32_t skip;
+
+    if (!client.connect(host, port)) return ConnectFailed;
+    if (!sendRequest(path, offset) || !readResponse(response))
+    {
+        client.stop();
+        return ConnectFailed;
+    }
+
+    if (response.status == 206 && response.rangeStart <= offset)
+    {
+        total = response.rangeTotal;
+        skip = offset - response.rangeStart;
+    }
+    else if (response.status == 200 && response.contentLength > 0)
+    {
+        //server ignored the Range header, throw away the part we already have
+        total = response.contentLength;
+        skip = offset;
+    }
+    else
+    {
+        client.stop();
+        if (response.status >= 500) return ConnectFailed;
+        Logger::error("Server answered %s with status %i", path, response.status);
+        return HttpError;
+    }
+    if (response.chunked)
+    {
+        client.stop();
+        Logger::error("Server sent a chunked response, can't resume those");
+        return HttpError;
+    }
+
+    if (!begun)
+    {
+        if (!Update.begin(total))
+        {
+            client.stop();
+            return NoSpace;
+        }
+        Logger::console("Image is %i bytes", total);
+        imageSize = total;
+        begun = true;
+    }
+    else if (total != imageSize)
+    {
+        client.stop();
+        Logger::error("Image changed size on the server during the update");
+        return HttpError;
+    }
+
+    while (offset < imageSize)
+    {
+        if (cancelRequested)
+        {
+            client.stop();
+            return Cancelled;
+        }
+        int len = readBody(buffer, sizeof(buffer));
+        if (len <= 0) break;
+        pace(len);
+
+        uint8_t *data = buffer;
+        if (skip)
+        {
+            uint32_t drop = (skip < (uint32_t)len) ? skip : len;
+            skip -= drop;
+            data += drop;
+            len -= drop;
+        }
+        if ((uint32_t)len > imageSize - offset) len = imageSize - offset;
+        if (len == 0) continue;
+
+        size_t written = Update.write(data, len);
+        mbedtls_sha256_update_ret(&sha, data, written);
+        offset += written;
+        if (written < (size_t)len)
+        {
+            client.stop();
+            Logger::error("Flash write failed at %i: %s", offset, Update.errorString());
+            return WriteFailed;
+        }
+
+        uint32_t percent = (uint32_t)((uint64_t)offset * 100 / imageSize);
+        if (percent >= lastPercent + 10)
+        {
+            Logger::console("%i%% (%i of %i bytes)", percent, offset, imageSize);
+            lastPercent = percent - percent % 10;
+        }
+    }
+    client.stop();
+    return Success;
+}
+
+/*
+ * Get the expected SHA-256 from <path>.sha256. The file can be just the hex
+ * digest or sha256sum output, only the first 64 characters are used.
+ * Returns ConnectFailed if it's worth asking again and HttpError if the
+ * server has no usable digest.
+ */
+OTAUpdater::Result OTAUpdater::fetchDigest(uint8_t *digest)
+{
+    char file[128];
+    char hex[65];
+    Response response;
+    int len = 0;
+
+    if (snprintf(file, sizeof(file), "%s.sha256", path) >= (int)sizeof(file)) return HttpError;
+    if (!client.connect(host, port)) return ConnectFailed;
+    if (!sendRequest(file, 0) || !readResponse(response))
+    {
+        client.stop();
+        return ConnectFailed;
+    }
+    if (response.status != 200)
+    {
+        client.stop();
+        return (response.status >= 500) ? ConnectFailed : HttpError;
+    }
+    while (len < 64)
+    {
+        int got = readBody((uint8_t *)&hex[len], 64 - len);
+        if (got <= 0) break;
+        len += got;
+    }
+    client.stop();
+    if (len < 64) return ConnectFailed;
+
+    for (int i = 0; i < 32; i++)
+    {
+        char byteHex[3] = {hex[i * 2], hex[i * 2 + 1], 0};
+        if (!isxdigit(byteHex[0]) || !isxdigit(byteHex[1])) return HttpError;
+        digest[i] = strtoul(byteHex, NULL, 16);
+    }
+    return Success;
+}
+
+bool OTAUpdater::sendRequest(const char *file, uint32_t rangeStart)
+{
+    char request[256];
+    int len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nCache-Control: no-cache\r\nConnection: close\r\n",
+                       file, host);
+    if (rangeStart) len += snprintf(&request[len], sizeof(request) - len, "Range: bytes=%u-\r\n", (unsigned int)rangeStart);
+    len += snprintf(&request[len], sizeof(request) - len, "\r\n");
+    if (len >= (int)sizeof(request)) return false;
+
+    return client.write((const uint8_t *)request, len) == (size_t)len;
+}
+
+/*
+ * Read the status line and headers, keeping only the few that matter here.
+ */
+bool OTAUpdater::readResponse(Response &response)
+{
+    char line[128];
+
+    response.status = 0;
+    response.contentLength = -1;
+    response.rangeStart = 0;
+    response.rangeTotal = 0;
+    response.chunked = false;
+
+    if (!readLine(line, sizeof(line)) || strncmp(line, "HTTP/", 5)) return false;
+    char *code = strchr(line, ' ');
+    if (!code) return false;
+    response.status = atoi(code + 1);
+
+    for (;;)
+    {
+        if (!readLine(line, sizeof(line))) return false;
+        if (line[0] == 0) return true; //blank line ends the headers
+
+        if (!strncasecmp(line, "Content-Length:", 15)) response.contentLength = strtol(line + 15, NULL, 10);
+        else if (!strncasecmp(line, "Content-Range:", 14))
+        {
+            //bytes <start>-<end>/<total>
+            char *range = strchr(line, ' ');
+            if (range) range = strchr(range + 1, ' ');
+            if (range) response.rangeStart = strtoul(range + 1, NULL, 10);
+            char *total = strchr(line, '/');
+            if (total) response.rangeTotal = strtoul(total + 1, NULL, 10);
+        }
+        else if (!strncasecmp(line, "Transfer-Encoding:", 18) && strstr(line, "chunked")) response.chunked = true;
+    }
+}
+
+/*
+ * Read one header line without the line ending. Anything past size - 1
+ * characters is dropped. Fails if the connection closes or stalls first.
+ */
+bool OTAUpdater::readLine(char *line, int size)
+{
+    int len = 0;
+    uint8_t c;
+
+    for (;;)
+    {
+        if (readBody(&c, 1) != 1) return false;
+        if (c == '\n') break;
+        if (c != '\r' && len < size - 1) line[len++] = c;
+    }
+    line[len] = 0;
+    return true;
+}
+
+/*
+ * Wait up to the timeout for data and read whatever is there, up to length
+ * bytes. Returns 0 if the connection closed or stalled.
+ */
+int OTAUpdater::readBody(uint8_t *data, int length)
+{
+    uint32_t start = millis();
+
+    while (client.available() <= 0)
+    {
+        if (!client.connected() || (millis() - start) > timeout) return 0;
+        delay(1);
+    }
+    int avail = client.available();
+    return client.read(data, (avail < length) ? avail : length);
+}
+
+/*
+ * Sleep as long as reading bytes more would have taken at the rate limit.
+ * A slow or stalled link doesn't earn credit for a burst afterward beyond
+ * a tenth of a second.
+ */
+void OTAUpdater::pace(uint32_t bytes)
+{
+    if (!rateLimit) return;
+
+    uint32_t now = micros();
+    if ((int32_t)(now - nextReadMicros) > 100000) nextReadMicros = now - 100000;
+    nextReadMicros += (uint32_t)((uint64_t)bytes * 1000000 / rateLimit);
+
+    int32_t wait = (int32_t)(nextReadMicros - now);
+    if (wait >= 1000) delay(wait / 1000);
+}
@@ -0,0 +1,109 @@
+/*
+ * OTAUpdater.h
+ *
+ * Downloads a firmware image over HTTP straight into the OTA partition. When the
+ * connection drops the download picks up from the last byte written to flash with
+ * an HTTP Range request instead of starting over. A SHA-256 of the image is kept
+ * while writing and checked against <path>.sha256 on the server if it has one.
+ * A finished image only becomes the boot partition when apply() is called.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef OTAUPDATER_H_
+#define OTAUPDATER_H_
+
+#include <Arduino.h>
+#include <Client.h>
+#include <mbedtls/sha256.h>
+#include <esp_ota_ops.h>
+#include "config.h"
+
+class OTAUpdater {
+public:
+    enum Result {
+        Success, ConnectFailed, HttpError, NoSpace, WriteFailed, DigestMismatch, ImageInvalid, TooManyRetries, Cancelled
+    };
+
+    enum State {
+        Idle, Downloading, Ready, Failed
+    };
+
+    OTAUpdater(Client &client);
+    void setServer(const char *host, uint16_t port, const char *path);
+    void setTimeout(uint32_t timeoutMillis);
+    void setRetryDelay(uint32_t delayMillis);
+    void setRateLimit(uint32_t bytesPerSecond);
+    Result run();
+    void cancel();
+    bool apply();
+    State getState();
+    Result getLastResult();
+    uint32_t getBytesWritten();
+    uint32_t getImageSize();
+    uint32_t getReconnects();
+    uint32_t getElapsedMillis();
+    uint32_t getBytesPerSecond();
+    static const char *getResultName(Result result);
+
+private:
+    struct Response {
+        int status;
+        int32_t contentLength;  //-1 if the server didn't say
+        uint32_t rangeStart;    //from Content-Range on a 206
+        uint32_t rangeTotal;
+        bool chunked;
+    };
+
+    Client &client;
+    const char *host;
+    uint16_t port;
+    const char *path;
+    uint32_t timeout;
+    uint32_t retryDelay;
+    uint32_t offset;            //bytes written to flash and hashed so far
+    uint32_t imageSize;
+    uint32_t reconnects;
+    uint32_t lastPercent;
+    uint32_t rateLimit;         //bytes per second, 0 for no limit
+    uint32_t nextReadMicros;    //when pacing allows the next read
+    uint32_t startMillis;
+    uint32_t endMillis;
+    bool begun;
+    volatile bool cancelRequested;
+    volatile State state;
+    Result lastResult;
+    const esp_partition_t *target;  //partition the image is written to
+    mbedtls_sha256_context sha;
+    uint8_t buffer[OTA_BUFFER_SIZE];
+
+    Result transfer();
+    Result finish(Result result);
+    Result fetchDigest(uint8_t *digest);
+    bool sendRequest(const char *file, uint32_t rangeStart);
+    bool readResponse(Response &response);
+    bool readLine(char *line, int size);
+    int readBody(uint8_t *data, int length);
+    void pace(uint32_t bytes);
+};
+
+#endif /* OTAUPDATER_H_ */
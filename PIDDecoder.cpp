@@ -0,0 +1,282 @@
+/*
+ * PIDDecoder.cpp
+ *
+ * Decodes Mode 01 responses into engineering values, see PIDDecoder.h. The
+ * formulas follow SAE J1979.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "PIDDecoder.h"
+#include "Logger.h"
+#include "obd2_codes.h"
+
+//One entry per PID in PID order so a PID indexes straight into it. Bitfields decode to their raw value
+static constexpr PIDDefinition pidTable[] = {
+    {PID_SUPPORTED1, 4, 4, PID_BITFIELD, 1, 0, "PIDs supported 01-20", ""},
+    {PID_MON_STATUS_SINCE_CLEARED, 4, 4, PID_BITFIELD, 1, 0, "Monitor status since DTCs cleared", ""},
+    {PID_FREEZE_DTC, 2, 2, PID_BITFIELD, 1, 0, "DTC that caused freeze frame", ""},
+    {PID_FUEL_SYS_STATUS, 2, 2, PID_BITFIELD, 1, 0, "Fuel system status", ""},
+    {PID_CALC_ENGINE_LOAD, 1, 1, 0, 100.0f / 255, 0, "Calculated engine load", "%"},
+    {PID_ENGINE_COOLANT_TEMP, 1, 1, 0, 1, -40, "Engine coolant temperature", "C"},
+    {PID_SHORT_FUEL_TRIM1, 1, 1, 0, 100.0f / 128, -100, "Short term fuel trim bank 1", "%"},
+    {PID_LONG_FUEL_TRIM1, 1, 1, 0, 100.0f / 128, -100, "Long term fuel trim bank 1", "%"},
+    {PID_SHORT_FUEL_TRIM2, 1, 1, 0, 100.0f / 128, -100, "Short term fuel trim bank 2", "%"},
+    {PID_LONG_FUEL_TRIM2, 1, 1, 0, 100.0f / 128, -100, "Long term fuel trim bank 2", "%"},
+    {PID_FUEL_PRESSURE, 1, 1, 0, 3, 0, "Fuel pressure", "kPa"},
+    {PID_INTAKE_MAP, 1, 1, 0, 1, 0, "Intake manifold pressure", "kPa"},
+    {PID_ENGINE_RPM, 2, 2, 0, 0.25f, 0, "Engine speed", "rpm"},
+    {PID_VEHICLE_SPEED, 1, 1, 0, 1, 0, "Vehicle speed", "km/h"},
+    {PID_TIMING_ADV, 1, 1, 0, 0.5f, -64, "Timing advance", "deg"},
+    {PID_INTAKE_AIR_TEMP, 1, 1, 0, 1, -40, "Intake air temperature", "C"},
+    {PID_MAF_RATE, 2, 2, 0, 0.01f, 0, "Mass air flow", "g/s"},
+    {PID_THROTTLE_POS, 1, 1, 0, 100.0f / 255, 0, "Throttle position", "%"},
+    {PID_SEC_AIR_STATUS, 1, 1, PID_BITFIELD, 1, 0, "Secondary air status", ""},
+    {PID_O2_SENSORS, 1, 1, PID_BITFIELD, 1, 0, "Oxygen sensors present", ""},
+    {PID_O2SENSOR_B1S1, 2, 1, 0, 0.005f, 0, "Oxygen sensor 1 voltage", "V"},
+    {PID_O2SENSOR_B1S2, 2, 1, 0, 0.005f, 0, "Oxygen sensor 2 voltage", "V"},
+    {PID_O2SENSOR_B1S3, 2, 1, 0, 0.005f, 0, "Oxygen sensor 3 voltage", "V"},
+    {PID_O2SENSOR_B1S4, 2, 1, 0, 0.005f, 0, "Oxygen sensor 4 voltage", "V"},
+    {PID_O2SENSOR_B2S1, 2, 1, 0, 0.005f, 0, "Oxygen sensor 5 voltage", "V"},
+    {PID_O2SENSOR_B2S2, 2, 1, 0, 0.005f, 0, "Oxygen sensor 6 voltage", "V"},
+    {PID_O2SENSOR_B2S3, 2, 1, 0, 0.005f, 0, "Oxygen sensor 7 voltage", "V"},
+    {PID_O2SENSOR_B2S4, 2, 1, 0, 0.005f, 0, "Oxygen sensor 8 voltage", "V"},
+    {PID_ODB2_VER, 1, 1, PID_BITFIELD, 1, 0, "OBD standard", ""},
+    {PID_O2SENSORS_BITFIELD, 1, 1, PID_BITFIELD, 1, 0, "Oxygen sensors present (4 banks)", ""},
+    {PID_AUX_INPUT, 1, 1, PID_BITFIELD, 1, 0, "Auxiliary input status", ""},
+    {PID_TIME_SINCE_START, 2, 2, 0, 1, 0, "Run time since engine start", "s"},
+    {PID_SUPPORTED2, 4, 4, PID_BITFIELD, 1, 0, "PIDs supported 21-40", ""},
+    {PID_MIL_DISTANCE, 2, 2, 0, 1, 0, "Distance with MIL on", "km"},
+    {PID_FUEL_RAIL_PRESSURE, 2, 2, 0, 0.079f, 0, "Fuel rail pressure", "kPa"},
+    {PID_FUEL_RAIL_DIESEL, 2, 2, 0, 10, 0, "Fuel rail gauge pressure", "kPa"},
+    {PID_O2S1_LAMDBA, 4, 2, 0, 2.0f / 65536, 0, "Oxygen sensor 1 air-fuel ratio", "lambda"},
+    {PID_O2S2_LAMDBA, 4, 2, 0, 2.0f / 65536, 0, "Oxygen sensor 2 air-fuel ratio", "lambda"},
+    {PID_O2S3_LAMDBA, 4, 2, 0, 2.0f / 65536, 0, "Oxygen sensor 3 air-fuel ratio", "lambda"},
+    {PID_O2S4_LAMDBA, 4, 2, 0, 2.0f / 65536, 0, "Oxygen sensor 4 air-fuel ratio", "lambda"},
+    {PID_O2S5_LAMDBA, 4, 2, 0, 2.0f / 65536, 0, "Oxygen sensor 5 air-fuel ratio", "lambda"},
+    {PID_O2S6_LAMDBA, 4, 2, 0, 2.0f / 65536, 0, "Oxygen sensor 6 air-fuel ratio", "lambda"},
+    {PID_O2S7_LAMDBA, 4, 2, 0, 2.0f / 65536, 0, "Oxygen sensor 7 air-fuel ratio", "lambda"},
+    {PID_O2S8_LAMDBA, 4, 2, 0, 2.0f / 65536, 0, "Oxygen sensor 8 air-fuel ratio", "lambda"},
+    {PID_CMD_EGR, 1, 1, 0, 100.0f / 255, 0, "Commanded EGR", "%"},
+    {PID_EGR_ERR, 1, 1, 0, 100.0f / 128, -100, "EGR error", "%"},
+    {PID_CMD_EVAP, 1, 1, 0, 100.0f / 255, 0, "Commanded evaporative purge", "%"},
+    {PID_FUEL_LEVEL, 1, 1, 0, 100.0f / 255, 0, "Fuel tank level", "%"},
+    {PID_WARMUPS_SINCE_CLEAR, 1, 1, 0, 1, 0, "Warm-ups since codes cleared", ""},
+    {PID_DISTANCE_SINCE_CLEAR, 2, 2, 0, 1, 0, "Distance since codes cleared", "km"},
+    {PID_EVAP_PRESSURE, 2, 2, PID_SIGNED, 0.25f, 0, "Evap system vapor pressure", "Pa"},
+    {PID_ATMOS_PRESSURE, 1, 1, 0, 1, 0, "Barometric pressure", "kPa"},
+    {PID_O2S1_CURRENT, 4, 2, 0, 2.0f / 65536, 0, "Oxygen sensor 1 air-fuel ratio", "lambda"},
+    {PID_O2S2_CURRENT, 4, 2, 0, 2.0f / 65536, 0, "Oxygen sensor 2 air-fuel ratio", "lambda"},
+    {PID_O2S3_CURRENT, 4, 2, 0, 2.0f / 65536, 0, "Oxygen sensor 3 air-fuel ratio", "lambda"},
+    {PID_O2S4_CURRENT, 4, 2, 0, 2.0f / 65536, 0, "Oxygen sensor 4 air-fuel ratio", "lambda"},
+    {PID_O2S5_CURRENT, 4, 2, 0, 2.0f / 65536, 0, "Oxygen sensor 5 air-fuel ratio", "lambda"},
+    {PID_O2S6_CURRENT, 4, 2, 0, 2.0f / 65536, 0, "Oxygen sensor 6 air-fuel ratio", "lambda"},
+    {PID_O2S7_CURRENT, 4, 2, 0, 2.0f / 65536, 0, "Oxygen sensor 7 air-fuel ratio", "lambda"},
+    {PID_O2S8_CURRENT, 4, 2, 0, 2.0f / 65536, 0, "Oxygen sensor 8 air-fuel ratio", "lambda"},
+    {PID_CAT_TEMP_B1S1, 2, 2, 0, 0.1f, -40, "Catalyst temperature bank 1 sensor 1", "C"},
+    {PID_CAT_TEMP_B1S2, 2, 2, 0, 0.1f, -40, "Catalyst temperature bank 1 sensor 2", "C"},
+    {PID_CAT_TEMP_B2S1, 2, 2, 0, 0.1f, -40, "Catalyst temperature bank 2 sensor 1", "C"},
+    {PID_CAT_TEMP_B2S2, 2, 2, 0, 0.1f, -40, "Catalyst temperature bank 2 sensor 2", "C"},
+    {PID_SUPPORTED3, 4, 4, PID_BITFIELD, 1, 0, "PIDs supported 41-60", ""},
+    {PID_MONITOR_STATUS, 4, 4, PID_BITFIELD, 1, 0, "Monitor status this drive cycle", ""},
+    {PID_CTRL_VOLTS, 2, 2, 0, 0.001f, 0, "Control module voltage", "V"},
+    {PID_ABS_LOAD, 2, 2, 0, 100.0f / 255, 0, "Absolute load", "%"},
+    {PID_CMD_EQUIV, 2, 2, 0, 2.0f / 65536, 0, "Commanded air-fuel ratio", "lambda"},
+    {PID_REL_THROTTLE, 1, 1, 0, 100.0f / 255, 0, "Relative throttle position", "%"},
+    {PID_AMB_TEMP, 1, 1, 0, 1, -40, "Ambient air temperature", "C"},
+    {PID_ABS_THROTTLE_B, 1, 1, 0, 100.0f / 255, 0, "Absolute throttle position B", "%"},
+    {PID_ABS_THROTTLE_C, 1, 1, 0, 100.0f / 255, 0, "Absolute throttle position C", "%"},
+    {PID_ABS_THROTTLE_D, 1, 1, 0, 100.0f / 255, 0, "Accelerator pedal position D", "%"},
+    {PID_ABS_THROTTLE_E, 1, 1, 0, 100.0f / 255, 0, "Accelerator pedal position E", "%"},
+    {PID_ABS_THROTTLE_F, 1, 1, 0, 100.0f / 255, 0, "Accelerator pedal position F", "%"},
+    {PID_CMD_THROTTLE_ACTUATOR, 1, 1, 0, 100.0f / 255, 0, "Commanded throttle actuator", "%"},
+    {PID_TIME_RUN_MIL, 2, 2, 0, 1, 0, "Time run with MIL on", "min"},
+    {PID_TIME_SINCE_DTC_CLEAR, 2, 2, 0, 1, 0, "Time since codes cleared", "min"},
+    {0x4F, 4, 4, PID_BITFIELD, 1, 0, "Maximum ratio, voltage, current and pressure", ""},
+    {0x50, 4, 1, 0, 10, 0, "Maximum mass air flow", "g/s"},
+    {PID_FUEL_TYPE, 1, 1, PID_BITFIELD, 1, 0, "Fuel type", ""},
+    {PID_ETHANOL_FUEL_PERC, 1, 1, 0, 100.0f / 255, 0, "Ethanol fuel", "%"},
+    {PID_ABS_EVAP_PRESS, 2, 2, 0, 0.005f, 0, "Absolute evap system vapor pressure", "kPa"},
+    {PID_EVAP_VAPOR_PRES, 2, 2, PID_SIGNED, 1, 0, "Evap system vapor pressure", "Pa"},
+    {PID_SHORT_SEC_O2_TRIM13, 2, 1, 0, 100.0f / 128, -100, "Short term secondary oxygen trim bank 1/3", "%"},
+    {PID_LONG_SEC_O2_TRIM13, 2, 1, 0, 100.0f / 128, -100, "Long term secondary oxygen trim bank 1/3", "%"},
+    {PID_SHORT_SEC_O2_TRIM24, 2, 1, 0, 100.0f / 128, -100, "Short term secondary oxygen trim bank 2/4", "%"},
+    {PID_LONG_SEC_O2_TRIM24, 2, 1, 0, 100.0f / 128, -100, "Long term secondary oxygen trim bank 2/4", "%"},
+    {PID_FUEL_ABS_PRES, 2, 2, 0, 10, 0, "Fuel rail absolute pressure", "kPa"},
+    {PID_REL_ACCEL_POS, 1, 1, 0, 100.0f / 255, 0, "Relative accelerator pedal position", "%"},
+    {PID_HYB_BATT_REM_LIFE, 1, 1, 0, 100.0f / 255, 0, "Hybrid battery remaining life", "%"},
+    {PID_ENGINE_OIL_TMP, 1, 1, 0, 1, -40, "Engine oil temperature", "C"},
+    {PID_FUEL_INJ_TIMING, 2, 2, 0, 1.0f / 128, -210, "Fuel injection timing", "deg"},
+    {PID_FUEL_RATE, 2, 2, 0, 0.05f, 0, "Engine fuel rate", "L/h"},
+    {PID_EMIS_REQ, 1, 1, PID_BITFIELD, 1, 0, "Emission requirements", ""},
+    {PID_SUPPORTED4, 4, 4, PID_BITFIELD, 1, 0, "PIDs supported 61-80", ""},
+    {PID_DEMAND_TRQ, 1, 1, 0, 1, -125, "Driver demand torque", "%"},
+    {PID_ACTUAL_TRQ, 1, 1, 0, 1, -125, "Actual engine torque", "%"},
+    {PID_REF_TRQ, 2, 2, 0, 1, 0, "Engine reference torque", "Nm"},
+    {PID_TRQ_DATA, 5, 1, 0, 1, -125, "Engine percent torque idle", "%"},
+};
+
+#define PID_TABLE_SIZE  (sizeof(pidTable) / sizeof(pidTable[0]))
+
+static constexpr bool tableInOrder(unsigned int i)
+{
+    return i >= PID_TABLE_SIZE || (pidTable[i].pid == i && pidTable[i].rawBytes <= pidTable[i].length &&
+                                   pidTable[i].rawBytes <= 4 && tableInOrder(i + 1));
+}
+static_assert(tableInOrder(0), "pidTable needs one entry per PID in order, with rawBytes within length");
+
+PIDDecoder::PIDDecoder()
+{
+    reset();
+}
+
+const PIDDefinition *PIDDecoder::getDefinition(uint8_t pid)
+{
+    return (pid < PID_TABLE_SIZE) ? &pidTable[pid] : NULL;
+}
+
+/*
+ * data points at the bytes after the PID. False when the PID is unknown or
+ * there aren't enough bytes for it.
+ */
+bool PIDDecoder::decode(uint8_t pid, const uint8_t *data, int length, uint32_t &raw, float &value)
+{
+    const PIDDefinition *def = getDefinition(pid);
+    if (!def || length < def->length) return false;
+
+    raw = 0;
+    for (int i = 0; i < def->rawBytes; i++) raw = (raw << 8) | data[i];
+    float base = raw;
+    if ((def->flags & PID_SIGNED) && (raw & (1ul << (def->rawBytes * 8 - 1)))) base = (float)raw - (float)(1ul << (def->rawBytes * 8));
+    value = base * def->scale + def->offset;
+    return true;
+}
+
+int PIDDecoder::processFrame(CAN_FRAME &frame, PIDValue *out, int maxValues)
+{
+    if (frame.id < 0x7E8 || frame.id > 0x7EF || frame.length < 3) return 0;
+    int length = frame.data.byte[0];
+    if (length > 7 || length + 1 > frame.length || frame.data.byte[1] != OBDII_SHOW_CURRENT + 0x40) return 0;
+
+    //a response carries one or more PID and data pairs
+    int count = 0;
+    int pos = 2;
+    uint32_t now = millis();
+    while (pos < length + 1)
+    {
+        uint8_t pid = frame.data.byte[pos];
+        const PIDDefinition *def = getDefinition(pid);
+        if (!def || pos + 1 + def->length > length + 1) break;
+
+        PIDValue *value = findValue(frame.id, pid);
+        if (value && decode(pid, &frame.data.byte[pos + 1], def->length, value->raw, value->value))
+        {
+            value->flags = def->flags;
+            value->millis = now;
+            if (count < maxValues) out[count++] = *value;
+        }
+        pos += 1 + def->length;
+    }
+    return count;
+}
+
+bool PIDDecoder::getValue(int idx, PIDValue &value)
+{
+    if (idx < 0 || idx >= PID_DECODE_VALUES || !used[idx]) return false;
+    value = values[idx];
+    return true;
+}
+
+//value in the PID's own terms: hex for bitfields, otherwise up to two decimals
+void PIDDecoder::formatValue(const PIDValue &value, char *buff)
+{
+    if (value.flags & PID_BITFIELD) sprintf(buff, "%X", (unsigned int)value.raw);
+    else sprintf(buff, "%.2f", value.value);
+}
+
+void PIDDecoder::printAll()
+{
+    PIDValue value;
+    char buff[20];
+    int count = 0;
+
+    for (int i = 0; i < PID_DECODE_VALUES; i++)
+    {
+        if (!getValue(i, value)) continue;
+        const PIDDefinition *def = getDefinition(value.pid);
+        formatValue(value, buff);
+        Logger::console("ECU %x PID %x %s: %s %s (%i ms ago)", value.ecu, value.pid, def->name, buff, def->unit,
+                        millis() - value.millis);
+        count++;
+    }
+    if (count == 0) Logger::console("No Mode 01 responses decoded yet");
+}
+
+/*
+ * One line per value: ECU PID value unit, IDs in hex. Bitfields are shown in hex
+ * without a unit.
+ */
+String PIDDecoder::toText(const char *lineEnding, int pid)
+{
+    String retString = String();
+    PIDValue value;
+    char buff[60];
+    char number[20];
+
+    for (int i = 0; i < PID_DECODE_VALUES; i++)
+    {
+        if (!getValue(i, value) || (pid >= 0 && value.pid != pid)) continue;
+        formatValue(value, number);
+        sprintf(buff, "%03X %02X %s %s", value.ecu, value.pid, number, getDefinition(value.pid)->unit);
+        retString.concat(buff);
+        retString.concat(lineEnding);
+    }
+    return retString;
+}
+
+void PIDDecoder::reset()
+{
+    for (int i = 0; i < PID_DECODE_VALUES; i++) used[i] = false;
+}
+
+/*
+ * Open addressed lookup like PIDProfiler's. Returns NULL once the table is full and the key is new.
+ */
+PIDValue *PIDDecoder::findValue(uint16_t ecu, uint8_t pid)
+{
+    uint32_t key = ((uint32_t)(ecu & 0xF) << 8) | pid;
+    uint32_t idx = (key * 2654435761ul) >> 24;
+
+    for (int probe = 0; probe < PID_DECODE_VALUES; probe++)
+    {
+        int slot = (idx + probe) % PID_DECODE_VALUES;
+        if (!used[slot])
+        {
+            used[slot] = true;
+            values[slot].ecu = ecu;
+            values[slot].pid = pid;
+            return &values[slot];
+        }
+        if (values[slot].ecu == ecu && values[slot].pid == pid) return &values[slot];
+    }
+    return NULL;
+}
@@ -0,0 +1,83 @@
+/*
+ * PIDDecoder.h
+ *
+ * Turns Mode 01 responses seen on the bus into engineering values. The byte
+ * length and formula of every PID up to 0x64 live in one constexpr table so
+ * they stay in flash. The latest value per ECU and PID is kept for the stxdec
+ * command and pushed to the subscription feed as it comes in.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef PIDDECODER_H_
+#define PIDDECODER_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include <esp32_can.h>
+
+#define PID_SIGNED      1 //raw value is two's complement
+#define PID_BITFIELD    2 //flags or a bitmap, not a quantity. Shown in hex and left out of the feed
+
+//value = raw * scale + offset, raw is the first rawBytes data bytes big endian
+struct PIDDefinition {
+    uint8_t pid;
+    uint8_t length;     //data bytes after the PID in a response
+    uint8_t rawBytes;
+    uint8_t flags;
+    float scale;
+    float offset;
+    const char *name;
+    const char *unit;
+};
+
+struct PIDValue {
+    uint16_t ecu;       //CAN ID the response came from
+    uint8_t pid;
+    uint8_t flags;
+    uint32_t raw;
+    float value;
+    uint32_t millis;    //when it was decoded
+};
+
+class PIDDecoder {
+public:
+    PIDDecoder();
+    static const PIDDefinition *getDefinition(uint8_t pid);
+    static bool decode(uint8_t pid, const uint8_t *data, int length, uint32_t &raw, float &value);
+    //decodes every PID in a single frame Mode 01 response. Returns how many went into values
+    int processFrame(CAN_FRAME &frame, PIDValue *values, int maxValues);
+    bool getValue(int idx, PIDValue &value);
+    void printAll();
+    //one line per value: ECU PID value unit. All PIDs when pid is -1
+    String toText(const char *lineEnding, int pid = -1);
+    static void formatValue(const PIDValue &value, char *buff);
+    void reset();
+
+private:
+    PIDValue *findValue(uint16_t ecu, uint8_t pid);
+
+    PIDValue values[PID_DECODE_VALUES];
+    bool used[PID_DECODE_VALUES];
+};
+
+#endif /* PIDDECODER_H_ */
@@ -0,0 +1,368 @@
+/*
+ * PIDPoller.cpp
+ *
+ * Polls the Mode 01 PIDs in the poll plan from the device itself so samples
+ * don't pay a network round trip each. Each PID has its own period and
+ * priority. Requests never go out faster than the budget allows and due PIDs
+ * are packed several to a request, highest priority and most overdue first.
+ * The answers are decoded and pushed to subscribers like any other response.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "PIDPoller.h"
+#include "PIDDecoder.h"
+#include "SettingsStore.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "Trace.h"
+
+extern SettingsStore settingsStore;
+
+MetricCounter pollRequests("poll.requests");
+MetricCounter pollTimeouts("poll.timeouts");
+MetricHistogram pollResponseTime("poll.response_us");
+
+PIDPoller::PIDPoller()
+{
+    waiting = false;
+    nextSend = 0;
+    for (int i = 0; i < POLL_MAX_PIDS; i++) resetEntry(i);
+}
+
+void PIDPoller::setup()
+{
+    for (int i = 0; i < POLL_MAX_PIDS; i++) resetEntry(i);
+    waiting = false;
+    nextSend = micros();
+}
+
+/*
+ * Give up on an unanswered request once PID_RESPONSE_TIMEOUT has passed, then
+ * send the next one if the budget allows and anything is due. Only one request
+ * is ever outstanding, an ECU that is slow to answer slows the poller down
+ * rather than getting requests queued up on it.
+ */
+void PIDPoller::loop(bool busy)
+{
+    TRACE_SCOPE("poller");
+    uint32_t now = micros();
+
+    if (waiting && now - sentMicros > PID_RESPONSE_TIMEOUT)
+    {
+        for (int i = 0; i < 6 && pending[i] != -1; i++) entries[pending[i]].timeouts++;
+        pollTimeouts.inc();
+        waiting = false;
+    }
+    if (waiting || busy || !settings.pollBudget || !settings.CAN0_Enabled) return;
+    if ((int32_t)(now - nextSend) < 0) return;
+    sendRequest(now);
+}
+
+/*
+ * Count the answer to the outstanding request as a sample of each PID it
+ * carries. Other ECUs answering a functional request afterward don't count,
+ * they'd make the sample intervals meaningless.
+ */
+bool PIDPoller::processFrame(CAN_FRAME &frame)
+{
+    if (!waiting || frame.id < 0x7E8 || frame.id > 0x7EF) return false;
+    int length = frame.data.byte[0];
+    if (length < 2 || length > 7 || frame.data.byte[1] != 0x41) return false;
+
+    bool answered = false;
+    uint32_t now = micros();
+    for (int pos = 2; pos < length + 1;)
+    {
+        const PIDDefinition *def = PIDDecoder::getDefinition(frame.data.byte[pos]);
+        int idx = findPID(frame.data.byte[pos]);
+        if (!def) break;
+        for (int i = 0; i < 6 && pending[i] != -1; i++)
+        {
+            if (pending[i] != idx) continue;
+            Entry &entry = entries[idx];
+            if (entry.samples)
+            {
+                uint32_t interval = now - entry.lastSample;
+                entry.intervalSum += interval;
+                if (interval < entry.intervalMin) entry.intervalMin = interval;
+                if (interval > entry.intervalMax) entry.intervalMax = interval;
+            }
+            entry.samples++;
+            entry.lastSample = now;
+            answered = true;
+        }
+        pos += 1 + def->length;
+    }
+    if (answered)
+    {
+        pollResponseTime.record(now - sentMicros);
+        waiting = false;
+    }
+    return answered;
+}
+
+/*
+ * ECUs commonly drop a request they are still working on when the next one
+ * arrives, so the poller gives up on its own and sends again once the client
+ * has its reply. Nothing arriving meanwhile is claimed, it may well be the
+ * client's answer. ELM327Emu checks replies against the client's request so a
+ * late answer to the poll isn't mistaken for it either.
+ */
+void PIDPoller::yieldToClient()
+{
+    waiting = false;
+}
+
+bool PIDPoller::setPID(uint8_t pid, uint16_t periodMs, uint8_t priority)
+{
+    if (!PIDDecoder::getDefinition(pid) || (pid & 0x1F) == 0) return false; //supported PID bitmaps aren't worth polling
+    if (periodMs < POLL_MIN_PERIOD || priority > POLL_MAX_PRIORITY) return false;
+
+    int idx = findPID(pid);
+    if (idx == -1)
+    {
+        for (int i = 0; i < POLL_MAX_PIDS && idx == -1; i++) if (!settings.pollPlan[i].periodMs) idx = i;
+        if (idx == -1) return false;
+        resetEntry(idx);
+    }
+    settings.pollPlan[idx].pid = pid;
+    settings.pollPlan[idx].periodMs = periodMs;
+    settings.pollPlan[idx].priority = priority;
+    settingsStore.markDirty();
+    return true;
+}
+
+bool PIDPoller::removePID(uint8_t pid)
+{
+    int idx = findPID(pid);
+    if (idx == -1) return false;
+    settings.pollPlan[idx].periodMs = 0;
+    resetEntry(idx);
+    settingsStore.markDirty();
+    return true;
+}
+
+void PIDPoller::clear()
+{
+    for (int i = 0; i < POLL_MAX_PIDS; i++)
+    {
+        settings.pollPlan[i].periodMs = 0;
+        resetEntry(i);
+    }
+    waiting = false;
+    settingsStore.markDirty();
+}
+
+bool PIDPoller::setBudget(uint8_t requestsPerSecond)
+{
+    settings.pollBudget = requestsPerSecond;
+    nextSend = micros();
+    settingsStore.markDirty();
+    return true;
+}
+
+bool PIDPoller::setRequestId(uint16_t id)
+{
+    if (id != 0x7DF && (id < 0x7E0 || id > 0x7E7)) return false;
+    settings.pollRequestId = id;
+    settingsStore.markDirty();
+    return true;
+}
+
+bool PIDPoller::getStats(int idx, PollStats &stats)
+{
+    if (idx < 0 || idx >= POLL_MAX_PIDS || !settings.pollPlan[idx].periodMs) return false;
+
+    Entry &entry = entries[idx];
+    uint32_t intervals = entry.samples ? entry.samples - 1 : 0;
+    stats.pid = settings.pollPlan[idx].pid;
+    stats.priority = settings.pollPlan[idx].priority;
+    stats.periodMs = settings.pollPlan[idx].periodMs;
+    stats.polls = entry.polls;
+    stats.samples = entry.samples;
+    stats.timeouts = entry.timeouts;
+    stats.missed = entry.missed;
+    stats.intervalAvg = intervals ? (uint32_t)(entry.intervalSum / intervals) : 0;
+    stats.intervalMin = intervals ? entry.intervalMin : 0;
+    stats.intervalMax = entry.intervalMax;
+    return true;
+}
+
+uint32_t PIDPoller::getDemand()
+{
+    uint32_t demand = 0;
+    for (int i = 0; i < POLL_MAX_PIDS; i++)
+    {
+        uint16_t period = settings.pollPlan[i].periodMs;
+        if (period) demand += (1000 + period - 1) / period;
+    }
+    return demand;
+}
+
+void PIDPoller::resetStats()
+{
+    for (int i = 0; i < POLL_MAX_PIDS; i++)
+    {
+        uint32_t deadline = entries[i].deadline;
+        resetEntry(i);
+        entries[i].deadline = deadline;
+    }
+}
+
+void PIDPoller::printStats()
+{
+    PollStats stats;
+    int count = 0;
+
+    Logger::console("Polling at %X, budget %i requests/s, the plan needs up to %i/s one PID at a time",
+                    settings.pollRequestId, settings.pollBudget, getDemand());
+    for (int i = 0; i < POLL_MAX_PIDS; i++)
+    {
+        if (!getStats(i, stats)) continue;
+        Logger::console("PID %X every %ims priority %i: %i polls %i samples %i timeouts %i missed, interval avg %ius min %ius max %ius",
+                        stats.pid, stats.periodMs, stats.priority, stats.polls, stats.samples, stats.timeouts,
+                        stats.missed, stats.intervalAvg, stats.intervalMin, stats.intervalMax);
+        count++;
+    }
+    if (count == 0) Logger::console("No PIDs in the poll plan");
+}
+
+String PIDPoller::toText(const char *lineEnding)
+{
+    String text = String();
+    PollStats stats;
+    char buff[96];
+
+    for (int i = 0; i < POLL_MAX_PIDS; i++)
+    {
+        if (!getStats(i, stats)) continue;
+        sprintf(buff, "%02X %u %u %u %u %u %u %u %u %u", stats.pid, (unsigned int)stats.periodMs,
+                (unsigned int)stats.priority, (unsigned int)stats.polls, (unsigned int)stats.samples,
+                (unsigned int)stats.timeouts, (unsigned int)stats.missed, (unsigned int)stats.intervalAvg,
+                (unsigned int)stats.intervalMin, (unsigned int)stats.intervalMax);
+        text.concat(buff);
+        text.concat(lineEnding);
+    }
+    return text;
+}
+
+int PIDPoller::findPID(uint8_t pid)
+{
+    for (int i = 0; i < POLL_MAX_PIDS; i++)
+    {
+        if (settings.pollPlan[i].periodMs && settings.pollPlan[i].pid == pid) return i;
+    }
+    return -1;
+}
+
+void PIDPoller::resetEntry(int idx)
+{
+    Entry &entry = entries[idx];
+    entry.deadline = micros(); //due right away
+    entry.polls = 0;
+    entry.samples = 0;
+    entry.timeouts = 0;
+    entry.missed = 0;
+    entry.lastSample = 0;
+    entry.intervalMin = 0xFFFFFFFF;
+    entry.intervalMax = 0;
+    entry.intervalSum = 0;
+}
+
+/*
+ * Pack due PIDs into one request, highest priority first and the most overdue
+ * among equal priorities, for as long as the answer still fits a single frame.
+ * A PID that has fallen a whole period behind, sent or not, has the periods
+ * it missed counted and skipped, the same as PeriodicSender does, so a short
+ * budget thins out low priority PIDs instead of building up a backlog.
+ */
+void PIDPoller::sendRequest(uint32_t now)
+{
+    bool taken[POLL_MAX_PIDS] = {false};
+    int count = 0;
+    int replyBytes = 1; //the 41 in front of the answer
+
+    while (count < 6)
+    {
+        int best = -1;
+        int32_t bestLate = 0;
+        for (int i = 0; i < POLL_MAX_PIDS; i++)
+        {
+            PollPlanEntry &plan = settings.pollPlan[i];
+            int32_t late = (int32_t)(now - entries[i].deadline);
+            if (!plan.periodMs || taken[i] || late < 0) continue;
+            if (replyBytes + 1 + PIDDecoder::getDefinition(plan.pid)->length > 7) continue;
+            if (best == -1 || plan.priority > settings.pollPlan[best].priority ||
+                (plan.priority == settings.pollPlan[best].priority && late > bestLate))
+            {
+                best = i;
+                bestLate = late;
+            }
+        }
+        if (best == -1) break;
+        taken[best] = true;
+        pending[count++] = best;
+        replyBytes += 1 + PIDDecoder::getDefinition(settings.pollPlan[best].pid)->length;
+    }
+    if (count == 0) return;
+    if (count < 6) pending[count] = -1;
+
+    CAN_FRAME frame;
+    frame.id = settings.pollRequestId;
+    frame.length = 8;
+    frame.rtr = 0;
+    frame.extended = 0;
+    frame.data.byte[0] = count + 1;
+    frame.data.byte[1] = 0x01;
+    for (int i = 0; i < 6; i++) frame.data.byte[i + 2] = (i < count) ? settings.pollPlan[pending[i]].pid : 0xAA;
+    if (!CAN0.sendFrame(frame)) return;
+
+    pollRequests.inc();
+    waiting = true;
+    sentMicros = now;
+    nextSend = now + 1000000ul / settings.pollBudget;
+    for (int i = 0; i < POLL_MAX_PIDS; i++)
+    {
+        Entry &entry = entries[i];
+        uint32_t period = settings.pollPlan[i].periodMs * 1000ul;
+        if (!period) continue;
+        if (taken[i])
+        {
+            entry.polls++;
+            entry.deadline += period;
+            if ((int32_t)(now - entry.deadline) >= 0)
+            {
+                uint32_t skipped = (now - entry.deadline) / period + 1;
+                entry.missed += skipped;
+                entry.deadline += skipped * period;
+            }
+        }
+        else if ((int32_t)(now - entry.deadline) >= (int32_t)period)
+        {
+            //held back by the budget for a whole period, it stays due but doesn't build up a backlog
+            uint32_t skipped = (now - entry.deadline) / period;
+            entry.missed += skipped;
+            entry.deadline += skipped * period;
+        }
+    }
+}
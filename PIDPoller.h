@@ -0,0 +1,100 @@
+/*
+ * PIDPoller.h
+ *
+ * Polls the Mode 01 PIDs in the poll plan from the device itself so samples
+ * don't pay a network round trip each. Each PID has its own period and
+ * priority. Requests never go out faster than the budget allows and due PIDs
+ * are packed several to a request, highest priority and most overdue first.
+ * The answers are decoded and pushed to subscribers like any other response.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef PIDPOLLER_H_
+#define PIDPOLLER_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include <esp32_can.h>
+
+struct PollStats {
+    uint8_t pid;
+    uint8_t priority;
+    uint16_t periodMs;
+    uint32_t polls;       //requests the PID went out in
+    uint32_t samples;     //answers received
+    uint32_t timeouts;    //requests nobody answered in time
+    uint32_t missed;      //periods skipped because the budget or the ELM327 client held the PID back
+    uint32_t intervalAvg; //time between samples in microseconds
+    uint32_t intervalMin;
+    uint32_t intervalMax;
+};
+
+class PIDPoller {
+public:
+    PIDPoller();
+    void setup();
+    //busy while the ELM327 client waits on its own request, nothing is sent then
+    void loop(bool busy);
+    //true if the frame answered the request the poller is waiting on
+    bool processFrame(CAN_FRAME &frame);
+    //the ELM327 client sent a request of its own
+    void yieldToClient();
+    //add a PID or change its period and priority. The plan is written to settings
+    bool setPID(uint8_t pid, uint16_t periodMs, uint8_t priority);
+    bool removePID(uint8_t pid);
+    void clear();
+    bool setBudget(uint8_t requestsPerSecond);
+    bool setRequestId(uint16_t id);
+    bool getStats(int idx, PollStats &stats);
+    //requests per second the plan needs if every PID went out on its own
+    uint32_t getDemand();
+    void resetStats();
+    void printStats();
+    //one line per PID: pid period priority polls samples timeouts missed avg min max
+    String toText(const char *lineEnding);
+
+private:
+    struct Entry {
+        uint32_t deadline;  //micros() value at which the PID is next due
+        uint32_t polls;
+        uint32_t samples;
+        uint32_t timeouts;
+        uint32_t missed;
+        uint32_t lastSample;
+        uint32_t intervalMin;
+        uint32_t intervalMax;
+        uint64_t intervalSum;
+    };
+
+    Entry entries[POLL_MAX_PIDS];
+    bool waiting;           //a request was sent and not answered yet
+    uint32_t sentMicros;
+    uint32_t nextSend;      //earliest micros() the budget allows the next request at
+    int8_t pending[6];      //plan entries in the request being waited on, -1 past the end
+
+    int findPID(uint8_t pid);
+    void resetEntry(int idx);
+    void sendRequest(uint32_t now);
+};
+
+#endif /* PIDPOLLER_H_ */
@@ -0,0 +1,253 @@
+/*
+ * PIDProfiler.cpp
+ *
+ * Measures how long each ECU takes to answer each mode/PID requested through the
+ * ELM emulator. Every ECU/mode/PID key keeps a small histogram with two buckets per
+ * octave so percentiles can be reported without storing samples.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "PIDProfiler.h"
+#include "Logger.h"
+#include "Metrics.h"
+
+MetricCounter pidTimeouts("elm.pid_timeouts");
+
+/*
+ * Bucket 0 and 1 hold exactly 0 and 1us. Above that each octave [2^o, 2^(o+1))
+ * is split into a lower and an upper half.
+ */
+static int bucketFor(uint32_t latency)
+{
+    if (latency < 2) return latency;
+    int octave = 31 - __builtin_clz(latency);
+    int idx = octave * 2 + ((latency >> (octave - 1)) & 1);
+    return (idx < PID_PROFILE_BUCKETS) ? idx : PID_PROFILE_BUCKETS - 1;
+}
+
+static uint32_t bucketUpperBound(int idx)
+{
+    if (idx < 2) return idx;
+    int octave = idx / 2;
+    return (1ul << octave) + ((idx & 1) + 1) * (1ul << (octave - 1)) - 1;
+}
+
+PIDProfiler::PIDProfiler()
+{
+    pending = false;
+    timeout = PID_RESPONSE_TIMEOUT;
+    reset();
+}
+
+/*
+ * Called when the emulator puts a request on the bus. Only one request is
+ * outstanding at a time, just like on a real ELM327. A request nobody answered
+ * within PID_RESPONSE_TIMEOUT is counted as a timeout when the next one goes out.
+ */
+void PIDProfiler::requestSent(uint8_t mode, uint8_t pid)
+{
+    if (pending && answeredMask == 0 && (micros() - sentMicros) > timeout) pidTimeouts.inc();
+    pending = true;
+    pendingMode = mode;
+    pendingPID = pid;
+    answeredMask = 0;
+    sentMicros = micros();
+    timeout = PID_RESPONSE_TIMEOUT;
+}
+
+/*
+ * Check whether a frame is an ECU's answer to the outstanding request and, if it
+ * is the first answer from that ECU, record the latency. Functional requests are
+ * answered by several ECUs so the request stays open until the timeout passes.
+ * Handles single frames and ISO-TP first frames. Negative responses count too
+ * since the ECU did answer, except "response pending" (7F xx 78). That only
+ * gives the ECU ELM_PENDING_TIMEOUT longer and the real answer is what's timed.
+ */
+bool PIDProfiler::frameReceived(CAN_FRAME &frame, uint32_t &latency)
+{
+    if (!pending || frame.id < 0x7E8 || frame.id > 0x7EF) return false;
+
+    latency = micros() - sentMicros;
+    if (latency > timeout)
+    {
+        if (answeredMask == 0) pidTimeouts.inc();
+        pending = false;
+        return false;
+    }
+
+    uint8_t *payload = frame.data.bytes + 1;
+    if ((frame.data.bytes[0] & 0xF0) == 0x10) payload++; //first frame has a 12 bit length
+    else if ((frame.data.bytes[0] & 0xF0) != 0) return false; //consecutive or flow control frame
+
+    if (payload[0] == 0x7F)
+    {
+        if (payload[1] != pendingMode) return false;
+        if (payload[2] == 0x78)
+        {
+            timeout = latency + ELM_PENDING_TIMEOUT;
+            return false;
+        }
+    }
+    else if (payload[0] != (pendingMode | 0x40)) return false;
+    //modes 1 and 2 echo the PID back. Mode 2 also adds the frame number after it
+    else if ((pendingMode == 1 || pendingMode == 2) && payload[1] != pendingPID) return false;
+
+    uint8_t ecuBit = 1 << (frame.id - 0x7E8);
+    if (answeredMask & ecuBit) return false;
+    answeredMask |= ecuBit;
+
+    Entry *entry = findEntry(frame.id, pendingMode, pendingPID);
+    if (entry) addSample(entry, latency);
+    return true;
+}
+
+bool PIDProfiler::getLatency(int idx, PIDLatency &latency)
+{
+    if (idx < 0 || idx >= PID_PROFILE_KEYS || !entries[idx].used) return false;
+
+    Entry *entry = &entries[idx];
+    latency.ecu = entry->ecu;
+    latency.mode = entry->mode;
+    latency.pid = entry->pid;
+    latency.count = entry->count;
+    latency.min = entry->min;
+    latency.max = entry->max;
+    latency.avg = entry->count ? (uint32_t)(entry->sum / entry->count) : 0;
+    latency.p50 = percentile(entry, 50);
+    latency.p90 = percentile(entry, 90);
+    latency.p99 = percentile(entry, 99);
+    return true;
+}
+
+void PIDProfiler::printAll()
+{
+    PIDLatency latency;
+    int count = 0;
+
+    for (int i = 0; i < PID_PROFILE_KEYS; i++)
+    {
+        if (!getLatency(i, latency)) continue;
+        Logger::console("ECU %x mode %x PID %x: count %i min %i avg %i p50 %i p90 %i p99 %i max %i us", latency.ecu,
+                        latency.mode, latency.pid, latency.count, latency.min, latency.avg, latency.p50, latency.p90,
+                        latency.p99, latency.max);
+        count++;
+    }
+    if (count == 0) Logger::console("No ECU responses recorded yet");
+}
+
+/*
+ * One line per key: ECU MODE PID count min avg p50 p90 p99 max, IDs in hex and
+ * latencies in decimal microseconds.
+ */
+String PIDProfiler::toText(const char *lineEnding)
+{
+    String retString = String();
+    PIDLatency latency;
+    char buff[80];
+
+    for (int i = 0; i < PID_PROFILE_KEYS; i++)
+    {
+        if (!getLatency(i, latency)) continue;
+        sprintf(buff, "%03X %02X %02X %u %u %u %u %u %u %u", latency.ecu, latency.mode, latency.pid,
+                (unsigned int)latency.count, (unsigned int)latency.min, (unsigned int)latency.avg,
+                (unsigned int)latency.p50, (unsigned int)latency.p90, (unsigned int)latency.p99,
+                (unsigned int)latency.max);
+        retString.concat(buff);
+        retString.concat(lineEnding);
+    }
+    return retString;
+}
+
+void PIDProfiler::reset()
+{
+    for (int i = 0; i < PID_PROFILE_KEYS; i++) entries[i].used = false;
+}
+
+/*
+ * Open addressed lookup. Returns NULL once the table is full and the key is new.
+ */
+PIDProfiler::Entry *PIDProfiler::findEntry(uint16_t ecu, uint8_t mode, uint8_t pid)
+{
+    uint32_t key = ((uint32_t)(ecu & 0xF) << 16) | (mode << 8) | pid;
+    uint32_t idx = (key * 2654435761ul) >> 24;
+
+    for (int probe = 0; probe < PID_PROFILE_KEYS; probe++)
+    {
+        Entry *entry = &entries[(idx + probe) % PID_PROFILE_KEYS];
+        if (!entry->used)
+        {
+            entry->used = true;
+            entry->ecu = ecu;
+            entry->mode = mode;
+            entry->pid = pid;
+            entry->count = 0;
+            entry->min = 0xFFFFFFFF;
+            entry->max = 0;
+            entry->sum = 0;
+            memset(entry->buckets, 0, sizeof(entry->buckets));
+            return entry;
+        }
+        if (entry->ecu == ecu && entry->mode == mode && entry->pid == pid) return entry;
+    }
+    return NULL;
+}
+
+/*
+ * Buckets are 16 bit. When one would overflow all of them are halved, which keeps
+ * the percentiles weighted towards recent behaviour on long sessions.
+ */
+void PIDProfiler::addSample(Entry *entry, uint32_t latency)
+{
+    int bucket = bucketFor(latency);
+    if (entry->buckets[bucket] == 0xFFFF)
+    {
+        for (int i = 0; i < PID_PROFILE_BUCKETS; i++) entry->buckets[i] >>= 1;
+    }
+    entry->buckets[bucket]++;
+    entry->count++;
+    entry->sum += latency;
+    if (latency < entry->min) entry->min = latency;
+    if (latency > entry->max) entry->max = latency;
+}
+
+uint32_t PIDProfiler::percentile(Entry *entry, uint8_t percent)
+{
+    uint32_t total = 0;
+    for (int i = 0; i < PID_PROFILE_BUCKETS; i++) total += entry->buckets[i];
+    if (total == 0) return 0;
+
+    uint32_t rank = (total * percent + 99) / 100;
+    uint32_t seen = 0;
+    for (int i = 0; i < PID_PROFILE_BUCKETS; i++)
+    {
+        seen += entry->buckets[i];
+        if (seen >= rank)
+        {
+            uint32_t upper = bucketUpperBound(i);
+            if (upper > entry->max) upper = entry->max;
+            if (upper < entry->min) upper = entry->min;
+            return upper;
+        }
+    }
+    return entry->max;
+}
@@ -0,0 +1,86 @@
+/*
+ * PIDProfiler.h
+ *
+ * Measures how long each ECU takes to answer each mode/PID requested through the
+ * ELM emulator. Every ECU/mode/PID key keeps a small histogram with two buckets per
+ * octave so percentiles can be reported without storing samples.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef PIDPROFILER_H_
+#define PIDPROFILER_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include <esp32_can.h>
+
+struct PIDLatency {
+    uint16_t ecu;    //CAN ID the response came from
+    uint8_t mode;
+    uint8_t pid;
+    uint32_t count;
+    uint32_t min;    //all latencies in microseconds
+    uint32_t avg;
+    uint32_t p50;
+    uint32_t p90;
+    uint32_t p99;
+    uint32_t max;
+};
+
+class PIDProfiler {
+public:
+    PIDProfiler();
+    void requestSent(uint8_t mode, uint8_t pid);
+    bool frameReceived(CAN_FRAME &frame, uint32_t &latency);
+    bool getLatency(int idx, PIDLatency &latency);
+    void printAll();
+    String toText(const char *lineEnding);
+    void reset();
+
+private:
+    struct Entry {
+        bool used;
+        uint16_t ecu;
+        uint8_t mode;
+        uint8_t pid;
+        uint32_t count;
+        uint32_t min;
+        uint32_t max;
+        uint64_t sum;
+        uint16_t buckets[PID_PROFILE_BUCKETS];
+    };
+
+    Entry entries[PID_PROFILE_KEYS];
+    bool pending;
+    uint8_t pendingMode;
+    uint8_t pendingPID;
+    uint8_t answeredMask; //bit per ECU 0x7E8 - 0x7EF that already answered the pending request
+    uint32_t sentMicros;
+    uint32_t timeout;     //microseconds after sentMicros the request is given up, longer once an ECU asked for more time
+
+    Entry *findEntry(uint16_t ecu, uint8_t mode, uint8_t pid);
+    void addSample(Entry *entry, uint32_t latency);
+    uint32_t percentile(Entry *entry, uint8_t percent);
+};
+
+#endif /* PIDPROFILER_H_ */
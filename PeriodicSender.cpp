@@ -0,0 +1,252 @@
+/*
+ * PeriodicSender.cpp
+ *
+ * Transmits registered CAN frames at fixed periods. Frames are scheduled on a
+ * hashed timer wheel so the cost per loop() is proportional to the frames that
+ * are actually due, not to the number registered.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "PeriodicSender.h"
+#include "Logger.h"
+#include "Trace.h"
+
+PeriodicSender::PeriodicSender() {
+    for (int i = 0; i < MAX_PERIODIC_FRAMES; i++)
+    {
+        entries[i].active = false;
+        entries[i].next = -1;
+        entries[i].wheelSlot = -1;
+    }
+    for (int i = 0; i < PERIODIC_WHEEL_SLOTS; i++) wheel[i] = -1;
+    currSlot = 0;
+    lastTick = 0;
+}
+
+void PeriodicSender::setup() {
+    lastTick = micros();
+}
+
+/*
+ * Advance the wheel one tick at a time until it has caught up with micros() and
+ * send every frame found due in the slots passed over. A frame is always linked
+ * into the first slot that starts at or after its deadline so it is never sent
+ * early. Lateness is bounded by one tick plus however long loop() takes to come
+ * back around.
+ */
+void PeriodicSender::loop() {
+    TRACE_SCOPE("periodic");
+    uint32_t now = micros();
+
+    while ((int32_t)(now - lastTick) >= PERIODIC_TICK_US)
+    {
+        lastTick += PERIODIC_TICK_US;
+        currSlot = (currSlot + 1) % PERIODIC_WHEEL_SLOTS;
+
+        int idx = wheel[currSlot];
+        wheel[currSlot] = -1;
+        while (idx != -1)
+        {
+            Entry &entry = entries[idx];
+            int next = entry.next;
+            if (entry.rounds > 0)
+            {
+                entry.rounds--;
+                entry.next = wheel[currSlot];
+                wheel[currSlot] = idx;
+            }
+            else
+            {
+                entry.wheelSlot = -1;
+                fire(idx, micros());
+            }
+            idx = next;
+        }
+        now = micros();
+    }
+}
+
+/*
+ * Register a new periodic frame. The first copy goes out on the next tick.
+ * Returns the slot number used to refer to the frame later or -1 if the
+ * period is out of range or there is no room left.
+ */
+int PeriodicSender::addFrame(CAN_FRAME &frame, uint32_t periodMicros) {
+    if (periodMicros < PERIODIC_MIN_PERIOD || periodMicros > PERIODIC_MAX_PERIOD) return -1;
+
+    for (int i = 0; i < MAX_PERIODIC_FRAMES; i++)
+    {
+        if (!entries[i].active)
+        {
+            Entry &entry = entries[i];
+            entry.frame = frame;
+            entry.period = periodMicros;
+            entry.deadline = micros();
+            entry.active = true;
+            entry.sent = 0;
+            entry.missed = 0;
+            entry.jitterMax = 0;
+            entry.jitterSum = 0;
+            schedule(i);
+            LOG_DEBUG("Periodic frame %X every %ius in slot %i", frame.id, periodMicros, i);
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Replace the frame and period of an existing slot. The phase is kept: the next
+ * copy is due one new period after the last one went out.
+ */
+bool PeriodicSender::updateFrame(int slot, CAN_FRAME &frame, uint32_t periodMicros) {
+    if (slot < 0 || slot >= MAX_PERIODIC_FRAMES || !entries[slot].active) return false;
+    entries[slot].frame = frame;
+    return updatePeriod(slot, periodMicros);
+}
+
+bool PeriodicSender::updatePeriod(int slot, uint32_t periodMicros) {
+    if (slot < 0 || slot >= MAX_PERIODIC_FRAMES || !entries[slot].active) return false;
+    if (periodMicros < PERIODIC_MIN_PERIOD || periodMicros > PERIODIC_MAX_PERIOD) return false;
+
+    Entry &entry = entries[slot];
+    if (periodMicros == entry.period) return true;
+
+    unlink(slot);
+    entry.deadline = entry.deadline - entry.period + periodMicros;
+    if ((int32_t)(entry.deadline - micros()) < 0) entry.deadline = micros();
+    entry.period = periodMicros;
+    schedule(slot);
+    return true;
+}
+
+bool PeriodicSender::removeFrame(int slot) {
+    if (slot < 0 || slot >= MAX_PERIODIC_FRAMES || !entries[slot].active) return false;
+    unlink(slot);
+    entries[slot].active = false;
+    return true;
+}
+
+void PeriodicSender::clear() {
+    for (int i = 0; i < MAX_PERIODIC_FRAMES; i++) removeFrame(i);
+}
+
+bool PeriodicSender::getStats(int slot, PeriodicStats &stats) {
+    if (slot < 0 || slot >= MAX_PERIODIC_FRAMES || !entries[slot].active) return false;
+
+    Entry &entry = entries[slot];
+    stats.id = entry.frame.id;
+    stats.extended = entry.frame.extended;
+    stats.period = entry.period;
+    stats.sent = entry.sent;
+    stats.missed = entry.missed;
+    stats.jitterMax = entry.jitterMax;
+    stats.jitterAvg = entry.sent ? (uint32_t)(entry.jitterSum / entry.sent) : 0;
+    return true;
+}
+
+void PeriodicSender::resetStats() {
+    for (int i = 0; i < MAX_PERIODIC_FRAMES; i++)
+    {
+        entries[i].sent = 0;
+        entries[i].missed = 0;
+        entries[i].jitterMax = 0;
+        entries[i].jitterSum = 0;
+    }
+}
+
+void PeriodicSender::printStats() {
+    PeriodicStats stats;
+    int count = 0;
+
+    for (int i = 0; i < MAX_PERIODIC_FRAMES; i++)
+    {
+        if (!getStats(i, stats)) continue;
+        Logger::console("%i: ID %x period %ius sent %i missed %i jitter avg %ius max %ius", i, stats.id,
+                        stats.period, stats.sent, stats.missed, stats.jitterAvg, stats.jitterMax);
+        count++;
+    }
+    if (count == 0) Logger::console("No periodic frames registered");
+}
+
+/*
+ * Link an entry into the wheel slot that starts at or after its deadline.
+ */
+void PeriodicSender::schedule(int idx) {
+    Entry &entry = entries[idx];
+    int32_t delta = (int32_t)(entry.deadline - lastTick);
+    uint32_t ticks = 1;
+
+    if (delta > PERIODIC_TICK_US) ticks = ((uint32_t)delta + PERIODIC_TICK_US - 1) / PERIODIC_TICK_US;
+
+    int slot = (currSlot + ticks) % PERIODIC_WHEEL_SLOTS;
+    entry.rounds = (ticks - 1) / PERIODIC_WHEEL_SLOTS;
+    entry.wheelSlot = slot;
+    entry.next = wheel[slot];
+    wheel[slot] = idx;
+}
+
+void PeriodicSender::unlink(int idx) {
+    int slot = entries[idx].wheelSlot;
+    if (slot == -1) return;
+
+    int8_t *link = &wheel[slot];
+    while (*link != -1)
+    {
+        if (*link == idx)
+        {
+            *link = entries[idx].next;
+            break;
+        }
+        link = &entries[*link].next;
+    }
+    entries[idx].next = -1;
+    entries[idx].wheelSlot = -1;
+}
+
+/*
+ * Send a due frame, record how late it went out and link it back in for its
+ * next period. If loop() was stalled for longer than a whole period the missed
+ * copies are counted and skipped rather than sent in a burst.
+ */
+void PeriodicSender::fire(int idx, uint32_t now) {
+    Entry &entry = entries[idx];
+    uint32_t late = ((int32_t)(now - entry.deadline) > 0) ? now - entry.deadline : 0;
+
+    if (settings.CAN0_Enabled && CAN0.sendFrame(entry.frame))
+    {
+        entry.sent++;
+        entry.jitterSum += late;
+        if (late > entry.jitterMax) entry.jitterMax = late;
+    }
+    else entry.missed++;
+
+    entry.deadline += entry.period;
+    if ((int32_t)(now - entry.deadline) >= 0)
+    {
+        uint32_t skipped = (now - entry.deadline) / entry.period + 1;
+        entry.missed += skipped;
+        entry.deadline += skipped * entry.period;
+    }
+    schedule(idx);
+}
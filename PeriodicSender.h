@@ -0,0 +1,86 @@
+/*
+ * PeriodicSender.h
+ *
+ * Transmits registered CAN frames at fixed periods. Frames are scheduled on a
+ * hashed timer wheel so the cost per loop() is proportional to the frames that
+ * are actually due, not to the number registered.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef PERIODICSENDER_H_
+#define PERIODICSENDER_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include <esp32_can.h>
+
+struct PeriodicStats {
+    uint32_t id;
+    bool extended;
+    uint32_t period;      //requested period in microseconds
+    uint32_t sent;        //number of frames transmitted so far
+    uint32_t missed;      //periods skipped because loop() was stalled longer than a period
+    uint32_t jitterMax;   //worst lateness seen, in microseconds
+    uint32_t jitterAvg;   //average lateness, in microseconds
+};
+
+class PeriodicSender {
+public:
+    PeriodicSender();
+    void setup();
+    void loop();
+    int addFrame(CAN_FRAME &frame, uint32_t periodMicros);
+    bool updateFrame(int slot, CAN_FRAME &frame, uint32_t periodMicros);
+    bool updatePeriod(int slot, uint32_t periodMicros);
+    bool removeFrame(int slot);
+    void clear();
+    bool getStats(int slot, PeriodicStats &stats);
+    void resetStats();
+    void printStats();
+
+private:
+    struct Entry {
+        CAN_FRAME frame;
+        uint32_t period;
+        uint32_t deadline;  //micros() value at which the frame is next due
+        uint32_t rounds;    //full turns of the wheel left before the entry is due
+        int8_t next;        //next entry in the same wheel slot, -1 ends the list
+        int8_t wheelSlot;   //wheel slot the entry is linked into, -1 if unlinked
+        bool active;
+        uint32_t sent;
+        uint32_t missed;
+        uint32_t jitterMax;
+        uint64_t jitterSum;
+    };
+
+    Entry entries[MAX_PERIODIC_FRAMES];
+    int8_t wheel[PERIODIC_WHEEL_SLOTS];
+    int currSlot;
+    uint32_t lastTick;
+
+    void schedule(int idx);
+    void unlink(int idx);
+    void fire(int idx, uint32_t now);
+};
+
+#endif /* PERIODICSENDER_H_ */
@@ -0,0 +1,356 @@
+/*
+ * Player.cpp
+ *
+ * Plays a log back onto CAN0 with its recorded timing, see Player.h
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "Player.h"
+#include "Logger.h"
+#include "Metrics.h"
+
+extern Recorder recorder;
+
+MetricCounter playbackFrames("playback.frames");
+MetricHistogram playbackJitter("playback.jitter_us");
+
+static_assert((PLAYBACK_QUEUE & (PLAYBACK_QUEUE - 1)) == 0, "PLAYBACK_QUEUE must be a power of two");
+
+Player::Player() : head(0), tail(0), playing(false), sourceDone(false), firing(false), sent(0), failed(0), late(0),
+    underruns(0), jitterSum(0), jitterMax(0)
+{
+    uploadCount = 0;
+    filterCount = 0;
+    timer = NULL;
+    source = Upload;
+    speed = 100;
+    looping = false;
+    reported = true;
+    starved = false;
+    filtered = 0;
+    loops = 0;
+}
+
+void Player::setup()
+{
+    esp_timer_create_args_t args;
+
+    args.callback = onTimer;
+    args.arg = this;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "playback";
+    args.skip_unhandled_events = false;
+    if (esp_timer_create(&args, &timer) != ESP_OK)
+    {
+        Logger::error("Could not create the playback timer");
+        timer = NULL;
+    }
+}
+
+/*
+ * Keeps the queue full. Each frame is due its source time since the first
+ * frame of the pass after the pass started, scaled by the speed.
+ */
+void Player::loop()
+{
+    if (!playing.load() && !reported)
+    {
+        reported = true;
+        Logger::info("Playback ended, %i frames sent", sent.load());
+    }
+    if (!playing.load() || sourceDone.load()) return;
+
+    while (head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire) < PLAYBACK_QUEUE)
+    {
+        CAN_FRAME frame;
+        uint64_t time;
+        Recorder::ReadResult result = read(frame, time);
+        if (result == Recorder::Wait) return;
+        if (result == Recorder::Done)
+        {
+            //a pass that queued nothing means the next one wouldn't either
+            if (!looping || passQueued == 0)
+            {
+                sourceDone = true;
+                return;
+            }
+            rewind();
+            passStart = lastDue + PLAYBACK_LOOP_GAP_MS * 1000;
+            passStarted = false;
+            passQueued = 0;
+            loops++;
+            continue;
+        }
+        if (!passStarted)
+        {
+            firstTime = time;
+            passStarted = true;
+        }
+        if (!passes(frame))
+        {
+            filtered++;
+            continue;
+        }
+
+        uint32_t pos = head.load(std::memory_order_relaxed);
+        Queued &queued = queue[pos & (PLAYBACK_QUEUE - 1)];
+        queued.frame = frame;
+        queued.due = passStart + (uint32_t)((time - firstTime) * 100 / speed);
+        lastDue = queued.due;
+        passQueued++;
+        head.store(pos + 1, std::memory_order_release);
+    }
+}
+
+bool Player::addUpload(const CAN_FRAME &frame, uint32_t micros)
+{
+    if (uploadCount >= PLAYBACK_UPLOAD_FRAMES) return false;
+    UploadedFrame &uploaded = upload[uploadCount];
+    uploaded.micros = micros;
+    uploaded.id = frame.extended ? (frame.id | PLAYBACK_EXTENDED) : frame.id;
+    uploaded.length = (frame.length > 8) ? 8 : frame.length;
+    memcpy(uploaded.data, frame.data.bytes, uploaded.length);
+    uploadCount++;
+    return true;
+}
+
+void Player::clearUpload()
+{
+    if (source == Upload) stop();
+    uploadCount = 0;
+}
+
+int Player::addFilter(uint32_t id, uint32_t mask, bool exclude)
+{
+    if (filterCount >= PLAYBACK_FILTERS) return -1;
+    //an 11 bit filter doesn't match 29 bit IDs or the other way around
+    filters[filterCount].mask = mask | PLAYBACK_EXTENDED;
+    filters[filterCount].id = id & filters[filterCount].mask;
+    filters[filterCount].exclude = exclude;
+    return filterCount++;
+}
+
+void Player::clearFilters()
+{
+    filterCount = 0;
+}
+
+bool Player::start(Source from, uint32_t seconds, uint16_t percent, bool repeat)
+{
+    if (!timer || percent < 1 || percent > PLAYBACK_MAX_SPEED) return false;
+    stop();
+    //a callback still running from before would take frames off the new queue
+    while (firing.load()) delay(1);
+
+    source = from;
+    if (source == Upload && uploadCount == 0) return false;
+    if (source == Recording && !recorder.startExport(cursor, seconds)) return false;
+    rewind();
+    speed = percent;
+    looping = repeat;
+    head = 0;
+    tail = 0;
+    passStarted = false;
+    passQueued = 0;
+    filtered = 0;
+    loops = 0;
+    sent = 0;
+    failed = 0;
+    late = 0;
+    underruns = 0;
+    starved = false;
+    jitterSum = 0;
+    jitterMax = 0;
+    playbackJitter.reset();
+
+    passStart = micros() + PLAYBACK_LEAD_MS * 1000;
+    uint32_t firstDue = passStart; //loop() moves passStart on when it reads ahead into the next pass
+    sourceDone = false;
+    playing = true;
+    reported = false;
+    loop();
+    int32_t wait = (int32_t)(firstDue - micros());
+    esp_timer_start_once(timer, (wait > 0) ? wait : 0);
+    Logger::info("Playback of %s at %i%% started", (source == Upload) ? "the upload" : "the recording", speed);
+    return true;
+}
+
+void Player::stop()
+{
+    playing = false;
+    if (timer) esp_timer_stop(timer);
+}
+
+bool Player::isPlaying()
+{
+    return playing.load();
+}
+
+void Player::getStats(PlayerStats &stats)
+{
+    stats.playing = playing.load();
+    stats.uploaded = uploadCount;
+    stats.sent = sent.load();
+    stats.failed = failed.load();
+    stats.filtered = filtered;
+    stats.loops = loops;
+    stats.late = late.load();
+    stats.underruns = underruns.load();
+    stats.jitterAvg = stats.sent ? jitterSum.load() / stats.sent : 0;
+    stats.jitterMax = jitterMax.load();
+}
+
+String Player::toText(const char *lineEnding)
+{
+    String text;
+    PlayerStats stats;
+    char buff[96];
+
+    for (int i = 0; i < filterCount; i++)
+    {
+        sprintf(buff, "%i %X %X%s", i, (unsigned int)(filters[i].id & 0x1FFFFFFF), (unsigned int)(filters[i].mask & 0x1FFFFFFF),
+                filters[i].exclude ? " X" : "");
+        text.concat(buff);
+        text.concat(lineEnding);
+    }
+    getStats(stats);
+    sprintf(buff, "%s %i %i %i %i %i %i %i %i", stats.playing ? "PLAYING" : "STOPPED", (int)stats.uploaded, (int)stats.sent,
+            (int)stats.filtered, (int)stats.loops, (int)stats.late, (int)stats.underruns, (int)stats.jitterAvg, (int)stats.jitterMax);
+    text.concat(buff);
+    text.concat(lineEnding);
+    return text;
+}
+
+void Player::printAll()
+{
+    PlayerStats stats;
+
+    getStats(stats);
+    Logger::console("Playback %s, %i frames uploaded", stats.playing ? "running" : "stopped", stats.uploaded);
+    for (int i = 0; i < filterCount; i++)
+        Logger::console("Filter %i: %s %X mask %X", i, filters[i].exclude ? "exclude" : "include", filters[i].id & 0x1FFFFFFF,
+                        filters[i].mask & 0x1FFFFFFF);
+    Logger::console("%i frames sent, %i refused by the driver, %i filtered out, %i passes repeated", stats.sent, stats.failed,
+                    stats.filtered, stats.loops);
+    Logger::console("Jitter avg %ius, max %ius, 99%% within %ius. %i frames later than %ius, %i queue underruns",
+                    stats.jitterAvg, stats.jitterMax, playbackJitter.getPercentile(99), stats.late, PLAYBACK_LATE_US, stats.underruns);
+}
+
+Recorder::ReadResult Player::read(CAN_FRAME &frame, uint64_t &time)
+{
+    if (source == Recording) return recorder.next(cursor, frame, time);
+    if (uploadPos >= uploadCount) return Recorder::Done;
+
+    const UploadedFrame &uploaded = upload[uploadPos];
+    if (uploadPos > 0) uploadTime += uploaded.micros - upload[uploadPos - 1].micros;
+    frame.id = uploaded.id & ~PLAYBACK_EXTENDED;
+    frame.extended = (uploaded.id & PLAYBACK_EXTENDED) != 0;
+    frame.rtr = 0;
+    frame.length = uploaded.length;
+    memcpy(frame.data.bytes, uploaded.data, uploaded.length);
+    uploadPos++;
+    time = uploadTime;
+    return Recorder::Frame;
+}
+
+void Player::rewind()
+{
+    if (source == Recording) recorder.rewind(cursor);
+    uploadPos = 0;
+    uploadTime = 0;
+}
+
+bool Player::passes(const CAN_FRAME &frame)
+{
+    uint32_t key = frame.extended ? (frame.id | PLAYBACK_EXTENDED) : frame.id;
+    bool includes = false;
+    bool included = false;
+
+    for (int i = 0; i < filterCount; i++)
+    {
+        bool matches = (key & filters[i].mask) == filters[i].id;
+        if (filters[i].exclude && matches) return false;
+        if (!filters[i].exclude)
+        {
+            includes = true;
+            included |= matches;
+        }
+    }
+    return included || !includes;
+}
+
+void Player::onTimer(void *arg)
+{
+    ((Player *)arg)->fire();
+}
+
+/*
+ * Runs in the esp_timer task. Sends whatever is due, then arms the timer for
+ * the next frame. With nothing queued it checks back every PLAYBACK_IDLE_US
+ * until loop() has caught up or the source has run out, an underrun counts
+ * once however long it lasts.
+ */
+void Player::fire()
+{
+    firing = true;
+    uint32_t pos = tail.load(std::memory_order_relaxed);
+    uint32_t now = micros();
+
+    while (playing.load() && pos != head.load(std::memory_order_acquire))
+    {
+        Queued &queued = queue[pos & (PLAYBACK_QUEUE - 1)];
+        if ((int32_t)(queued.due - now) > 0) break;
+        uint32_t lateBy = now - queued.due;
+        if (settings.CAN0_Enabled && CAN0.sendFrame(queued.frame))
+        {
+            sent++;
+            playbackFrames.inc();
+        }
+        else failed++;
+        jitterSum += lateBy;
+        if (lateBy > jitterMax.load()) jitterMax = lateBy;
+        if (lateBy > PLAYBACK_LATE_US) late++;
+        playbackJitter.record(lateBy);
+        tail.store(++pos, std::memory_order_release);
+        starved = false;
+        now = micros();
+    }
+
+    if (playing.load())
+    {
+        if (pos != head.load(std::memory_order_acquire))
+        {
+            int32_t wait = (int32_t)(queue[pos & (PLAYBACK_QUEUE - 1)].due - now);
+            esp_timer_start_once(timer, (wait > 0) ? wait : 0);
+        }
+        //head is read again after sourceDone, the last frames may have come in between
+        else if (sourceDone.load() && pos == head.load()) playing = false;
+        else
+        {
+            if (!starved && !sourceDone.load()) underruns++;
+            starved = true;
+            esp_timer_start_once(timer, PLAYBACK_IDLE_US);
+        }
+    }
+    firing = false;
+}
@@ -0,0 +1,145 @@
+/*
+ * Player.h
+ *
+ * Plays a log back onto CAN0 with the gaps it was recorded with, from the
+ * flight recording or from frames uploaded over GVRET. loop() reads ahead into
+ * a queue and a one shot esp_timer sends each frame when it is due, so the
+ * timing doesn't depend on how long loop() takes to come around.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef PLAYER_H_
+#define PLAYER_H_
+
+#include <Arduino.h>
+#include <atomic>
+#include "config.h"
+#include <esp32_can.h>
+#include <esp_timer.h>
+#include "Recorder.h"
+
+#define PLAYBACK_EXTENDED   0x80000000ul //set in an ID for a 29 bit one
+
+struct UploadedFrame {
+    uint32_t micros;    //when it was recorded, only the gaps count
+    uint32_t id;
+    uint8_t length;
+    uint8_t data[8];
+};
+
+struct PlayerStats {
+    bool playing;
+    uint32_t uploaded;
+    uint32_t sent;
+    uint32_t failed;    //the driver wouldn't take them
+    uint32_t filtered;
+    uint32_t loops;     //passes started again in loop mode
+    uint32_t late;      //sent more than PLAYBACK_LATE_US after they were due
+    uint32_t underruns; //times the timer found nothing queued
+    uint32_t jitterAvg; //us after the frames were due
+    uint32_t jitterMax;
+};
+
+class Player {
+public:
+    enum Source { Upload, Recording };
+
+    Player();
+    void setup();
+    //reads ahead for the timer
+    void loop();
+    //frames uploaded for playback. Times have to go up, only the gaps between them count
+    bool addUpload(const CAN_FRAME &frame, uint32_t micros);
+    void clearUpload();
+    //ID filters, a frame is played if it matches an include filter (or there are none) and no
+    //exclude filter. Returns the filter's index or -1 if they are all in use
+    int addFilter(uint32_t id, uint32_t mask, bool exclude);
+    void clearFilters();
+    //speed in percent, 200 plays twice as fast. seconds picks the end of the recording like
+    //Recorder::startExport() does. Returns false if there is nothing to play
+    bool start(Source source, uint32_t seconds, uint16_t speed, bool repeat);
+    void stop();
+    bool isPlaying();
+    void getStats(PlayerStats &stats);
+    //filters, then a status line: PLAYING|STOPPED uploaded sent filtered loops late underruns jitter avg max
+    String toText(const char *lineEnding);
+    void printAll();
+
+private:
+    struct Queued {
+        CAN_FRAME frame;
+        uint32_t due;   //micros()
+    };
+
+    struct Filter {
+        uint32_t id;
+        uint32_t mask;
+        bool exclude;
+    };
+
+    RecorderCursor cursor;
+    UploadedFrame upload[PLAYBACK_UPLOAD_FRAMES];
+    int uploadCount;
+    Filter filters[PLAYBACK_FILTERS];
+    int filterCount;
+    esp_timer_handle_t timer;
+
+    //filled by loop(), emptied by the timer
+    Queued queue[PLAYBACK_QUEUE];
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    std::atomic<bool> playing;
+    std::atomic<bool> sourceDone; //everything left is queued
+    std::atomic<bool> firing;     //the timer callback is running
+
+    Source source;
+    uint16_t speed;
+    bool looping;
+    bool reported;      //the end of the playback was logged
+    int uploadPos;
+    uint64_t uploadTime;
+    bool passStarted;
+    uint64_t firstTime; //source time of the first frame of the pass
+    uint32_t passStart; //micros() the first frame of the pass is due at
+    uint32_t lastDue;
+    uint32_t passQueued;
+    uint32_t filtered;
+    uint32_t loops;
+
+    //written by the timer callback
+    std::atomic<uint32_t> sent;
+    std::atomic<uint32_t> failed;
+    std::atomic<uint32_t> late;
+    std::atomic<uint32_t> underruns;
+    std::atomic<uint32_t> jitterSum;
+    std::atomic<uint32_t> jitterMax;
+    bool starved;       //the queue ran empty, until the next frame goes out
+
+    Recorder::ReadResult read(CAN_FRAME &frame, uint64_t &time);
+    void rewind();
+    bool passes(const CAN_FRAME &frame);
+    void fire();
+    static void onTimer(void *arg);
+};
+
+#endif /* PLAYER_H_ */
@@ -0,0 +1,654 @@
+/*
+ * Recorder.cpp
+ *
+ * The flight recorder's encoder, writer task and export, see Recorder.h
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "Recorder.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "SettingsStore.h"
+
+#define RECORDER_MAGIC      0x43455241 //"AREC" in memory order
+#define RECORD_EXTENDED     0x10
+#define RECORD_RTR          0x20
+#define RECORD_DELTA        0x40
+#define RECORD_KEEP         0x80
+#define RECORD_MAX_SIZE     24 //header byte, 64 bit varint, 29 bit ID and 8 data bytes
+#define RECORDER_MAX_KEPT   256 //a delta record refers to a kept frame with one byte
+
+MetricCounter recorderFrames("recorder.frames");
+MetricCounter recorderDrops("recorder.drops");
+MetricCounter recorderFlashBytes("recorder.flash_bytes");
+MetricCounter recorderErases("recorder.erases");
+MetricHistogram recorderWriteTime("recorder.write_us");
+MetricHistogram recorderEraseTime("recorder.erase_us");
+
+static_assert(sizeof(RecorderCursor::kept) / sizeof(RecorderCursor::kept[0]) == RECORDER_MAX_KEPT, "one kept frame per index");
+static_assert(RECORDER_CHUNK_SIZE + 2 + 24 <= RECORDER_SECTOR_SIZE, "a chunk has to fit a block");
+
+Recorder::Recorder() : flashBytes(0), erases(0), head(0), tail(0)
+{
+    partition = NULL;
+    sectors = 0;
+    oldestSequence = 0;
+    blockSequence = 0;
+    blockOffset = 0;
+    blockOpen = false;
+    filling = false;
+    taskHandle = NULL;
+    dumpCursor.active = false;
+}
+
+/*
+ * Read the header of every block to build the time index, then decode the
+ * newest block to find the last frame recorded, which is where the time of
+ * this session carries on from. The blocks this session records come after
+ * the newest one, so nothing recorded before a restart gets overwritten
+ * until the log wraps around to it.
+ */
+void Recorder::setup()
+{
+    BlockHeader header;
+    BlockHeader newestHeader;
+    bool found = false;
+
+    //what is still queued from before goes out first
+    flush();
+    while (head.load(std::memory_order_acquire) != tail.load(std::memory_order_acquire)) vTaskDelay(1);
+
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, RECORDER_PARTITION);
+    sectors = 0;
+    if (partition && partition->size > RECORDER_OFFSET) sectors = (partition->size - RECORDER_OFFSET) / RECORDER_SECTOR_SIZE;
+    if (sectors > RECORDER_MAX_SECTORS) sectors = RECORDER_MAX_SECTORS;
+    if (sectors < 2)
+    {
+        Logger::console("No room for the flight recorder in a '%s' partition, frames aren't recorded", RECORDER_PARTITION);
+        partition = NULL;
+        sectors = 0;
+    }
+
+    blockOpen = false;
+    filling = false;
+    keptCount = 0;
+    memset(bases, 0, sizeof(bases));
+    frames = 0;
+    drops = 0;
+    recordBytes = 0;
+    flashBytes.store(0, std::memory_order_relaxed);
+    erases.store(0, std::memory_order_relaxed);
+    dumpCursor.active = false;
+    oldestSequence = 0;
+    blockSequence = 0;
+    session = 0;
+    now = 0;
+    lastTime = 0;
+
+    for (uint32_t sector = 0; sector < sectors; sector++)
+    {
+        index[sector].valid = false;
+        uint32_t offset = RECORDER_OFFSET + sector * RECORDER_SECTOR_SIZE;
+        if (esp_partition_read(partition, offset, &header, sizeof(header)) != ESP_OK) continue;
+        if (header.magic != RECORDER_MAGIC || header.sequence == 0 || header.sequence % sectors != sector) continue;
+        if (SettingsStore::crc32(0, (uint8_t *)&header, offsetof(BlockHeader, crc)) != header.crc) continue;
+        index[sector].startTime = header.startTime;
+        index[sector].sequence = header.sequence;
+        index[sector].valid = true;
+        if (!found || (int32_t)(header.sequence - newestHeader.sequence) > 0) newestHeader = header;
+        found = true;
+    }
+
+    if (found)
+    {
+        blockSequence = newestHeader.sequence;
+        oldestSequence = (blockSequence > sectors) ? blockSequence - sectors + 1 : 1;
+        while (oldestSequence < blockSequence && !(index[oldestSequence % sectors].valid && index[oldestSequence % sectors].sequence == oldestSequence)) oldestSequence++;
+        //blocks a reset left without a valid header stay in the index so it stays in order
+        uint64_t startTime = index[oldestSequence % sectors].startTime;
+        for (uint32_t sequence = oldestSequence; sequence != blockSequence + 1; sequence++)
+        {
+            IndexEntry &entry = index[sequence % sectors];
+            if (!entry.valid || entry.sequence != sequence)
+            {
+                entry.valid = false;
+                entry.sequence = sequence;
+                entry.startTime = startTime;
+            }
+            startTime = entry.startTime;
+        }
+
+        CAN_FRAME frame;
+        uint64_t time;
+        dumpCursor.active = true;
+        dumpCursor.sequence = blockSequence;
+        dumpCursor.offset = 0;
+        dumpCursor.endSequence = blockSequence;
+        dumpCursor.endOffset = RECORDER_SECTOR_SIZE;
+        dumpCursor.endChunk = tail.load(std::memory_order_relaxed);
+        dumpCursor.from = 0;
+        dumpCursor.time = newestHeader.startTime;
+        dumpCursor.length = dumpCursor.pos = 0;
+        while (next(dumpCursor, frame, time) == Frame) {}
+        dumpCursor.active = false;
+        lastTime = (dumpCursor.time > newestHeader.startTime) ? dumpCursor.time : newestHeader.startTime;
+        session = newestHeader.session;
+        //a second between sessions so a restart is easy to spot in the exported frames
+        now = lastTime + 1000000;
+        Logger::info("Flight recorder holds %i blocks from %i sessions", blockSequence - oldestSequence + 1, session);
+    }
+    session++;
+    lastStamp = micros();
+
+    if (partition && !taskHandle) xTaskCreatePinnedToCore(writerTask, "Recorder", 4096, this, 1, &taskHandle, 0);
+}
+
+/*
+ * Move recording time on to a micros() stamp. Stamps from before the last one,
+ * a frame the driver took in just before loop() read the time, don't go back
+ * in time. Wraps of micros() are fine as long as this is called at least once
+ * every 71 minutes, which loop() takes care of.
+ */
+void Recorder::advance(uint32_t stamp)
+{
+    if ((int32_t)(stamp - lastStamp) <= 0) return;
+    now += stamp - lastStamp;
+    lastStamp = stamp;
+}
+
+void Recorder::processFrame(CAN_FRAME &frame, int entry)
+{
+    if (!partition || !settings.recordFrames) return;
+    //the time the driver took the frame in, so time it spent queued doesn't end up in the gaps
+    advance(frame.timestamp);
+
+    //the chunk and block need room for the largest record, whatever this one turns out to be
+    if (filling && chunks[head.load(std::memory_order_relaxed) % RECORDER_CHUNKS].length + RECORD_MAX_SIZE > RECORDER_CHUNK_SIZE) publish();
+    uint16_t used = filling ? 2 + chunks[head.load(std::memory_order_relaxed) % RECORDER_CHUNKS].length : 2;
+    bool newBlock = !blockOpen || blockOffset + used + RECORD_MAX_SIZE > RECORDER_SECTOR_SIZE;
+    if (newBlock && filling) publish();
+    if (!filling && !startChunk(newBlock))
+    {
+        drops++;
+        recorderDrops.inc();
+        return;
+    }
+
+    Chunk &chunk = chunks[head.load(std::memory_order_relaxed) % RECORDER_CHUNKS];
+    int length = encode(frame, entry, &chunk.data[chunk.length]);
+    chunk.length += length;
+    recordBytes += length;
+    if (frames++ == 0) firstMillis = millis();
+    recorderFrames.inc();
+}
+
+/*
+ * Take the next free chunk, opening a new block with it if asked to. Returns
+ * false if the writer task still has all of them.
+ */
+bool Recorder::startChunk(bool opensBlock)
+{
+    uint32_t next = head.load(std::memory_order_relaxed);
+    if (next - tail.load(std::memory_order_acquire) >= RECORDER_CHUNKS) return false;
+    Chunk &chunk = chunks[next % RECORDER_CHUNKS];
+
+    if (opensBlock)
+    {
+        blockSequence++;
+        blockOffset = sizeof(BlockHeader);
+        blockOpen = true;
+        keptCount = 0;
+        lastTime = now;
+        chunk.header.magic = RECORDER_MAGIC;
+        chunk.header.sequence = blockSequence;
+        chunk.header.startTime = now;
+        chunk.header.session = session;
+        chunk.header.reserved = 0;
+        chunk.header.crc = SettingsStore::crc32(0, (uint8_t *)&chunk.header, offsetof(BlockHeader, crc));
+
+        //the block the sector held is gone as soon as the writer gets to it
+        IndexEntry &entry = index[blockSequence % sectors];
+        entry.startTime = now;
+        entry.sequence = blockSequence;
+        entry.valid = true;
+        if (oldestSequence == 0) oldestSequence = blockSequence;
+        else if (blockSequence - oldestSequence >= sectors) oldestSequence = blockSequence - sectors + 1;
+    }
+    chunk.opensBlock = opensBlock;
+    chunk.sequence = blockSequence;
+    chunk.offset = blockOffset;
+    chunk.length = 0;
+    chunkMillis = millis();
+    filling = true;
+    return true;
+}
+
+//hands the chunk being filled to the writer task
+void Recorder::publish()
+{
+    uint32_t next = head.load(std::memory_order_relaxed);
+    //chunks start word aligned
+    blockOffset = (blockOffset + 2 + chunks[next % RECORDER_CHUNKS].length + 3) & ~3;
+    filling = false;
+    head.store(next + 1, std::memory_order_release);
+}
+
+void Recorder::flush()
+{
+    if (filling) publish();
+}
+
+/*
+ * Write the record for a frame, see Recorder.h for the format. The first
+ * frame of a FrameTable entry in a block is kept, later ones are written as
+ * the bytes that changed since unless the full record is shorter.
+ */
+int Recorder::encode(CAN_FRAME &frame, int entry, uint8_t *out)
+{
+    uint8_t length = (frame.length > 8) ? 8 : frame.length;
+    uint32_t id = frame.extended ? ((frame.id & 0x1FFFFFFF) | 0x80000000ul) : (frame.id & 0x7FF);
+    uint8_t header = length | (frame.rtr ? RECORD_RTR : 0);
+    uint64_t delta = now - lastTime;
+    int pos = 1;
+
+    lastTime = now;
+    do
+    {
+        out[pos] = delta & 0x7F;
+        delta >>= 7;
+        if (delta) out[pos] |= 0x80;
+        pos++;
+    } while (delta);
+
+    Base *base = (entry >= 0 && entry < FRAME_TABLE_SIZE && !frame.rtr) ? &bases[entry] : NULL;
+    if (base && base->block == blockSequence && base->id == id)
+    {
+        uint8_t mask = 0;
+        int changed = 0;
+        for (int i = 0; i < length; i++)
+        {
+            if (frame.data.bytes[i] != base->data[i])
+            {
+                mask |= 1 << i;
+                changed++;
+            }
+        }
+        //the kept frame's index and the mask against the ID
+        if (2 + changed <= (frame.extended ? 4 : 2) + length)
+        {
+            out[0] = header | RECORD_DELTA;
+            out[pos++] = base->index;
+            out[pos++] = mask;
+            for (int i = 0; i < length; i++)
+            {
+                if (mask & (1 << i)) out[pos++] = base->data[i] = frame.data.bytes[i];
+            }
+            return pos;
+        }
+        //written in full and the kept frame stays as it is
+    }
+    else if (base && keptCount < RECORDER_MAX_KEPT)
+    {
+        base->block = blockSequence;
+        base->id = id;
+        base->index = keptCount++;
+        memset(base->data, 0, sizeof(base->data));
+        memcpy(base->data, frame.data.bytes, length);
+        header |= RECORD_KEEP;
+    }
+
+    out[pos++] = id & 0xFF;
+    out[pos++] = (id >> 8) & 0xFF;
+    if (frame.extended)
+    {
+        header |= RECORD_EXTENDED;
+        out[pos++] = (id >> 16) & 0xFF;
+        out[pos++] = (id >> 24) & 0x1F;
+    }
+    if (!frame.rtr)
+    {
+        memcpy(&out[pos], frame.data.bytes, length);
+        pos += length;
+    }
+    out[0] = header;
+    return pos;
+}
+
+/*
+ * Hand a chunk that has waited long enough to the writer, keep recording time
+ * going while the bus is quiet and print the next lines of a console export.
+ */
+void Recorder::loop()
+{
+    CAN_FRAME frame;
+    uint64_t time;
+    char line[64]; //"(4294967295.999999) can0 1FFFFFFF#" and 8 data bytes is 51
+
+    if (!partition) return;
+    if (micros() - lastStamp > 1000000) advance(micros());
+    if (filling && millis() - chunkMillis >= RECORDER_FLUSH_MS) publish();
+    if (!dumpCursor.active) return;
+
+    for (int i = 0; i < RECORDER_DUMP_LINES; i++)
+    {
+        ReadResult result = next(dumpCursor, frame, time);
+        if (result == Wait) return;
+        if (result == Done)
+        {
+            Logger::console("%i recorded frames", dumpCursor.frames);
+            return;
+        }
+        int len = snprintf(line, sizeof(line), "(%lu.%06lu) can0 ", (unsigned long)(time / 1000000), (unsigned long)(time % 1000000));
+        len += snprintf(&line[len], sizeof(line) - len, frame.extended ? "%08X#" : "%03X#", (unsigned int)frame.id);
+        if (frame.rtr) snprintf(&line[len], sizeof(line) - len, "R");
+        for (int c = 0; !frame.rtr && c < frame.length && c < 8; c++) len += snprintf(&line[len], sizeof(line) - len, "%02X", frame.data.uint8[c]);
+        Logger::console("%s", line);
+    }
+}
+
+bool Recorder::startExport(RecorderCursor &cursor, uint32_t seconds)
+{
+    if (!partition || oldestSequence == 0) return false;
+    flush();
+
+    uint64_t window = seconds * 1000000ull;
+    cursor.from = (seconds && lastTime > window) ? lastTime - window : 0;
+    cursor.endSequence = blockSequence;
+    cursor.endOffset = blockOpen ? blockOffset : RECORDER_SECTOR_SIZE;
+    cursor.endChunk = head.load(std::memory_order_relaxed);
+    rewind(cursor);
+    return true;
+}
+
+void Recorder::rewind(RecorderCursor &cursor)
+{
+    cursor.active = true;
+    cursor.sequence = findBlock(cursor.from);
+    cursor.offset = 0;
+    cursor.time = 0;
+    cursor.frames = 0;
+    cursor.length = cursor.pos = 0;
+}
+
+bool Recorder::startDump(uint32_t seconds)
+{
+    if (!startExport(dumpCursor, seconds))
+    {
+        Logger::console("Nothing has been recorded");
+        return false;
+    }
+    return true;
+}
+
+//last block starting at or before the time, binary searched in the index
+uint32_t Recorder::findBlock(uint64_t time)
+{
+    uint32_t low = oldestSequence;
+    uint32_t high = blockSequence;
+
+    while (low != high)
+    {
+        uint32_t mid = low + (high - low + 1) / 2;
+        if (index[mid % sectors].startTime <= time) low = mid;
+        else high = mid - 1;
+    }
+    return low;
+}
+
+/*
+ * Read the cursor's next frame. Chunks that don't read back complete and
+ * blocks whose header doesn't are skipped, as are blocks new frames have
+ * taken over since the export started.
+ */
+Recorder::ReadResult Recorder::next(RecorderCursor &cursor, CAN_FRAME &frame, uint64_t &time)
+{
+    BlockHeader header;
+    uint16_t length;
+
+    while (cursor.active)
+    {
+        if (cursor.pos < cursor.length)
+        {
+            //the rest of a chunk that doesn't decode is left out
+            if (!decode(cursor, frame)) cursor.pos = cursor.length;
+            else if (cursor.time >= cursor.from)
+            {
+                time = cursor.time;
+                cursor.frames++;
+                return Frame;
+            }
+            continue;
+        }
+
+        if ((int32_t)(cursor.sequence - cursor.endSequence) > 0 ||
+            (cursor.sequence == cursor.endSequence && cursor.offset >= cursor.endOffset)) break;
+
+        //chunks queued before the export started may not be in flash yet
+        bool queued = (int32_t)(cursor.endChunk - tail.load(std::memory_order_acquire)) > 0;
+        uint32_t sectorOffset = RECORDER_OFFSET + (cursor.sequence % sectors) * RECORDER_SECTOR_SIZE;
+        if (cursor.offset == 0)
+        {
+            if (!readHeader(cursor.sequence, header))
+            {
+                if (queued) return Wait;
+                nextBlock(cursor);
+                continue;
+            }
+            cursor.time = header.startTime;
+            cursor.keptCount = 0;
+            cursor.offset = sizeof(BlockHeader);
+        }
+
+        if (cursor.offset + 2 > RECORDER_SECTOR_SIZE ||
+            esp_partition_read(partition, sectorOffset + cursor.offset, &length, 2) != ESP_OK) length = 0;
+        if (length == 0xFFFF)
+        {
+            if (queued) return Wait;
+            nextBlock(cursor);
+            continue;
+        }
+        if (length == 0 || length > RECORDER_CHUNK_SIZE || cursor.offset + 2 + length > RECORDER_SECTOR_SIZE ||
+            esp_partition_read(partition, sectorOffset + cursor.offset + 2, cursor.data, length) != ESP_OK ||
+            !readHeader(cursor.sequence, header)) //erased for new frames while it was read
+        {
+            nextBlock(cursor);
+            continue;
+        }
+        cursor.pos = 0;
+        cursor.length = length;
+        cursor.offset = (cursor.offset + 2 + length + 3) & ~3;
+    }
+    cursor.active = false;
+    return Done;
+}
+
+void Recorder::nextBlock(RecorderCursor &cursor)
+{
+    cursor.sequence++;
+    if ((int32_t)(oldestSequence - cursor.sequence) > 0) cursor.sequence = oldestSequence;
+    cursor.offset = 0;
+    cursor.length = cursor.pos = 0;
+}
+
+bool Recorder::readHeader(uint32_t sequence, BlockHeader &header)
+{
+    uint32_t offset = RECORDER_OFFSET + (sequence % sectors) * RECORDER_SECTOR_SIZE;
+    if (esp_partition_read(partition, offset, &header, sizeof(header)) != ESP_OK) return false;
+    return header.magic == RECORDER_MAGIC && header.sequence == sequence &&
+           SettingsStore::crc32(0, (uint8_t *)&header, offsetof(BlockHeader, crc)) == header.crc;
+}
+
+//the record at the cursor, false if it runs past the chunk or refers to a frame that wasn't kept
+bool Recorder::decode(RecorderCursor &cursor, CAN_FRAME &frame)
+{
+    const uint8_t *data = cursor.data;
+    int pos = cursor.pos;
+    int end = cursor.length;
+    uint8_t header = data[pos++];
+    uint8_t length = header & 0x0F;
+    uint64_t delta = 0;
+    uint32_t id;
+    uint8_t in;
+
+    if (length > 8) return false;
+    for (int shift = 0; ; shift += 7)
+    {
+        if (pos >= end || shift > 63) return false;
+        in = data[pos++];
+        delta |= (uint64_t)(in & 0x7F) << shift;
+        if (!(in & 0x80)) break;
+    }
+
+    frame.rtr = (header & RECORD_RTR) ? 1 : 0;
+    frame.length = length;
+    if (header & RECORD_DELTA)
+    {
+        if (pos + 2 > end || data[pos] >= cursor.keptCount) return false;
+        auto &kept = cursor.kept[data[pos++]];
+        uint8_t mask = data[pos++];
+        for (int i = 0; i < length; i++)
+        {
+            if (!(mask & (1 << i))) continue;
+            if (pos >= end) return false;
+            kept.data[i] = data[pos++];
+        }
+        kept.length = length;
+        id = kept.id;
+        memcpy(frame.data.bytes, kept.data, 8);
+    }
+    else
+    {
+        int idLength = (header & RECORD_EXTENDED) ? 4 : 2;
+        int dataLength = frame.rtr ? 0 : length;
+        if (pos + idLength + dataLength > end) return false;
+        id = data[pos] | (data[pos + 1] << 8);
+        if (idLength == 4) id |= (data[pos + 2] << 16) | ((uint32_t)data[pos + 3] << 24) | 0x80000000ul;
+        pos += idLength;
+        frame.data.value = 0;
+        memcpy(frame.data.bytes, &data[pos], dataLength);
+        pos += dataLength;
+        if (header & RECORD_KEEP)
+        {
+            if (cursor.keptCount >= RECORDER_MAX_KEPT) return false;
+            auto &kept = cursor.kept[cursor.keptCount++];
+            kept.id = id;
+            kept.length = length;
+            memcpy(kept.data, frame.data.bytes, 8);
+        }
+    }
+    frame.extended = (id >> 31) != 0;
+    frame.id = id & 0x1FFFFFFF;
+    cursor.time += delta;
+    cursor.pos = pos;
+    return true;
+}
+
+void Recorder::getStats(RecorderStats &stats)
+{
+    stats.sectors = sectors;
+    stats.session = session;
+    stats.blocks = oldestSequence ? blockSequence - oldestSequence + 1 : 0;
+    stats.oldestTime = oldestSequence ? index[oldestSequence % sectors].startTime : 0;
+    stats.newestTime = lastTime;
+    stats.frames = frames;
+    stats.drops = drops;
+    stats.recordBytes = recordBytes;
+    stats.flashBytes = flashBytes.load(std::memory_order_relaxed);
+    stats.erases = erases.load(std::memory_order_relaxed);
+    stats.recordingMillis = frames ? millis() - firstMillis : 0;
+}
+
+/*
+ * What the log holds, how fast it is written and what that comes to for the
+ * flash: every sector is erased once per trip around the partition, so at
+ * the current rate the rated erase cycles last this many trips.
+ */
+void Recorder::printAll()
+{
+    RecorderStats stats;
+
+    getStats(stats);
+    if (!partition)
+    {
+        Logger::console("The flight recorder has no partition to write to");
+        return;
+    }
+    Logger::console("Flight recorder %s, %i sectors of '%s', session %i", settings.recordFrames ? "on" : "off",
+                    stats.sectors, RECORDER_PARTITION, stats.session);
+    Logger::console("Holds %fs in %i blocks", (float)(stats.newestTime - stats.oldestTime) / 1000000, stats.blocks);
+    Logger::console("%i frames recorded, %i dropped, %f bytes per frame", stats.frames, stats.drops,
+                    stats.frames ? (float)stats.recordBytes / stats.frames : 0.0f);
+    if (stats.recordingMillis >= 1000 && stats.flashBytes)
+    {
+        float rate = stats.flashBytes * 1000.0f / stats.recordingMillis;
+        float tripSeconds = stats.sectors * RECORDER_SECTOR_SIZE / rate;
+        Logger::console("Writing %fKB/s, %i sector erases. Each sector is erased every %fs, %i cycles last %f days",
+                        rate / 1024, stats.erases, tripSeconds, RECORDER_FLASH_CYCLES, tripSeconds * RECORDER_FLASH_CYCLES / 86400);
+    }
+    Logger::console("Chunk writes take up to %ius (99%% within %ius), sector erases up to %ius", recorderWriteTime.getMax(),
+                    recorderWriteTime.getPercentile(99), recorderEraseTime.getMax());
+}
+
+void Recorder::writeChunk(Chunk &chunk)
+{
+    uint32_t offset = RECORDER_OFFSET + (chunk.sequence % sectors) * RECORDER_SECTOR_SIZE;
+    uint32_t start = micros();
+    bool written = true;
+
+    if (chunk.opensBlock)
+    {
+        esp_partition_erase_range(partition, offset, RECORDER_SECTOR_SIZE);
+        recorderEraseTime.record(micros() - start);
+        erases.fetch_add(1, std::memory_order_relaxed);
+        recorderErases.inc();
+        start = micros();
+        written = esp_partition_write(partition, offset, &chunk.header, sizeof(BlockHeader)) == ESP_OK;
+        flashBytes.fetch_add(sizeof(BlockHeader), std::memory_order_relaxed);
+        recorderFlashBytes.inc(sizeof(BlockHeader));
+    }
+    //records first so the chunk can't look complete before all of it is there
+    written = written && esp_partition_write(partition, offset + chunk.offset + 2, chunk.data, chunk.length) == ESP_OK &&
+              esp_partition_write(partition, offset + chunk.offset, &chunk.length, 2) == ESP_OK;
+    recorderWriteTime.record(micros() - start);
+    flashBytes.fetch_add(2 + chunk.length, std::memory_order_relaxed);
+    recorderFlashBytes.inc(2 + chunk.length);
+    if (!written) Logger::error("Could not write recorded frames to flash");
+}
+
+//writes the chunks loop() hands over, erasing each block's sector as it is opened
+void Recorder::writerTask(void *param)
+{
+    Recorder *recorder = (Recorder *)param;
+
+    for (;;)
+    {
+        uint32_t next = recorder->tail.load(std::memory_order_relaxed);
+        if (next == recorder->head.load(std::memory_order_acquire))
+        {
+            vTaskDelay(10 / portTICK_PERIOD_MS);
+            continue;
+        }
+        recorder->writeChunk(recorder->chunks[next % RECORDER_CHUNKS]);
+        recorder->tail.store(next + 1, std::memory_order_release);
+    }
+}
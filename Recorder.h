@@ -0,0 +1,198 @@
+/*
+ * Recorder.h
+ *
+ * Flight recorder: every received frame is kept in a circular log in flash so
+ * there is data to look at when a fault shows up with nothing attached.
+ *
+ * The log is a run of blocks, one per flash sector, used round robin. A block
+ * starts with a BlockHeader and holds chunks, each a 16 bit length followed by
+ * records. The length is written after the records, so a chunk a reset cut
+ * short still reads as erased flash and is skipped. A record is:
+ *
+ *   header byte   bits 0-3 DLC, bit 4 29 bit ID, bit 5 RTR, bit 6 delta, bit 7 keep
+ *   time          microseconds since the record before as a LEB128 varint, the
+ *                 first record of a block is at the block's start time
+ *   full record   the ID in 2 (11 bit) or 4 (29 bit) little endian bytes, then the data
+ *   delta record  the index of a frame kept earlier in the block, a mask byte with
+ *                 a bit per data byte that differs from it, then just those bytes
+ *
+ * A full record with the keep bit becomes the next kept frame of its block,
+ * a delta record replaces the kept frame it refers to. Nothing refers to
+ * another block, so every block decodes on its own once its header is read.
+ *
+ * Time is recording time: microseconds that carry on across restarts, a new
+ * session starting a second after the last frame recorded before it. The
+ * start time of every block is kept in RAM, which is all finding the start of
+ * an export window takes.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef RECORDER_H_
+#define RECORDER_H_
+
+#include <Arduino.h>
+#include <atomic>
+#include "config.h"
+#include <esp32_can.h>
+#include <esp_partition.h>
+
+#define RECORDER_SECTOR_SIZE    4096
+
+struct RecorderStats {
+    uint32_t sectors;       //blocks the log has room for, 0 if there is no partition
+    uint32_t session;
+    uint32_t blocks;        //blocks holding recorded frames
+    uint64_t oldestTime;    //recording time the oldest block starts at
+    uint64_t newestTime;    //of the last frame recorded
+    uint32_t frames;        //recorded since startup
+    uint32_t drops;         //left out because the writer task fell behind
+    uint32_t recordBytes;   //records encoded since startup
+    uint32_t flashBytes;    //written to flash since startup, headers and chunk lengths included
+    uint32_t erases;
+    uint32_t recordingMillis; //since the first frame this session, what the write rate is over
+};
+
+//where an export is and the frames kept in the block it is in. Big enough to keep off the stack
+struct RecorderCursor {
+    bool active;
+    uint32_t sequence;      //block being read
+    uint16_t offset;        //of the next chunk in it, 0 before the header is read
+    uint32_t endSequence;   //where recording stood when the export started
+    uint16_t endOffset;
+    uint32_t endChunk;      //chunks handed to the writer by then
+    uint64_t from;          //records before this recording time are skipped
+    uint64_t time;          //of the last record read
+    uint32_t frames;        //handed out so far
+    uint16_t length;        //of the chunk in data
+    uint16_t pos;
+    uint8_t data[RECORDER_CHUNK_SIZE];
+    int keptCount;
+    struct {
+        uint32_t id;        //bit 31 set for a 29 bit ID
+        uint8_t length;
+        uint8_t data[8];
+    } kept[256];
+};
+
+class Recorder {
+public:
+    enum ReadResult {
+        Frame, Wait, Done
+    };
+
+    Recorder();
+    //finds the blocks already in flash and starts the writer task. Calling it again starts over
+    //from what is in flash, the way a restart would
+    void setup();
+    //entry is the frame's FrameTable entry, only frames with one are delta encoded
+    void processFrame(CAN_FRAME &frame, int entry);
+    //hands a chunk that waited RECORDER_FLUSH_MS to the writer and prints the console export
+    void loop();
+    //queues what has been recorded so far for writing
+    void flush();
+    //positions the cursor at the frames of the last seconds of the recording, 0 for all of it.
+    //Returns false if nothing has been recorded
+    bool startExport(RecorderCursor &cursor, uint32_t seconds);
+    //back to the start of the window, which still ends where it did
+    void rewind(RecorderCursor &cursor);
+    //Wait if the next frame is still on its way to flash
+    ReadResult next(RecorderCursor &cursor, CAN_FRAME &frame, uint64_t &time);
+    //prints the frames of the last seconds in candump -L format, a few lines per loop()
+    bool startDump(uint32_t seconds);
+    void getStats(RecorderStats &stats);
+    void printAll();
+
+private:
+    struct BlockHeader {
+        uint32_t magic;
+        uint32_t sequence;  //sector = sequence % sectors
+        uint64_t startTime; //recording time of the first record
+        uint16_t session;
+        uint16_t reserved;
+        uint32_t crc;       //CRC32 of the fields above
+    };
+
+    //records on their way to flash. The first chunk of a block also has the block erased and its header written
+    struct Chunk {
+        BlockHeader header;
+        uint32_t sequence;
+        uint16_t offset;
+        uint16_t length;
+        bool opensBlock;
+        uint8_t data[RECORDER_CHUNK_SIZE];
+    };
+
+    //the frame of a FrameTable entry that delta records of the current block refer to
+    struct Base {
+        uint32_t block;     //sequence of the block it was kept in
+        uint32_t id;
+        uint8_t index;
+        uint8_t data[8];
+    };
+
+    struct IndexEntry {
+        uint64_t startTime; //blocks that didn't read back valid carry the start time of the one before
+        uint32_t sequence;
+        bool valid;
+    };
+
+    const esp_partition_t *partition;
+    uint32_t sectors;
+    IndexEntry index[RECORDER_MAX_SECTORS];
+    uint32_t oldestSequence;    //0 while nothing has been recorded
+    uint32_t blockSequence;     //block being filled, or the newest one found in flash
+    uint16_t blockOffset;       //where its next chunk goes
+    bool blockOpen;
+    uint16_t session;
+    int keptCount;              //frames kept in the current block so far
+    Base bases[FRAME_TABLE_SIZE];
+    uint64_t now;               //recording time
+    uint32_t lastStamp;         //micros() value now was last advanced to
+    uint64_t lastTime;          //of the newest record
+    uint32_t firstMillis;       //when the first frame of this session was recorded, 0 before
+    uint32_t chunkMillis;       //when the chunk being filled got its first record
+    bool filling;
+    uint32_t frames;
+    uint32_t drops;
+    uint32_t recordBytes;
+    std::atomic<uint32_t> flashBytes;
+    std::atomic<uint32_t> erases;
+    Chunk chunks[RECORDER_CHUNKS];
+    std::atomic<uint32_t> head; //chunks handed to the writer
+    std::atomic<uint32_t> tail; //chunks it has written
+    TaskHandle_t taskHandle;
+    RecorderCursor dumpCursor;
+
+    void advance(uint32_t stamp);
+    bool startChunk(bool opensBlock);
+    void publish();
+    int encode(CAN_FRAME &frame, int entry, uint8_t *out);
+    bool readHeader(uint32_t sequence, BlockHeader &header);
+    void nextBlock(RecorderCursor &cursor);
+    uint32_t findBlock(uint64_t time);
+    static bool decode(RecorderCursor &cursor, CAN_FRAME &frame);
+    void writeChunk(Chunk &chunk);
+    static void writerTask(void *param);
+};
+
+#endif /* RECORDER_H_ */
@@ -35,11 +35,41 @@
 #ifndef BLUETOOTH
 #include <WiFi.h>
 #endif
-#include "EEPROM.h"
+#include "SettingsStore.h"
 #include "Logger.h"
+#include "PeriodicSender.h"
+#include "PIDPoller.h"
+#include "UDSStreamer.h"
+#include "SignalDB.h"
+#include "BusStats.h"
+#include "Recorder.h"
+#include "TriggerEngine.h"
+#include "Player.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "ELM327_Emulator.h"
+#include "BootProfile.h"
+#ifndef BLUETOOTH
+#include "OTAUpdater.h"
+#endif
 
 extern void CANHandler();
 extern void execOTA();
+extern void applyOTA();
+extern void printOTAStatus();
+extern PeriodicSender periodicSender;
+extern PIDPoller pidPoller;
+extern UDSStreamer udsStreamer;
+extern SignalDB signalDB;
+extern BusStats busStats;
+extern Recorder recorder;
+extern TriggerEngine triggerEngine;
+extern Player player;
+extern ELM327Emu elmEmulator;
+extern SettingsStore settingsStore;
+#ifndef BLUETOOTH
+extern OTAUpdater otaUpdater;
+#endif
 
 SerialConsole::SerialConsole()
 {
@@ -78,20 +108,54 @@ void SerialConsole::printMenu()
     Logger::console("CAN0SPEED=%i - Set speed of CAN0 in baud (125000, 250000, etc)", settings.CAN0Speed);
     Serial.println();
 
+    Logger::console("POLL=<pid>,<period ms>[,<priority 0-3>] - Have the device poll a Mode 01 PID (POLLSTATS lists the plan)");
+    Logger::console("POLLDEL=<pid> - Stop polling a PID");
+    Logger::console("POLLBUDGET=%i - Most requests per second the poller sends (0 = stop polling)", settings.pollBudget);
+    Logger::console("POLLID=%X - ID polls go to, 7DF for every ECU or 7E0-7E7", settings.pollRequestId);
+    Serial.println();
+
+    Logger::console("RECORD=%i - Keep a flight recording of every frame in flash (0 = off, 1 = on)", settings.recordFrames);
+    Logger::console("RECDUMP=<seconds> - Print the last seconds of the recording in candump -L format (0 = all of it)");
+    Serial.println();
+
 #ifndef BLUETOOTH
     Logger::console("SSID=%s - SSID for creating a soft AP", settings.softSSID);
     Logger::console("WPA2KEY=%s - WPA2 key to use for softAP", settings.softWPA2KEY);
     Logger::console("WIFIMODE=%i - 0 = Connect to an AP as client, 1 = Make a softAP", settings.softAPMode);
     Logger::console("CLIENTSSID=%s - SSID to connect to as a client", settings.clientSSID);
     Logger::console("CLIENTWPA2KEY=%s - WPA2 key to use when connecting to AP", settings.clientWPA2KEY);
+    Logger::console("OTAHOST=%s - Server UPDATE downloads firmware from", settings.otaHost);
+    Logger::console("OTAPORT=%i - HTTP port on that server", settings.otaPort);
+    Logger::console("OTAPATH=%s - Path of the firmware image. <path>.sha256 is checked if present", settings.otaPath);
+    Logger::console("OTARATE=%i - KB/s the firmware download may use (0 = no limit)", settings.otaRateLimit);
 #else
     Logger::console("BTNAME=%s - Name for bluetooth", settings.btName);
 #endif
     Serial.println();
 
 #ifndef BLUETOOTH
-    Logger::console("UPDATE - Get an update from S3 server (Requires you can connect to an AP)");
+    Logger::console("UPDATE - Download an update in the background (Requires you can connect to an AP)");
+    Logger::console("OTASTATUS - Show download progress and how it affects CAN latency");
+    Logger::console("OTAAPPLY - Reboot into the downloaded update");
+    Logger::console("OTACANCEL - Stop a running download");
 #endif    
+    Logger::console("PERIODIC - List periodic frames with their send jitter");
+    Logger::console("METRICS - Show frame counters, buffer high-water marks and latency histograms");
+    Logger::console("RESETMETRICS - Zero all metrics");
+    Logger::console("PIDLATENCY - Show how long each ECU takes to answer each mode/PID");
+    Logger::console("PIDVALUES - Show the latest decoded Mode 01 value from each ECU");
+    Logger::console("POLLSTATS - Show the poll plan with sample counts and intervals (POLLCLEAR empties it)");
+    Logger::console("STREAMS - Show the ECU side streams set up with stxstra and their frame rates");
+    Logger::console("SIGNALS - Show the signals defined with stxsiga and their latest values");
+    Logger::console("BUSSTATS - Show bus load and per ID frame counts, periods, DLCs and data changes (RESETBUSSTATS zeroes them)");
+    Logger::console("RECSTATUS - Show what the flight recorder holds, its flash write rate and the wear that comes to");
+    Logger::console("TRIGGERS - Show the capture triggers set with stxtrg and whether one has fired");
+    Logger::console("PLAYBACK - Show the log playback's ID filters, frame counts and timing jitter (PLAYSTOP stops it)");
+#ifdef TRACE_ENABLED
+    Logger::console("TRACE - Dump loop() trace as Chrome trace-event JSON (TRACECLEAR empties it)");
+#endif
+    Logger::console("BOOTTIME - Show when each startup stage finished");
+    Logger::console("LOGBENCH - Measure CPU cycles per log call, synchronous vs deferred (%i dropped so far)", Logger::getDroppedCount());
     Serial.println();
 }
 
@@ -122,7 +186,53 @@ void SerialConsole::handleConsoleCmd()
 #ifndef BLUETOOTH
             if (!strncmp(cmdBuffer, "UPDATE", 6)) execOTA();
             if (!strncmp(cmdBuffer, "update", 6)) execOTA();
+            if (!strncmp(cmdBuffer, "OTASTATUS", 9)) printOTAStatus();
+            if (!strncmp(cmdBuffer, "otastatus", 9)) printOTAStatus();
+            if (!strncmp(cmdBuffer, "OTAAPPLY", 8)) applyOTA();
+            if (!strncmp(cmdBuffer, "otaapply", 8)) applyOTA();
+            if (!strncmp(cmdBuffer, "OTACANCEL", 9)) otaUpdater.cancel();
+            if (!strncmp(cmdBuffer, "otacancel", 9)) otaUpdater.cancel();
 #endif
+            if (!strncmp(cmdBuffer, "PERIODIC", 8)) periodicSender.printStats();
+            if (!strncmp(cmdBuffer, "periodic", 8)) periodicSender.printStats();
+            if (!strncmp(cmdBuffer, "METRICS", 7)) Metric::printAll();
+            if (!strncmp(cmdBuffer, "metrics", 7)) Metric::printAll();
+            if (!strncmp(cmdBuffer, "RESETMETRICS", 12)) Metric::resetAll();
+            if (!strncmp(cmdBuffer, "resetmetrics", 12)) Metric::resetAll();
+#ifdef TRACE_ENABLED
+            if (!strncmp(cmdBuffer, "TRACECLEAR", 10)) Trace::clear();
+            else if (!strncmp(cmdBuffer, "TRACE", 5)) Trace::dump();
+            if (!strncmp(cmdBuffer, "traceclear", 10)) Trace::clear();
+            else if (!strncmp(cmdBuffer, "trace", 5)) Trace::dump();
+#endif
+            if (!strncmp(cmdBuffer, "PIDLATENCY", 10)) elmEmulator.getPIDProfiler().printAll();
+            if (!strncmp(cmdBuffer, "pidlatency", 10)) elmEmulator.getPIDProfiler().printAll();
+            if (!strncmp(cmdBuffer, "PIDVALUES", 9)) elmEmulator.getPIDDecoder().printAll();
+            if (!strncmp(cmdBuffer, "pidvalues", 9)) elmEmulator.getPIDDecoder().printAll();
+            if (!strncmp(cmdBuffer, "POLLSTATS", 9)) pidPoller.printStats();
+            if (!strncmp(cmdBuffer, "pollstats", 9)) pidPoller.printStats();
+            if (!strncmp(cmdBuffer, "POLLCLEAR", 9)) pidPoller.clear();
+            if (!strncmp(cmdBuffer, "pollclear", 9)) pidPoller.clear();
+            if (!strncmp(cmdBuffer, "STREAMS", 7)) udsStreamer.printStats();
+            if (!strncmp(cmdBuffer, "streams", 7)) udsStreamer.printStats();
+            if (!strncmp(cmdBuffer, "SIGNALS", 7)) signalDB.printAll();
+            if (!strncmp(cmdBuffer, "signals", 7)) signalDB.printAll();
+            if (!strncmp(cmdBuffer, "BUSSTATS", 8)) busStats.printAll();
+            if (!strncmp(cmdBuffer, "busstats", 8)) busStats.printAll();
+            if (!strncmp(cmdBuffer, "RESETBUSSTATS", 13)) busStats.reset();
+            if (!strncmp(cmdBuffer, "resetbusstats", 13)) busStats.reset();
+            if (!strncmp(cmdBuffer, "RECSTATUS", 9)) recorder.printAll();
+            if (!strncmp(cmdBuffer, "recstatus", 9)) recorder.printAll();
+            if (!strncmp(cmdBuffer, "TRIGGERS", 8)) triggerEngine.printAll();
+            if (!strncmp(cmdBuffer, "triggers", 8)) triggerEngine.printAll();
+            if (!strncmp(cmdBuffer, "PLAYBACK", 8)) player.printAll();
+            if (!strncmp(cmdBuffer, "playback", 8)) player.printAll();
+            if (!strncmp(cmdBuffer, "PLAYSTOP", 8)) player.stop();
+            if (!strncmp(cmdBuffer, "playstop", 8)) player.stop();
+            if (!strncmp(cmdBuffer, "BOOTTIME", 8)) BootProfile::print();
+            if (!strncmp(cmdBuffer, "boottime", 8)) BootProfile::print();
+            if (!strncmp(cmdBuffer, "LOGBENCH", 8)) Logger::benchmark();
+            if (!strncmp(cmdBuffer, "logbench", 8)) Logger::benchmark();
             boolean equalSign = false;
             for (int i = 0; i < ptrBuffer; i++) if (cmdBuffer[i] == '=') equalSign = true;
             if (equalSign) handleConfigCmd();
@@ -143,8 +253,7 @@ void SerialConsole::handleShortCmd()
         printMenu();
         break;
     case 'R': //reset to factory defaults.
-        settings.version = 0xFF;
-        EEPROM.writeBytes(0, &settings, sizeof(settings));
+        settingsStore.storeDefaults();
         Logger::console("Power cycle to reset to factory defaults");
         break;        
     }
@@ -240,6 +349,55 @@ void SerialConsole::handleConfigCmd()
         Logger::console("Setting client WPA2 Key to %s", newString);
         strncpy(settings.clientWPA2KEY, newString, 32);
         writeEEPROM = true;
+    } else if (cmdString == String("OTAHOST")) {
+        Logger::console("Setting OTA host to %s", newString);
+        strncpy(settings.otaHost, newString, 63);
+        writeEEPROM = true;
+    } else if (cmdString == String("OTAPORT")) {
+        if (newValue > 0 && newValue <= 65535) {
+            Logger::console("Setting OTA port to %i", newValue);
+            settings.otaPort = newValue;
+            writeEEPROM = true;
+        } else Logger::console("Invalid port! Enter a value 1 - 65535");
+    } else if (cmdString == String("OTAPATH")) {
+        if (newString[0] == '/') {
+            Logger::console("Setting OTA path to %s", newString);
+            strncpy(settings.otaPath, newString, 95);
+            writeEEPROM = true;
+        } else Logger::console("The path has to start with /");
+    } else if (cmdString == String("OTARATE")) {
+        if (newValue >= 0 && newValue <= 65535) {
+            Logger::console("Setting OTA rate limit to %iKB/s", newValue);
+            settings.otaRateLimit = newValue;
+            writeEEPROM = true;
+        } else Logger::console("Invalid rate! Enter a value 0 - 65535");
+    } else if (cmdString == String("POLL")) {
+        char *pid = strtok(newString, ",");
+        char *period = strtok(NULL, ",");
+        char *priority = strtok(NULL, ",");
+        if (period && pidPoller.setPID(strtoul(pid, 0, 16), strtoul(period, 0, 10), priority ? atoi(priority) : 1))
+            Logger::console("Polling PID %X every %sms", strtoul(pid, 0, 16), period);
+        else Logger::console("Invalid PID or period! Enter a Mode 01 PID in hex and at least %ims", POLL_MIN_PERIOD);
+    } else if (cmdString == String("POLLDEL")) {
+        if (pidPoller.removePID(strtoul(newString, 0, 16))) Logger::console("Stopped polling PID %s", newString);
+        else Logger::console("PID %s isn't in the poll plan", newString);
+    } else if (cmdString == String("POLLBUDGET")) {
+        if (newValue >= 0 && newValue <= 255) {
+            Logger::console("Setting poll budget to %i requests per second", newValue);
+            pidPoller.setBudget(newValue);
+        } else Logger::console("Invalid budget! Enter a value 0 - 255");
+    } else if (cmdString == String("POLLID")) {
+        if (pidPoller.setRequestId(strtoul(newString, 0, 16))) Logger::console("Sending polls to %X", settings.pollRequestId);
+        else Logger::console("Invalid ID! Enter 7DF or 7E0 - 7E7");
+    } else if (cmdString == String("RECORD")) {
+        if (newValue >= 0 && newValue <= 1) {
+            Logger::console("Setting flight recording to %i", newValue);
+            settings.recordFrames = newValue;
+            writeEEPROM = true;
+        } else Logger::console("Invalid setting! Enter a value 0 - 1");
+    } else if (cmdString == String("RECDUMP")) {
+        if (newValue >= 0 && newValue <= 65535) recorder.startDump(newValue);
+        else Logger::console("Invalid window! Enter a value 0 - 65535 seconds");
     } else if (cmdString == String("BTNAME")) {
         Logger::console("Setting bluetooth name to %s", newString);
         strncpy(settings.btName, newString, 32);
@@ -250,6 +408,7 @@ void SerialConsole::handleConfigCmd()
             Logger::setLoglevel(Logger::Debug);
             settings.logLevel = 0;
             Logger::console("setting loglevel to 'debug'");
+            if (LOG_MIN_LEVEL > Logger::Debug) Logger::console("Debug output isn't compiled into this build, see LOG_MIN_LEVEL");
             writeEEPROM = true;
             break;
         case 1:
@@ -280,13 +439,10 @@ void SerialConsole::handleConfigCmd()
     } else {
         Logger::console("Unknown command");
     }
-    if (writeEEPROM) {
-        EEPROM.writeBytes(0, &settings, sizeof(settings));
-        EEPROM.commit();
-    }
+    if (writeEEPROM) settingsStore.markDirty();
     if (needReboot)
     {
-        delay(1000); //let EEPROM write settle
+        settingsStore.commitNow();
 #ifndef BLUETOOTH
         if (settings.softAPMode) WiFi.softAPdisconnect();
         else WiFi.disconnect();
@@ -0,0 +1,389 @@
+/*
+ * SettingsStore.cpp
+ *
+ * Persists the global settings struct. Changes are only marked dirty by the code
+ * that makes them. A background task writes them out once they have stopped
+ * changing for SETTINGS_COMMIT_DELAY milliseconds. Every write goes to the next
+ * slot of a flash partition so a sector is only erased once per lap around it.
+ * Each record carries a CRC and the layout version it was written with so older
+ * records can be migrated instead of thrown away.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "SettingsStore.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "EEPROM.h"
+
+#define SETTINGS_MAGIC          0x54455341 //"ASET" in memory order
+#define SETTINGS_SECTOR_SIZE    4096
+
+MetricHistogram settingsCommitTime("settings.commit_us");
+MetricCounter settingsCommits("settings.commits");
+MetricCounter settingsErases("settings.erases");
+
+SettingsStore::SettingsStore()
+{
+    partition = NULL;
+    slotCount = 0;
+    currSlot = -1;
+    sequence = 0;
+    generation = 0;
+    committedGeneration = 0;
+    lastChange = 0;
+    lastCommitMicros = 0;
+    writeLock = NULL;
+}
+
+/*
+ * Find the newest valid record and load it into settings, migrating it if it
+ * was written by an older layout. If there is no record yet, the ones older
+ * builds kept in the 'eeprom' partition are looked at, and after them the raw
+ * struct older firmware wrote through the EEPROM library. Anything that had to
+ * be migrated, moved or defaulted is written back in the background. Also
+ * starts the task that does the writing.
+ */
+SettingsStore::LoadResult SettingsStore::begin()
+{
+    RecordHeader header;
+    uint8_t payload[SLOT_SIZE - sizeof(RecordHeader)];
+    LoadResult result = Defaults;
+    bool haveEEPROM = false;
+
+    writeLock = xSemaphoreCreateMutex();
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, SETTINGS_PARTITION);
+    if (partition && partition->size >= SETTINGS_OFFSET + 2 * SETTINGS_SECTOR_SIZE)
+    {
+        //two sectors so one always holds the current record while the other is erased
+        slotCount = 2 * SLOTS_PER_SECTOR;
+    }
+    else
+    {
+        //no room in this partition table. Keep a single record in the EEPROM emulation
+        Logger::console("No room for settings in a '%s' partition, they are stored without wear leveling", SETTINGS_PARTITION);
+        partition = NULL;
+        haveEEPROM = EEPROM.begin(1024);
+        slotCount = haveEEPROM ? 1 : 0;
+    }
+    currSlot = findNewest(partition, SETTINGS_OFFSET, slotCount, sequence);
+
+    getDefaults(settings);
+    if (currSlot != -1)
+    {
+        readRecord(partition, partition ? slotOffset(SETTINGS_OFFSET, currSlot) : 0, header, payload);
+        if (migrate(header.version, payload, header.length))
+        {
+            result = (header.version == EEPROM_VER) ? Loaded : Migrated;
+        }
+    }
+    else
+    {
+        const esp_partition_t *old = partition ? esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, SETTINGS_OLD_PARTITION) : NULL;
+        uint32_t oldSequence;
+        int32_t oldSlot = old ? findNewest(old, 0, (old->size / SETTINGS_SECTOR_SIZE) * SLOTS_PER_SECTOR, oldSequence) : -1;
+
+        if (oldSlot != -1)
+        {
+            readRecord(old, slotOffset(0, oldSlot), header, payload);
+            if (migrate(header.version, payload, header.length)) result = Migrated;
+        }
+        else if (haveEEPROM || EEPROM.begin(1024))
+        {
+            EEPROMSettings legacy;
+            EEPROM.readBytes(0, &legacy, sizeof(legacy));
+            if (migrate(legacy.version, (uint8_t *)&legacy, sizeof(legacy))) result = Migrated;
+        }
+    }
+    sanitize();
+
+    if (result != Loaded) markDirty();
+    xTaskCreatePinnedToCore(storeTask, "Settings", 4096, this, 1, NULL, 0);
+    return result;
+}
+
+/*
+ * Note that settings changed. This is all the code changing settings pays for;
+ * the write happens later in the background.
+ */
+void SettingsStore::markDirty()
+{
+    lastChange = millis();
+    generation++;
+}
+
+/*
+ * Write any pending change right away, for instance before a reboot.
+ */
+void SettingsStore::commitNow()
+{
+    commit(true);
+}
+
+/*
+ * Write the factory defaults to flash without touching the settings in use.
+ * They take over at the next boot, unless settings change again before that.
+ */
+void SettingsStore::storeDefaults()
+{
+    EEPROMSettings defaults;
+    getDefaults(defaults);
+
+    xSemaphoreTake(writeLock, portMAX_DELAY);
+    if (writeRecord(defaults)) committedGeneration = generation;
+    xSemaphoreGive(writeLock);
+}
+
+void SettingsStore::getDefaults(EEPROMSettings &settings)
+{
+    memset(&settings, 0, sizeof(settings));
+    settings.version = EEPROM_VER;
+    settings.CAN0Speed = 500000;
+    settings.CAN0_Enabled = true;
+    settings.valid = 0; //not used, records are checked by CRC
+    settings.logLevel = 1; //info instead of debug
+    strcpy(settings.softSSID, "MACCHINAOBD2");
+    settings.softWPA2KEY[0] = 0; //no password by default
+    settings.softAPMode = 1; //create an AP by default
+    settings.wifiChannel = 13;
+    settings.wifiTxPower = 78; //19.5dB tx power - the max. Values are in quarter dB
+    strcpy(settings.clientSSID, "YOURAP");
+    strcpy(settings.clientWPA2KEY, "Password");
+    strcpy(settings.btName, "MACCHINAOBDII");
+    strcpy(settings.otaHost, "www.macchina.cc");
+    strcpy(settings.otaPath, "/Macchina_A0_OBDII.ino.esp32.bin");
+    settings.otaPort = 80; //plain HTTP, the image is checked by SHA-256 instead
+    settings.otaRateLimit = 64;
+    settings.pollRequestId = 0x7E0;
+    settings.pollBudget = POLL_DEFAULT_BUDGET;
+    settings.recordFrames = 1;
+}
+
+uint32_t SettingsStore::getSlotCount()
+{
+    return slotCount;
+}
+
+/*
+ * How long the last write took. This is the time EEPROM.commit() used to
+ * block the caller for on every change.
+ */
+uint32_t SettingsStore::getLastCommitMicros()
+{
+    return lastCommitMicros;
+}
+
+/*
+ * Write out the settings if they changed since the last write. Unless forced,
+ * waits until they have been left alone for SETTINGS_COMMIT_DELAY so a burst of
+ * console commands turns into a single write.
+ */
+void SettingsStore::commit(bool force)
+{
+    if (generation == committedGeneration) return;
+    if (!force && (millis() - lastChange) < SETTINGS_COMMIT_DELAY) return;
+
+    xSemaphoreTake(writeLock, portMAX_DELAY);
+    uint32_t gen = generation;
+    if (gen != committedGeneration)
+    {
+        EEPROMSettings snapshot = settings;
+        if (writeRecord(snapshot)) committedGeneration = gen;
+    }
+    xSemaphoreGive(writeLock);
+}
+
+uint32_t SettingsStore::slotOffset(uint32_t base, uint32_t slot)
+{
+    return base + (slot / SLOTS_PER_SECTOR) * SETTINGS_SECTOR_SIZE + (slot % SLOTS_PER_SECTOR) * SLOT_SIZE;
+}
+
+/*
+ * The slot of the valid record with the highest sequence, or -1 if there is
+ * none. Without a partition the single record in the EEPROM emulation is read.
+ */
+int32_t SettingsStore::findNewest(const esp_partition_t *part, uint32_t base, uint32_t slots, uint32_t &sequence)
+{
+    RecordHeader header;
+    uint8_t payload[SLOT_SIZE - sizeof(RecordHeader)];
+    int32_t newest = -1;
+
+    for (uint32_t slot = 0; slot < slots; slot++)
+    {
+        if (!readRecord(part, part ? slotOffset(base, slot) : 0, header, payload)) continue;
+        if (newest == -1 || (int32_t)(header.sequence - sequence) > 0)
+        {
+            newest = slot;
+            sequence = header.sequence;
+        }
+    }
+    return newest;
+}
+
+bool SettingsStore::readRecord(const esp_partition_t *part, uint32_t offset, RecordHeader &header, uint8_t *payload)
+{
+    if (part)
+    {
+        if (esp_partition_read(part, offset, &header, sizeof(header)) != ESP_OK) return false;
+    }
+    else EEPROM.readBytes(offset, &header, sizeof(header));
+
+    if (header.magic != SETTINGS_MAGIC || header.length > SLOT_SIZE - sizeof(RecordHeader)) return false;
+
+    if (part)
+    {
+        if (esp_partition_read(part, offset + sizeof(header), payload, header.length) != ESP_OK) return false;
+    }
+    else EEPROM.readBytes(offset + sizeof(header), payload, header.length);
+
+    uint32_t crc = crc32(0, (uint8_t *)&header, offsetof(RecordHeader, crc));
+    return crc32(crc, payload, header.length) == header.crc;
+}
+
+/*
+ * Append a record in the slot after the current one. A sector is only erased
+ * when its first slot comes up, which is when the current record sits in the
+ * other one, so a reset during the erase or the write still leaves it to boot
+ * from. Every write is read back. If a slot doesn't verify (say a write was cut
+ * off by a reset and left bits programmed) the record moves on to the next slot.
+ */
+bool SettingsStore::writeRecord(EEPROMSettings &snapshot)
+{
+    RecordHeader header;
+    RecordHeader check;
+    uint8_t payload[SLOT_SIZE - sizeof(RecordHeader)];
+    uint32_t start = micros();
+
+    if (slotCount == 0) return false;
+
+    header.magic = SETTINGS_MAGIC;
+    header.sequence = sequence + 1;
+    header.version = EEPROM_VER;
+    header.length = sizeof(EEPROMSettings);
+    header.crc = crc32(crc32(0, (uint8_t *)&header, offsetof(RecordHeader, crc)), (uint8_t *)&snapshot, sizeof(snapshot));
+
+    for (uint32_t attempt = 0; attempt < slotCount; attempt++)
+    {
+        uint32_t slot = (currSlot + 1 + attempt) % slotCount;
+        bool written;
+
+        if (partition)
+        {
+            uint32_t offset = slotOffset(SETTINGS_OFFSET, slot);
+            if (slot % SLOTS_PER_SECTOR == 0)
+            {
+                //only reached when every slot in the other sector failed to verify. Keep the current record
+                if (currSlot != -1 && slot / SLOTS_PER_SECTOR == currSlot / SLOTS_PER_SECTOR) continue;
+                esp_partition_erase_range(partition, offset, SETTINGS_SECTOR_SIZE);
+                settingsErases.inc();
+            }
+            //payload first so a record can't look valid before all of it is there
+            written = esp_partition_write(partition, offset + sizeof(header), &snapshot, sizeof(snapshot)) == ESP_OK &&
+                      esp_partition_write(partition, offset, &header, sizeof(header)) == ESP_OK;
+        }
+        else
+        {
+            EEPROM.writeBytes(0, &header, sizeof(header));
+            EEPROM.writeBytes(sizeof(header), &snapshot, sizeof(snapshot));
+            written = EEPROM.commit();
+        }
+
+        if (written && readRecord(partition, partition ? slotOffset(SETTINGS_OFFSET, slot) : 0, check, payload) && check.sequence == header.sequence)
+        {
+            currSlot = slot;
+            sequence = header.sequence;
+            lastCommitMicros = micros() - start;
+            settingsCommitTime.record(lastCommitMicros);
+            settingsCommits.inc();
+            return true;
+        }
+    }
+    Logger::error("Could not write settings to flash");
+    return false;
+}
+
+/*
+ * Load a stored payload into settings, which already hold the defaults.
+ * Fields are only ever appended to EEPROMSettings, so a record from an older
+ * layout carries over its common prefix and newer fields keep their defaults.
+ * Add a case here if a change ever needs more than that.
+ */
+bool SettingsStore::migrate(uint16_t version, uint8_t *payload, uint16_t length)
+{
+    if (version < EEPROM_OLDEST_VER || version > EEPROM_VER) return false;
+
+    //0x24 ended with wifiTxPower. Its trailing padding would land on the start of otaHost
+    if (version == 0x24 && length > offsetof(EEPROMSettings, otaHost)) length = offsetof(EEPROMSettings, otaHost);
+    //likewise 0x25 padding after otaPort is where otaRateLimit sits now
+    if (version == 0x25 && length > offsetof(EEPROMSettings, otaRateLimit)) length = offsetof(EEPROMSettings, otaRateLimit);
+    if (version == 0x26 && length > offsetof(EEPROMSettings, pollPlan)) length = offsetof(EEPROMSettings, pollPlan);
+    if (version == 0x27 && length > offsetof(EEPROMSettings, recordFrames)) length = offsetof(EEPROMSettings, recordFrames);
+
+    memcpy(&settings, payload, (length < sizeof(settings)) ? length : sizeof(settings));
+    settings.version = EEPROM_VER;
+    return true;
+}
+
+void SettingsStore::sanitize()
+{
+    if (settings.wifiChannel > 15 || settings.wifiChannel < 1) settings.wifiChannel = 13;
+    if (settings.wifiTxPower < 8 || settings.wifiTxPower > 78) settings.wifiTxPower = 78;
+    if (settings.logLevel > 4) settings.logLevel = 1;
+    settings.softSSID[32] = 0;
+    settings.softWPA2KEY[32] = 0;
+    settings.clientSSID[32] = 0;
+    settings.clientWPA2KEY[32] = 0;
+    settings.btName[31] = 0;
+    settings.otaHost[63] = 0;
+    settings.otaPath[95] = 0;
+    if (settings.otaPort == 0) settings.otaPort = 80;
+    if (settings.recordFrames > 1) settings.recordFrames = 1;
+    if (settings.pollRequestId != 0x7DF && (settings.pollRequestId < 0x7E0 || settings.pollRequestId > 0x7E7)) settings.pollRequestId = 0x7E0;
+    for (int i = 0; i < POLL_MAX_PIDS; i++)
+    {
+        PollPlanEntry &entry = settings.pollPlan[i];
+        if (entry.periodMs && entry.periodMs < POLL_MIN_PERIOD) entry.periodMs = POLL_MIN_PERIOD;
+        if (entry.priority > POLL_MAX_PRIORITY) entry.priority = POLL_MAX_PRIORITY;
+    }
+}
+
+uint32_t SettingsStore::crc32(uint32_t crc, const uint8_t *data, size_t length)
+{
+    crc = ~crc;
+    while (length--)
+    {
+        crc ^= *data++;
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0xEDB88320ul & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
+
+void SettingsStore::storeTask(void *param)
+{
+    SettingsStore *store = (SettingsStore *)param;
+
+    for (;;)
+    {
+        store->commit(false);
+        vTaskDelay(100 / portTICK_PERIOD_MS);
+    }
+}
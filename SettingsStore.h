@@ -0,0 +1,95 @@
+/*
+ * SettingsStore.h
+ *
+ * Persists the global settings struct. Changes are only marked dirty by the code
+ * that makes them. A background task writes them out once they have stopped
+ * changing for SETTINGS_COMMIT_DELAY milliseconds. Every write goes to the next
+ * slot of a flash partition so a sector is only erased once per lap around it.
+ * Each record carries a CRC and the layout version it was written with so older
+ * records can be migrated instead of thrown away.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SETTINGSSTORE_H_
+#define SETTINGSSTORE_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include <esp_partition.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+class SettingsStore {
+public:
+    enum LoadResult {
+        Loaded, Migrated, Defaults
+    };
+
+    SettingsStore();
+    LoadResult begin();
+    void markDirty();
+    void commitNow();
+    void storeDefaults();
+    uint32_t getSlotCount();
+    uint32_t getLastCommitMicros();
+    //the zlib CRC32, also used by other records kept in flash
+    static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t length);
+
+private:
+    //written ahead of the settings in every slot
+    struct RecordHeader {
+        uint32_t magic;
+        uint32_t sequence;  //increments with every write, the highest valid one is current
+        uint16_t version;   //EEPROM_VER the payload was written with
+        uint16_t length;    //payload length, sizeof(EEPROMSettings) at the time
+        uint32_t crc;       //CRC32 of the header fields above plus the payload
+    };
+
+    //slots never straddle a flash sector so erasing one sector never touches the slots of another.
+    //The size is fixed so growing EEPROMSettings doesn't move where records written by older firmware live
+    static const uint32_t SLOT_SIZE = SETTINGS_SLOT_SIZE;
+    static const uint32_t SLOTS_PER_SECTOR = 4096 / SLOT_SIZE;
+    static_assert(sizeof(RecordHeader) + sizeof(EEPROMSettings) <= SETTINGS_SLOT_SIZE, "EEPROMSettings outgrew SETTINGS_SLOT_SIZE");
+
+    const esp_partition_t *partition;  //NULL when the record is kept in the EEPROM emulation instead
+    uint32_t slotCount;
+    int32_t currSlot;       //slot holding the newest record, -1 if none yet
+    uint32_t sequence;
+    volatile uint32_t generation;
+    uint32_t committedGeneration;
+    volatile uint32_t lastChange;
+    uint32_t lastCommitMicros;
+    SemaphoreHandle_t writeLock;
+
+    void commit(bool force);
+    static void getDefaults(EEPROMSettings &settings);
+    static uint32_t slotOffset(uint32_t base, uint32_t slot);
+    static int32_t findNewest(const esp_partition_t *part, uint32_t base, uint32_t slots, uint32_t &sequence);
+    static bool readRecord(const esp_partition_t *part, uint32_t offset, RecordHeader &header, uint8_t *payload);
+    bool writeRecord(EEPROMSettings &snapshot);
+    bool migrate(uint16_t version, uint8_t *payload, uint16_t length);
+    void sanitize();
+    static void storeTask(void *);
+};
+
+#endif /* SETTINGSSTORE_H_ */
@@ -0,0 +1,365 @@
+/*
+ * SignalDB.cpp
+ *
+ * Signal extraction and the signal store, see SignalDB.h
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "SignalDB.h"
+#include "SettingsStore.h"
+#include "Logger.h"
+#include "Metrics.h"
+
+MetricCounter signalFrames("signal.frames");
+
+#define SIGNAL_MAGIC        0x47495341 //"ASIG" in memory order
+#define SIGNAL_SECTOR_SIZE  4096
+
+static_assert(16 + SIGNAL_MAX * sizeof(SignalDef) <= SIGNAL_SECTOR_SIZE, "SIGNAL_MAX definitions don't fit a flash sector");
+
+SignalDB::SignalDB()
+{
+    count = 0;
+    groupCount = 0;
+    partition = NULL;
+    currSector = -1;
+    sequence = 0;
+    memset(standardIds, 0, sizeof(standardIds));
+}
+
+/*
+ * The definitions live in two sectors of SIGNAL_PARTITION that are written in
+ * turn, so a reset while saving leaves the previous set intact.
+ */
+void SignalDB::setup()
+{
+    StoreHeader header;
+
+    count = 0;
+    currSector = -1;
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, SIGNAL_PARTITION);
+    if (partition && partition->size < SIGNAL_STORE_OFFSET + 2 * SIGNAL_SECTOR_SIZE) partition = NULL;
+    if (!partition)
+    {
+        Logger::console("No '%s' partition, signal definitions are kept until reset only", SIGNAL_PARTITION);
+        compile();
+        return;
+    }
+
+    for (int sector = 0; sector < 2; sector++)
+    {
+        if (!readSector(sector, header, NULL)) continue;
+        if (currSector == -1 || (int32_t)(header.sequence - sequence) > 0)
+        {
+            currSector = sector;
+            sequence = header.sequence;
+        }
+    }
+    if (currSector != -1)
+    {
+        readSector(currSector, header, defs);
+        count = header.count;
+        for (int i = 0; i < count; i++) if (!validDef(defs[i])) count = i; //written by a build with other limits
+        Logger::info("Loaded %i signal definitions", count);
+    }
+    compile();
+}
+
+int SignalDB::add(const SignalDef &def)
+{
+    if (count >= SIGNAL_MAX || !validDef(def)) return -1;
+    defs[count] = def;
+    defs[count].name[SIGNAL_NAME_LEN - 1] = 0;
+    count++;
+    compile();
+    return count - 1;
+}
+
+void SignalDB::clear()
+{
+    count = 0;
+    compile();
+}
+
+bool SignalDB::save()
+{
+    if (!partition) return false;
+
+    StoreHeader header;
+    StoreHeader check;
+    int sector = (currSector == -1) ? 0 : 1 - currSector;
+    uint32_t offset = SIGNAL_STORE_OFFSET + sector * SIGNAL_SECTOR_SIZE;
+
+    header.magic = SIGNAL_MAGIC;
+    header.sequence = sequence + 1;
+    header.count = count;
+    header.crc = SettingsStore::crc32(SettingsStore::crc32(0, (uint8_t *)&header, offsetof(StoreHeader, crc)),
+                                      (uint8_t *)defs, count * sizeof(SignalDef));
+    esp_partition_erase_range(partition, offset, SIGNAL_SECTOR_SIZE);
+    //definitions first so a sector can't look valid before all of them are there
+    if ((count && esp_partition_write(partition, offset + sizeof(header), defs, count * sizeof(SignalDef)) != ESP_OK) ||
+        esp_partition_write(partition, offset, &header, sizeof(header)) != ESP_OK ||
+        !readSector(sector, check, NULL) || check.sequence != header.sequence)
+    {
+        Logger::error("Could not write signal definitions to flash");
+        return false;
+    }
+    currSector = sector;
+    sequence = header.sequence;
+    return true;
+}
+
+int SignalDB::getCount()
+{
+    return count;
+}
+
+bool SignalDB::getDef(int idx, SignalDef &def)
+{
+    if (idx < 0 || idx >= count) return false;
+    def = defs[idx];
+    return true;
+}
+
+bool SignalDB::getValue(int idx, SignalValue &value)
+{
+    if (idx < 0 || idx >= count) return false;
+    value = values[idx];
+    return true;
+}
+
+/*
+ * Most frames on a bus carry no signal of interest, 11 bit ones are turned
+ * away by a single bit test. The data is read into a 64 bit word once for each
+ * byte order and every kernel is then a shift and a mask.
+ */
+int SignalDB::processFrame(CAN_FRAME &frame, uint8_t *changed, int maxChanged)
+{
+    uint32_t key = frame.id;
+    if (frame.extended) key |= SIG_EXTENDED;
+    else if (!(standardIds[(frame.id & 0x7FF) >> 5] & (1ul << (frame.id & 31)))) return 0;
+
+    int lo = 0;
+    int hi = groupCount - 1;
+    const IdGroup *group = NULL;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (groups[mid].id == key)
+        {
+            group = &groups[mid];
+            break;
+        }
+        if (groups[mid].id < key) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    if (!group) return 0;
+
+    uint64_t little = 0;
+    uint64_t big = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        uint8_t byte = (i < frame.length) ? frame.data.byte[i] : 0;
+        little |= (uint64_t)byte << (8 * i);
+        big |= (uint64_t)byte << (8 * (7 - i));
+    }
+
+    signalFrames.inc();
+    uint32_t now = millis();
+    int changes = 0;
+    for (int k = group->first; k < group->first + group->count; k++)
+    {
+        const Kernel &kernel = kernels[k];
+        if (frame.length < kernel.needed) continue;
+        uint32_t raw = (uint32_t)(((kernel.flags & SIG_BIG_ENDIAN) ? big : little) >> kernel.shift) & kernel.mask;
+        SignalValue &value = values[kernel.signal];
+        bool isNew = value.updates == 0 || value.raw != raw;
+        value.raw = raw;
+        if (kernel.signBit && (raw & kernel.signBit)) raw |= ~kernel.mask;
+        value.value = (kernel.signBit ? (float)(int32_t)raw : (float)raw) * kernel.scale + kernel.offset;
+        value.millis = now;
+        value.updates++;
+        if (isNew && changes < maxChanged) changed[changes++] = kernel.signal;
+    }
+    return changes;
+}
+
+/*
+ * The plain version of what a kernel does, for a single signal.
+ */
+bool SignalDB::extract(const SignalDef &def, const uint8_t *data, int length, uint32_t &raw, float &value)
+{
+    if (!validDef(def)) return false;
+
+    uint32_t mask = (def.length == 32) ? 0xFFFFFFFFul : ((1ul << def.length) - 1);
+    int bit = def.startBit;
+    raw = 0;
+    for (int i = 0; i < def.length; i++)
+    {
+        //Intel walks up from the lsb. Motorola walks down from the msb, into the next byte's bit 7
+        int pos = (def.flags & SIG_BIG_ENDIAN) ? bit : def.startBit + (def.length - 1 - i);
+        if (pos / 8 >= length) return false;
+        uint32_t set = (data[pos / 8] >> (pos % 8)) & 1;
+        raw = (raw << 1) | set;
+        if (def.flags & SIG_BIG_ENDIAN) bit = (bit % 8 == 0) ? bit + 15 : bit - 1;
+    }
+    raw &= mask;
+    uint32_t signBit = 1ul << (def.length - 1);
+    if ((def.flags & SIG_SIGNED) && (raw & signBit)) value = (float)(int32_t)(raw | ~mask);
+    else value = (float)raw;
+    value = value * def.scale + def.offset;
+    return true;
+}
+
+/*
+ * Turns the definitions into kernels sorted by ID and rebuilds the 11 bit ID
+ * bitmap. Recorded values are forgotten, the indices may mean other signals now.
+ */
+void SignalDB::compile()
+{
+    uint8_t order[SIGNAL_MAX];
+
+    for (int i = 0; i < count; i++)
+    {
+        //insertion sort, stable so signals of one ID stay in definition order
+        int j = i;
+        while (j > 0 && defs[order[j - 1]].id > defs[i].id)
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    memset(standardIds, 0, sizeof(standardIds));
+    memset(values, 0, sizeof(values));
+    groupCount = 0;
+    for (int k = 0; k < count; k++)
+    {
+        const SignalDef &def = defs[order[k]];
+        Kernel &kernel = kernels[k];
+        kernel.signal = order[k];
+        kernel.flags = def.flags;
+        kernel.mask = (def.length == 32) ? 0xFFFFFFFFul : ((1ul << def.length) - 1);
+        kernel.signBit = (def.flags & SIG_SIGNED) ? (1ul << (def.length - 1)) : 0;
+        kernel.scale = def.scale;
+        kernel.offset = def.offset;
+        if (def.flags & SIG_BIG_ENDIAN)
+        {
+            //position of the msb in the big endian word, the signal runs down from there
+            int msb = (7 - def.startBit / 8) * 8 + def.startBit % 8;
+            kernel.shift = msb - (def.length - 1);
+            kernel.needed = 8 - kernel.shift / 8;
+        }
+        else
+        {
+            kernel.shift = def.startBit;
+            kernel.needed = (def.startBit + def.length - 1) / 8 + 1;
+        }
+
+        if (groupCount == 0 || groups[groupCount - 1].id != def.id)
+        {
+            groups[groupCount].id = def.id;
+            groups[groupCount].first = k;
+            groups[groupCount].count = 0;
+            groupCount++;
+        }
+        groups[groupCount - 1].count++;
+        if (!(def.id & SIG_EXTENDED)) standardIds[def.id >> 5] |= 1ul << (def.id & 31);
+    }
+}
+
+bool SignalDB::readSector(int sector, StoreHeader &header, SignalDef *stored)
+{
+    SignalDef buffer[SIGNAL_MAX];
+    uint32_t offset = SIGNAL_STORE_OFFSET + sector * SIGNAL_SECTOR_SIZE;
+
+    if (esp_partition_read(partition, offset, &header, sizeof(header)) != ESP_OK) return false;
+    if (header.magic != SIGNAL_MAGIC || header.count > SIGNAL_MAX) return false;
+    if (!stored) stored = buffer;
+    if (esp_partition_read(partition, offset + sizeof(header), stored, header.count * sizeof(SignalDef)) != ESP_OK) return false;
+    uint32_t crc = SettingsStore::crc32(0, (uint8_t *)&header, offsetof(StoreHeader, crc));
+    return SettingsStore::crc32(crc, (uint8_t *)stored, header.count * sizeof(SignalDef)) == header.crc;
+}
+
+bool SignalDB::validDef(const SignalDef &def)
+{
+    if (def.length < 1 || def.length > 32 || def.startBit > 63) return false;
+    if ((def.flags & SIG_SIGNED) && def.length < 2) return false;
+    if (!(def.id & SIG_EXTENDED) && def.id > 0x7FF) return false;
+    if ((def.id & ~SIG_EXTENDED) > 0x1FFFFFFF) return false;
+    if (def.flags & SIG_BIG_ENDIAN) return (7 - def.startBit / 8) * 8 + def.startBit % 8 >= def.length - 1;
+    return def.startBit + def.length <= 64;
+}
+
+void SignalDB::printAll()
+{
+    SignalValue value;
+
+    for (int i = 0; i < count; i++)
+    {
+        const SignalDef &def = defs[i];
+        getValue(i, value);
+        if (value.updates)
+            Logger::console("%i %s (%X bit %i, %i bits): %f, %i updates, %ims ago", i, def.name, def.id & ~SIG_EXTENDED,
+                            def.startBit, def.length, value.value, value.updates, millis() - value.millis);
+        else
+            Logger::console("%i %s (%X bit %i, %i bits): not seen", i, def.name, def.id & ~SIG_EXTENDED, def.startBit, def.length);
+    }
+    if (count == 0) Logger::console("No signals defined");
+}
+
+String SignalDB::defsToText(const char *lineEnding)
+{
+    String text = String();
+    char buff[100];
+
+    for (int i = 0; i < count; i++)
+    {
+        const SignalDef &def = defs[i];
+        //candump style, 3 hex digits for an 11 bit ID and 8 for a 29 bit one
+        sprintf(buff, (def.id & SIG_EXTENDED) ? "%i %08X %u %u %c%c %g %g %s" : "%i %03X %u %u %c%c %g %g %s", i,
+                (unsigned int)(def.id & ~SIG_EXTENDED), def.startBit, def.length, (def.flags & SIG_BIG_ENDIAN) ? 'b' : 'l',
+                (def.flags & SIG_SIGNED) ? 's' : 'u', def.scale, def.offset, def.name);
+        text.concat(buff);
+        text.concat(lineEnding);
+    }
+    return text;
+}
+
+String SignalDB::valuesToText(const char *lineEnding)
+{
+    String text = String();
+    char buff[80];
+    uint32_t now = millis();
+
+    for (int i = 0; i < count; i++)
+    {
+        const SignalValue &value = values[i];
+        if (!value.updates) continue;
+        sprintf(buff, "%i %s %g %X %u", i, defs[i].name, value.value, (unsigned int)value.raw, (unsigned int)(now - value.millis));
+        text.concat(buff);
+        text.concat(lineEnding);
+    }
+    return text;
+}
@@ -0,0 +1,129 @@
+/*
+ * SignalDB.h
+ *
+ * Signal definitions in the spirit of a DBC file: which bits of which CAN ID
+ * hold a value and how to scale it. The definitions are compiled into
+ * extraction kernels grouped by ID and kept in flash.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SIGNALDB_H_
+#define SIGNALDB_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include <esp32_can.h>
+#include <esp_partition.h>
+
+#define SIG_BIG_ENDIAN  1 //Motorola byte order, startBit is the most significant bit
+#define SIG_SIGNED      2 //raw value is two's complement
+
+#define SIG_EXTENDED    0x80000000ul //set in SignalDef::id for a 29 bit ID
+
+//value = raw * scale + offset. Bits are numbered like DBC files do: bit 0 is
+//the least significant bit of byte 0, bit 8 that of byte 1 and so on
+struct SignalDef {
+    uint32_t id;
+    uint16_t startBit;  //least significant bit for Intel order, most significant for Motorola
+    uint8_t length;     //1-32 bits
+    uint8_t flags;
+    float scale;
+    float offset;
+    char name[SIGNAL_NAME_LEN];
+};
+
+struct SignalValue {
+    float value;
+    uint32_t raw;
+    uint32_t millis;    //when it was last extracted, 0 if never
+    uint32_t updates;
+};
+
+class SignalDB {
+public:
+    SignalDB();
+    //reads the stored definitions and compiles them
+    void setup();
+    //returns the new signal's index or -1 if it is invalid or the table is full
+    int add(const SignalDef &def);
+    void clear();
+    //writes the definitions to flash, they are loaded again at startup
+    bool save();
+    int getCount();
+    bool getDef(int idx, SignalDef &def);
+    bool getValue(int idx, SignalValue &value);
+    //runs the kernels for the frame's ID. Fills changed with the signals whose value changed
+    //and returns how many there are
+    int processFrame(CAN_FRAME &frame, uint8_t *changed, int maxChanged);
+    static bool extract(const SignalDef &def, const uint8_t *data, int length, uint32_t &raw, float &value);
+    void printAll();
+    //one line per definition: idx id start length order scale offset name
+    String defsToText(const char *lineEnding);
+    //one line per signal: idx name value raw age ms
+    String valuesToText(const char *lineEnding);
+
+private:
+    //one signal boiled down to a shift and mask of the frame's first 8 bytes
+    struct Kernel {
+        uint32_t mask;
+        uint8_t shift;      //bit of the 64 bit word the signal ends at
+        uint8_t flags;
+        uint8_t needed;     //data bytes the frame must have for the signal to be in it
+        uint8_t signal;
+        uint32_t signBit;   //0 for unsigned signals
+        float scale;
+        float offset;
+    };
+
+    //the kernels of one ID, kept sorted by ID for a binary search
+    struct IdGroup {
+        uint32_t id;
+        uint8_t first;
+        uint8_t count;
+    };
+
+    //written ahead of the definitions in a store sector
+    struct StoreHeader {
+        uint32_t magic;
+        uint32_t sequence;  //the valid sector with the highest one is current
+        uint32_t count;
+        uint32_t crc;       //CRC32 of the fields above plus the definitions
+    };
+
+    SignalDef defs[SIGNAL_MAX];
+    SignalValue values[SIGNAL_MAX];
+    int count;
+    Kernel kernels[SIGNAL_MAX];
+    IdGroup groups[SIGNAL_MAX];
+    int groupCount;
+    uint32_t standardIds[2048 / 32]; //bit per 11 bit ID that has signals
+    const esp_partition_t *partition;
+    int currSector;     //store sector holding the current definitions, -1 if none
+    uint32_t sequence;
+
+    void compile();
+    bool readSector(int sector, StoreHeader &header, SignalDef *stored);
+    static bool validDef(const SignalDef &def);
+};
+
+#endif /* SIGNALDB_H_ */
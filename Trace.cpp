@@ -0,0 +1,86 @@
+/*
+ * Trace.cpp
+ *
+ * Cycle counter based tracing of where time goes in loop(). See Trace.h
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "Trace.h"
+
+#ifdef TRACE_ENABLED
+
+Trace::TraceEvent Trace::ring[TRACE_RING_SIZE];
+uint32_t Trace::writeIdx = 0;
+volatile bool Trace::enabled = true;
+
+/*
+ * Write the ring, oldest event first, to the serial port as Chrome trace-event JSON.
+ * Timestamps are microseconds since the oldest event. Deltas between neighbouring
+ * events are summed so the cycle counter wrapping around doesn't matter. Recording
+ * is paused while dumping. End events whose begin was already overwritten are
+ * skipped so the viewer doesn't get unbalanced scopes.
+ */
+void Trace::dump()
+{
+    char buff[100];
+    uint32_t count = (writeIdx < TRACE_RING_SIZE) ? writeIdx : TRACE_RING_SIZE;
+    uint32_t idx = writeIdx - count;
+    uint32_t mhz = ESP.getCpuFreqMHz();
+    uint64_t elapsed = 0;
+    uint32_t lastCycles = 0;
+    int depth = 0;
+    bool first = true;
+
+    enabled = false;
+    Serial.print("{\"traceEvents\":[");
+    for (uint32_t i = 0; i < count; i++, idx++)
+    {
+        TraceEvent &event = ring[idx & (TRACE_RING_SIZE - 1)];
+        if (i > 0) elapsed += (uint32_t)(event.cycles - lastCycles);
+        lastCycles = event.cycles;
+
+        if (event.phase == 'E')
+        {
+            if (depth == 0) continue;
+            depth--;
+        }
+        else depth++;
+
+        snprintf(buff, sizeof(buff), "%s\r\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lu.%03lu,\"pid\":1,\"tid\":1}",
+                 first ? "" : ",", event.name, event.phase, (unsigned long)(elapsed / mhz),
+                 (unsigned long)((elapsed % mhz) * 1000 / mhz));
+        Serial.print(buff);
+        first = false;
+    }
+    Serial.println("\r\n],\"displayTimeUnit\":\"ns\"}");
+    enabled = true;
+}
+
+void Trace::clear()
+{
+    enabled = false;
+    writeIdx = 0;
+    enabled = true;
+}
+
+#endif /* TRACE_ENABLED */
@@ -0,0 +1,96 @@
+/*
+ * Trace.h
+ *
+ * Cycle counter based tracing of where time goes in loop(). TRACE_SCOPE() records a
+ * begin event when it is declared and an end event when the enclosing block exits.
+ * Events go into a fixed ring that the console can dump as Chrome trace-event JSON
+ * (load it in chrome://tracing or Perfetto). Without TRACE_ENABLED in config.h every
+ * trace point compiles to nothing.
+ *
+ * Trace points are meant for the loop() task only. The ring has a single writer.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+#ifdef TRACE_ENABLED
+
+class Trace {
+public:
+    static inline uint32_t cycles() {
+#ifdef ESP32
+        uint32_t ccount;
+        asm volatile("rsr %0, ccount" : "=r"(ccount));
+        return ccount;
+#else
+        return ESP.getCycleCount();
+#endif
+    }
+
+    static inline void record(const char *name, char phase) {
+        if (!enabled) return;
+        TraceEvent &event = ring[writeIdx++ & (TRACE_RING_SIZE - 1)];
+        event.name = name;
+        event.cycles = cycles();
+        event.phase = phase;
+    }
+
+    static void dump();
+    static void clear();
+
+private:
+    struct TraceEvent {
+        const char *name;
+        uint32_t cycles;
+        char phase;
+    };
+
+    static TraceEvent ring[TRACE_RING_SIZE];
+    static uint32_t writeIdx;
+    static volatile bool enabled;
+};
+
+class TraceScope {
+public:
+    TraceScope(const char *name) : name(name) { Trace::record(name, 'B'); }
+    ~TraceScope() { Trace::record(name, 'E'); }
+
+private:
+    const char *name;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+
+#else
+
+#define TRACE_SCOPE(name) do {} while (0)
+
+#endif /* TRACE_ENABLED */
+
+#endif /* TRACE_H_ */
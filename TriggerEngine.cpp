@@ -0,0 +1,403 @@
+/*
+ * TriggerEngine.cpp
+ *
+ * Catches the frames around a rare event, see TriggerEngine.h
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "TriggerEngine.h"
+#include "Logger.h"
+#include "Metrics.h"
+
+extern SignalDB signalDB;
+
+MetricCounter triggerCaptures("trigger.captures");
+
+static_assert((TRIGGER_RING_SIZE & (TRIGGER_RING_SIZE - 1)) == 0, "TRIGGER_RING_SIZE must be a power of two");
+
+TriggerEngine::TriggerEngine()
+{
+    count = 0;
+    preMicros = TRIGGER_PRE_MS * 1000ul;
+    postMicros = TRIGGER_POST_MS * 1000ul;
+    compile();
+    rearm();
+}
+
+int TriggerEngine::add(const TriggerDef &def)
+{
+    if (count >= TRIGGER_MAX || !validDef(def)) return -1;
+    if (def.type == TriggerDef::Signal && !signalDB.getDef(def.signal, signals[count])) return -1;
+    defs[count] = def;
+    count++;
+    compile();
+    return count - 1;
+}
+
+void TriggerEngine::clear()
+{
+    count = 0;
+    compile();
+    rearm();
+}
+
+int TriggerEngine::getCount()
+{
+    return count;
+}
+
+bool TriggerEngine::getDef(int idx, TriggerDef &def)
+{
+    if (idx < 0 || idx >= count) return false;
+    def = defs[idx];
+    return true;
+}
+
+bool TriggerEngine::setWindow(uint32_t preMillis, uint32_t postMillis)
+{
+    if (preMillis > 60000 || postMillis > 60000) return false;
+    preMicros = preMillis * 1000;
+    postMicros = postMillis * 1000;
+    return true;
+}
+
+/*
+ * Runs for every frame, so the ring write and the matcher are all there is
+ * while armed. Nothing at all happens without triggers or once a capture
+ * is waiting to be pulled.
+ */
+void TriggerEngine::processFrame(CAN_FRAME &frame)
+{
+    if (count == 0 || state == Captured) return;
+    if (state == Capturing && frame.timestamp - firedMicros > postMicros)
+    {
+        finish();
+        return;
+    }
+
+    CapturedFrame &slot = ring[writePos];
+    slot.micros = frame.timestamp;
+    slot.id = frame.extended ? (frame.id | TRIGGER_EXTENDED) : frame.id;
+    slot.length = (frame.length > 8) ? 8 : frame.length;
+    memcpy(slot.data, frame.data.bytes, 8);
+    uint32_t pos = writePos;
+    writePos = (writePos + 1) & (TRIGGER_RING_SIZE - 1);
+    if (filled < TRIGGER_RING_SIZE) filled++;
+
+    if (state == Capturing)
+    {
+        //the next frame would overwrite the start of the capture
+        if (++captureCount == TRIGGER_RING_SIZE) finish();
+        return;
+    }
+
+    int trigger = match(frame);
+    if (trigger == -1) return;
+
+    uint32_t back = 0;
+    while (back + 1 < filled && frame.timestamp - ring[(pos - back - 1) & (TRIGGER_RING_SIZE - 1)].micros <= preMicros) back++;
+    fired = trigger;
+    firedMicros = frame.timestamp;
+    first = (pos - back) & (TRIGGER_RING_SIZE - 1);
+    captureCount = back + 1;
+    triggerPosition = back;
+    state = Capturing;
+    if (postMicros == 0 || captureCount == TRIGGER_RING_SIZE) finish();
+}
+
+void TriggerEngine::loop()
+{
+    if (state == Capturing && micros() - firedMicros > postMicros) finish();
+}
+
+TriggerEngine::State TriggerEngine::getState()
+{
+    return state;
+}
+
+void TriggerEngine::rearm()
+{
+    writePos = 0;
+    filled = 0;
+    captureCount = 0;
+    fired = -1;
+    state = Armed;
+}
+
+int TriggerEngine::getCaptureCount()
+{
+    return (state == Captured) ? captureCount : 0;
+}
+
+const CapturedFrame *TriggerEngine::getCaptured(int n)
+{
+    if (state != Captured || n < 0 || n >= (int)captureCount) return NULL;
+    return &ring[(first + n) & (TRIGGER_RING_SIZE - 1)];
+}
+
+int TriggerEngine::getFiredTrigger()
+{
+    return fired;
+}
+
+int TriggerEngine::getTriggerPosition()
+{
+    return triggerPosition;
+}
+
+void TriggerEngine::finish()
+{
+    state = Captured;
+    triggerCaptures.inc();
+    Logger::info("Trigger %i fired, %i frames captured", fired, captureCount);
+}
+
+/*
+ * The DTC trigger runs ahead of the ID lookup since it covers many IDs but
+ * only a few frames on them.
+ */
+int TriggerEngine::match(CAN_FRAME &frame)
+{
+    if (dtcTrigger != -1 && carriesDTCs(frame)) return dtcTrigger;
+
+    uint32_t key = frame.id;
+    if (frame.extended) key |= TRIGGER_EXTENDED;
+    else if (!(standardIds[(frame.id & 0x7FF) >> 5] & (1ul << (frame.id & 31)))) return -1;
+
+    int lo = 0;
+    int hi = groupCount - 1;
+    const IdGroup *group = NULL;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (groups[mid].id == key)
+        {
+            group = &groups[mid];
+            break;
+        }
+        if (groups[mid].id < key) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    if (!group) return -1;
+
+    uint64_t data = 0;
+    for (int i = 0; i < 8 && i < frame.length; i++) data |= (uint64_t)frame.data.byte[i] << (8 * i);
+    for (int k = group->first; k < group->first + group->count; k++)
+    {
+        const Kernel &kernel = kernels[k];
+        if (frame.length < kernel.needed) continue;
+        const TriggerDef &def = defs[kernel.trigger];
+        if (def.type == TriggerDef::Signal)
+        {
+            uint32_t raw;
+            float value;
+            if (SignalDB::extract(signals[kernel.trigger], frame.data.bytes, frame.length, raw, value) &&
+                (def.above ? value > def.threshold : value < def.threshold)) return kernel.trigger;
+        }
+        else if ((data & kernel.mask) == kernel.value) return kernel.trigger;
+    }
+    return -1;
+}
+
+/*
+ * Answers with at least one DTC in them: OBDII modes 03/07/0A and UDS 0x19 02
+ * from an engine ECU or a 29 bit physical response to the tester, and J1939
+ * DM1 with an active DTC or announcing several over BAM. A longer answer is
+ * caught by its first frame.
+ */
+bool TriggerEngine::carriesDTCs(CAN_FRAME &frame)
+{
+    const uint8_t *data = frame.data.bytes;
+    if (frame.length < 3) return false;
+
+    if ((!frame.extended && frame.id >= 0x7E8 && frame.id <= 0x7EF) ||
+        (frame.extended && (frame.id & 0x1FFFFF00) == 0x18DAF100))
+    {
+        const uint8_t *payload;
+        int length;
+        if ((data[0] >> 4) == 0) //single frame
+        {
+            payload = data + 1;
+            length = data[0] & 0x0F;
+            if (length > frame.length - 1) return false;
+        }
+        else if ((data[0] >> 4) == 1 && frame.length == 8) //first frame
+        {
+            payload = data + 2;
+            length = ((data[0] & 0x0F) << 8) | data[1];
+        }
+        else return false;
+        if (length < 2) return false;
+        if (payload[0] == 0x43 || payload[0] == 0x47 || payload[0] == 0x4A) return payload[1] != 0; //count of DTCs
+        //0x59 0x02, the status availability mask, then 4 bytes per DTC
+        return payload[0] == 0x59 && payload[1] == 0x02 && length >= 7;
+    }
+
+    if (frame.extended && frame.length >= 8)
+    {
+        uint32_t pgn = (frame.id >> 8) & 0x3FFFF;
+        if (((pgn >> 8) & 0xFF) < 0xF0) pgn &= 0x3FF00; //PDU1, the low byte is the destination
+        //DM1: lamps, then SPN and FMI. All 0 or all 1 means no DTC
+        uint32_t dtc = data[2] | (data[3] << 8) | (data[4] << 16);
+        if (pgn == 0xFECA) return dtc != 0 && dtc != 0xFFFFFF;
+        //TP.CM BAM for a DM1, only sent when it holds more than one DTC
+        if (pgn == 0xEC00) return data[0] == 0x20 && data[5] == 0xCA && data[6] == 0xFE && data[7] == 0x00;
+    }
+    return false;
+}
+
+/*
+ * Turns the triggers into kernels sorted by ID and rebuilds the 11 bit ID
+ * bitmap, like SignalDB::compile(). An ID trigger is a data one with nothing
+ * to compare.
+ */
+void TriggerEngine::compile()
+{
+    uint8_t order[TRIGGER_MAX];
+    uint32_t ids[TRIGGER_MAX];
+    int kernelCount = 0;
+
+    dtcTrigger = -1;
+    for (int i = 0; i < count; i++)
+    {
+        if (defs[i].type == TriggerDef::DTC)
+        {
+            if (dtcTrigger == -1) dtcTrigger = i;
+            continue;
+        }
+        ids[i] = (defs[i].type == TriggerDef::Signal) ? (signals[i].id & ~SIG_EXTENDED) | ((signals[i].id & SIG_EXTENDED) ? TRIGGER_EXTENDED : 0)
+                                                      : defs[i].id;
+        //insertion sort, stable so the triggers of one ID are tried in definition order
+        int j = kernelCount++;
+        while (j > 0 && ids[order[j - 1]] > ids[i])
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    memset(standardIds, 0, sizeof(standardIds));
+    groupCount = 0;
+    for (int k = 0; k < kernelCount; k++)
+    {
+        const TriggerDef &def = defs[order[k]];
+        uint32_t id = ids[order[k]];
+        Kernel &kernel = kernels[k];
+        kernel.trigger = order[k];
+        kernel.mask = 0;
+        kernel.value = 0;
+        kernel.needed = 0;
+        if (def.type == TriggerDef::Data)
+        {
+            for (int i = 0; i < def.length; i++)
+            {
+                kernel.mask |= (uint64_t)def.mask[i] << (8 * i);
+                kernel.value |= (uint64_t)(def.value[i] & def.mask[i]) << (8 * i);
+            }
+            kernel.needed = def.length;
+        }
+
+        if (groupCount == 0 || groups[groupCount - 1].id != id)
+        {
+            groups[groupCount].id = id;
+            groups[groupCount].first = k;
+            groups[groupCount].count = 0;
+            groupCount++;
+        }
+        groups[groupCount - 1].count++;
+        if (!(id & TRIGGER_EXTENDED)) standardIds[id >> 5] |= 1ul << (id & 31);
+    }
+}
+
+bool TriggerEngine::validDef(const TriggerDef &def)
+{
+    if (def.type == TriggerDef::Id || def.type == TriggerDef::Data)
+    {
+        if (!(def.id & TRIGGER_EXTENDED) && def.id > 0x7FF) return false;
+        if ((def.id & ~TRIGGER_EXTENDED) > 0x1FFFFFFF) return false;
+        return def.type == TriggerDef::Id || def.length <= 8;
+    }
+    return def.type == TriggerDef::Signal || def.type == TriggerDef::DTC;
+}
+
+void TriggerEngine::describe(int idx, char *buff)
+{
+    const TriggerDef &def = defs[idx];
+    int len = sprintf(buff, "%i ", idx);
+    switch (def.type)
+    {
+        case TriggerDef::Id:
+            sprintf(buff + len, "ID %X", def.id & 0x1FFFFFFF);
+            break;
+        case TriggerDef::Data:
+            len += sprintf(buff + len, "DATA %X ", def.id & 0x1FFFFFFF);
+            for (int b = 0; b < def.length; b++) len += sprintf(buff + len, "%02X", def.mask[b]);
+            buff[len++] = ' ';
+            for (int b = 0; b < def.length; b++) len += sprintf(buff + len, "%02X", def.value[b]);
+            buff[len] = 0;
+            break;
+        case TriggerDef::Signal:
+            sprintf(buff + len, "SIGNAL %i %c %g", def.signal, def.above ? '>' : '<', def.threshold);
+            break;
+        default:
+            sprintf(buff + len, "DTC");
+            break;
+    }
+}
+
+String TriggerEngine::toText(const char *lineEnding)
+{
+    String text;
+    char buff[64];
+
+    for (int i = 0; i < count; i++)
+    {
+        describe(i, buff);
+        text.concat(buff);
+        text.concat(lineEnding);
+    }
+    if (state == Armed) sprintf(buff, "ARMED %i %i", (int)(preMicros / 1000), (int)(postMicros / 1000));
+    else if (state == Capturing) sprintf(buff, "CAPTURING %i", fired);
+    else sprintf(buff, "CAPTURED %i %i %i", fired, (int)captureCount, (int)triggerPosition);
+    text.concat(buff);
+    text.concat(lineEnding);
+    return text;
+}
+
+void TriggerEngine::printAll()
+{
+    char buff[64];
+
+    for (int i = 0; i < count; i++)
+    {
+        describe(i, buff);
+        Logger::console("%s", buff);
+    }
+    if (count == 0) Logger::console("No triggers defined");
+    else if (state == Armed) Logger::console("Armed");
+    else if (state == Capturing) Logger::console("Trigger %i fired, capturing", fired);
+    else Logger::console("Trigger %i fired, %i frames captured, waiting to be pulled", fired, captureCount);
+    Logger::console("Window %ims before to %ims after the trigger, %i captures so far", preMicros / 1000, postMicros / 1000,
+                    triggerCaptures.get());
+}
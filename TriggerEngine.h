@@ -0,0 +1,135 @@
+/*
+ * TriggerEngine.h
+ *
+ * Catches the frames around a rare event. Every frame goes into a RAM ring
+ * while the engine is armed, and the first one to match a trigger freezes what
+ * the ring holds of the pre-trigger window. Frames keep coming in until the
+ * post-trigger window is over, then the capture is kept until it is pulled.
+ *
+ * Triggers are compiled like SignalDB's signals: 11 bit IDs without one are
+ * turned away by a bit test, the others find their kernels with a binary search.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef TRIGGERENGINE_H_
+#define TRIGGERENGINE_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include <esp32_can.h>
+#include "SignalDB.h"
+
+#define TRIGGER_EXTENDED    0x80000000ul //set in TriggerDef::id and CapturedFrame::id for a 29 bit ID
+
+struct TriggerDef {
+    enum Type { Id, Data, Signal, DTC };
+    uint8_t type;
+    uint32_t id;            //Id and Data
+    uint8_t length;         //Data: bytes mask and value cover, the frame needs at least that many
+    uint8_t mask[8];        //Data: bits that have to be like in value
+    uint8_t value[8];
+    uint8_t signal;         //Signal: SignalDB index
+    bool above;             //Signal: fires over the threshold, else under it
+    float threshold;
+};
+
+struct CapturedFrame {
+    uint32_t micros;        //CAN_FRAME::timestamp
+    uint32_t id;
+    uint8_t length;
+    uint8_t data[8];
+};
+
+class TriggerEngine {
+public:
+    enum State { Armed, Capturing, Captured };
+
+    TriggerEngine();
+    //returns the new trigger's index or -1 if it is invalid or the table is full. A signal
+    //trigger keeps the definition the signal has now
+    int add(const TriggerDef &def);
+    //removes all triggers and any capture
+    void clear();
+    int getCount();
+    bool getDef(int idx, TriggerDef &def);
+    //how far the capture reaches before and after the triggering frame
+    bool setWindow(uint32_t preMillis, uint32_t postMillis);
+    void processFrame(CAN_FRAME &frame);
+    //ends the post-trigger window when the bus has gone quiet
+    void loop();
+    State getState();
+    //drops the capture and starts watching again
+    void rearm();
+    //the capture, oldest frame first. Only valid in the Captured state
+    int getCaptureCount();
+    const CapturedFrame *getCaptured(int n);
+    int getFiredTrigger();
+    int getTriggerPosition(); //of the frame that fired in the capture
+    //one line per trigger: idx type arguments, then the state
+    String toText(const char *lineEnding);
+    void printAll();
+    static bool carriesDTCs(CAN_FRAME &frame);
+
+private:
+    struct Kernel {
+        uint64_t mask;
+        uint64_t value;
+        uint8_t needed;     //data bytes the frame must have
+        uint8_t trigger;
+    };
+
+    struct IdGroup {
+        uint32_t id;
+        uint8_t first;
+        uint8_t count;
+    };
+
+    TriggerDef defs[TRIGGER_MAX];
+    SignalDef signals[TRIGGER_MAX]; //of the signal triggers
+    int count;
+    Kernel kernels[TRIGGER_MAX];
+    IdGroup groups[TRIGGER_MAX];
+    int groupCount;
+    uint32_t standardIds[2048 / 32]; //bit per 11 bit ID that has a trigger
+    int dtcTrigger;     //-1 if there is none
+    uint32_t preMicros;
+    uint32_t postMicros;
+
+    CapturedFrame ring[TRIGGER_RING_SIZE];
+    uint32_t writePos;  //next ring slot
+    uint32_t filled;    //slots written since the engine was armed, up to TRIGGER_RING_SIZE
+    State state;
+    int fired;
+    uint32_t firedMicros;
+    uint32_t first;     //ring slot the capture starts at
+    uint32_t captureCount;
+    uint32_t triggerPosition;
+
+    void compile();
+    int match(CAN_FRAME &frame);
+    void finish();
+    void describe(int idx, char *buff);
+    static bool validDef(const TriggerDef &def);
+};
+
+#endif /* TRIGGERENGINE_H_ */
@@ -0,0 +1,393 @@
+/*
+ * UDSReader.cpp
+ *
+ * Batched UDS ReadDataByIdentifier, see UDSReader.h
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "UDSReader.h"
+#include "PIDPoller.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "obd2_codes.h"
+
+extern PIDPoller pidPoller;
+
+MetricCounter udsRequests("uds.requests");
+MetricCounter udsTimeouts("uds.timeouts");
+MetricCounter udsNegative("uds.negative");
+MetricHistogram udsResponseTime("uds.response_us");
+
+#define NRC_BAD_LENGTH          0x13
+#define NRC_RESPONSE_TOO_LONG   0x14
+#define NRC_OUT_OF_RANGE        0x31
+#define NRC_RESPONSE_PENDING    0x78
+
+UDSReader::UDSReader()
+{
+    state = Idle;
+    owner = None;
+    count = 0;
+    requests = 0;
+    knownNext = 0;
+    for (int i = 0; i < 8; i++) batchLimit[i] = UDS_MAX_BATCH;
+    for (int i = 0; i < UDS_LENGTH_CACHE; i++) known[i].length = 0;
+}
+
+void UDSReader::setup()
+{
+    state = Idle;
+    owner = None;
+}
+
+/*
+ * Send the next batch once the previous answer is in, and push the
+ * consecutive frames of a long request out as the ECU's flow control allows.
+ * An ECU that doesn't answer at all in PID_RESPONSE_TIMEOUT isn't going to
+ * answer the rest either, so the whole read ends there.
+ */
+void UDSReader::loop(bool busy)
+{
+    TRACE_SCOPE("uds_reader");
+
+    if (state == Sending || state == Waiting)
+    {
+        channel.loop();
+        if (state == Sending && !channel.isSending())
+        {
+            state = Waiting;
+            sentMicros = micros();
+            deadline = sentMicros + PID_RESPONSE_TIMEOUT;
+        }
+        if ((int32_t)(micros() - deadline) > 0)
+        {
+            udsTimeouts.inc();
+            finishAll(UDS_NO_ANSWER);
+        }
+        return;
+    }
+    if (state != Ready || busy) return;
+    if (buildBatch()) sendBatch();
+    else state = Done;
+}
+
+bool UDSReader::processFrame(CAN_FRAME &frame)
+{
+    if ((state != Sending && state != Waiting) || frame.id != channel.getRxId()) return false;
+
+    //the start of someone else's answer, such as a late one to PIDPoller, is left alone
+    uint8_t type = frame.data.byte[0] >> 4;
+    const uint8_t *start = (type == 0) ? &frame.data.byte[1] : &frame.data.byte[2];
+    if ((type == 0 || type == 1) && start[0] != UDS_READ_BY_ID + 0x40 &&
+        !(start[0] == UDS_NEG_RESP && start[1] == UDS_READ_BY_ID)) return false;
+
+    switch (channel.processFrame(frame))
+    {
+    case ISOTP_IGNORED:
+        return false;
+    case ISOTP_CONSUMED:
+        if (channel.isReceiving()) deadline = micros() + PID_RESPONSE_TIMEOUT;
+        return true;
+    case ISOTP_OVERFLOW:
+        //the request or the answer was too long for one side, ask for fewer DIDs at a time
+        if (batchCount == 1) finish(batch[0], NRC_RESPONSE_TOO_LONG);
+        else batchLimit[ecu] = batchCount / 2;
+        state = Ready;
+        return true;
+    case ISOTP_COMPLETE:
+        return handleResponse(channel.getMessage(), channel.getLength());
+    }
+    return false;
+}
+
+void UDSReader::yieldToClient()
+{
+    if (state != Sending && state != Waiting) return;
+    channel.reset();
+    state = Ready;
+}
+
+bool UDSReader::start(Owner newOwner, uint8_t ecuNum, const uint16_t *dids, const uint16_t *lengthHints, int didCount)
+{
+    if (state != Idle || ecuNum > 7 || didCount < 1 || didCount > UDS_MAX_DIDS) return false;
+
+    ecu = ecuNum;
+    owner = newOwner;
+    count = didCount;
+    for (int i = 0; i < count; i++)
+    {
+        records[i].did = dids[i];
+        records[i].status = UDS_NO_ANSWER;
+        records[i].length = 0;
+        lengths[i] = (lengthHints && lengthHints[i]) ? lengthHints[i] : knownLength(dids[i]);
+        finished[i] = false;
+        alone[i] = false;
+    }
+    channel.begin(0x7E0 + ecu, 0x7E8 + ecu, rxBuffer, sizeof(rxBuffer));
+    state = Ready;
+    return true;
+}
+
+bool UDSReader::isBusy()
+{
+    return state != Idle;
+}
+
+bool UDSReader::isActive()
+{
+    return state == Ready || state == Sending || state == Waiting;
+}
+
+bool UDSReader::isDone(Owner who)
+{
+    return state == Done && owner == who;
+}
+
+int UDSReader::getCount()
+{
+    return count;
+}
+
+const UDSRecord &UDSReader::getRecord(int idx)
+{
+    return records[idx];
+}
+
+uint8_t UDSReader::getECU()
+{
+    return ecu;
+}
+
+void UDSReader::release()
+{
+    channel.reset();
+    state = Idle;
+    owner = None;
+}
+
+String UDSReader::toText(const char *lineEnding)
+{
+    String text = String();
+    char buff[8];
+
+    for (int i = 0; i < count; i++)
+    {
+        UDSRecord &record = records[i];
+        sprintf(buff, "%04X:", record.did);
+        text.concat(buff);
+        if (record.status == UDS_OK)
+        {
+            for (int b = 0; b < record.length && b < UDS_MAX_DID_DATA; b++)
+            {
+                sprintf(buff, "%02X", record.data[b]);
+                text.concat(buff);
+            }
+        }
+        else if (record.status == UDS_NO_ANSWER) text.concat("NO DATA");
+        else
+        {
+            sprintf(buff, "7F%02X", record.status);
+            text.concat(buff);
+        }
+        text.concat(lineEnding);
+    }
+    return text;
+}
+
+uint32_t UDSReader::getRequests()
+{
+    return requests;
+}
+
+/*
+ * The DIDs still to read, in order. A DID of unknown length, or one whose
+ * last batch was refused, goes on its own. Otherwise as many DIDs of known
+ * length as the ECU takes and whose answer fits the receive buffer.
+ */
+bool UDSReader::buildBatch()
+{
+    int answerLength = 1;
+    batchCount = 0;
+
+    for (int i = 0; i < count && batchCount < batchLimit[ecu]; i++)
+    {
+        if (finished[i]) continue;
+        bool single = !lengths[i] || alone[i];
+        if (single)
+        {
+            if (batchCount) continue;
+            batch[batchCount++] = i;
+            break;
+        }
+        if (answerLength + 2 + lengths[i] > (int)sizeof(rxBuffer)) break;
+        answerLength += 2 + lengths[i];
+        batch[batchCount++] = i;
+    }
+    return batchCount > 0;
+}
+
+void UDSReader::sendBatch()
+{
+    request[0] = UDS_READ_BY_ID;
+    for (int i = 0; i < batchCount; i++)
+    {
+        request[1 + 2 * i] = records[batch[i]].did >> 8;
+        request[2 + 2 * i] = records[batch[i]].did & 0xFF;
+    }
+    //an ECU commonly drops a request it is working on when another arrives, the poller asks again later
+    pidPoller.yieldToClient();
+    channel.send(request, 1 + 2 * batchCount);
+    requests++;
+    udsRequests.inc();
+    sentMicros = micros();
+    deadline = sentMicros + PID_RESPONSE_TIMEOUT;
+    state = channel.isSending() ? Sending : Waiting;
+}
+
+/*
+ * Split a positive answer back into the DIDs of the batch. The ECU answers
+ * them in the order they were asked for and leaves out the ones it doesn't
+ * have. If the answer doesn't add up with the lengths expected, the DIDs
+ * that couldn't be placed are read alone again. An answer that doesn't start
+ * with a DID of the batch is left for whoever asked for it.
+ */
+bool UDSReader::handleResponse(const uint8_t *message, uint16_t length)
+{
+    if (message[0] == UDS_NEG_RESP)
+    {
+        if (length < 3 || message[1] != UDS_READ_BY_ID) return false;
+        uint8_t nrc = message[2];
+        if (nrc == NRC_RESPONSE_PENDING)
+        {
+            deadline = micros() + ELM_PENDING_TIMEOUT;
+            return true;
+        }
+        udsNegative.inc();
+        udsResponseTime.record(micros() - sentMicros);
+        if (batchCount == 1) finish(batch[0], nrc);
+        else if (nrc == NRC_BAD_LENGTH || nrc == NRC_RESPONSE_TOO_LONG)
+        {
+            //too many DIDs for this ECU
+            batchLimit[ecu] = batchCount / 2;
+            LOG_DEBUG("ECU %i refused %i DIDs, trying %i", ecu, batchCount, batchLimit[ecu]);
+        }
+        else for (int i = 0; i < batchCount; i++) alone[batch[i]] = true;
+        state = Ready;
+        return true;
+    }
+    if (message[0] != UDS_READ_BY_ID + 0x40 || length < 3) return false;
+    uint16_t first = (message[1] << 8) | message[2];
+    bool ours = false;
+    for (int i = 0; i < batchCount && !ours; i++) ours = (records[batch[i]].did == first);
+    if (!ours) return false;
+    udsResponseTime.record(micros() - sentMicros);
+
+    //check the answer adds up before taking any value from it, a wrong length would shift all that follow
+    int pos = 1;
+    int next = 0; //batch entries before this one were answered or skipped
+    int placed[UDS_MAX_BATCH];
+    int starts[UDS_MAX_BATCH];
+    int placedCount = 0;
+    while (pos + 2 <= length && next < batchCount)
+    {
+        uint16_t did = (message[pos] << 8) | message[pos + 1];
+        int found = -1;
+        for (int i = next; i < batchCount && found == -1; i++) if (records[batch[i]].did == did) found = i;
+        if (found == -1) break;
+        uint16_t valueLength = (batchCount == 1) ? length - pos - 2 : lengths[batch[found]];
+        if (pos + 2 + valueLength > length) break;
+        placed[placedCount] = found;
+        starts[placedCount++] = pos + 2;
+        pos += 2 + valueLength;
+        next = found + 1;
+    }
+    if (pos != length)
+    {
+        //the lengths were off. Each DID gets read alone and learns its real length
+        for (int i = 0; i < batchCount; i++)
+        {
+            alone[batch[i]] = true;
+            lengths[batch[i]] = 0;
+        }
+        state = Ready;
+        return true;
+    }
+
+    next = 0;
+    for (int p = 0; p < placedCount; p++)
+    {
+        //the ECU leaves out DIDs it doesn't have
+        for (int i = next; i < placed[p]; i++) finish(batch[i], NRC_OUT_OF_RANGE);
+        int idx = batch[placed[p]];
+        uint16_t valueLength = ((p + 1 < placedCount) ? starts[p + 1] - 2 : length) - starts[p];
+        UDSRecord &record = records[idx];
+        record.length = valueLength;
+        memcpy(record.data, &message[starts[p]], (valueLength < UDS_MAX_DID_DATA) ? valueLength : UDS_MAX_DID_DATA);
+        learnLength(record.did, valueLength);
+        lengths[idx] = valueLength;
+        finish(idx, UDS_OK);
+        next = placed[p] + 1;
+    }
+    for (int i = next; i < batchCount; i++) finish(batch[i], NRC_OUT_OF_RANGE);
+    state = Ready;
+    return true;
+}
+
+void UDSReader::finish(int idx, uint8_t status)
+{
+    records[idx].status = status;
+    finished[idx] = true;
+}
+
+void UDSReader::finishAll(uint8_t status)
+{
+    for (int i = 0; i < count; i++) if (!finished[i]) finish(i, status);
+    channel.reset();
+    state = Done;
+}
+
+uint16_t UDSReader::knownLength(uint16_t did)
+{
+    for (int i = 0; i < UDS_LENGTH_CACHE; i++)
+    {
+        if (known[i].length && known[i].did == did && known[i].ecu == ecu) return known[i].length;
+    }
+    return 0;
+}
+
+void UDSReader::learnLength(uint16_t did, uint16_t length)
+{
+    for (int i = 0; i < UDS_LENGTH_CACHE; i++)
+    {
+        if (known[i].length && known[i].did == did && known[i].ecu == ecu)
+        {
+            known[i].length = length;
+            return;
+        }
+    }
+    known[knownNext].did = did;
+    known[knownNext].ecu = ecu;
+    known[knownNext].length = length;
+    knownNext = (knownNext + 1) % UDS_LENGTH_CACHE;
+}
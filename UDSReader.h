@@ -0,0 +1,122 @@
+/*
+ * UDSReader.h
+ *
+ * Reads UDS DIDs (ReadDataByIdentifier, 0x22) from an ECU several to a
+ * request. The answer carries the DIDs back to back without lengths, so only
+ * DIDs whose length is known are batched. The others are read alone first,
+ * which teaches their length for the next read. ECUs that refuse a batch as too
+ * long get smaller ones, negative responses to a batch are narrowed down by
+ * reading its DIDs one by one and "response pending" just extends the wait.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef UDSREADER_H_
+#define UDSREADER_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include <esp32_can.h>
+#include "IsoTp.h"
+
+#define UDS_OK          0x00 //status of a DID that was read, anything else is the negative response code
+#define UDS_NO_ANSWER   0xFF //the ECU didn't answer at all
+
+struct UDSRecord {
+    uint16_t did;
+    uint8_t status;     //UDS_OK, a negative response code or UDS_NO_ANSWER
+    uint16_t length;    //length of the value, only the first UDS_MAX_DID_DATA bytes are kept
+    uint8_t data[UDS_MAX_DID_DATA];
+};
+
+class UDSReader {
+public:
+    //who started a read and gets its results
+    enum Owner {
+        None, Elm, Gvret
+    };
+
+    UDSReader();
+    void setup();
+    //busy while the ELM327 client waits on its own request, nothing is sent then
+    void loop(bool busy);
+    //true if the frame belonged to the read
+    bool processFrame(CAN_FRAME &frame);
+    //the ELM327 client sent a request of its own. The batch in flight is asked again afterward
+    void yieldToClient();
+    //read DIDs from ECU 0-7 (7E0-7E7). lengths may be NULL and 0 means unknown. Fails while another read is running
+    bool start(Owner owner, uint8_t ecu, const uint16_t *dids, const uint16_t *lengths, int count);
+    //a read is running or its results haven't been released yet
+    bool isBusy();
+    //a request is on the bus, other requesters should hold off
+    bool isActive();
+    bool isDone(Owner owner);
+    int getCount();
+    const UDSRecord &getRecord(int idx);
+    uint8_t getECU();
+    //forget the read, finished or not
+    void release();
+    //one line per DID: DID:value, DID:7Fnn for a negative response or DID:NO DATA
+    String toText(const char *lineEnding);
+    uint32_t getRequests();
+
+private:
+    enum State {
+        Idle, Ready, Sending, Waiting, Done
+    };
+
+    struct KnownLength {
+        uint16_t did;
+        uint8_t ecu;
+        uint16_t length;    //0 for an unused entry
+    };
+
+    UDSRecord records[UDS_MAX_DIDS];
+    uint16_t lengths[UDS_MAX_DIDS];     //expected length of each DID, 0 if unknown
+    bool finished[UDS_MAX_DIDS];
+    bool alone[UDS_MAX_DIDS];           //read on its own, the last batch it was in was refused
+    int count;
+    int8_t batch[UDS_MAX_BATCH];
+    int batchCount;
+    uint8_t request[1 + 2 * UDS_MAX_BATCH];
+    uint8_t rxBuffer[ISOTP_BUFFER_SIZE];
+    IsoTpChannel channel;
+    State state;
+    Owner owner;
+    uint8_t ecu;
+    uint32_t deadline;
+    uint32_t sentMicros;
+    uint32_t requests;
+    uint8_t batchLimit[8];              //most DIDs per request each ECU took so far
+    KnownLength known[UDS_LENGTH_CACHE];
+    int knownNext;
+
+    bool buildBatch();
+    void sendBatch();
+    bool handleResponse(const uint8_t *message, uint16_t length);
+    void finish(int idx, uint8_t status);
+    void finishAll(uint8_t status);
+    uint16_t knownLength(uint16_t did);
+    void learnLength(uint16_t did, uint16_t length);
+};
+
+#endif /* UDSREADER_H_ */
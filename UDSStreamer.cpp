@@ -0,0 +1,398 @@
+/*
+ * UDSStreamer.cpp
+ *
+ * ECU side periodic streaming with UDS 0x2C and 0x2A, see UDSStreamer.h
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "UDSStreamer.h"
+#include "UDSReader.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "obd2_codes.h"
+
+extern UDSReader udsReader;
+
+MetricCounter streamFrames("uds.stream_frames");
+MetricCounter streamRestarts("uds.stream_restarts");
+
+#define NRC_RESPONSE_PENDING    0x78
+
+static const char *stateNames[] = {"unused", "session", "clear", "define", "start", "running", "stopping", "forget", "failed"};
+
+UDSStreamer::UDSStreamer()
+{
+    current = -1;
+    for (int i = 0; i < UDS_MAX_STREAMS; i++) streams[i].state = Unused;
+    for (int i = 0; i < 8; i++) lastTesterPresent[i] = 0;
+}
+
+void UDSStreamer::setup()
+{
+    current = -1;
+    for (int i = 0; i < UDS_MAX_STREAMS; i++) streams[i].state = Unused;
+}
+
+/*
+ * One request at a time: tester present for ECUs that stream, then the next
+ * set up or tear down step. A stream that went quiet is set up again, the ECU
+ * most likely dropped back to the default session and forgot it.
+ */
+void UDSStreamer::loop(bool busy)
+{
+    TRACE_SCOPE("uds_streamer");
+
+    if (current != -1)
+    {
+        channel.loop();
+        if (channel.isSending()) return;
+        if ((int32_t)(micros() - deadline) > 0)
+        {
+            Stream &stream = streams[current];
+            current = -1;
+            //tearing down is best effort, the ECU may be gone
+            if (stream.state == Clear || stream.state == StopSending || stream.state == Forget) advance(stream);
+            else fail(stream, UDS_NO_ANSWER);
+        }
+        return;
+    }
+    if (busy || !settings.CAN0_Enabled) return;
+    if (sendTesterPresent()) return;
+
+    for (int i = 0; i < UDS_MAX_STREAMS; i++)
+    {
+        Stream &stream = streams[i];
+        if (stream.state == Running && (uint32_t)(millis() - stream.lastFrameMillis) > UDS_STREAM_STALL_MS)
+        {
+            LOG_DEBUG("Stream %i from ECU %i went quiet, setting it up again", i, stream.ecu);
+            stream.restarts++;
+            streamRestarts.inc();
+            stream.state = Session;
+        }
+    }
+    for (int i = 0; i < UDS_MAX_STREAMS; i++)
+    {
+        State state = streams[i].state;
+        if (state == Unused || state == Running || state == Failed) continue;
+        sendStep(i);
+        return;
+    }
+}
+
+bool UDSStreamer::processFrame(CAN_FRAME &frame)
+{
+    if (current == -1 || frame.id != channel.getRxId()) return false;
+
+    //only answers to the service asked for, a late answer to someone else is left alone
+    uint8_t service = request[0];
+    uint8_t type = frame.data.byte[0] >> 4;
+    const uint8_t *start = (type == 0) ? &frame.data.byte[1] : &frame.data.byte[2];
+    if ((type == 0 || type == 1) && start[0] != service + 0x40 && !(start[0] == UDS_NEG_RESP && start[1] == service))
+        return false;
+
+    switch (channel.processFrame(frame))
+    {
+    case ISOTP_IGNORED:
+        return false;
+    case ISOTP_CONSUMED:
+        return true;
+    case ISOTP_OVERFLOW:
+        fail(streams[current], UDS_NO_ANSWER);
+        current = -1;
+        return true;
+    case ISOTP_COMPLETE:
+        handleResponse(channel.getMessage(), channel.getLength());
+        return true;
+    }
+    return false;
+}
+
+int UDSStreamer::decode(CAN_FRAME &frame, StreamValue *values, int max)
+{
+    if (frame.id < 0x7E8 || frame.id > 0x7EF || frame.extended) return 0;
+    int idx = frame.data.byte[0] - (UDS_STREAM_DID_BASE & 0xFF);
+    if (idx < 0 || idx >= UDS_MAX_STREAMS) return 0;
+    Stream &stream = streams[idx];
+    if (stream.ecu != frame.id - 0x7E8 || stream.state == Unused || stream.state == Session) return 0;
+
+    uint32_t now = micros();
+    if (stream.frames) stream.intervalSum += now - stream.lastFrame;
+    stream.frames++;
+    stream.lastFrame = now;
+    stream.lastFrameMillis = millis();
+    streamFrames.inc();
+
+    int count = 0;
+    int pos = 1;
+    for (int p = 0; p < stream.partCount && count < max; p++)
+    {
+        StreamPart &part = stream.parts[p];
+        if (pos + part.size > frame.length) break;
+        StreamValue &value = values[count++];
+        value.ecu = stream.ecu;
+        value.stream = idx;
+        value.did = part.did;
+        value.raw = 0;
+        for (int b = 0; b < part.size; b++) value.raw = (value.raw << 8) | frame.data.byte[pos + b];
+        value.millis = stream.lastFrameMillis;
+        pos += part.size;
+    }
+    return count;
+}
+
+void UDSStreamer::yieldToClient()
+{
+    if (current == -1) return;
+    channel.reset();
+    current = -1;
+}
+
+int UDSStreamer::start(uint8_t ecu, uint8_t rate, const StreamPart *parts, int count)
+{
+    if (ecu > 7 || rate < 1 || rate > 3 || count < 1 || count > UDS_STREAM_MAX_PARTS) return -1;
+    int length = 0;
+    for (int p = 0; p < count; p++)
+    {
+        if (parts[p].size < 1 || parts[p].size > 4 || parts[p].position < 1) return -1;
+        length += parts[p].size;
+    }
+    if (length > 7) return -1; //the data has to fit a single periodic frame
+
+    for (int i = 0; i < UDS_MAX_STREAMS; i++)
+    {
+        Stream &stream = streams[i];
+        if (stream.state != Unused) continue;
+        stream.ecu = ecu;
+        stream.rate = rate;
+        stream.status = 0;
+        memcpy(stream.parts, parts, count * sizeof(StreamPart));
+        stream.partCount = count;
+        stream.frames = 0;
+        stream.restarts = 0;
+        stream.intervalSum = 0;
+        stream.state = Session;
+        return i;
+    }
+    return -1;
+}
+
+bool UDSStreamer::stop(int idx)
+{
+    if (idx < 0 || idx >= UDS_MAX_STREAMS || streams[idx].state == Unused) return false;
+    Stream &stream = streams[idx];
+    if (idx == current) yieldToClient();
+    if (stream.state == Failed || stream.state == Session) stream.state = Unused; //nothing defined on the ECU yet
+    else if (stream.state != Forget) stream.state = StopSending;
+    return true;
+}
+
+bool UDSStreamer::getStats(int idx, StreamStats &stats)
+{
+    if (idx < 0 || idx >= UDS_MAX_STREAMS || streams[idx].state == Unused) return false;
+    Stream &stream = streams[idx];
+    stats.ecu = stream.ecu;
+    stats.rate = stream.rate;
+    stats.state = stream.state;
+    stats.status = stream.status;
+    stats.parts = stream.partCount;
+    stats.frames = stream.frames;
+    stats.restarts = stream.restarts;
+    stats.intervalAvg = (stream.frames > 1) ? stream.intervalSum / (stream.frames - 1) : 0;
+    return true;
+}
+
+bool UDSStreamer::isActive()
+{
+    return current != -1;
+}
+
+void UDSStreamer::printStats()
+{
+    StreamStats stats;
+    int count = 0;
+
+    for (int i = 0; i < UDS_MAX_STREAMS; i++)
+    {
+        if (!getStats(i, stats)) continue;
+        Logger::console("Stream %i from ECU %i rate %i, %i parts: %s (status %X), %i frames every %ius, %i restarts",
+                        i, stats.ecu, stats.rate, stats.parts, stateNames[stats.state], stats.status, stats.frames,
+                        stats.intervalAvg, stats.restarts);
+        count++;
+    }
+    if (count == 0) Logger::console("No streams");
+}
+
+String UDSStreamer::toText(const char *lineEnding)
+{
+    String text = String();
+    StreamStats stats;
+    char buff[80];
+
+    for (int i = 0; i < UDS_MAX_STREAMS; i++)
+    {
+        if (!getStats(i, stats)) continue;
+        sprintf(buff, "%i %i %i %s %02X %u %u %u", i, stats.ecu, stats.rate, stateNames[stats.state], stats.status,
+                (unsigned int)stats.frames, (unsigned int)stats.intervalAvg, (unsigned int)stats.restarts);
+        text.concat(buff);
+        text.concat(lineEnding);
+    }
+    return text;
+}
+
+/*
+ * Set up: extended session (unless another stream keeps this ECU in it),
+ * clear whatever an earlier run left in the dynamic DID, define it, start
+ * sending. Tear down: stop sending, clear the dynamic DID.
+ */
+void UDSStreamer::sendStep(int idx)
+{
+    Stream &stream = streams[idx];
+    uint16_t did = UDS_STREAM_DID_BASE + idx;
+    int length = 0;
+
+    if (stream.state == Session && ecuStreaming(stream.ecu, idx)) stream.state = Clear;
+    switch (stream.state)
+    {
+    case Session:
+        request[length++] = UDS_DIAG_CTRL;
+        request[length++] = 0x03; //extended diagnostic session
+        break;
+    case Clear:
+    case Forget:
+        request[length++] = UDS_DYNAMIC_DATA_DEF;
+        request[length++] = 0x03;
+        request[length++] = did >> 8;
+        request[length++] = did & 0xFF;
+        break;
+    case Define:
+        request[length++] = UDS_DYNAMIC_DATA_DEF;
+        request[length++] = 0x01;
+        request[length++] = did >> 8;
+        request[length++] = did & 0xFF;
+        for (int p = 0; p < stream.partCount; p++)
+        {
+            request[length++] = stream.parts[p].did >> 8;
+            request[length++] = stream.parts[p].did & 0xFF;
+            request[length++] = stream.parts[p].position;
+            request[length++] = stream.parts[p].size;
+        }
+        break;
+    case Start:
+        request[length++] = UDS_READ_ID_PERIODIC;
+        request[length++] = stream.rate;
+        request[length++] = did & 0xFF;
+        break;
+    case StopSending:
+        request[length++] = UDS_READ_ID_PERIODIC;
+        request[length++] = 0x04;
+        request[length++] = did & 0xFF;
+        break;
+    default:
+        return;
+    }
+    channel.begin(0x7E0 + stream.ecu, 0x7E8 + stream.ecu, rxBuffer, sizeof(rxBuffer));
+    //an ECU commonly drops a request it is working on when another arrives
+    udsReader.yieldToClient();
+    if (!channel.send(request, length)) return;
+    current = idx;
+    sentMicros = micros();
+    deadline = sentMicros + PID_RESPONSE_TIMEOUT;
+    lastTesterPresent[stream.ecu] = millis(); //any request keeps the session open
+}
+
+void UDSStreamer::handleResponse(const uint8_t *message, uint16_t length)
+{
+    Stream &stream = streams[current];
+    if (message[0] == UDS_NEG_RESP)
+    {
+        if (length >= 3 && message[2] == NRC_RESPONSE_PENDING)
+        {
+            deadline = micros() + ELM_PENDING_TIMEOUT;
+            return;
+        }
+        current = -1;
+        //clearing a DID that isn't defined is refused and doesn't matter
+        if (stream.state == Clear || stream.state == StopSending || stream.state == Forget) advance(stream);
+        else fail(stream, (length >= 3) ? message[2] : UDS_NO_ANSWER);
+        return;
+    }
+    current = -1;
+    advance(stream);
+}
+
+void UDSStreamer::advance(Stream &stream)
+{
+    switch (stream.state)
+    {
+    case Session: stream.state = Clear; break;
+    case Clear: stream.state = Define; break;
+    case Define: stream.state = Start; break;
+    case Start:
+        stream.state = Running;
+        stream.lastFrameMillis = millis(); //the stall check counts from here
+        break;
+    case StopSending: stream.state = Forget; break;
+    case Forget: stream.state = Unused; break;
+    default: break;
+    }
+}
+
+void UDSStreamer::fail(Stream &stream, uint8_t status)
+{
+    LOG_DEBUG("Stream from ECU %i failed in %s with %X", stream.ecu, stateNames[stream.state], status);
+    stream.status = status;
+    stream.state = Failed;
+}
+
+//true if another stream has the ECU in the extended session already
+bool UDSStreamer::ecuStreaming(uint8_t ecu, int except)
+{
+    for (int i = 0; i < UDS_MAX_STREAMS; i++)
+    {
+        if (i != except && streams[i].ecu == ecu && streams[i].state == Running) return true;
+    }
+    return false;
+}
+
+//3E 80, tester present without an answer, to each ECU that streams once UDS_TESTER_PRESENT_MS passed
+bool UDSStreamer::sendTesterPresent()
+{
+    for (int ecu = 0; ecu < 8; ecu++)
+    {
+        if (!ecuStreaming(ecu, -1) || (uint32_t)(millis() - lastTesterPresent[ecu]) < UDS_TESTER_PRESENT_MS) continue;
+        CAN_FRAME frame;
+        frame.id = 0x7E0 + ecu;
+        frame.length = 8;
+        frame.rtr = 0;
+        frame.extended = 0;
+        frame.data.byte[0] = 0x02;
+        frame.data.byte[1] = UDS_TESTER_PRESENT;
+        frame.data.byte[2] = 0x80;
+        for (int i = 3; i < 8; i++) frame.data.byte[i] = 0xAA;
+        CAN0.sendFrame(frame);
+        lastTesterPresent[ecu] = millis();
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,128 @@
+/*
+ * UDSStreamer.h
+ *
+ * ECU side periodic streaming: defines a dynamic DID (UDS 0x2C) from parts of
+ * other DIDs, asks the ECU to send it on its own (0x2A) and keeps the
+ * diagnostic session open with tester present.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef UDSSTREAMER_H_
+#define UDSSTREAMER_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include <esp32_can.h>
+#include "IsoTp.h"
+
+//periodic DIDs F2F0 up, one per stream. Their low byte starts each periodic
+//frame and can't be mistaken for an ISO-TP PCI byte, which are all below 0x40
+#define UDS_STREAM_DID_BASE 0xF2F0
+
+//one range of a DID the ECU copies into the stream
+struct StreamPart {
+    uint16_t did;
+    uint8_t position;   //first byte, 1 based like 0x2C counts them
+    uint8_t size;       //1-4 bytes
+};
+
+//a part taken from a periodic frame, the bytes big endian
+struct StreamValue {
+    uint8_t ecu;        //0-7 for 7E8-7EF
+    uint8_t stream;
+    uint16_t did;
+    uint32_t raw;
+    uint32_t millis;
+};
+
+struct StreamStats {
+    uint8_t ecu;
+    uint8_t rate;       //0x2A transmission mode, 1 slow to 3 fast
+    uint8_t state;      //UDSStreamer::State
+    uint8_t status;     //negative response code or UDS_NO_ANSWER that stopped the set up, 0 otherwise
+    uint8_t parts;
+    uint32_t frames;
+    uint32_t restarts;  //set up again after the ECU stopped sending
+    uint32_t intervalAvg; //time between frames in microseconds
+};
+
+class UDSStreamer {
+public:
+    enum State {
+        Unused, Session, Clear, Define, Start, Running, StopSending, Forget, Failed
+    };
+
+    UDSStreamer();
+    void setup();
+    //busy while another requester has the bus, nothing is sent then
+    void loop(bool busy);
+    //true if the frame answered a set up request
+    bool processFrame(CAN_FRAME &frame);
+    //the values in a periodic frame of one of the streams, 0 for any other frame
+    int decode(CAN_FRAME &frame, StreamValue *values, int max);
+    //the ELM327 client sent a request of its own. The step in flight is asked again afterward
+    void yieldToClient();
+    //have ECU 0-7 send the parts as a dynamic DID at 0x2A rate 1-3. Returns the stream or -1
+    int start(uint8_t ecu, uint8_t rate, const StreamPart *parts, int count);
+    //stops the ECU sending and forgets the dynamic DID
+    bool stop(int stream);
+    bool getStats(int stream, StreamStats &stats);
+    //a request is on the bus, other requesters should hold off
+    bool isActive();
+    void printStats();
+    //one line per stream: stream ecu rate state status frames avg restarts
+    String toText(const char *lineEnding);
+
+private:
+    struct Stream {
+        State state;
+        uint8_t ecu;
+        uint8_t rate;
+        uint8_t status;
+        StreamPart parts[UDS_STREAM_MAX_PARTS];
+        uint8_t partCount;
+        uint32_t frames;
+        uint32_t restarts;
+        uint32_t lastFrame; //micros()
+        uint32_t lastFrameMillis;
+        uint64_t intervalSum;
+    };
+
+    Stream streams[UDS_MAX_STREAMS];
+    IsoTpChannel channel;
+    uint8_t rxBuffer[16];
+    uint8_t request[4 + 4 * UDS_STREAM_MAX_PARTS];
+    int current;            //stream whose request is on the bus, -1 for none
+    uint32_t sentMicros;
+    uint32_t deadline;
+    uint32_t lastTesterPresent[8];
+
+    void sendStep(int idx);
+    void handleResponse(const uint8_t *message, uint16_t length);
+    void advance(Stream &stream);
+    void fail(Stream &stream, uint8_t status);
+    bool ecuStreaming(uint8_t ecu, int except);
+    bool sendTesterPresent();
+};
+
+#endif /* UDSSTREAMER_H_ */
@@ -39,7 +39,8 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #define CFG_BUILD_NUM   112
 #define CFG_VERSION "Macchina OBDII May 1 2019"
-#define EEPROM_VER      0x24
+#define EEPROM_VER      0x28
+#define EEPROM_OLDEST_VER   0x24 //oldest settings layout SettingsStore can migrate from
 //How many devices to allow to connect to our WiFi port?
 #define MAX_CLIENTS 1
 
@@ -48,9 +49,134 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define NUM_PASS_FILTERS    32
 #define NUM_STM_BUFFER      32
 
+//Newest frame per ID for the coalesced monitors, see FrameTable
+#define FRAME_TABLE_SIZE        256 //IDs kept, frames with further IDs are left out
+#define FRAME_TABLE_EXT_SLOTS   512 //29 bit ID hash slots, a power of two at least twice FRAME_TABLE_SIZE
+#define MONITOR_MIN_INTERVAL    10 //ms, shortest rate a client can ask the newest frames for
+#define BUS_LOAD_WINDOW         1000 //ms the bus load is averaged over, see BusStats
+
 //How frequently to flush the serial buffer to wifi or bluetooth
 #define SER_BUFF_FLUSH_INTERVAL 50000
 
+//Periodic frame transmission. The timer wheel turns once every PERIODIC_WHEEL_SLOTS * PERIODIC_TICK_US
+//microseconds. Longer periods just take more turns. Send lateness is bounded by one tick plus loop() latency.
+#define MAX_PERIODIC_FRAMES     16
+#define PERIODIC_WHEEL_SLOTS    64
+#define PERIODIC_TICK_US        250
+#define PERIODIC_MIN_PERIOD     500
+#define PERIODIC_MAX_PERIOD     0x3FFFFFFFul
+
+//Lowest log level compiled into the image (0=debug, 1=info, 2=warn, 3=error, 4=off). The LOG_* macros for
+//levels below it generate no code at all. Set it to 0 for a development build where LOGLEVEL=0 should work.
+#define LOG_MIN_LEVEL       1
+
+//Log messages are captured into a ring (size must be a power of two) and written out by a background task
+#define LOG_RING_SIZE       32
+#define LOG_MAX_ARGS        12
+#define LOG_STRING_SPACE    96
+#define LOG_LINE_SIZE       200
+#define LOG_TASK_IDLE_MS    10
+
+//Per ECU/mode/PID response latency profiling. Buckets are half octaves, 48 of them reach past 8 seconds
+#define PID_PROFILE_KEYS        64
+#define PID_PROFILE_BUCKETS     48
+#define PID_RESPONSE_TIMEOUT    250000 //microseconds to wait for ECUs to answer a request
+#define PID_DECODE_VALUES       32 //latest decoded Mode 01 values kept, one per ECU/PID seen
+#define ELM_PENDING_TIMEOUT     5000000 //microseconds an ECU that answered "response pending" (7F xx 78) gets to finish
+
+//PIDs the device polls by itself, see PIDPoller. The plan is kept in settings
+#define POLL_MAX_PIDS           16
+#define POLL_MIN_PERIOD         10 //ms
+#define POLL_MAX_PRIORITY       3
+#define POLL_DEFAULT_BUDGET     20 //requests per second the ECUs are asked at most
+#define FEED_UDP_SUBSCRIBERS    2 //addresses the decoded value feed is also sent to as UDP datagrams
+#define FEED_BUFF_SIZE          1440 //bytes of feed output held until loop() sends it, one UDP datagram at most
+#define FEED_FLUSH_INTERVAL     20000 //microseconds feed output waits at most before it goes out
+
+//UDS ReadDataByIdentifier (0x22) with several DIDs to a request, see UDSReader
+#define UDS_MAX_DIDS            32 //DIDs one read can ask for
+#define UDS_MAX_BATCH           16 //DIDs per request at most, fewer if an ECU refuses that many
+#define UDS_MAX_DID_DATA        64 //bytes of each value kept
+#define UDS_LENGTH_CACHE        32 //DID lengths remembered so later reads can batch those DIDs
+#define ISOTP_BUFFER_SIZE       1024 //longest ISO-TP message reassembled
+
+//ECU side streaming with UDS 0x2C/0x2A, see UDSStreamer
+#define UDS_MAX_STREAMS         4 //dynamic DIDs the ECUs can be asked to send periodically at once
+#define UDS_STREAM_MAX_PARTS    7 //DID ranges one stream is put together from, a periodic frame holds 7 bytes
+#define UDS_TESTER_PRESENT_MS   2000 //keeps the session of a streaming ECU open, most time out (S3) after 5s
+#define UDS_STREAM_STALL_MS     3000 //a stream that sent nothing for this long is set up again
+
+//DTCs of all ECUs at once, see DTCSweep
+#define DTC_SWEEP_MAX           48 //DTCs one sweep keeps, the same code from several services counts once
+#define DTC_SWEEP_BUFFER        256 //longest answer taken from each ECU, 127 OBDII DTCs or 63 UDS ones
+#define DTC_SWEEP_STATUS_MASK   0x0D //0x19 02 status mask: failed, pending or confirmed
+
+//DBC style signals taken from any frame on the bus, see SignalDB
+#define SIGNAL_MAX              64 //definitions, all of them are stored in one flash sector
+#define SIGNAL_NAME_LEN         16
+#define SIGNAL_PARTITION        "spiffs" //the stock partition table's SPIFFS partition, which nothing else uses
+#define SIGNAL_STORE_OFFSET     0 //the definitions take the two sectors from here
+
+//Flight recording of every frame, see Recorder
+#define RECORDER_PARTITION      SIGNAL_PARTITION
+#define RECORDER_OFFSET         (SETTINGS_OFFSET + 0x2000) //after the settings, up to the end of the partition
+#define RECORDER_MAX_SECTORS    320 //blocks the time index has room for, the stock partition leaves 315
+#define RECORDER_CHUNK_SIZE     1024 //records gathered before they are written
+#define RECORDER_CHUNKS         4 //chunks queued for the writer task, more ride out longer erases
+#define RECORDER_FLUSH_MS       500 //a chunk that isn't full is written after this long, what a power loss can take
+#define RECORDER_DUMP_LINES     16 //candump lines a console export prints per loop()
+#define RECORDER_FLASH_CYCLES   100000 //erase cycles a sector is rated for, for the wear estimate
+
+//Capture of the frames around an event, see TriggerEngine
+#define TRIGGER_MAX             16
+#define TRIGGER_RING_SIZE       1024 //frames, must be a power of two. Half a second of a busy 500kbit bus
+#define TRIGGER_PRE_MS          250 //default window before the trigger
+#define TRIGGER_POST_MS         250 //and after it
+
+//Log playback onto CAN0 with the recorded timing, see Player
+#define PLAYBACK_UPLOAD_FRAMES  512 //frames uploaded over GVRET it can hold
+#define PLAYBACK_QUEUE          64 //frames read ahead for the timer, must be a power of two
+#define PLAYBACK_FILTERS        8
+#define PLAYBACK_MAX_SPEED      10000 //percent
+#define PLAYBACK_LEAD_MS        20 //from the start to the first frame, time to fill the queue
+#define PLAYBACK_LOOP_GAP_MS    100 //from the last frame of a pass to the first of the next in loop mode
+#define PLAYBACK_LATE_US        500 //frames sent later than this are counted as late
+#define PLAYBACK_IDLE_US        1000 //how often the timer looks for frames while the queue is empty
+
+//Uncomment to record loop() phases with the CPU cycle counter. Dump them with TRACE on the console.
+//#define TRACE_ENABLED
+#define TRACE_RING_SIZE     512 //events, must be a power of two
+
+//Latency histograms have log2 buckets: 0, 1, 2-3, 4-7 ... microseconds. 24 buckets reach past 8 seconds
+#define METRIC_HIST_BUCKETS 24
+//A write to a client socket that comes up short or takes longer than this is counted as a stall
+#define SOCKET_STALL_US     10000
+
+#define BOOT_PROFILE_STAGES     16 //startup stages BootProfile keeps timestamps for
+#define SOFTAP_RETRIES          5 //times to redo the softAP config if it comes up on the wrong address
+
+#define SETTINGS_PARTITION      SIGNAL_PARTITION //flash partition the settings slots rotate through
+#define SETTINGS_OFFSET         (SIGNAL_STORE_OFFSET + 0x2000) //the slots take the two sectors from here, after the signal definitions
+#define SETTINGS_OLD_PARTITION  "eeprom" //single sector older builds kept their records in, picked up once
+#define SETTINGS_COMMIT_DELAY   2000 //ms settings must stay unchanged before they're written out
+#define SETTINGS_SLOT_SIZE      512 //bytes per stored record, header included. Changing it orphans stored settings
+
+#define OTA_BUFFER_SIZE         1024 //bytes read from the socket per flash write
+#define OTA_READ_TIMEOUT        5000 //ms without data before a download connection is given up and resumed
+#define OTA_MAX_RETRIES         8 //reconnects in a row without progress before an update is abandoned
+#define OTA_RETRY_DELAY         2000 //ms to wait before reconnecting
+#define OTA_TASK_PRIORITY       1 //below loop() so the download only gets otherwise idle time
+#define OTA_WIFI_TIMEOUT        20000 //ms to wait for the client AP before giving up on an update
+
+//One PID in the poll plan. A period of 0 marks an unused entry
+struct PollPlanEntry {
+    uint8_t pid;
+    uint8_t priority; //0 - POLL_MAX_PRIORITY, higher goes first when the budget runs short
+    uint16_t periodMs;
+};
+
+//Only ever add fields to the end of this struct and bump EEPROM_VER when doing so.
+//SettingsStore then carries stored values over and new fields get their defaults.
 struct EEPROMSettings {
     uint8_t version;
 
@@ -69,6 +195,18 @@ struct EEPROMSettings {
     char btName[32];
     uint8_t wifiChannel;
     uint8_t wifiTxPower;
+    //added in 0x25
+    char otaHost[64];
+    char otaPath[96];
+    uint16_t otaPort;
+    //added in 0x26
+    uint16_t otaRateLimit; //KB/s a background firmware download may use, 0 for no limit
+    //added in 0x27
+    PollPlanEntry pollPlan[POLL_MAX_PIDS];
+    uint16_t pollRequestId; //0x7DF asks every ECU, 0x7E0 - 0x7E7 just one
+    uint8_t pollBudget; //requests per second, 0 stops polling
+    //added in 0x28
+    uint8_t recordFrames; //1 keeps a flight recording of every frame, see Recorder
 };
 
 enum STATE {
@@ -85,7 +223,13 @@ enum STATE {
     SET_SINGLEWIRE_MODE,
     SET_SYSTYPE,
     ECHO_CAN_FRAME,
-    SETUP_EXT_BUSES
+    SETUP_EXT_BUSES,
+    SETUP_PERIODIC,
+    UDS_READ,
+    SET_COALESCE,
+    GET_RECORDING,
+    PLAYBACK_UPLOAD,
+    PLAYBACK_CONTROL,
 };
 
 enum GVRET_PROTOCOL
@@ -104,7 +248,19 @@ enum GVRET_PROTOCOL
     PROTO_ECHO_CAN_FRAME = 11,
     PROTO_GET_NUMBUSES = 12,
     PROTO_GET_EXT_BUSES = 13,
-    PROTO_SET_EXT_BUSES = 14
+    PROTO_SET_EXT_BUSES = 14,
+    //Commands from 0x20 up are specific to this firmware so they won't collide with upstream GVRET
+    PROTO_SET_PERIODIC = 0x20,
+    PROTO_GET_PERIODIC_STATS = 0x21,
+    PROTO_GET_METRICS = 0x22,
+    PROTO_UDS_READ = 0x23,
+    PROTO_SET_COALESCE = 0x24,
+    PROTO_GET_SNAPSHOT = 0x25,
+    PROTO_GET_BUS_STATS = 0x26,
+    PROTO_GET_RECORDING = 0x27,
+    PROTO_GET_CAPTURE = 0x28,
+    PROTO_PLAYBACK_UPLOAD = 0x29,
+    PROTO_PLAYBACK = 0x2A
 };
 
 extern EEPROMSettings settings;
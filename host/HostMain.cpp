@@ -0,0 +1,86 @@
+/*
+ * HostMain.cpp
+ *
+ * Runs the firmware on a workstation: setup() once, then loop() forever, with
+ * the console on stdin/stdout.
+ *
+ *     macchina_host [--can <interface>] [--port-offset <n>] [--bind <address>]
+ *
+ * --can puts CAN0 on a SocketCAN interface such as vcan0 instead of the
+ * in-process bus. --port-offset moves every listening port up by n, 10000 by
+ * default so the GVRET port 23 works without root.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <esp32_can.h>
+#include "EcuSimulator.h"
+#include "Hal.h"
+
+void setup();
+void loop();
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [--can <interface>] [--sim <script | default>] [--port-offset <n>] [--bind <address>]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static SocketCanBus socketBus;
+    static EcuSimulator sim;
+    bool simulate = false;
+    uint16_t portOffset = 10000;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 >= argc) usage(argv[0]);
+        if (!strcmp(argv[i], "--can"))
+        {
+            if (!socketBus.open(argv[++i]))
+            {
+                fprintf(stderr, "Can't open CAN interface %s\n", argv[i]);
+                return 1;
+            }
+            CAN0.attach(&socketBus);
+        }
+        else if (!strcmp(argv[i], "--sim"))
+        {
+            i++;
+            if (!strcmp(argv[i], "default") ? !sim.loadDefault() : !sim.loadScript(argv[i])) return 1;
+            simulate = true;
+        }
+        else if (!strcmp(argv[i], "--port-offset")) portOffset = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--bind")) Hal::setBindAddress(argv[++i]);
+        else usage(argv[0]);
+    }
+    Hal::setPortOffset(portOffset);
+    //simulated ECUs go on the bus CAN0 uses
+    if (simulate) sim.attach(CAN0.getBus() ? *CAN0.getBus() : Hal::getDefaultCanBus());
+    setvbuf(stdout, NULL, _IOLBF, 0); //console output shows up right away even when piped
+    fprintf(stderr, "ELM327 on port %u, GVRET on port %u\n", Hal::mapPort(35000), Hal::mapPort(23));
+
+    setup();
+    for (;;) loop();
+}
@@ -0,0 +1,96 @@
+/*
+ * Baseline.cpp
+ *
+ * Benchmark baselines, see Baseline.h
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "Baseline.h"
+#include <fstream>
+#include <sstream>
+
+bool Baseline::load(const char *path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        fprintf(stderr, "%s: can't open\n", path);
+        return false;
+    }
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        lineNumber++;
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) line.erase(comment);
+        std::istringstream words(line);
+        std::string name, direction;
+        Entry entry;
+        entry.tolerance = -1;
+        if (!(words >> name)) continue;
+        if (!(words >> entry.value >> direction) || (direction != "higher" && direction != "lower"))
+        {
+            fprintf(stderr, "%s:%i: expected <name> <value> <higher | lower> [tolerance %%]\n", path, lineNumber);
+            return false;
+        }
+        words >> entry.tolerance;
+        entry.higherIsBetter = (direction == "higher");
+        entries[name] = entry;
+    }
+    return true;
+}
+
+bool Baseline::save(const char *path, const std::vector<BenchMetric> &metrics, double tolerance)
+{
+    FILE *file = fopen(path, "w");
+    if (!file) return false;
+    fprintf(file, "# workload_bench baseline: <name> <value> <higher | lower> [tolerance %%]\n");
+    for (const BenchMetric &metric : metrics)
+    {
+        fprintf(file, "%s %.6g %s %.0f\n", metric.name.c_str(), metric.value, metric.higherIsBetter ? "higher" : "lower", tolerance);
+    }
+    return fclose(file) == 0;
+}
+
+int Baseline::check(const std::vector<BenchMetric> &metrics, double defaultTolerance, FILE *out)
+{
+    int regressions = 0;
+    for (const BenchMetric &metric : metrics)
+    {
+        auto found = entries.find(metric.name);
+        if (found == entries.end())
+        {
+            fprintf(out, "%-32s %12.2f %-8s no baseline\n", metric.name.c_str(), metric.value, metric.unit);
+            continue;
+        }
+        const Entry &entry = found->second;
+        double tolerance = (entry.tolerance >= 0) ? entry.tolerance : defaultTolerance;
+        double limit = entry.higherIsBetter ? entry.value * (1 - tolerance / 100) : entry.value * (1 + tolerance / 100);
+        bool regressed = entry.higherIsBetter ? (metric.value < limit) : (metric.value > limit);
+        if (regressed) regressions++;
+        fprintf(out, "%-32s %12.2f %-8s baseline %.2f, limit %.2f%s\n", metric.name.c_str(), metric.value, metric.unit,
+                entry.value, limit, regressed ? "  REGRESSED" : "");
+    }
+    return regressions;
+}
@@ -0,0 +1,58 @@
+/*
+ * Baseline.h
+ *
+ * Stored benchmark results to check new runs against. One metric per line,
+ * '#' starts a comment:
+ *   <name> <value> <higher | lower> [tolerance %]
+ * A result fails when it is worse than the stored value by more than the
+ * tolerance, the line's own or the default.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef BASELINE_H_
+#define BASELINE_H_
+
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "Workloads.h"
+
+class Baseline {
+public:
+    bool load(const char *path);
+    static bool save(const char *path, const std::vector<BenchMetric> &metrics, double tolerance);
+    //prints a line per metric, returns how many regressed
+    int check(const std::vector<BenchMetric> &metrics, double defaultTolerance, FILE *out);
+
+private:
+    struct Entry {
+        double value;
+        bool higherIsBetter;
+        double tolerance;   //percent, negative for the default
+    };
+
+    std::map<std::string, Entry> entries;
+};
+
+#endif /* BASELINE_H_ */
@@ -0,0 +1,99 @@
+/*
+ * BenchMain.cpp
+ *
+ * Runs the app-shaped workloads and checks them against a stored baseline.
+ * Exits non-zero when a workload fails or a result regresses.
+ *   workload_bench [--baseline <file>] [--write-baseline <file>] [--tolerance <%>] [workload ...]
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <unistd.h>
+#include "Baseline.h"
+#include "Hal.h"
+#include "Workloads.h"
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [--baseline <file>] [--write-baseline <file>] [--tolerance <%%>] [connect | dashboard | stm | savvycan ...]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *baselinePath = NULL;
+    const char *writePath = NULL;
+    double tolerance = 30;
+    std::vector<std::string> names;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--baseline") && i + 1 < argc) baselinePath = argv[++i];
+        else if (!strcmp(argv[i], "--write-baseline") && i + 1 < argc) writePath = argv[++i];
+        else if (!strcmp(argv[i], "--tolerance") && i + 1 < argc) tolerance = atof(argv[++i]);
+        else if (argv[i][0] == '-') usage(argv[0]);
+        else names.push_back(argv[i]);
+    }
+    if (names.empty()) names = {"connect", "dashboard", "stm", "savvycan"};
+
+    Baseline baseline;
+    if (baselinePath && !baseline.load(baselinePath)) return 1;
+
+    //firmware console output would get mixed into the report
+    Hal::setPortOffset(20000 + getpid() % 10000);
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+
+    Workloads workloads;
+    if (!workloads.start(Workloads::Options()))
+    {
+        fprintf(stderr, "The firmware didn't come up\n");
+        return 1;
+    }
+    int failed = 0;
+    for (const std::string &name : names)
+    {
+        bool ok;
+        if (name == "connect") ok = workloads.runConnect();
+        else if (name == "dashboard") ok = workloads.runDashboard();
+        else if (name == "stm") ok = workloads.runStm();
+        else if (name == "savvycan") ok = workloads.runSavvyCan();
+        else usage(argv[0]);
+        if (!ok)
+        {
+            fprintf(report, "%s: FAILED to run\n", name.c_str());
+            failed++;
+        }
+    }
+
+    if (baselinePath) failed += baseline.check(workloads.getMetrics(), tolerance, report);
+    else workloads.print(report);
+    if (writePath && !Baseline::save(writePath, workloads.getMetrics(), tolerance))
+    {
+        fprintf(stderr, "Can't write %s\n", writePath);
+        failed++;
+    }
+    fprintf(report, "%s\n", failed ? "REGRESSED" : "ok");
+    fclose(report);
+    _exit(failed ? 1 : 0); //the firmware's tasks never end
+}
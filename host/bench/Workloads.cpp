@@ -0,0 +1,289 @@
+/*
+ * Workloads.cpp
+ *
+ * App-shaped benchmark workloads, see Workloads.h
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "Workloads.h"
+#include <Arduino.h>
+#include <WiFi.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "ElmBench.h"
+#include "Hal.h"
+#include "config.h"
+#include "Metrics.h"
+
+void loop();
+extern MetricCounter stmDrops;
+
+typedef std::chrono::steady_clock Clock;
+
+#define TRAFFIC_BASE_ID     0x100 //background traffic uses 0x100-0x17F
+#define GVRET_SEND_ID       0x5A5 //frames the SavvyCAN client sends
+#define GVRET_SEND_INTERVAL 10 //ms between them
+
+static uint64_t microsSince(Clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+}
+
+//Steady background traffic from its own thread, the way the car's ECUs put it on the bus.
+//Also counts what other nodes send with one ID.
+class BusTraffic : public CanNode {
+public:
+    BusTraffic(uint32_t watchId = 0) : sent(0), received(0), watchId(watchId)
+    {
+        Hal::getDefaultCanBus().attach(this);
+    }
+    ~BusTraffic()
+    {
+        if (thread.joinable()) thread.join();
+        Hal::getDefaultCanBus().detach(this);
+    }
+    void frameReceived(const CAN_FRAME &frame) override
+    {
+        if (frame.id == watchId) received++;
+    }
+    void start(uint32_t rate, uint32_t millis)
+    {
+        uint32_t count = (uint64_t)rate * millis / 1000;
+        thread = std::thread([this, rate, count] {
+            Clock::time_point start = Clock::now();
+            for (uint32_t i = 0; i < count; i++)
+            {
+                std::this_thread::sleep_until(start + std::chrono::microseconds((uint64_t)i * 1000000 / rate));
+                CAN_FRAME frame;
+                frame.id = TRAFFIC_BASE_ID + (i & 0x7F);
+                frame.extended = 0;
+                frame.rtr = 0;
+                frame.length = 8;
+                for (int b = 0; b < 8; b++) frame.data.bytes[b] = (uint8_t)(i >> (b & 3));
+                Hal::getDefaultCanBus().send(this, frame);
+                sent++;
+            }
+        });
+    }
+
+    std::atomic<uint32_t> sent;
+    std::atomic<uint32_t> received;
+
+private:
+    std::thread thread;
+    uint32_t watchId;
+};
+
+bool Workloads::start(const Options &newOptions)
+{
+    static bool started = false;
+    if (started) return true;
+    options = newOptions;
+    if (!sim.loadDefault()) return false;
+    sim.setDelay(0, options.ecuDelay);
+    sim.setDelay(1, options.ecuDelay);
+    sim.attach(Hal::getDefaultCanBus());
+
+    //brings the firmware up so the first workload doesn't time startup
+    ElmBench elm;
+    if (!elm.connect()) return false;
+    elm.disconnect();
+    started = true;
+    return true;
+}
+
+void Workloads::add(const char *name, double value, bool higherIsBetter, const char *unit)
+{
+    BenchMetric metric = {name, value, higherIsBetter, unit};
+    metrics.push_back(metric);
+}
+
+//What an app sends on connecting, timed from the TCP connect to the 0100 answer
+bool Workloads::runConnect()
+{
+    std::vector<uint32_t> times;
+    for (uint32_t round = 0; round < options.connectRounds; round++)
+    {
+        ElmBench elm;
+        std::string reply;
+        uint32_t micros;
+        Clock::time_point start = Clock::now();
+        if (!elm.connect({"atz", "ate0", "atl0", "ath1", "atsp0"})) return false;
+        if (!elm.request("0100", reply, micros) || reply.find("4100") == std::string::npos) return false;
+        times.push_back(microsSince(start));
+        elm.disconnect();
+    }
+    std::sort(times.begin(), times.end());
+    add("connect.first_data_p50", times[times.size() / 2] / 1000.0, false, "ms");
+    add("connect.first_data_max", times.back() / 1000.0, false, "ms");
+    return true;
+}
+
+//A gauge screen: ten PIDs round robin, each one waiting for the last
+bool Workloads::runDashboard()
+{
+    ElmBench elm;
+    if (!elm.connect({"atz", "ate0", "atl0", "ath0"})) return false;
+    Clock::time_point start = Clock::now();
+    std::vector<ElmBench::Result> results = elm.run({"0104", "0105", "010B", "010C", "010D", "010F", "0110", "0111", "012F", "0146"},
+                                                    options.dashboardRounds);
+    uint64_t elapsed = microsSince(start);
+    elm.disconnect();
+
+    const ElmBench::Result &all = results.back();
+    add("dashboard.pids_per_sec", (all.count - all.noData) * 1000000.0 / elapsed, true, "PIDs/s");
+    add("dashboard.rtt_p50", all.p50, false, "us");
+    add("dashboard.rtt_p99", all.p99, false, "us");
+    add("dashboard.no_data", all.noData, false, "requests");
+    return true;
+}
+
+//STM prints every frame as it comes in. Only the Bluetooth build passes frames to it
+bool Workloads::runStm()
+{
+#ifdef BLUETOOTH
+    ElmBench elm;
+    if (!elm.connect()) return false;
+    elm.send("stm");
+    uint32_t dropsBefore = stmDrops.get();
+
+    BusTraffic traffic;
+    Clock::time_point start = Clock::now();
+    traffic.start(options.trafficRate, options.trafficMillis);
+    std::string out = elm.receive(options.trafficMillis + 200);
+    uint64_t elapsed = std::min<uint64_t>(microsSince(start), options.trafficMillis * 1000ull);
+    elm.disconnect();
+
+    //frames buffered before STM went on come out first, only the traffic is counted
+    uint32_t lines = 0;
+    uint64_t bytes = 0;
+    size_t lineStart = 0;
+    for (size_t i = 0; i < out.size(); i++)
+    {
+        if (out[i] != '\r') continue;
+        if (out[lineStart] == '1')
+        {
+            lines++;
+            bytes += i + 1 - lineStart;
+        }
+        lineStart = i + 1;
+    }
+    add("stm.frames_per_sec", lines * 1000000.0 / elapsed, true, "frames/s");
+    add("stm.bytes_per_sec", bytes * 1000000.0 / elapsed, true, "bytes/s");
+    add("stm.delivered", traffic.sent ? lines * 100.0 / traffic.sent : 0, true, "%");
+    add("stm.drops", stmDrops.get() - dropsBefore, false, "frames");
+#endif
+    return true;
+}
+
+//SavvyCAN in binary mode capturing the traffic while sending a frame of its own every 10ms
+bool Workloads::runSavvyCan()
+{
+#ifndef BLUETOOTH
+    WiFiClient gvret;
+    uint32_t startMillis = millis();
+    while (millis() - startMillis < 2000 && !gvret.connect("127.0.0.1", Hal::mapPort(23))) loop();
+    if (!gvret.connected()) return false;
+    const uint8_t hello[] = {0xE7, 0xE7, 0xF1, PROTO_GET_CANBUS_PARAMS, 0xF1, PROTO_GET_DEV_INFO};
+    gvret.write(hello, sizeof(hello));
+
+    BusTraffic traffic(GVRET_SEND_ID);
+    std::vector<uint8_t> pending;
+    uint32_t captured = 0, sends = 0, replies = 0;
+    uint64_t bytes = 0, firstFrame = 0;
+    Clock::time_point start = Clock::now();
+    traffic.start(options.trafficRate, options.trafficMillis);
+    uint64_t end = (options.trafficMillis + 200) * 1000ull;
+    uint64_t now;
+    while ((now = microsSince(start)) < end)
+    {
+        loop();
+        if (now < options.trafficMillis * 1000ull && now / 1000 >= sends * GVRET_SEND_INTERVAL)
+        {
+            uint8_t send[] = {0xF1, PROTO_BUILD_CAN_FRAME, GVRET_SEND_ID & 0xFF, GVRET_SEND_ID >> 8, 0, 0, 0, 8,
+                              1, 2, 3, 4, 5, 6, 7, (uint8_t)sends, 0};
+            gvret.write(send, sizeof(send));
+            sends++;
+        }
+        uint8_t buffer[2048];
+        int n = gvret.read(buffer, sizeof(buffer));
+        if (n <= 0) continue;
+        bytes += n;
+        pending.insert(pending.end(), buffer, buffer + n);
+
+        //F1 <command> <payload>. Frames are 12 bytes plus the data
+        size_t pos = 0;
+        while (pending.size() - pos >= 2)
+        {
+            if (pending[pos] != 0xF1)
+            {
+                pos++;
+                continue;
+            }
+            size_t length;
+            uint8_t command = pending[pos + 1];
+            if (command == PROTO_BUILD_CAN_FRAME) length = (pending.size() - pos >= 11) ? 12 + (pending[pos + 10] & 0xF) : 0;
+            else if (command == PROTO_GET_CANBUS_PARAMS) length = 12;
+            else if (command == PROTO_GET_DEV_INFO) length = 8;
+            else
+            {
+                pos++;
+                continue;
+            }
+            if (!length || pending.size() - pos < length) break;
+            if (command == PROTO_BUILD_CAN_FRAME)
+            {
+                uint32_t id = pending[pos + 6] | (pending[pos + 7] << 8) | (pending[pos + 8] << 16) | ((uint32_t)pending[pos + 9] << 24);
+                if (id >= TRAFFIC_BASE_ID && id < TRAFFIC_BASE_ID + 0x80)
+                {
+                    if (!captured) firstFrame = now;
+                    captured++;
+                }
+            }
+            else replies++;
+            pos += length;
+        }
+        pending.erase(pending.begin(), pending.begin() + pos);
+    }
+    gvret.stop();
+
+    double seconds = options.trafficMillis / 1000.0;
+    add("savvycan.frames_per_sec", captured / seconds, true, "frames/s");
+    add("savvycan.bytes_per_sec", bytes / seconds, true, "bytes/s");
+    add("savvycan.captured", traffic.sent ? captured * 100.0 / traffic.sent : 0, true, "%");
+    add("savvycan.sent", sends ? traffic.received * 100.0 / sends : 0, true, "%");
+    add("savvycan.first_frame", firstFrame / 1000.0, false, "ms");
+    add("savvycan.replies", replies, true, "replies");
+#endif
+    return true;
+}
+
+void Workloads::print(FILE *out)
+{
+    for (const BenchMetric &metric : metrics)
+    {
+        fprintf(out, "%-32s %12.2f %s\n", metric.name.c_str(), metric.value, metric.unit);
+    }
+}
@@ -0,0 +1,77 @@
+/*
+ * Workloads.h
+ *
+ * App-shaped workloads run against the firmware on the host HAL, with
+ * simulated ECUs and bus traffic on the CAN side and loopback clients on the
+ * ELM327 and GVRET ports:
+ *   connect     what an OBDII app sends on connecting, ATZ through 0100
+ *   dashboard   ten PIDs polled round robin like a gauge screen
+ *   stm         STM sniffing busy bus traffic (Bluetooth build)
+ *   savvycan    SavvyCAN capturing busy bus traffic while sending (WiFi build)
+ * Each one reports metrics that Baseline checks against stored values.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef WORKLOADS_H_
+#define WORKLOADS_H_
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "EcuSimulator.h"
+
+struct BenchMetric {
+    std::string name;       //workload.metric
+    double value;
+    bool higherIsBetter;
+    const char *unit;
+};
+
+class Workloads {
+public:
+    struct Options {
+        uint32_t connectRounds = 20;
+        uint32_t dashboardRounds = 50;      //times through the ten PIDs
+        uint32_t trafficRate = 2000;        //frames per second of background traffic, about half of a 500k bus
+        uint32_t trafficMillis = 1000;
+        uint32_t ecuDelay = 2000;           //microseconds the simulated ECUs take to answer
+    };
+
+    //starts the firmware and the simulated ECUs, only runs once
+    bool start(const Options &options);
+    bool runConnect();
+    bool runDashboard();
+    bool runStm();
+    bool runSavvyCan();
+    const std::vector<BenchMetric> &getMetrics() { return metrics; }
+    void print(FILE *out);
+
+private:
+    void add(const char *name, double value, bool higherIsBetter, const char *unit);
+
+    Options options;
+    EcuSimulator sim;
+    std::vector<BenchMetric> metrics;
+};
+
+#endif /* WORKLOADS_H_ */
@@ -0,0 +1,164 @@
+/*
+ * CanBus.cpp
+ *
+ * In-process and SocketCAN buses for the host build.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "CanBus.h"
+#include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#endif
+
+void CanBus::attach(CanNode *node)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (std::find(nodes.begin(), nodes.end(), node) == nodes.end()) nodes.push_back(node);
+}
+
+void CanBus::detach(CanNode *node)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    nodes.erase(std::remove(nodes.begin(), nodes.end(), node), nodes.end());
+}
+
+//The node list is copied so a node can answer from inside frameReceived()
+void CanBus::deliver(CanNode *from, const CAN_FRAME &frame)
+{
+    std::vector<CanNode *> targets;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        targets = nodes;
+        frames++;
+    }
+    for (CanNode *node : targets)
+    {
+        if (node != from) node->frameReceived(frame);
+    }
+}
+
+bool MemoryCanBus::send(CanNode *from, const CAN_FRAME &frame)
+{
+    deliver(from, frame);
+    return true;
+}
+
+SocketCanBus::SocketCanBus()
+{
+    fd = -1;
+    running = false;
+}
+
+SocketCanBus::~SocketCanBus()
+{
+    running = false;
+    if (fd >= 0) close(fd);
+}
+
+#ifdef __linux__
+bool SocketCanBus::open(const char *interface)
+{
+    struct ifreq ifr;
+    struct sockaddr_can addr;
+
+    fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (fd < 0) return false;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, interface, IFNAMSIZ - 1);
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) goto fail;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) goto fail;
+
+    pthread_t thread;
+    running = true;
+    if (pthread_create(&thread, NULL, readerThread, this)) goto fail;
+    pthread_detach(thread);
+    return true;
+
+fail:
+    running = false;
+    close(fd);
+    fd = -1;
+    return false;
+}
+
+bool SocketCanBus::send(CanNode *from, const CAN_FRAME &frame)
+{
+    struct can_frame out;
+    memset(&out, 0, sizeof(out));
+    out.can_id = frame.extended ? ((frame.id & CAN_EFF_MASK) | CAN_EFF_FLAG) : (frame.id & CAN_SFF_MASK);
+    if (frame.rtr) out.can_id |= CAN_RTR_FLAG;
+    out.can_dlc = (frame.length > 8) ? 8 : frame.length;
+    memcpy(out.data, frame.data.bytes, 8);
+    if (fd < 0 || write(fd, &out, sizeof(out)) != sizeof(out)) return false;
+    deliver(from, frame);
+    return true;
+}
+
+void *SocketCanBus::readerThread(void *arg)
+{
+    SocketCanBus *bus = (SocketCanBus *)arg;
+    struct can_frame in;
+    while (bus->running)
+    {
+        if (read(bus->fd, &in, sizeof(in)) != sizeof(in)) continue;
+        if (in.can_id & CAN_ERR_FLAG) continue;
+        CAN_FRAME frame;
+        frame.extended = (in.can_id & CAN_EFF_FLAG) ? 1 : 0;
+        frame.rtr = (in.can_id & CAN_RTR_FLAG) ? 1 : 0;
+        frame.id = in.can_id & (frame.extended ? CAN_EFF_MASK : CAN_SFF_MASK);
+        frame.length = in.can_dlc;
+        memcpy(frame.data.bytes, in.data, 8);
+        bus->deliver(NULL, frame);
+    }
+    return NULL;
+}
+#else
+bool SocketCanBus::open(const char *interface)
+{
+    (void)interface;
+    return false;
+}
+
+bool SocketCanBus::send(CanNode *from, const CAN_FRAME &frame)
+{
+    (void)from; (void)frame;
+    return false;
+}
+
+void *SocketCanBus::readerThread(void *arg)
+{
+    (void)arg;
+    return NULL;
+}
+#endif
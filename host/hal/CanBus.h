@@ -0,0 +1,76 @@
+/*
+ * CanBus.h
+ *
+ * CAN buses the host build can put CAN0 on. MemoryCanBus connects nodes inside
+ * the process, SocketCanBus puts them on a Linux SocketCAN interface such as
+ * vcan0 so candump, cansend or another process can take part.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef CANBUS_H_
+#define CANBUS_H_
+
+#include <esp32_can.h>
+#include <mutex>
+#include <vector>
+
+class CanBus {
+public:
+    virtual ~CanBus() {}
+    void attach(CanNode *node);
+    void detach(CanNode *node);
+    //put a frame on the bus. Every attached node except the sender gets it
+    virtual bool send(CanNode *from, const CAN_FRAME &frame) = 0;
+    uint32_t getFrameCount() { return frames; }
+
+protected:
+    void deliver(CanNode *from, const CAN_FRAME &frame);
+
+    std::mutex lock;
+    std::vector<CanNode *> nodes;
+    uint32_t frames = 0;
+};
+
+//Frames are handed straight to the other nodes from the sending thread
+class MemoryCanBus : public CanBus {
+public:
+    bool send(CanNode *from, const CAN_FRAME &frame) override;
+};
+
+//Frames go through a raw CAN socket. A reader thread hands frames from other
+//processes to the attached nodes, frames between local nodes skip the socket.
+class SocketCanBus : public CanBus {
+public:
+    SocketCanBus();
+    ~SocketCanBus();
+    bool open(const char *interface);
+    bool send(CanNode *from, const CAN_FRAME &frame) override;
+
+private:
+    static void *readerThread(void *arg);
+
+    int fd;
+    bool running;
+};
+
+#endif /* CANBUS_H_ */
@@ -0,0 +1,58 @@
+/*
+ * Hal.cpp
+ *
+ * Host stand-in settings.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "Hal.h"
+
+uint16_t Hal::portOffset = 0;
+const char *Hal::bindAddress = "127.0.0.1";
+
+//CAN0 and CAN1 start out on this bus unless attached somewhere else
+CanBus &Hal::getDefaultCanBus()
+{
+    static MemoryCanBus bus;
+    return bus;
+}
+
+void Hal::setPortOffset(uint16_t offset)
+{
+    portOffset = offset;
+}
+
+uint16_t Hal::mapPort(uint16_t port)
+{
+    return port + portOffset;
+}
+
+void Hal::setBindAddress(const char *address)
+{
+    bindAddress = address;
+}
+
+const char *Hal::getBindAddress()
+{
+    return bindAddress;
+}
@@ -0,0 +1,54 @@
+/*
+ * Hal.h
+ *
+ * Settings for the host stand-ins that have no equivalent on the ESP32: which
+ * bus CAN0 is on and where the WiFi servers listen. Servers bind to loopback
+ * by default and every listening port can be shifted by an offset so port 23
+ * works without root and several instances can run side by side. Tests can also
+ * resize the in-memory flash partitions and cut flash writes off part way.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef HAL_H_
+#define HAL_H_
+
+#include <stdint.h>
+#include "CanBus.h"
+
+class Hal {
+public:
+    static CanBus &getDefaultCanBus();
+    static void setPortOffset(uint16_t offset);
+    static uint16_t mapPort(uint16_t port);
+    static void setBindAddress(const char *address);
+    static const char *getBindAddress();
+    //the in-memory flash, implemented in esp_partition.cpp
+    static bool setPartitionSize(const char *label, uint32_t size);
+    static void setFlashWriteLimit(int32_t bytes);
+
+private:
+    static uint16_t portOffset;
+    static const char *bindAddress;
+};
+
+#endif /* HAL_H_ */
@@ -0,0 +1,45 @@
+/*
+ * Percentile.h
+ *
+ * Percentiles of latency samples for the host benchmarks and replay stats.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef PERCENTILE_H_
+#define PERCENTILE_H_
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+//nearest rank percentile. Reorders samples, which is fine for callers that are done collecting them
+inline uint32_t percentile(std::vector<uint32_t> &samples, double percent)
+{
+    if (samples.empty()) return 0;
+    size_t index = (size_t)(samples.size() * percent / 100.0);
+    if (index >= samples.size()) index = samples.size() - 1;
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+#endif /* PERCENTILE_H_ */
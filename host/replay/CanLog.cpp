@@ -0,0 +1,306 @@
+/*
+ * CanLog.cpp
+ *
+ * candump, GVRET CSV and SavvyCAN capture reader.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "CanLog.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+CanLog::CanLog()
+{
+    format = Unknown;
+    stream = NULL;
+    mapped = NULL;
+    mappedLength = 0;
+    position = 0;
+    ownsMapping = false;
+    havePending = false;
+    badLines = 0;
+}
+
+CanLog::~CanLog()
+{
+    close();
+}
+
+bool CanLog::open(const char *path, bool useMmap)
+{
+    close();
+    if (!strcmp(path, "-")) stream = stdin;
+    else if (useMmap)
+    {
+        int fd = ::open(path, O_RDONLY);
+        struct stat info;
+        if (fd < 0) return false;
+        if (fstat(fd, &info) < 0 || info.st_size == 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) return false;
+        madvise(data, info.st_size, MADV_SEQUENTIAL);
+        mapped = (const char *)data;
+        mappedLength = info.st_size;
+        ownsMapping = true;
+    }
+    else stream = fopen(path, "r");
+
+    if (!stream && !mapped) return false;
+    return detectFormat();
+}
+
+bool CanLog::openStream(FILE *file)
+{
+    close();
+    stream = file;
+    return stream && detectFormat();
+}
+
+bool CanLog::openText(const char *text, size_t length)
+{
+    close();
+    mapped = text;
+    mappedLength = length;
+    return detectFormat();
+}
+
+void CanLog::close()
+{
+    if (ownsMapping) munmap((void *)mapped, mappedLength);
+    if (stream && stream != stdin) fclose(stream);
+    stream = NULL;
+    mapped = NULL;
+    mappedLength = 0;
+    position = 0;
+    ownsMapping = false;
+    format = Unknown;
+    badLines = 0;
+}
+
+bool CanLog::rewind()
+{
+    position = 0;
+    if (stream && fseek(stream, 0, SEEK_SET)) return false;
+    return detectFormat();
+}
+
+const char *CanLog::getFormatName(Format format)
+{
+    switch (format)
+    {
+    case Candump: return "candump";
+    case GvretCsv: return "GVRET CSV";
+    case SavvyCsv: return "SavvyCAN CSV";
+    default: return "unknown";
+    }
+}
+
+//Lines longer than CANLOG_LINE_SIZE are cut short, no capture format has any
+bool CanLog::nextLine(char *line, size_t room)
+{
+    if (havePending)
+    {
+        strcpy(line, pendingLine);
+        havePending = false;
+        return true;
+    }
+    if (mapped)
+    {
+        if (position >= mappedLength) return false;
+        const char *start = mapped + position;
+        const char *end = (const char *)memchr(start, '\n', mappedLength - position);
+        size_t length = end ? (size_t)(end - start) : mappedLength - position;
+        position += length + (end ? 1 : 0);
+        if (length >= room) length = room - 1;
+        memcpy(line, start, length);
+        line[length] = 0;
+    }
+    else if (!stream || !fgets(line, room, stream)) return false;
+
+    size_t length = strlen(line);
+    while (length && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = 0;
+    return true;
+}
+
+//Candump lines start with the timestamp, the CSV formats with a header line. The
+//header is consumed here, a candump line is left to be read as the first frame.
+bool CanLog::detectFormat()
+{
+    char line[CANLOG_LINE_SIZE];
+    format = Unknown;
+    havePending = false;
+    for (;;)
+    {
+        if (!nextLine(line, sizeof(line))) return false;
+        const char *text = line + strspn(line, " \t");
+        if (!*text) continue;
+        if (*text == '(')
+        {
+            format = Candump;
+            strcpy(pendingLine, line);
+            havePending = true;
+            return true;
+        }
+        if (!strncasecmp(text, "Time Stamp", 10))
+        {
+            format = strstr(text, ",Dir,") ? SavvyCsv : GvretCsv;
+            return true;
+        }
+        return false;
+    }
+}
+
+bool CanLog::next(LoggedFrame &out)
+{
+    char line[CANLOG_LINE_SIZE];
+    while (nextLine(line, sizeof(line)))
+    {
+        if (!line[strspn(line, " \t")]) continue;
+        if (parseLine(line, out)) return true;
+        badLines++;
+    }
+    return false;
+}
+
+bool CanLog::parseLine(char *line, LoggedFrame &out)
+{
+    out.frame = CAN_FRAME();
+    out.bus = 0;
+    if (format == Candump) return parseCandump(line, out);
+    return parseCsv(line, out);
+}
+
+static bool parseHexByte(const char *text, uint8_t &value)
+{
+    if (!isxdigit((unsigned char)text[0]) || !isxdigit((unsigned char)text[1])) return false;
+    char hex[3] = {text[0], text[1], 0};
+    value = strtoul(hex, NULL, 16);
+    return true;
+}
+
+//(seconds.micros) interface then either ID#DATA or ID [len] bytes
+bool CanLog::parseCandump(char *line, LoggedFrame &out)
+{
+    char *cursor = strchr(line, '(');
+    char *end;
+    if (!cursor) return false;
+    uint64_t seconds = strtoull(cursor + 1, &end, 10);
+    if (*end != '.') return false;
+    char *fraction = end + 1;
+    uint64_t micros = strtoull(fraction, &end, 10);
+    for (int digits = end - fraction; digits < 6; digits++) micros *= 10;
+    for (int digits = end - fraction; digits > 6; digits--) micros /= 10;
+    out.timeMicros = seconds * 1000000ull + micros;
+    if (*end != ')') return false;
+
+    char *save;
+    char *interface = strtok_r(end + 1, " \t", &save);
+    char *id = strtok_r(NULL, " \t", &save);
+    if (!interface || !id) return false;
+    //can1, vcan1 and so on end up on the second bus
+    size_t ifLength = strlen(interface);
+    if (ifLength && isdigit((unsigned char)interface[ifLength - 1])) out.bus = (interface[ifLength - 1] - '0') & 1;
+
+    char *data = strchr(id, '#');
+    if (data) *data++ = 0;
+    out.frame.id = strtoul(id, &end, 16);
+    if (*end) return false;
+    out.frame.extended = (strlen(id) > 3 || out.frame.id > 0x7FF);
+
+    if (data)
+    {
+        if (*data == '#') return false; //CAN FD
+        if (*data == 'R' || *data == 'r')
+        {
+            out.frame.rtr = 1;
+            out.frame.length = isdigit((unsigned char)data[1]) ? data[1] - '0' : 0;
+            return out.frame.length <= 8;
+        }
+        int length = 0;
+        while (*data && length < 8)
+        {
+            if (*data == '.') data++;
+            else if (parseHexByte(data, out.frame.data.bytes[length]))
+            {
+                data += 2;
+                length++;
+            }
+            else return false;
+        }
+        out.frame.length = length;
+        return !*data;
+    }
+
+    char *lengthText = strtok_r(NULL, " \t", &save);
+    if (!lengthText || *lengthText != '[') return false;
+    int length = atoi(lengthText + 1);
+    if (length < 0 || length > 8) return false;
+    out.frame.length = length;
+    for (int i = 0; i < length; i++)
+    {
+        char *byteText = strtok_r(NULL, " \t", &save);
+        if (!byteText || *byteText == 'r' || !parseHexByte(byteText, out.frame.data.bytes[i])) return false;
+    }
+    return true;
+}
+
+//Time Stamp,ID,Extended,[Dir,]Bus,LEN,D1..D8. SavvyCAN writes the data bytes without leading zeros
+bool CanLog::parseCsv(char *line, LoggedFrame &out)
+{
+    char *fields[16];
+    int count = 0;
+    char *save;
+    for (char *field = strtok_r(line, ",", &save); field && count < 16; field = strtok_r(NULL, ",", &save)) fields[count++] = field;
+
+    int bus = (format == SavvyCsv) ? 4 : 3;
+    if (count < bus + 2) return false;
+
+    char *end;
+    out.timeMicros = strtoull(fields[0], &end, 10);
+    if (end == fields[0]) return false;
+    out.frame.id = strtoul(fields[1], &end, 16);
+    if (end == fields[1]) return false;
+    const char *extended = fields[2] + strspn(fields[2], " ");
+    out.frame.extended = (!strncasecmp(extended, "true", 4) || *extended == '1');
+    out.bus = atoi(fields[bus]) & 1;
+    int length = atoi(fields[bus + 1]);
+    if (length < 0 || length > 8 || count < bus + 2 + length) return false;
+    out.frame.length = length;
+    for (int i = 0; i < length; i++)
+    {
+        unsigned long value = strtoul(fields[bus + 2 + i], &end, 16);
+        if (end == fields[bus + 2 + i] || value > 0xFF) return false;
+        out.frame.data.bytes[i] = value;
+    }
+    return true;
+}
@@ -0,0 +1,90 @@
+/*
+ * CanLog.h
+ *
+ * Reads CAN captures for replay. Three formats are recognised from the first
+ * line of the file:
+ *
+ *   candump    (1436509052.249713) can0 7E8#0441050A  or  (1436509052.249713) can0 7E8 [4] 04 41 05 0A
+ *   GVRET CSV  Time Stamp,ID,Extended,Bus,LEN,D1,...,D8 with the time in microseconds
+ *   SavvyCAN   Time Stamp,ID,Extended,Dir,Bus,LEN,D1,...,D8 with the time in microseconds
+ *
+ * Files can be memory mapped, which keeps file reads out of the timing, or read
+ * as a stream, which also works for stdin and captures larger than memory.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef CANLOG_H_
+#define CANLOG_H_
+
+#include <esp32_can.h>
+#include <stdio.h>
+
+#define CANLOG_LINE_SIZE    512
+
+struct LoggedFrame {
+    uint64_t timeMicros;
+    uint8_t bus;
+    CAN_FRAME frame;
+};
+
+class CanLog {
+public:
+    enum Format {
+        Unknown, Candump, GvretCsv, SavvyCsv
+    };
+
+    CanLog();
+    ~CanLog();
+    //path "-" streams stdin
+    bool open(const char *path, bool useMmap);
+    //read from an open stream, which the CanLog closes when done
+    bool openStream(FILE *file);
+    //parse a capture that's already in memory, the text has to outlive the CanLog
+    bool openText(const char *text, size_t length);
+    void close();
+    bool next(LoggedFrame &out);
+    //start over from the first frame, not possible for pipes
+    bool rewind();
+    Format getFormat() { return format; }
+    uint32_t getBadLines() { return badLines; }
+    static const char *getFormatName(Format format);
+
+private:
+    bool nextLine(char *line, size_t room);
+    bool detectFormat();
+    bool parseLine(char *line, LoggedFrame &out);
+    bool parseCandump(char *line, LoggedFrame &out);
+    bool parseCsv(char *line, LoggedFrame &out);
+
+    Format format;
+    FILE *stream;
+    const char *mapped;     //whole file when memory mapped or given as text
+    size_t mappedLength;
+    size_t position;
+    bool ownsMapping;
+    uint32_t badLines;
+    char pendingLine[CANLOG_LINE_SIZE];   //first candump line, read while detecting the format
+    bool havePending;
+};
+
+#endif /* CANLOG_H_ */
@@ -0,0 +1,210 @@
+/*
+ * CanReplay.cpp
+ *
+ * Capture replay into the host firmware.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "CanReplay.h"
+#include <Arduino.h>
+#include <WiFi.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "ELM327_Emulator.h"
+#include "Metrics.h"
+#include "FrameTable.h"
+#include "BusStats.h"
+#include "Recorder.h"
+#include "TriggerEngine.h"
+#include "Hal.h"
+#include "Percentile.h"
+
+void setup();
+void loop();
+void sendFrameToWiFi(CAN_FRAME &frame, int whichBus, uint32_t now);
+extern ELM327Emu elmEmulator;
+extern FrameTable frameTable;
+extern BusStats busStats;
+extern Recorder recorder;
+extern TriggerEngine triggerEngine;
+extern MetricCounter canRxFrames;
+extern MetricCounter gvretBytesOut;
+extern MetricCounter gvretBufferDiscards;
+extern MetricCounter socketWriteStalls;
+extern MetricCounter elmBytesOut;
+extern MetricCounter stmDrops;
+#ifndef BLUETOOTH
+extern WiFiClient savvyClient;
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<uint64_t> sinkBytes(0);
+
+static uint64_t nanosSince(Clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+bool CanReplay::startFirmware(bool sink)
+{
+    static bool started = false;
+    static bool sinkConnected = false;
+    if (!started)
+    {
+        setup();
+        started = true;
+    }
+#ifndef BLUETOOTH
+    if (sink && !sinkConnected)
+    {
+        //the servers come up once loop() sees the radio is ready
+        static WiFiClient client;
+        uint32_t start = millis();
+        while (millis() - start < 2000 && !client.connect("127.0.0.1", Hal::mapPort(23))) loop();
+        while (millis() - start < 2000 && !savvyClient.connected()) loop();
+        if (!savvyClient.connected()) return false;
+        std::thread([] {
+            uint8_t buffer[4096];
+            for (;;)
+            {
+                int n = client.read(buffer, sizeof(buffer));
+                if (n > 0) sinkBytes += n;
+                else if (!client.connected()) break;
+                else delayMicroseconds(200);
+            }
+        }).detach();
+        sinkConnected = true;
+    }
+#else
+    (void)sink;
+    (void)sinkConnected;
+#endif
+    return true;
+}
+
+CanReplay::Stats CanReplay::run(CanLog &log, const Options &options)
+{
+    Stats stats;
+    LoggedFrame logged;
+    uint64_t firstTime = 0, lastTime = 0, loopOffset = 0;
+    bool haveFirst = false;
+
+    uint32_t gvretBytesBefore = gvretBytesOut.get();
+    uint32_t elmBytesBefore = elmBytesOut.get();
+    uint32_t discardsBefore = gvretBufferDiscards.get();
+    uint32_t stallsBefore = socketWriteStalls.get();
+    uint32_t stmDropsBefore = stmDrops.get();
+    latencies.clear();
+    lags.clear();
+
+    Clock::time_point start = Clock::now();
+    for (uint32_t pass = 0; pass < options.loops; pass++)
+    {
+        if (pass && !log.rewind()) break;
+        while (log.next(logged))
+        {
+            if (!haveFirst)
+            {
+                firstTime = logged.timeMicros;
+                haveFirst = true;
+            }
+            uint64_t logTime = loopOffset + ((logged.timeMicros > firstTime) ? logged.timeMicros - firstTime : 0);
+            lastTime = std::max(lastTime, logTime);
+
+            if (options.speed > 0)
+            {
+                uint64_t due = (uint64_t)(logTime * 1000.0 / options.speed);
+                uint64_t now = nanosSince(start);
+                //sleep most of the way, then spin for the last stretch
+                if (due > now + 200000) std::this_thread::sleep_for(std::chrono::nanoseconds(due - now - 100000));
+                while ((now = nanosSince(start)) < due) {}
+                uint32_t lag = (uint32_t)((now - due) / 1000);
+                lags.push_back(lag);
+                if (lag > 1000) stats.lateFrames++;
+            }
+
+            //what loop() does with a frame CAN0 hands it
+            CAN_FRAME frame = logged.frame;
+            frame.timestamp = micros();
+            Clock::time_point frameStart = Clock::now();
+            canRxFrames.inc();
+            int entry = frameTable.processFrame(frame);
+            busStats.processFrame(frame, entry);
+            recorder.processFrame(frame, entry);
+            triggerEngine.processFrame(frame);
+            elmEmulator.processFrame(frame);
+#ifndef BLUETOOTH
+            sendFrameToWiFi(frame, logged.bus, micros());
+#endif
+            latencies.push_back((uint32_t)nanosSince(frameStart));
+            stats.frames++;
+            loop();
+        }
+        stats.badLines += log.getBadLines();
+        //the next pass starts one average frame gap after this one ended
+        loopOffset = lastTime + (stats.frames > 1 ? lastTime / (stats.frames - 1) : 0);
+    }
+
+    stats.elapsedMicros = nanosSince(start) / 1000;
+    //let the last buffer go out
+    uint32_t flushStart = micros();
+    while (micros() - flushStart < 2 * SER_BUFF_FLUSH_INTERVAL) loop();
+
+    stats.format = CanLog::getFormatName(log.getFormat());
+    stats.gvretBytes = gvretBytesOut.get() - gvretBytesBefore;
+    stats.elmBytes = elmBytesOut.get() - elmBytesBefore;
+    stats.gvretDiscards = gvretBufferDiscards.get() - discardsBefore;
+    stats.writeStalls = socketWriteStalls.get() - stallsBefore;
+    stats.stmDrops = stmDrops.get() - stmDropsBefore;
+    stats.latencyP50 = percentile(latencies, 50);
+    stats.latencyP90 = percentile(latencies, 90);
+    stats.latencyP99 = percentile(latencies, 99);
+    stats.latencyP999 = percentile(latencies, 99.9);
+    stats.latencyMax = percentile(latencies, 100);
+    stats.lagP99 = percentile(lags, 99);
+    stats.lagMax = percentile(lags, 100);
+    return stats;
+}
+
+double CanReplay::Stats::framesPerSecond() const
+{
+    return elapsedMicros ? frames * 1000000.0 / elapsedMicros : 0;
+}
+
+double CanReplay::Stats::bytesPerSecond() const
+{
+    return elapsedMicros ? (gvretBytes + elmBytes) * 1000000.0 / elapsedMicros : 0;
+}
+
+void CanReplay::Stats::print(FILE *out) const
+{
+    fprintf(out, "Replayed %u frames (%s) in %.3fs: %.0f frames/s\n", frames, format, elapsedMicros / 1000000.0, framesPerSecond());
+    fprintf(out, "Output: %llu GVRET + %llu ELM bytes, %.0f bytes/s\n", (unsigned long long)gvretBytes, (unsigned long long)elmBytes, bytesPerSecond());
+    fprintf(out, "Drops: %u GVRET buffers discarded, %u socket write stalls, %u STM frames, %u unreadable lines\n",
+            gvretDiscards, writeStalls, stmDrops, badLines);
+    fprintf(out, "Frame processing: p50 %uns p90 %uns p99 %uns p99.9 %uns max %uns\n", latencyP50, latencyP90, latencyP99, latencyP999, latencyMax);
+    fprintf(out, "Schedule lag: p99 %uus max %uus, %u frames more than 1ms late\n", lagP99, lagMax, lateFrames);
+}
@@ -0,0 +1,80 @@
+/*
+ * CanReplay.h
+ *
+ * Replays a capture into the firmware running on the host HAL. Each frame goes
+ * through the same calls loop() makes for a received frame,
+ * ELM327Emu::processFrame() and sendFrameToWiFi(), then loop() runs once to
+ * flush and serve clients. Frames are paced by their timestamps at real time,
+ * N times faster, or sent as fast as possible.
+ *
+ * A loopback client stays connected to the GVRET port and drains it so socket
+ * writes cost what they would with SavvyCAN attached.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef CANREPLAY_H_
+#define CANREPLAY_H_
+
+#include <stdio.h>
+#include <vector>
+#include "CanLog.h"
+
+class CanReplay {
+public:
+    struct Options {
+        double speed = 1.0;         //1 is real time, 0 as fast as possible
+        uint32_t loops = 1;         //times through the capture
+        bool sink = true;           //keep a client on the GVRET port
+    };
+
+    struct Stats {
+        const char *format = "";
+        uint32_t frames = 0;
+        uint32_t badLines = 0;
+        uint64_t elapsedMicros = 0;
+        uint64_t gvretBytes = 0;        //written to the GVRET socket
+        uint64_t elmBytes = 0;
+        uint32_t gvretDiscards = 0;     //output buffers dropped for want of a client
+        uint32_t writeStalls = 0;       //short or slow socket writes
+        uint32_t stmDrops = 0;
+        uint32_t lateFrames = 0;        //injected more than a millisecond after their time
+        //nanoseconds spent in processFrame() and sendFrameToWiFi() per frame
+        uint32_t latencyP50 = 0, latencyP90 = 0, latencyP99 = 0, latencyP999 = 0, latencyMax = 0;
+        //how far behind the schedule frames went in, microseconds
+        uint32_t lagP99 = 0, lagMax = 0;
+
+        double framesPerSecond() const;
+        double bytesPerSecond() const;
+        void print(FILE *out) const;
+    };
+
+    //setup() plus waiting for the servers and connecting the sink. Only runs once
+    static bool startFirmware(bool sink);
+    Stats run(CanLog &log, const Options &options);
+
+private:
+    std::vector<uint32_t> latencies;
+    std::vector<uint32_t> lags;
+};
+
+#endif /* CANREPLAY_H_ */
@@ -0,0 +1,94 @@
+/*
+ * ReplayMain.cpp
+ *
+ * Replays a CAN capture into the firmware and reports throughput, drops and
+ * per-frame processing time.
+ *
+ *     can_replay [--speed <n> | --fast] [--loops <n>] [--stream] [--no-sink] <capture | ->
+ *
+ * --speed 1 (the default) keeps the recorded timing, 10 plays ten times faster
+ * and --fast sends frames as quickly as the firmware takes them. Captures are
+ * memory mapped unless --stream is given or the capture is read from stdin.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <unistd.h>
+#include "CanReplay.h"
+#include "Hal.h"
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [--speed <n> | --fast] [--loops <n>] [--stream] [--no-sink] <capture | ->\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    CanReplay::Options options;
+    bool stream = false;
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--fast")) options.speed = 0;
+        else if (!strcmp(argv[i], "--stream")) stream = true;
+        else if (!strcmp(argv[i], "--no-sink")) options.sink = false;
+        else if (!strcmp(argv[i], "--speed") && i + 1 < argc) options.speed = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--loops") && i + 1 < argc) options.loops = atoi(argv[++i]);
+        else if (argv[i][0] == '-' && argv[i][1]) usage(argv[0]);
+        else path = argv[i];
+    }
+    if (!path || options.loops == 0) usage(argv[0]);
+
+    //the firmware console reads stdin, so a capture piped in gets a descriptor of its own
+    CanLog log;
+    bool opened;
+    if (!strcmp(path, "-"))
+    {
+        opened = log.openStream(fdopen(dup(STDIN_FILENO), "r"));
+        if (!freopen("/dev/null", "r", stdin)) return 1;
+    }
+    else opened = log.open(path, !stream);
+    if (!opened)
+    {
+        fprintf(stderr, "Can't read a capture from %s\n", path);
+        return 1;
+    }
+
+    //firmware console output would get mixed into the report
+    Hal::setPortOffset(20000 + getpid() % 10000);
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+
+    if (!CanReplay::startFirmware(options.sink))
+    {
+        fprintf(stderr, "The GVRET server didn't come up\n");
+        return 1;
+    }
+    CanReplay replay;
+    CanReplay::Stats stats = replay.run(log, options);
+    stats.print(report);
+    fclose(report);
+    _exit(0); //the firmware's tasks never end
+}
@@ -0,0 +1,323 @@
+/*
+ * Arduino.cpp
+ *
+ * Host implementations of the Arduino core pieces declared in the shim headers.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+
+HardwareSerial Serial;
+EspClass ESP;
+
+static const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+uint32_t millis()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+uint32_t micros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void delay(uint32_t ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(uint32_t us)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+String::String(double val, int decimals)
+{
+    char buff[40];
+    snprintf(buff, sizeof(buff), "%.*f", decimals, val);
+    value = buff;
+}
+
+void String::toCharArray(char *buf, unsigned int size) const
+{
+    if (!size) return;
+    strncpy(buf, value.c_str(), size - 1);
+    buf[size - 1] = 0;
+}
+
+void String::toUpperCase()
+{
+    for (size_t i = 0; i < value.length(); i++) value[i] = toupper(value[i]);
+}
+
+void String::toLowerCase()
+{
+    for (size_t i = 0; i < value.length(); i++) value[i] = tolower(value[i]);
+}
+
+void String::trim()
+{
+    size_t start = value.find_first_not_of(" \t\r\n");
+    size_t end = value.find_last_not_of(" \t\r\n");
+    value = (start == std::string::npos) ? "" : value.substr(start, end - start + 1);
+}
+
+int String::indexOf(const char *str) const
+{
+    size_t pos = value.find(str);
+    return (pos == std::string::npos) ? -1 : (int)pos;
+}
+
+int String::indexOf(char c) const
+{
+    size_t pos = value.find(c);
+    return (pos == std::string::npos) ? -1 : (int)pos;
+}
+
+String String::substring(unsigned int from) const
+{
+    return (from >= value.length()) ? String() : String(value.substr(from));
+}
+
+String String::substring(unsigned int from, unsigned int to) const
+{
+    if (from >= value.length() || to <= from) return String();
+    return String(value.substr(from, to - from));
+}
+
+String IPAddress::toString() const
+{
+    char buff[16];
+    snprintf(buff, sizeof(buff), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+    return String(buff);
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+    size_t n = 0;
+    while (size--) n += write(*buffer++);
+    return n;
+}
+
+size_t Print::print(long val, int base)
+{
+    if (base == 10) return print(String(val));
+    if (val < 0) return print('-') + print((unsigned long)-val, base);
+    return print((unsigned long)val, base);
+}
+
+size_t Print::print(unsigned long val, int base)
+{
+    char buff[68];
+    int pos = sizeof(buff) - 1;
+    buff[pos] = 0;
+    if (base < 2) base = 10;
+    do {
+        int digit = val % base;
+        buff[--pos] = (digit < 10) ? '0' + digit : 'A' + digit - 10;
+        val /= base;
+    } while (val);
+    return write(&buff[pos]);
+}
+
+size_t Print::printf(const char *format, ...)
+{
+    char buff[512];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buff, sizeof(buff), format, args);
+    va_end(args);
+    if (len < 0) return 0;
+    return write((const uint8_t *)buff, ((size_t)len < sizeof(buff)) ? len : sizeof(buff) - 1);
+}
+
+size_t Stream::readBytes(uint8_t *buffer, size_t length)
+{
+    size_t count = 0;
+    uint32_t start = millis();
+    while (count < length && millis() - start < timeout)
+    {
+        int c = read();
+        if (c < 0)
+        {
+            delay(1);
+            continue;
+        }
+        buffer[count++] = c;
+    }
+    return count;
+}
+
+String Stream::readStringUntil(char terminator)
+{
+    String ret;
+    uint32_t start = millis();
+    while (millis() - start < timeout)
+    {
+        int c = read();
+        if (c < 0)
+        {
+            delay(1);
+            continue;
+        }
+        if (c == terminator) break;
+        ret += (char)c;
+    }
+    return ret;
+}
+
+//stdin is polled rather than switched to non-blocking. O_NONBLOCK would be shared with every other
+//process on the same terminal or pipe, and any of them clearing it again would stall read()
+static bool stdinReady()
+{
+    struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&fd, 1, 0) == 1 && (fd.revents & POLLIN);
+}
+
+int HardwareSerial::available()
+{
+    if (peeked < 0) peeked = read();
+    return (peeked < 0) ? 0 : 1;
+}
+
+int HardwareSerial::read()
+{
+    if (peeked >= 0)
+    {
+        int c = peeked;
+        peeked = -1;
+        return c;
+    }
+    uint8_t c;
+    if (!stdinReady()) return -1;
+    return (::read(STDIN_FILENO, &c, 1) == 1) ? c : -1;
+}
+
+int HardwareSerial::peek()
+{
+    available();
+    return peeked;
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+    return fwrite(&c, 1, 1, stdout);
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+    return fwrite(buffer, 1, size, stdout);
+}
+
+void EspClass::restart()
+{
+    fflush(stdout);
+    exit(0);
+}
+
+uint32_t EspClass::getCycleCount()
+{
+    //pretend to be a 240MHz core so cycle based numbers stay comparable
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+    return (uint32_t)(ns * 240 / 1000);
+}
+
+struct TaskStart {
+    TaskFunction_t task;
+    void *param;
+};
+
+static void *runTask(void *arg)
+{
+    TaskStart start = *(TaskStart *)arg;
+    delete (TaskStart *)arg;
+    start.task(start.param);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stackDepth, void *param,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+    pthread_t thread;
+    TaskStart *start = new TaskStart{task, param};
+    (void)name; (void)stackDepth; (void)priority; (void)core;
+
+    if (pthread_create(&thread, NULL, runTask, start))
+    {
+        delete start;
+        return pdFALSE;
+    }
+    pthread_detach(thread);
+    if (handle) *handle = (TaskHandle_t)thread;
+    return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    delay(ticks * portTICK_PERIOD_MS);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    //only deleting the calling task is supported, which is all the firmware does
+    if (task == NULL) pthread_exit(NULL);
+}
+
+BaseType_t xPortGetCoreID()
+{
+    return 1;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+    return new std::timed_mutex();
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks)
+{
+    std::timed_mutex *mutex = (std::timed_mutex *)semaphore;
+    if (ticks == portMAX_DELAY)
+    {
+        mutex->lock();
+        return pdTRUE;
+    }
+    return mutex->try_lock_for(std::chrono::milliseconds(ticks * portTICK_PERIOD_MS)) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    ((std::timed_mutex *)semaphore)->unlock();
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+    delete (std::timed_mutex *)semaphore;
+}
@@ -0,0 +1,181 @@
+/*
+ * Arduino.h
+ *
+ * Just enough of the ESP32 Arduino core to build the firmware modules on a
+ * desktop machine. Time comes from the host's monotonic clock, Serial is
+ * stdin/stdout and FreeRTOS tasks are threads.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ARDUINO_H_
+#define ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <math.h>
+#include <string>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+
+class String {
+public:
+    String() {}
+    String(const char *str) : value(str ? str : "") {}
+    String(const std::string &str) : value(str) {}
+    explicit String(char c) : value(1, c) {}
+    String(int val) : value(std::to_string(val)) {}
+    String(unsigned int val) : value(std::to_string(val)) {}
+    String(long val) : value(std::to_string(val)) {}
+    String(unsigned long val) : value(std::to_string(val)) {}
+    String(double val, int decimals = 2);
+
+    bool concat(const String &str) { value += str.value; return true; }
+    bool concat(const char *str) { value += str; return true; }
+    bool concat(char c) { value += c; return true; }
+    const char *c_str() const { return value.c_str(); }
+    unsigned int length() const { return value.length(); }
+    void toCharArray(char *buf, unsigned int size) const;
+    void toUpperCase();
+    void toLowerCase();
+    void trim();
+    long toInt() const { return strtol(value.c_str(), NULL, 10); }
+    bool startsWith(const String &prefix) const { return value.compare(0, prefix.value.length(), prefix.value) == 0; }
+    int indexOf(const char *str) const;
+    int indexOf(char c) const;
+    String substring(unsigned int from) const;
+    String substring(unsigned int from, unsigned int to) const;
+    char operator[](unsigned int idx) const { return idx < value.length() ? value[idx] : 0; }
+
+    bool operator==(const String &other) const { return value == other.value; }
+    bool operator==(const char *other) const { return value == other; }
+    bool operator!=(const String &other) const { return value != other.value; }
+    String &operator+=(const String &other) { value += other.value; return *this; }
+    String &operator+=(const char *other) { value += other; return *this; }
+    String &operator+=(char c) { value += c; return *this; }
+    friend String operator+(const String &a, const String &b) { return String(a.value + b.value); }
+    friend String operator+(const String &a, const char *b) { return String(a.value + b); }
+    friend String operator+(const char *a, const String &b) { return String(a + b.value); }
+
+private:
+    std::string value;
+};
+
+class IPAddress {
+public:
+    IPAddress() : addr(0) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : addr(a | (b << 8) | (c << 16) | ((uint32_t)d << 24)) {}
+    IPAddress(uint32_t address) : addr(address) {}
+    operator uint32_t() const { return addr; }
+    uint8_t operator[](int idx) const { return (addr >> (idx * 8)) & 0xFF; }
+    bool operator==(const IPAddress &other) const { return addr == other.addr; }
+    String toString() const;
+
+private:
+    uint32_t addr;
+};
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+
+    size_t print(const char *str) { return write(str); }
+    size_t print(const String &str) { return write(str.c_str()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int val, int base = 10) { return print((long)val, base); }
+    size_t print(unsigned int val, int base = 10) { return print((unsigned long)val, base); }
+    size_t print(long val, int base = 10);
+    size_t print(unsigned long val, int base = 10);
+    size_t print(double val, int decimals = 2) { return print(String(val, decimals)); }
+    size_t print(const IPAddress &ip) { return print(ip.toString()); }
+
+    size_t println() { return write("\r\n"); }
+    template<class T> size_t println(T val) { size_t n = print(val); return n + println(); }
+    template<class T> size_t println(T val, int format) { size_t n = print(val, format); return n + println(); }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    virtual void flush() {}
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    void setTimeout(unsigned long timeout) { this->timeout = timeout; }
+    size_t readBytes(uint8_t *buffer, size_t length);
+    String readStringUntil(char terminator);
+
+protected:
+    unsigned long timeout = 1000;
+};
+
+//Serial talks to the terminal the host program runs in
+class HardwareSerial : public Stream {
+public:
+    void begin(unsigned long baud) { (void)baud; }
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    void flush() override { fflush(stdout); }
+    operator bool() { return true; }
+
+private:
+    int peeked = -1;
+};
+
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+    void restart();
+    uint32_t getCycleCount();
+    uint8_t getCpuFreqMHz() { return 240; }
+    uint32_t getFreeHeap() { return 200000; }
+};
+
+extern EspClass ESP;
+
+#endif /* ARDUINO_H_ */
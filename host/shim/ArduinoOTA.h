@@ -0,0 +1,62 @@
+/*
+ * ArduinoOTA.h
+ *
+ * ArduinoOTA does nothing on the host. The sketch's callbacks are accepted
+ * and never called.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ARDUINOOTA_H_
+#define ARDUINOOTA_H_
+
+#include <Arduino.h>
+#include <functional>
+
+typedef enum {
+    OTA_AUTH_ERROR,
+    OTA_BEGIN_ERROR,
+    OTA_CONNECT_ERROR,
+    OTA_RECEIVE_ERROR,
+    OTA_END_ERROR
+} ota_error_t;
+
+#define U_FLASH     0
+#define U_SPIFFS    100
+
+class ArduinoOTAClass {
+public:
+    ArduinoOTAClass &setPort(uint16_t port) { (void)port; return *this; }
+    ArduinoOTAClass &setHostname(const char *hostname) { (void)hostname; return *this; }
+    ArduinoOTAClass &setPassword(const char *password) { (void)password; return *this; }
+    ArduinoOTAClass &onStart(std::function<void()> fn) { (void)fn; return *this; }
+    ArduinoOTAClass &onEnd(std::function<void()> fn) { (void)fn; return *this; }
+    ArduinoOTAClass &onProgress(std::function<void(unsigned int, unsigned int)> fn) { (void)fn; return *this; }
+    ArduinoOTAClass &onError(std::function<void(ota_error_t)> fn) { (void)fn; return *this; }
+    void begin() {}
+    void handle() {}
+    int getCommand() { return U_FLASH; }
+};
+
+extern ArduinoOTAClass ArduinoOTA;
+
+#endif /* ARDUINOOTA_H_ */
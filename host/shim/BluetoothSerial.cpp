@@ -0,0 +1,76 @@
+/*
+ * BluetoothSerial.cpp
+ *
+ * Loopback TCP in place of Bluetooth SPP.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "BluetoothSerial.h"
+
+BluetoothSerial::BluetoothSerial() : server(BLUETOOTH_HOST_PORT, 1)
+{
+}
+
+bool BluetoothSerial::begin(String localName)
+{
+    (void)localName;
+    server.begin();
+    server.setNoDelay(true);
+    return true;
+}
+
+bool BluetoothSerial::hasClient()
+{
+    if (!client.connected())
+    {
+        client.stop();
+        if (server.hasClient()) client = server.available();
+    }
+    return client.connected();
+}
+
+int BluetoothSerial::available()
+{
+    return hasClient() ? client.available() : 0;
+}
+
+int BluetoothSerial::read()
+{
+    return hasClient() ? client.read() : -1;
+}
+
+int BluetoothSerial::peek()
+{
+    return hasClient() ? client.peek() : -1;
+}
+
+size_t BluetoothSerial::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+//Like SPP, output is thrown away while nobody is connected
+size_t BluetoothSerial::write(const uint8_t *buffer, size_t size)
+{
+    return hasClient() ? client.write(buffer, size) : 0;
+}
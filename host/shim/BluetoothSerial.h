@@ -0,0 +1,55 @@
+/*
+ * BluetoothSerial.h
+ *
+ * Bluetooth SPP for the host build. The port is a loopback TCP server on the
+ * ELM327 WiFi port (35000 plus the Hal offset) so the same client tools work
+ * for both builds. One connection at a time, like SPP.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef BLUETOOTHSERIAL_H_
+#define BLUETOOTHSERIAL_H_
+
+#include <Arduino.h>
+#include "WiFi.h"
+
+#define BLUETOOTH_HOST_PORT 35000
+
+class BluetoothSerial : public Stream {
+public:
+    BluetoothSerial();
+    bool begin(String localName);
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    bool hasClient();
+
+private:
+    WiFiServer server;
+    WiFiClient client;
+};
+
+#endif /* BLUETOOTHSERIAL_H_ */
@@ -0,0 +1,52 @@
+/*
+ * EEPROM.cpp
+ *
+ * In-memory EEPROM for the host build. It starts out erased.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "EEPROM.h"
+
+EEPROMClass EEPROM;
+
+bool EEPROMClass::begin(size_t size)
+{
+    if (size > sizeof(data)) return false;
+    if (this->size == 0) memset(data, 0xFF, sizeof(data));
+    this->size = size;
+    return true;
+}
+
+size_t EEPROMClass::readBytes(int address, void *value, size_t len)
+{
+    if (address < 0 || address + len > size) return 0;
+    memcpy(value, &data[address], len);
+    return len;
+}
+
+size_t EEPROMClass::writeBytes(int address, const void *value, size_t len)
+{
+    if (address < 0 || address + len > size) return 0;
+    memcpy(&data[address], value, len);
+    return len;
+}
@@ -0,0 +1,47 @@
+/*
+ * EEPROM.h
+ *
+ * EEPROM emulation kept in memory for the host build.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef EEPROM_H_
+#define EEPROM_H_
+
+#include <Arduino.h>
+
+class EEPROMClass {
+public:
+    bool begin(size_t size);
+    size_t readBytes(int address, void *value, size_t len);
+    size_t writeBytes(int address, const void *value, size_t len);
+    bool commit() { return true; }
+
+private:
+    uint8_t data[4096];
+    size_t size = 0;
+};
+
+extern EEPROMClass EEPROM;
+
+#endif /* EEPROM_H_ */
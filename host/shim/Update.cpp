@@ -0,0 +1,138 @@
+/*
+ * Update.cpp
+ *
+ * In-memory OTA partition for the host build.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "Update.h"
+#include "esp_ota_ops.h"
+
+UpdateClass Update;
+
+static const esp_partition_t appPartitions[2] = {
+    {ESP_PARTITION_TYPE_APP, 0x10, 0x10000, 0x1E0000, "app0", false},
+    {ESP_PARTITION_TYPE_APP, 0x11, 0x1F0000, 0x1E0000, "app1", false}
+};
+static const esp_partition_t *bootPartition = &appPartitions[0];
+
+const esp_partition_t *esp_ota_get_running_partition()
+{
+    return &appPartitions[0];
+}
+
+const esp_partition_t *esp_ota_get_boot_partition()
+{
+    return bootPartition;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from)
+{
+    if (!start_from) start_from = esp_ota_get_running_partition();
+    return (start_from == &appPartitions[0]) ? &appPartitions[1] : &appPartitions[0];
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+    if (partition != &appPartitions[0] && partition != &appPartitions[1]) return ESP_FAIL;
+    bootPartition = partition;
+    return ESP_OK;
+}
+
+UpdateClass::UpdateClass()
+{
+    partitionSize = 0x1E0000;
+    reset();
+}
+
+void UpdateClass::reset()
+{
+    image.clear();
+    size = 0;
+    failAt = 0;
+    ended = false;
+    running = false;
+    error = UPDATE_ERROR_OK;
+    esp_ota_set_boot_partition(esp_ota_get_running_partition());
+}
+
+bool UpdateClass::begin(size_t size)
+{
+    if (size == 0 || size > partitionSize)
+    {
+        error = UPDATE_ERROR_SPACE;
+        return false;
+    }
+    image.clear();
+    this->size = size;
+    ended = false;
+    running = true;
+    error = UPDATE_ERROR_OK;
+    return true;
+}
+
+size_t UpdateClass::write(uint8_t *data, size_t len)
+{
+    if (!running) return 0;
+    if (image.size() + len > size) len = size - image.size();
+    if (failAt && image.size() + len > failAt)
+    {
+        len = (failAt > image.size()) ? failAt - image.size() : 0;
+        error = UPDATE_ERROR_WRITE;
+    }
+    image.insert(image.end(), data, data + len);
+    return len;
+}
+
+bool UpdateClass::end(bool evenIfRemaining)
+{
+    if (!running) return false;
+    if (!isFinished() && !evenIfRemaining)
+    {
+        error = UPDATE_ERROR_SIZE;
+        return false;
+    }
+    running = false;
+    ended = true;
+    esp_ota_set_boot_partition(esp_ota_get_next_update_partition(NULL));
+    return true;
+}
+
+void UpdateClass::abort()
+{
+    running = false;
+    error = UPDATE_ERROR_ABORT;
+}
+
+const char *UpdateClass::errorString()
+{
+    switch (error)
+    {
+    case UPDATE_ERROR_OK: return "No Error";
+    case UPDATE_ERROR_WRITE: return "Flash Write Failed";
+    case UPDATE_ERROR_SIZE: return "Bad Size Given";
+    case UPDATE_ERROR_SPACE: return "Not Enough Space";
+    case UPDATE_ERROR_ABORT: return "Update Aborted";
+    }
+    return "UNKNOWN";
+}
@@ -0,0 +1,69 @@
+/*
+ * Update.h
+ *
+ * Stand-in for the ESP32 UpdateClass. The image lands in memory so tests can
+ * compare it with what the server sent. failAt makes a write fail part way
+ * through like a bad flash sector would.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef UPDATE_H_
+#define UPDATE_H_
+
+#include <Arduino.h>
+#include <vector>
+
+#define UPDATE_ERROR_OK         0
+#define UPDATE_ERROR_WRITE      1
+#define UPDATE_ERROR_SIZE       4
+#define UPDATE_ERROR_SPACE      5
+#define UPDATE_ERROR_ABORT      8
+
+class UpdateClass {
+public:
+    UpdateClass();
+    bool begin(size_t size);
+    size_t write(uint8_t *data, size_t len);
+    bool end(bool evenIfRemaining = false);
+    void abort();
+    bool isFinished() { return size && image.size() == size; }
+    bool isRunning() { return running; }
+    size_t progress() { return image.size(); }
+    uint8_t getError() { return error; }
+    const char *errorString();
+    void reset();
+
+    std::vector<uint8_t> image;
+    size_t size;
+    size_t partitionSize;   //begin() fails for anything larger
+    size_t failAt;          //write() stops at this offset, 0 to never fail
+    bool ended;             //end() succeeded so the image would boot next
+
+private:
+    bool running;
+    uint8_t error;
+};
+
+extern UpdateClass Update;
+
+#endif /* UPDATE_H_ */
@@ -0,0 +1,382 @@
+/*
+ * WiFi.cpp
+ *
+ * Socket backed WiFi classes for the host build.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "WiFi.h"
+#include "Hal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+WiFiClass WiFi;
+
+static void setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+bool WiFiClass::mode(wifi_mode_t newMode)
+{
+    currentMode = newMode;
+    if (!(newMode & WIFI_AP)) apUp = false;
+    if (!(newMode & WIFI_STA)) staConnected = false;
+    return true;
+}
+
+bool WiFiClass::softAPConfig(IPAddress localIP, IPAddress gateway, IPAddress subnet)
+{
+    (void)gateway; (void)subnet;
+    apIP = localIP;
+    return true;
+}
+
+bool WiFiClass::softAP(const char *ssid, const char *passphrase, int channel, int hidden, int maxConnections)
+{
+    (void)ssid; (void)passphrase; (void)channel; (void)hidden; (void)maxConnections;
+    if (!(currentMode & WIFI_AP)) return false;
+    apUp = true;
+    return true;
+}
+
+bool WiFiClass::softAPdisconnect(bool wifiOff)
+{
+    (void)wifiOff;
+    apUp = false;
+    return true;
+}
+
+IPAddress WiFiClass::softAPIP()
+{
+    return apUp ? apIP : IPAddress();
+}
+
+//The workstation is already on a network so joining an AP always works right away
+wl_status_t WiFiClass::begin(const char *ssid, const char *passphrase)
+{
+    (void)passphrase;
+    if (!(currentMode & WIFI_STA)) mode(WIFI_STA);
+    staSSID = ssid;
+    staConnected = true;
+    return WL_CONNECTED;
+}
+
+bool WiFiClass::disconnect(bool wifiOff)
+{
+    (void)wifiOff;
+    staConnected = false;
+    return true;
+}
+
+bool WiFiClass::isConnected()
+{
+    return staConnected;
+}
+
+wl_status_t WiFiClass::status()
+{
+    return staConnected ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+bool WiFiClass::setTxPower(wifi_power_t power)
+{
+    (void)power;
+    return true;
+}
+
+IPAddress WiFiClass::localIP()
+{
+    return staConnected ? IPAddress(127, 0, 0, 1) : IPAddress();
+}
+
+int8_t WiFiClass::RSSI()
+{
+    return staConnected ? -40 : 0;
+}
+
+String WiFiClass::SSID()
+{
+    return staConnected ? staSSID : String();
+}
+
+WiFiClient::Socket::~Socket()
+{
+    if (fd >= 0) close(fd);
+}
+
+WiFiClient::WiFiClient(int fd)
+{
+    if (fd > 0) socket = std::make_shared<Socket>(fd);
+}
+
+int WiFiClient::connect(IPAddress ip, uint16_t port)
+{
+    return connect(ip.toString().c_str(), port);
+}
+
+int WiFiClient::connect(const char *host, uint16_t port)
+{
+    struct addrinfo hints, *result;
+    char service[8];
+    stop();
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%u", port);
+    if (getaddrinfo(host, service, &hints, &result)) return 0;
+
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        freeaddrinfo(result);
+        return 0;
+    }
+    setNonBlocking(fd);
+    int ret = ::connect(fd, result->ai_addr, result->ai_addrlen);
+    freeaddrinfo(result);
+    if (ret < 0 && errno == EINPROGRESS)
+    {
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (poll(&pfd, 1, WIFI_CLIENT_CONNECT_TIMEOUT) == 1 && !getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) && !error) ret = 0;
+    }
+    if (ret < 0)
+    {
+        close(fd);
+        return 0;
+    }
+    socket = std::make_shared<Socket>(fd);
+    return 1;
+}
+
+size_t WiFiClient::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+//Blocks until everything is queued in the socket or the peer stops reading for
+//WIFI_CLIENT_WRITE_TIMEOUT, which is roughly how the ESP32 version behaves
+size_t WiFiClient::write(const uint8_t *buf, size_t size)
+{
+    if (!socket) return 0;
+    size_t sent = 0;
+    while (sent < size)
+    {
+        ssize_t n = send(socket->fd, buf + sent, size - sent, MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            sent += n;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) break;
+        struct pollfd pfd = {socket->fd, POLLOUT, 0};
+        if (poll(&pfd, 1, WIFI_CLIENT_WRITE_TIMEOUT) <= 0) break;
+    }
+    return sent;
+}
+
+int WiFiClient::available()
+{
+    int count = 0;
+    if (!socket || ioctl(socket->fd, FIONREAD, &count) < 0) return 0;
+    return count;
+}
+
+int WiFiClient::read()
+{
+    uint8_t c;
+    return (read(&c, 1) == 1) ? c : -1;
+}
+
+int WiFiClient::read(uint8_t *buf, size_t size)
+{
+    if (!socket) return -1;
+    ssize_t n = recv(socket->fd, buf, size, MSG_DONTWAIT);
+    return (n > 0) ? n : -1;
+}
+
+int WiFiClient::peek()
+{
+    uint8_t c;
+    if (!socket) return -1;
+    return (recv(socket->fd, &c, 1, MSG_DONTWAIT | MSG_PEEK) == 1) ? c : -1;
+}
+
+void WiFiClient::stop()
+{
+    if (socket && socket->fd >= 0)
+    {
+        close(socket->fd);
+        socket->fd = -1;
+    }
+    socket.reset();
+}
+
+//Still true while received data is waiting even if the peer has closed
+uint8_t WiFiClient::connected()
+{
+    uint8_t c;
+    if (!socket || socket->fd < 0) return 0;
+    ssize_t n = recv(socket->fd, &c, 1, MSG_DONTWAIT | MSG_PEEK);
+    if (n > 0) return 1;
+    if (n == 0) return 0;
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 1 : 0;
+}
+
+int WiFiClient::setNoDelay(bool noDelay)
+{
+    int flag = noDelay ? 1 : 0;
+    if (!socket) return -1;
+    return setsockopt(socket->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+}
+
+IPAddress WiFiClient::remoteIP()
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (!socket || getpeername(socket->fd, (struct sockaddr *)&addr, &len) < 0) return IPAddress();
+    return IPAddress(addr.sin_addr.s_addr);
+}
+
+int WiFiClient::fd()
+{
+    return socket ? socket->fd : -1;
+}
+
+WiFiServer::WiFiServer(uint16_t port, uint8_t maxClients)
+{
+    (void)maxClients;
+    this->port = port;
+    listenFd = -1;
+    pendingFd = -1;
+    noDelay = false;
+}
+
+WiFiServer::~WiFiServer()
+{
+    end();
+}
+
+void WiFiServer::begin()
+{
+    struct sockaddr_in addr;
+    int flag = 1;
+    if (listenFd >= 0) return;
+
+    listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0) return;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(Hal::mapPort(port));
+    inet_pton(AF_INET, Hal::getBindAddress(), &addr.sin_addr);
+    if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, 4) < 0)
+    {
+        fprintf(stderr, "Can't listen on %s:%u: %s\n", Hal::getBindAddress(), Hal::mapPort(port), strerror(errno));
+        close(listenFd);
+        listenFd = -1;
+        return;
+    }
+    setNonBlocking(listenFd);
+}
+
+void WiFiServer::end()
+{
+    if (pendingFd >= 0) close(pendingFd);
+    if (listenFd >= 0) close(listenFd);
+    pendingFd = -1;
+    listenFd = -1;
+}
+
+void WiFiServer::setNoDelay(bool noDelay)
+{
+    this->noDelay = noDelay;
+}
+
+bool WiFiServer::hasClient()
+{
+    if (pendingFd < 0 && listenFd >= 0)
+    {
+        pendingFd = accept(listenFd, NULL, NULL);
+        if (pendingFd >= 0) setNonBlocking(pendingFd);
+    }
+    return pendingFd >= 0;
+}
+
+WiFiClient WiFiServer::available()
+{
+    if (!hasClient()) return WiFiClient();
+    WiFiClient client(pendingFd);
+    pendingFd = -1;
+    client.setNoDelay(noDelay);
+    return client;
+}
+
+WiFiUDP::~WiFiUDP()
+{
+    if (fd >= 0) close(fd);
+}
+
+//Broadcasts stay on this machine, they go to the loopback address at the mapped port
+int WiFiUDP::beginPacket(IPAddress ip, uint16_t port)
+{
+    destination = (ip == IPAddress(255, 255, 255, 255)) ? IPAddress(127, 0, 0, 1) : ip;
+    destPort = Hal::mapPort(port);
+    packet.clear();
+    return 1;
+}
+
+size_t WiFiUDP::write(uint8_t c)
+{
+    packet.push_back(c);
+    return 1;
+}
+
+size_t WiFiUDP::write(const uint8_t *buffer, size_t size)
+{
+    packet.insert(packet.end(), buffer, buffer + size);
+    return size;
+}
+
+int WiFiUDP::endPacket()
+{
+    struct sockaddr_in addr;
+    if (fd < 0) fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return 0;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(destPort);
+    addr.sin_addr.s_addr = (uint32_t)destination;
+    return (sendto(fd, packet.data(), packet.size(), 0, (struct sockaddr *)&addr, sizeof(addr)) == (ssize_t)packet.size()) ? 1 : 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * WiFi.h
+ *
+ * WiFi for the host build. The radio calls only keep track of what mode the
+ * firmware asked for. WiFiClient, WiFiServer and WiFiUDP are real sockets,
+ * servers listen on Hal::getBindAddress() at Hal::mapPort(port).
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef WIFI_H_
+#define WIFI_H_
+
+#include <Arduino.h>
+#include <Client.h>
+#include <memory>
+#include <vector>
+
+typedef enum {
+    WIFI_OFF = 0,
+    WIFI_STA = 1,
+    WIFI_AP = 2,
+    WIFI_AP_STA = 3
+} wifi_mode_t;
+
+typedef enum {
+    WL_IDLE_STATUS = 0,
+    WL_NO_SSID_AVAIL = 1,
+    WL_CONNECTED = 3,
+    WL_CONNECT_FAILED = 4,
+    WL_CONNECTION_LOST = 5,
+    WL_DISCONNECTED = 6
+} wl_status_t;
+
+typedef int wifi_power_t;
+
+#define WIFI_CLIENT_WRITE_TIMEOUT   5000 //ms write() waits for room in the socket before giving up
+#define WIFI_CLIENT_CONNECT_TIMEOUT 3000
+
+class WiFiClass {
+public:
+    bool mode(wifi_mode_t newMode);
+    wifi_mode_t getMode() { return currentMode; }
+    bool softAPConfig(IPAddress localIP, IPAddress gateway, IPAddress subnet);
+    bool softAP(const char *ssid, const char *passphrase = NULL, int channel = 1, int hidden = 0, int maxConnections = 4);
+    bool softAPdisconnect(bool wifiOff = false);
+    IPAddress softAPIP();
+    wl_status_t begin(const char *ssid, const char *passphrase = NULL);
+    bool disconnect(bool wifiOff = false);
+    bool isConnected();
+    wl_status_t status();
+    bool setTxPower(wifi_power_t power);
+    IPAddress localIP();
+    int8_t RSSI();
+    String SSID();
+
+private:
+    wifi_mode_t currentMode = WIFI_OFF;
+    IPAddress apIP = IPAddress(192, 168, 4, 1);
+    bool apUp = false;
+    bool staConnected = false;
+    String staSSID;
+};
+
+extern WiFiClass WiFi;
+
+//Copies share the socket, like the ESP32 version. Constructing from an fd of 0 or
+//less gives an empty client so the firmware's "client = 0" works.
+class WiFiClient : public Client {
+public:
+    WiFiClient() {}
+    WiFiClient(int fd);
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char *host, uint16_t port) override;
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buf, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t *buf, size_t size) override;
+    int peek() override;
+    void flush() override {}
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override { return connected(); }
+    using Print::write;
+
+    int setNoDelay(bool noDelay);
+    IPAddress remoteIP();
+    int fd();
+
+private:
+    struct Socket {
+        explicit Socket(int fd) : fd(fd) {}
+        ~Socket();
+        int fd;
+    };
+    std::shared_ptr<Socket> socket;
+};
+
+class WiFiServer {
+public:
+    WiFiServer(uint16_t port, uint8_t maxClients = 4);
+    ~WiFiServer();
+    void begin();
+    void end();
+    void setNoDelay(bool noDelay);
+    bool hasClient();
+    WiFiClient available();
+    uint16_t getPort() { return port; }
+
+private:
+    uint16_t port;
+    int listenFd;
+    int pendingFd;
+    bool noDelay;
+};
+
+class WiFiUDP : public Print {
+public:
+    WiFiUDP() {}
+    ~WiFiUDP();
+    int beginPacket(IPAddress ip, uint16_t port);
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    int endPacket();
+
+private:
+    int fd = -1;
+    IPAddress destination;
+    uint16_t destPort = 0;
+    std::vector<uint8_t> packet;
+};
+
+#endif /* WIFI_H_ */
@@ -0,0 +1,151 @@
+/*
+ * esp32_can.cpp
+ *
+ * CAN0 and CAN1 for the host build, queued like the ESP32 driver and put on a
+ * CanBus from hal/.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "esp32_can.h"
+#include "Hal.h"
+
+CAN_COMMON CAN0;
+CAN_COMMON CAN1;
+
+CAN_COMMON::CAN_COMMON()
+{
+    bus = NULL;
+    baudRate = 0;
+    enabled = false;
+    listenOnly = false;
+    numFilters = 0;
+    rxDrops = 0;
+}
+
+uint32_t CAN_COMMON::begin(uint32_t baudrate, uint8_t enablePin)
+{
+    (void)enablePin;
+    baudRate = baudrate;
+    if (!bus) attach(&Hal::getDefaultCanBus());
+    enabled = true;
+    return baudrate;
+}
+
+void CAN_COMMON::enable()
+{
+    enabled = true;
+}
+
+void CAN_COMMON::disable()
+{
+    enabled = false;
+}
+
+void CAN_COMMON::setListenOnlyMode(bool state)
+{
+    listenOnly = state;
+}
+
+void CAN_COMMON::setCANPins(gpio_num_t rxPin, gpio_num_t txPin)
+{
+    (void)rxPin; (void)txPin;
+}
+
+int CAN_COMMON::watchFor()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    numFilters = 0;
+    return 0;
+}
+
+int CAN_COMMON::watchFor(uint32_t id, uint32_t mask)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (numFilters == CAN_HOST_FILTERS) return -1;
+    filterId[numFilters] = id & mask;
+    filterMask[numFilters] = mask;
+    return numFilters++;
+}
+
+bool CAN_COMMON::sendFrame(CAN_FRAME &frame)
+{
+    if (!enabled || listenOnly || !bus) return false;
+    return bus->send(this, frame);
+}
+
+int CAN_COMMON::available()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return rxQueue.size();
+}
+
+uint32_t CAN_COMMON::read(CAN_FRAME &frame)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (rxQueue.empty()) return 0;
+    frame = rxQueue.front();
+    rxQueue.pop_front();
+    return 1;
+}
+
+void CAN_COMMON::printDebug()
+{
+    Serial.printf("Bus at %u baud, %u frames queued, %u dropped\r\n", baudRate, (unsigned)available(), rxDrops);
+}
+
+void CAN_COMMON::attach(CanBus *newBus)
+{
+    if (bus) bus->detach(this);
+    bus = newBus;
+    if (bus) bus->attach(this);
+}
+
+CanBus *CAN_COMMON::getBus()
+{
+    return bus;
+}
+
+//Called from whatever thread sent the frame, like the receive interrupt on the ESP32
+void CAN_COMMON::frameReceived(const CAN_FRAME &frame)
+{
+    if (!enabled) return;
+    std::lock_guard<std::mutex> guard(lock);
+    if (!accepts(frame)) return;
+    if (rxQueue.size() >= CAN_HOST_RX_QUEUE)
+    {
+        rxDrops++;
+        return;
+    }
+    rxQueue.push_back(frame);
+    rxQueue.back().timestamp = micros();
+}
+
+bool CAN_COMMON::accepts(const CAN_FRAME &frame)
+{
+    if (numFilters == 0) return true;
+    for (int i = 0; i < numFilters; i++)
+    {
+        if ((frame.id & filterMask[i]) == filterId[i]) return true;
+    }
+    return false;
+}
@@ -0,0 +1,124 @@
+/*
+ * esp32_can.h
+ *
+ * The CAN frame type from the esp32_can library for the host build.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ESP32_CAN_H_
+#define ESP32_CAN_H_
+
+#include <Arduino.h>
+#include <deque>
+#include <mutex>
+
+typedef union {
+    uint64_t value;
+    struct {
+        uint32_t low;
+        uint32_t high;
+    };
+    struct {
+        uint16_t s0;
+        uint16_t s1;
+        uint16_t s2;
+        uint16_t s3;
+    };
+    uint8_t bytes[8];
+    uint8_t byte[8];
+    uint8_t uint8[8];
+} BytesUnion;
+
+class CAN_FRAME {
+public:
+    CAN_FRAME() : id(0), fid(0), timestamp(0), rtr(0), priority(15), extended(false), length(0) { data.value = 0; }
+
+    BytesUnion data;
+    uint32_t id;
+    uint32_t fid;
+    uint32_t timestamp;
+    uint8_t rtr;
+    uint8_t priority;
+    uint8_t extended;
+    uint8_t length;
+};
+
+enum gpio_num_t {
+    GPIO_NUM_4 = 4,
+    GPIO_NUM_5 = 5
+};
+
+//Anything that wants to see frames on a CanBus: CAN0, ECU simulators, replay tools
+class CanNode {
+public:
+    virtual ~CanNode() {}
+    virtual void frameReceived(const CAN_FRAME &frame) = 0;
+};
+
+class CanBus;
+
+#define CAN_HOST_RX_QUEUE   100 //frames queued until read(), the rest are dropped like the ESP32 driver does
+#define CAN_HOST_FILTERS    32
+
+//CAN0 and CAN1. Frames come from and go to whatever CanBus they're attached to,
+//Hal::getDefaultCanBus() unless attach() picked another one.
+class CAN_COMMON : public CanNode {
+public:
+    CAN_COMMON();
+    uint32_t begin(uint32_t baudrate, uint8_t enablePin = 255);
+    void enable();
+    void disable();
+    void setListenOnlyMode(bool state);
+    void setCANPins(gpio_num_t rxPin, gpio_num_t txPin);
+    int watchFor();
+    int watchFor(uint32_t id, uint32_t mask);
+    bool sendFrame(CAN_FRAME &frame);
+    int available();
+    uint32_t read(CAN_FRAME &frame);
+    void printDebug();
+
+    void attach(CanBus *bus);
+    CanBus *getBus();
+    uint32_t getBaudRate() { return baudRate; }
+    uint32_t getRxDrops() { return rxDrops; }
+    void frameReceived(const CAN_FRAME &frame) override;
+
+private:
+    bool accepts(const CAN_FRAME &frame);
+
+    std::mutex lock;
+    std::deque<CAN_FRAME> rxQueue;
+    CanBus *bus;
+    uint32_t baudRate;
+    bool enabled;
+    bool listenOnly;
+    int numFilters;         //0 accepts everything
+    uint32_t filterId[CAN_HOST_FILTERS];
+    uint32_t filterMask[CAN_HOST_FILTERS];
+    uint32_t rxDrops;
+};
+
+extern CAN_COMMON CAN0;
+extern CAN_COMMON CAN1;
+
+#endif /* ESP32_CAN_H_ */
@@ -0,0 +1,40 @@
+/*
+ * esp_ota_ops.h
+ *
+ * Stand-in for the ESP-IDF OTA partition calls. There are two app slots and
+ * the boot selection is a plain pointer tests can inspect. Update.end()
+ * switches it to the other slot like the real UpdateClass does.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ESP_OTA_OPS_H_
+#define ESP_OTA_OPS_H_
+
+#include "esp_partition.h"
+
+const esp_partition_t *esp_ota_get_running_partition();
+const esp_partition_t *esp_ota_get_boot_partition();
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from);
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition);
+
+#endif /* ESP_OTA_OPS_H_ */
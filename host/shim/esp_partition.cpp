@@ -0,0 +1,119 @@
+/*
+ * esp_partition.cpp
+ *
+ * In-memory data partitions for the host build, laid out like the default
+ * ESP32 partition table.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "esp_partition.h"
+#include <string.h>
+#include <vector>
+#include "Hal.h"
+
+static esp_partition_t dataPartitions[] = {
+    {ESP_PARTITION_TYPE_DATA, 0x99, 0x3D0000, 0x1000, "eeprom", false},
+    {ESP_PARTITION_TYPE_DATA, 0x82, 0x291000, 0x13F000, "spiffs", false}
+};
+#define NUM_DATA_PARTITIONS (sizeof(dataPartitions) / sizeof(dataPartitions[0]))
+
+static int32_t writeLimit = -1;   //bytes still programmed before writes stop landing, -1 for no limit
+
+static std::vector<uint8_t> &contents(const esp_partition_t *partition)
+{
+    static std::vector<uint8_t> flash[NUM_DATA_PARTITIONS];
+    std::vector<uint8_t> &data = flash[partition - dataPartitions];
+    if (data.empty()) data.assign(partition->size, 0xFF);
+    return data;
+}
+
+static bool valid(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    if (partition < dataPartitions || partition >= dataPartitions + NUM_DATA_PARTITIONS) return false;
+    return offset <= partition->size && size <= partition->size - offset;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    for (size_t i = 0; i < NUM_DATA_PARTITIONS; i++)
+    {
+        const esp_partition_t *partition = &dataPartitions[i];
+        if (partition->type != type) continue;
+        if (subtype != ESP_PARTITION_SUBTYPE_ANY && partition->subtype != subtype) continue;
+        if (label && strcmp(label, partition->label)) continue;
+        return partition;
+    }
+    return NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t srcOffset, void *dst, size_t size)
+{
+    if (!valid(partition, srcOffset, size)) return ESP_ERR_INVALID_SIZE;
+    memcpy(dst, &contents(partition)[srcOffset], size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dstOffset, const void *src, size_t size)
+{
+    if (!valid(partition, dstOffset, size)) return ESP_ERR_INVALID_SIZE;
+    uint8_t *data = &contents(partition)[dstOffset];
+    for (size_t i = 0; i < size && writeLimit != 0; i++)
+    {
+        data[i] &= ((const uint8_t *)src)[i];
+        if (writeLimit > 0) writeLimit--;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t startAddress, size_t size)
+{
+    if (!valid(partition, startAddress, size)) return ESP_ERR_INVALID_SIZE;
+    if ((startAddress | size) % SPI_FLASH_SEC_SIZE) return ESP_ERR_INVALID_ARG;
+    memset(&contents(partition)[startAddress], 0xFF, size);
+    return ESP_OK;
+}
+
+/*
+ * Change the size of a partition, which also erases it. Lets tests run against
+ * partition tables other than the default one.
+ */
+bool Hal::setPartitionSize(const char *label, uint32_t size)
+{
+    for (size_t i = 0; i < NUM_DATA_PARTITIONS; i++)
+    {
+        if (strcmp(label, dataPartitions[i].label) || size % SPI_FLASH_SEC_SIZE) continue;
+        dataPartitions[i].size = size;
+        contents(&dataPartitions[i]).assign(size, 0xFF);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Only program the next bytes worth of writes and silently drop the rest, the
+ * way a reset in the middle of a write leaves flash. -1 lifts the limit.
+ */
+void Hal::setFlashWriteLimit(int32_t bytes)
+{
+    writeLimit = bytes;
+}
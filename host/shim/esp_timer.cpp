@@ -0,0 +1,113 @@
+/*
+ * esp_timer.cpp
+ *
+ * One shot timers from ESP-IDF on a dispatcher thread.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "esp_timer.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void *arg;
+    bool armed;
+    Clock::time_point due;
+};
+
+static std::mutex timerLock;
+static std::condition_variable timerChanged;
+static std::vector<esp_timer *> timers;
+static bool dispatcherRunning = false;
+static const Clock::time_point timeBase = Clock::now();
+
+//runs the callback of the timer due first, one at a time
+static void dispatch()
+{
+    std::unique_lock<std::mutex> guard(timerLock);
+    for (;;)
+    {
+        esp_timer *next = NULL;
+        for (esp_timer *timer : timers)
+            if (timer->armed && (!next || timer->due < next->due)) next = timer;
+        if (!next)
+        {
+            timerChanged.wait(guard);
+            continue;
+        }
+        if (Clock::now() < next->due)
+        {
+            timerChanged.wait_until(guard, next->due);
+            continue;
+        }
+        next->armed = false;
+        guard.unlock();
+        next->callback(next->arg);
+        guard.lock();
+    }
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle)
+{
+    if (!create_args || !create_args->callback || !out_handle) return ESP_ERR_INVALID_ARG;
+    std::lock_guard<std::mutex> guard(timerLock);
+    esp_timer *timer = new esp_timer{create_args->callback, create_args->arg, false, Clock::time_point()};
+    timers.push_back(timer);
+    if (!dispatcherRunning)
+    {
+        std::thread(dispatch).detach();
+        dispatcherRunning = true;
+    }
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    std::lock_guard<std::mutex> guard(timerLock);
+    if (timer->armed) return ESP_ERR_INVALID_STATE;
+    timer->armed = true;
+    timer->due = Clock::now() + std::chrono::microseconds(timeout_us);
+    timerChanged.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    std::lock_guard<std::mutex> guard(timerLock);
+    if (!timer->armed) return ESP_ERR_INVALID_STATE;
+    timer->armed = false;
+    timerChanged.notify_all();
+    return ESP_OK;
+}
+
+int64_t esp_timer_get_time()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - timeBase).count();
+}
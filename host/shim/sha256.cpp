@@ -0,0 +1,67 @@
+/*
+ * sha256.cpp
+ *
+ * mbedTLS style SHA-256 on top of OpenSSL's EVP interface.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "mbedtls/sha256.h"
+#include <openssl/evp.h>
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx)
+{
+    ctx->md = NULL;
+}
+
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx)
+{
+    EVP_MD_CTX_free((EVP_MD_CTX *)ctx->md);
+    ctx->md = NULL;
+}
+
+int mbedtls_sha256_starts_ret(mbedtls_sha256_context *ctx, int is224)
+{
+    if (!ctx->md) ctx->md = EVP_MD_CTX_new();
+    return EVP_DigestInit_ex((EVP_MD_CTX *)ctx->md, is224 ? EVP_sha224() : EVP_sha256(), NULL) ? 0 : -1;
+}
+
+int mbedtls_sha256_update_ret(mbedtls_sha256_context *ctx, const unsigned char *input, size_t ilen)
+{
+    return EVP_DigestUpdate((EVP_MD_CTX *)ctx->md, input, ilen) ? 0 : -1;
+}
+
+int mbedtls_sha256_finish_ret(mbedtls_sha256_context *ctx, unsigned char output[32])
+{
+    return EVP_DigestFinal_ex((EVP_MD_CTX *)ctx->md, output, NULL) ? 0 : -1;
+}
+
+int mbedtls_sha256_ret(const unsigned char *input, size_t ilen, unsigned char output[32], int is224)
+{
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    int ret = mbedtls_sha256_starts_ret(&ctx, is224);
+    if (!ret) ret = mbedtls_sha256_update_ret(&ctx, input, ilen);
+    if (!ret) ret = mbedtls_sha256_finish_ret(&ctx, output);
+    mbedtls_sha256_free(&ctx);
+    return ret;
+}
@@ -0,0 +1,825 @@
+/*
+ * EcuSimulator.cpp
+ *
+ * Simulated OBDII/UDS ECUs, see EcuSimulator.h
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "EcuSimulator.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include "obd2_codes.h"
+
+//UDS services from obd2_codes.h. Without a canned response they are refused with requestOutOfRange
+static const uint8_t udsServices[] = {
+    UDS_DIAG_CTRL, UDS_ECU_RESET, UDS_GMLAN_READ_FAILURE_REC, UDS_CLEAR_DIAG, UDS_READ_DTC,
+    UDS_GMLAN_READ_DIAG_ID, UDS_RETURN_TO_NORMAL, UDS_READ_BY_ID, UDS_READ_BY_ADDR, UDS_READ_SCALING_ID,
+    UDS_SECURITY_ACCESS, UDS_COMM_CTRL, UDS_READ_ID_PERIODIC, UDS_DYNAMIC_DATA_DEF, UDS_DEFINE_PID_BY_ADDR,
+    UDS_WRITE_BY_ID, UDS_IO_CTRL, UDS_ROUTINE_CTRL, UDS_REQ_DOWNLOAD, UDS_REQ_UPLOAD, UDS_TRANSFER_DATA,
+    UDS_REQ_TRANS_EXIT, UDS_REQ_FILE_TRANS, UDS_GMLAN_WRITE_DID, UDS_WRITE_BY_ADDR, UDS_TESTER_PRESENT,
+    UDS_ACCESS_TIMING, UDS_SECURED_DATA_TRANS, UDS_CTRL_DTC_SETTINGS, UDS_RESP_ON_EVENT, UDS_RESP_LINK_CTRL,
+    UDS_GMLAN_REPORT_PROG_STATE, UDS_GMLAN_ENTER_PROG_MODE, UDS_GMLAN_CHECK_CODES, UDS_GMLAN_READ_DPID,
+    UDS_GMLAN_DEVICE_CTRL
+};
+
+//negative response codes
+#define NRC_SERVICE_NOT_SUPPORTED   0x11
+#define NRC_SUBFUNCTION_NOT_SUPPORTED 0x12
+#define NRC_BAD_LENGTH              0x13
+#define NRC_OUT_OF_RANGE            0x31
+#define NRC_RESPONSE_PENDING        0x78
+#define NRC_NOT_IN_SESSION          0x7F
+
+//An engine ECU and a transmission ECU that answer in 5-15ms like most cars do
+static const char *defaultScript =
+    "ecu 0\n"
+    "delay 0 8000 4000\n"
+    "pid 0 01 04 66\n"              //engine load 40%
+    "pid 0 01 05 7B\n"              //coolant 83C
+    "pid 0 01 0B 21\n"              //MAP 33kPa
+    "pid 0 01 0C 1AF8\n"            //1726 rpm
+    "pid 0 01 0D 3C\n"              //60 km/h
+    "pid 0 01 0F 44\n"              //intake air 28C
+    "pid 0 01 10 0190\n"            //MAF 4g/s
+    "pid 0 01 11 33\n"              //throttle 20%
+    "pid 0 01 2F A0\n"              //fuel 63%
+    "pid 0 01 46 3A\n"              //ambient 18C
+    "pid 0 09 02 01 31 47 31 4A 43 35 34 34 34 52 37 32 35 32 33 36 37\n" //VIN 1G1JC5444R7252367
+    "did 0 F190 31 47 31 4A 43 35 34 34 34 52 37 32 35 32 33 36 37\n"
+    "did 0 F18C 4D 41 43 43 48 49 4E 41 30 31\n"
+    "dtc 0 03 0133 0420\n"
+    "dtc 0 19 013300 042000\n"
+    "ecu 1\n"
+    "delay 1 12000 4000\n"
+    "pid 1 01 05 7E\n"
+    "pid 1 01 0D 3C\n"
+    "did 1 F190 31 47 31 4A 43 35 34 34 34 52 37 32 35 32 33 36 37\n"
+    "dtc 1 07 0700\n";
+
+EcuSimulator::EcuSimulator()
+{
+    running = false;
+    bus = NULL;
+    requests = 0;
+    responses = 0;
+    periodicFrames = 0;
+}
+
+EcuSimulator::~EcuSimulator()
+{
+    if (bus) detach();
+}
+
+void EcuSimulator::attach(CanBus &canBus)
+{
+    if (bus) return;
+    bus = &canBus;
+    running = true;
+    worker = std::thread(workerThread, this);
+    bus->attach(this);
+}
+
+void EcuSimulator::detach()
+{
+    if (!bus) return;
+    bus->detach(this);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        running = false;
+    }
+    wake.notify_all();
+    worker.join();
+    bus = NULL;
+}
+
+bool EcuSimulator::checkEcu(int ecu)
+{
+    return ecu >= 0 && ecu < ECU_SIM_MAX_ECUS;
+}
+
+bool EcuSimulator::addEcu(int ecu, bool functional)
+{
+    if (!checkEcu(ecu)) return false;
+    std::lock_guard<std::mutex> guard(lock);
+    ecus[ecu].present = true;
+    ecus[ecu].functional = functional;
+    return true;
+}
+
+void EcuSimulator::setDelay(int ecu, uint32_t micros, uint32_t jitter)
+{
+    if (!checkEcu(ecu)) return;
+    std::lock_guard<std::mutex> guard(lock);
+    ecus[ecu].delay = micros;
+    ecus[ecu].jitter = jitter;
+}
+
+void EcuSimulator::setPID(int ecu, uint8_t mode, uint8_t pid, const std::vector<uint8_t> &data)
+{
+    if (!checkEcu(ecu)) return;
+    std::lock_guard<std::mutex> guard(lock);
+    ecus[ecu].pids[(mode << 8) | pid] = data;
+}
+
+void EcuSimulator::setDID(int ecu, uint16_t did, const std::vector<uint8_t> &data)
+{
+    if (!checkEcu(ecu)) return;
+    std::lock_guard<std::mutex> guard(lock);
+    ecus[ecu].dids[did] = data;
+}
+
+void EcuSimulator::setDTCs(int ecu, uint8_t service, const std::vector<uint32_t> &codes)
+{
+    if (!checkEcu(ecu)) return;
+    std::lock_guard<std::mutex> guard(lock);
+    ecus[ecu].dtcs[service] = codes;
+}
+
+void EcuSimulator::setResponse(int ecu, const std::vector<uint8_t> &request, const std::vector<uint8_t> &response)
+{
+    if (!checkEcu(ecu) || request.empty()) return;
+    std::lock_guard<std::mutex> guard(lock);
+    ecus[ecu].responses[request] = response;
+}
+
+void EcuSimulator::setPending(int ecu, uint8_t service, int count)
+{
+    if (!checkEcu(ecu)) return;
+    std::lock_guard<std::mutex> guard(lock);
+    ecus[ecu].pending[service] = count;
+}
+
+void EcuSimulator::setFlowControl(int ecu, uint8_t blockSize, uint8_t separationTime)
+{
+    if (!checkEcu(ecu)) return;
+    std::lock_guard<std::mutex> guard(lock);
+    ecus[ecu].blockSize = blockSize;
+    ecus[ecu].separationTime = separationTime;
+}
+
+void EcuSimulator::setDIDLimit(int ecu, int count)
+{
+    if (!checkEcu(ecu)) return;
+    std::lock_guard<std::mutex> guard(lock);
+    ecus[ecu].didLimit = count;
+}
+
+void EcuSimulator::setPeriodicRates(int ecu, uint32_t slow, uint32_t medium, uint32_t fast)
+{
+    if (!checkEcu(ecu)) return;
+    std::lock_guard<std::mutex> guard(lock);
+    ecus[ecu].periodicRates[0] = slow;
+    ecus[ecu].periodicRates[1] = medium;
+    ecus[ecu].periodicRates[2] = fast;
+}
+
+void EcuSimulator::setSessionTimeout(int ecu, uint32_t micros)
+{
+    if (!checkEcu(ecu)) return;
+    std::lock_guard<std::mutex> guard(lock);
+    ecus[ecu].sessionTimeout = micros;
+}
+
+bool EcuSimulator::parseHex(const std::string &text, std::vector<uint8_t> &bytes)
+{
+    std::string digits;
+    for (char c : text)
+    {
+        if (isspace((unsigned char)c)) continue;
+        if (!isxdigit((unsigned char)c)) return false;
+        digits += c;
+    }
+    if (digits.size() & 1) return false;
+    bytes.clear();
+    for (size_t i = 0; i < digits.size(); i += 2) bytes.push_back(strtoul(digits.substr(i, 2).c_str(), NULL, 16));
+    return true;
+}
+
+bool EcuSimulator::loadScript(const char *path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        fprintf(stderr, "%s: can't open\n", path);
+        return false;
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+    return parseScript(text.str(), path);
+}
+
+bool EcuSimulator::loadDefault()
+{
+    return parseScript(defaultScript, "default");
+}
+
+bool EcuSimulator::parseScript(const std::string &text, const char *name)
+{
+    std::istringstream lines(text);
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(lines, line))
+    {
+        lineNumber++;
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) line.erase(comment);
+        std::istringstream words(line);
+        std::string directive, ecuText;
+        if (!(words >> directive)) continue;
+
+        int ecu = (words >> ecuText) ? atoi(ecuText.c_str()) : -1;
+        if (!checkEcu(ecu))
+        {
+            fprintf(stderr, "%s:%i: ECU number missing or not 0-%i\n", name, lineNumber, ECU_SIM_MAX_ECUS - 1);
+            return false;
+        }
+        std::string a, b, rest, word;
+        words >> a >> b;
+        while (words >> word) rest += word;
+        std::vector<uint8_t> data;
+        bool ok = true;
+
+        if (directive == "ecu") ok = addEcu(ecu, a != "physical");
+        else if (directive == "delay" && !a.empty()) setDelay(ecu, strtoul(a.c_str(), NULL, 10), strtoul(b.c_str(), NULL, 10));
+        else if (directive == "pid" && !b.empty() && parseHex(rest, data))
+            setPID(ecu, strtoul(a.c_str(), NULL, 16), strtoul(b.c_str(), NULL, 16), data);
+        else if (directive == "did" && !a.empty() && parseHex(b + rest, data)) setDID(ecu, strtoul(a.c_str(), NULL, 16), data);
+        else if (directive == "dtc" && !a.empty())
+        {
+            std::vector<uint32_t> codes;
+            std::istringstream list(line);
+            list >> word >> word >> word; //directive, ECU and service
+            while (list >> word) codes.push_back(strtoul(word.c_str(), NULL, 16));
+            setDTCs(ecu, strtoul(a.c_str(), NULL, 16), codes);
+        }
+        else if (directive == "response" && !b.empty() && parseHex(a, data))
+        {
+            std::vector<uint8_t> response;
+            ok = parseHex(b + rest, response) && !data.empty();
+            if (ok) setResponse(ecu, data, response);
+        }
+        else if (directive == "pending" && !b.empty()) setPending(ecu, strtoul(a.c_str(), NULL, 16), atoi(b.c_str()));
+        else if (directive == "flow" && !b.empty()) setFlowControl(ecu, atoi(a.c_str()), strtoul(b.c_str(), NULL, 16));
+        else if (directive == "didlimit" && !a.empty()) setDIDLimit(ecu, atoi(a.c_str()));
+        else if (directive == "periodic" && !rest.empty())
+            setPeriodicRates(ecu, strtoul(a.c_str(), NULL, 10), strtoul(b.c_str(), NULL, 10), strtoul(rest.c_str(), NULL, 10));
+        else if (directive == "s3" && !a.empty()) setSessionTimeout(ecu, strtoul(a.c_str(), NULL, 10));
+        else ok = false;
+
+        if (!ok)
+        {
+            fprintf(stderr, "%s:%i: can't make sense of \"%s\"\n", name, lineNumber, line.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+uint64_t EcuSimulator::nowMicros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//ISO-TP separation time: 0-7F milliseconds, F1-F9 hundreds of microseconds
+static uint32_t separationMicros(uint8_t stmin)
+{
+    if (stmin <= 0x7F) return stmin * 1000;
+    if (stmin >= 0xF1 && stmin <= 0xF9) return (stmin - 0xF0) * 100;
+    return 127000;
+}
+
+void EcuSimulator::frameReceived(const CAN_FRAME &frame)
+{
+    if (frame.extended || frame.rtr || frame.length < 1) return;
+    bool functional = (frame.id == 0x7DF);
+    int first, last;
+    if (functional)
+    {
+        first = 0;
+        last = ECU_SIM_MAX_ECUS - 1;
+    }
+    else if (frame.id >= 0x7E0 && frame.id < 0x7E0 + ECU_SIM_MAX_ECUS) first = last = frame.id - 0x7E0;
+    else return;
+
+    const uint8_t *bytes = frame.data.bytes;
+    std::lock_guard<std::mutex> guard(lock);
+    for (int i = first; i <= last; i++)
+    {
+        Ecu &ecu = ecus[i];
+        if (!ecu.present || (functional && !ecu.functional)) continue;
+
+        switch (bytes[0] >> 4)
+        {
+        case 0: //single frame
+        {
+            int length = bytes[0] & 0xF;
+            if (length == 0 || length > frame.length - 1) break;
+            handleRequest(i, std::vector<uint8_t>(bytes + 1, bytes + 1 + length), functional);
+            break;
+        }
+        case 1: //first frame of a request, ask for the rest
+        {
+            if (functional || frame.length < 8) break;
+            ecu.generation++;
+            ecu.rxLength = ((bytes[0] & 0xF) << 8) | bytes[1];
+            ecu.rxPayload.assign(bytes + 2, bytes + 8);
+            ecu.rxSeq = 1;
+            uint8_t flow[3] = {0x30, ecu.blockSize, ecu.separationTime};
+            queueFrame(i, nowMicros(), flow, 3, false);
+            break;
+        }
+        case 2: //consecutive frame
+        {
+            if (functional || !ecu.rxLength || (bytes[0] & 0xF) != (ecu.rxSeq & 0xF)) break;
+            size_t count = std::min<size_t>(std::min<size_t>(7, frame.length - 1), ecu.rxLength - ecu.rxPayload.size());
+            ecu.rxPayload.insert(ecu.rxPayload.end(), bytes + 1, bytes + 1 + count);
+            ecu.rxSeq++;
+            if (ecu.rxPayload.size() >= ecu.rxLength)
+            {
+                ecu.rxLength = 0;
+                handleRequest(i, ecu.rxPayload, false);
+            }
+            else if (ecu.blockSize && ((ecu.rxSeq - 1) % ecu.blockSize) == 0)
+            {
+                uint8_t flow[3] = {0x30, ecu.blockSize, ecu.separationTime};
+                queueFrame(i, nowMicros(), flow, 3, false);
+            }
+            break;
+        }
+        case 3: //flow control for the reply being sent
+            if (functional || !ecu.txWaitFlow) break;
+            if ((bytes[0] & 0xF) == 0)
+            {
+                ecu.txWaitFlow = false;
+                queueConsecutive(i, bytes[1], separationMicros(bytes[2]));
+            }
+            else if ((bytes[0] & 0xF) == 2) //overflow, the tester gave up
+            {
+                ecu.txWaitFlow = false;
+                ecu.txPayload.clear();
+            }
+            break;
+        }
+    }
+    wake.notify_one();
+}
+
+void EcuSimulator::handleRequest(int index, const std::vector<uint8_t> &request, bool functional)
+{
+    Ecu &ecu = ecus[index];
+    requests++;
+    ecu.generation++;
+    ecu.txWaitFlow = false;
+    ecu.txPayload.clear();
+    uint64_t now = nowMicros();
+    if (ecu.session != 1 && now > ecu.sessionEnd) endSession(ecu);
+    ecu.sessionEnd = now + ecu.sessionTimeout;
+
+    std::vector<uint8_t> reply;
+    if (!buildReply(ecu, request, functional, reply) || reply.empty()) return;
+
+    uint64_t due = nowMicros() + ecu.delay + (ecu.jitter ? jitterRandom() % (ecu.jitter + 1) : 0);
+    auto pending = ecu.pending.find(request[0]);
+    if (pending != ecu.pending.end() && reply[0] != UDS_NEG_RESP)
+    {
+        for (int i = 0; i < pending->second; i++)
+        {
+            uint8_t wait[4] = {0x03, UDS_NEG_RESP, request[0], NRC_RESPONSE_PENDING};
+            queueFrame(index, due, wait, 4, false);
+            due += std::max<uint32_t>(ecu.delay, 1);
+        }
+    }
+    queueReply(index, reply, due);
+    if (reply[0] == UDS_READ_ID_PERIODIC + 0x40)
+    {
+        //the first of each comes a period after the answer
+        for (auto &entry : ecu.periodic) queuePeriodic(index, entry.first, due + entry.second);
+    }
+}
+
+bool EcuSimulator::buildReply(Ecu &ecu, const std::vector<uint8_t> &request, bool functional, std::vector<uint8_t> &reply)
+{
+    uint8_t service = request[0];
+    uint8_t nrc = 0;
+
+    //canned responses first, the longest matching request wins
+    const std::vector<uint8_t> *canned = NULL;
+    size_t matched = 0;
+    for (auto &entry : ecu.responses)
+    {
+        if (entry.first.size() > request.size() || entry.first.size() <= matched) continue;
+        if (!std::equal(entry.first.begin(), entry.first.end(), request.begin())) continue;
+        canned = &entry.second;
+        matched = entry.first.size();
+    }
+    if (canned)
+    {
+        reply = *canned;
+        return true;
+    }
+
+    switch (service)
+    {
+    case OBDII_SHOW_CURRENT: //up to six PIDs per request, all answered together
+    case OBDII_VEHICLE_INFO: //one info type per request
+        reply.push_back(service + 0x40);
+        for (size_t i = 1; i < request.size(); i++)
+        {
+            auto value = ecu.pids.find((service << 8) | request[i]);
+            if (value != ecu.pids.end())
+            {
+                reply.push_back(request[i]);
+                reply.insert(reply.end(), value->second.begin(), value->second.end());
+            }
+            else if ((request[i] & 0x1F) == 0) supportedPIDs(ecu, service, request[i], reply);
+            if (service == OBDII_VEHICLE_INFO) break;
+        }
+        return reply.size() > 1;
+
+    case OBDII_SHOW_STORED_DTC:
+    case OBDII_SHOW_PENDING_DTC:
+    case OBDII_PERM_DTC:
+    {
+        std::vector<uint32_t> &codes = ecu.dtcs[service];
+        reply.push_back(service + 0x40);
+        reply.push_back(codes.size());
+        for (uint32_t code : codes)
+        {
+            reply.push_back(code >> 8);
+            reply.push_back(code);
+        }
+        return true;
+    }
+
+    case OBDII_CLEAR_DTC:
+        ecu.dtcs[OBDII_SHOW_STORED_DTC].clear();
+        ecu.dtcs[OBDII_SHOW_PENDING_DTC].clear();
+        reply.push_back(service + 0x40);
+        return true;
+
+    case UDS_DIAG_CTRL:
+        if (request.size() != 2) nrc = NRC_BAD_LENGTH;
+        else
+        {
+            if ((request[1] & 0x7F) == 1) endSession(ecu);
+            ecu.session = request[1] & 0x7F;
+            if (request[1] & 0x80) return false; //positive response suppressed
+            reply = {0x50, request[1], 0x00, 0x32, 0x01, 0xF4}; //P2 50ms, P2* 5s
+        }
+        break;
+
+    case UDS_ECU_RESET:
+        if (request.size() != 2) nrc = NRC_BAD_LENGTH;
+        else
+        {
+            endSession(ecu);
+            if (request[1] & 0x80) return false;
+            reply = {0x51, request[1]};
+        }
+        break;
+
+    case UDS_TESTER_PRESENT:
+        if (request.size() != 2) nrc = NRC_BAD_LENGTH;
+        else if (request[1] & 0x7F) nrc = NRC_SUBFUNCTION_NOT_SUPPORTED;
+        else if (request[1] & 0x80) return false;
+        else reply = {0x7E, 0x00};
+        break;
+
+    case UDS_READ_BY_ID: //any number of DIDs up to the limit, the ones this ECU has are answered
+        if (request.size() < 3 || !(request.size() & 1)) nrc = NRC_BAD_LENGTH;
+        else if (ecu.didLimit && (int)request.size() / 2 > ecu.didLimit) nrc = NRC_BAD_LENGTH;
+        else
+        {
+            reply.push_back(service + 0x40);
+            for (size_t i = 1; i + 1 < request.size(); i += 2)
+            {
+                std::vector<uint8_t> value;
+                if (!readDID(ecu, (request[i] << 8) | request[i + 1], value)) continue;
+                reply.push_back(request[i]);
+                reply.push_back(request[i + 1]);
+                reply.insert(reply.end(), value.begin(), value.end());
+            }
+            if (reply.size() == 1) nrc = NRC_OUT_OF_RANGE;
+        }
+        break;
+
+    case UDS_READ_DTC:
+    {
+        std::vector<uint32_t> &codes = ecu.dtcs[service];
+        const uint8_t status = 0x09; //confirmed, failed
+        if (request.size() < 2) nrc = NRC_BAD_LENGTH;
+        else if (request[1] == 0x01 || request[1] == 0x02) //count or list by status mask
+        {
+            if (request.size() != 3) nrc = NRC_BAD_LENGTH;
+            else
+            {
+                bool match = (status & request[2]) != 0;
+                reply = {0x59, request[1], 0xFF};
+                if (request[1] == 0x01)
+                {
+                    uint16_t count = match ? codes.size() : 0;
+                    reply.push_back(0x01); //ISO 14229-1 DTC format
+                    reply.push_back(count >> 8);
+                    reply.push_back(count);
+                }
+                else if (match)
+                {
+                    for (uint32_t code : codes)
+                    {
+                        reply.push_back(code >> 16);
+                        reply.push_back(code >> 8);
+                        reply.push_back(code);
+                        reply.push_back(status);
+                    }
+                }
+            }
+        }
+        else nrc = NRC_SUBFUNCTION_NOT_SUPPORTED;
+        break;
+    }
+
+    case UDS_DYNAMIC_DATA_DEF:
+        nrc = defineDynamic(ecu, request, reply);
+        break;
+
+    case UDS_READ_ID_PERIODIC:
+        nrc = readPeriodic(ecu, request, reply);
+        break;
+
+    default:
+        if (service <= OBDII_PERM_DTC) return false; //OBDII modes go unanswered when not supported
+        nrc = std::find(std::begin(udsServices), std::end(udsServices), service) != std::end(udsServices) ?
+              NRC_OUT_OF_RANGE : NRC_SERVICE_NOT_SUPPORTED;
+        break;
+    }
+
+    if (nrc)
+    {
+        //functional requests don't get told what isn't supported
+        if (functional && (nrc == NRC_SERVICE_NOT_SUPPORTED || nrc == NRC_SUBFUNCTION_NOT_SUPPORTED || nrc == NRC_OUT_OF_RANGE))
+            return false;
+        reply = {UDS_NEG_RESP, service, nrc};
+    }
+    return true;
+}
+
+//PIDs 00, 20, 40... are bitmaps of the next 32 PIDs, the last bit says the next bitmap exists
+bool EcuSimulator::supportedPIDs(Ecu &ecu, uint8_t mode, uint8_t base, std::vector<uint8_t> &reply)
+{
+    uint32_t bits = 0;
+    for (auto &entry : ecu.pids)
+    {
+        if ((entry.first >> 8) != mode) continue;
+        int pid = entry.first & 0xFF;
+        if (pid <= base) continue;
+        if (pid <= base + 0x20) bits |= 1ul << (0x20 - (pid - base));
+        else bits |= 1;
+    }
+    if (!bits && base) return false;
+    reply.push_back(base);
+    reply.push_back(bits >> 24);
+    reply.push_back(bits >> 16);
+    reply.push_back(bits >> 8);
+    reply.push_back(bits);
+    return true;
+}
+
+//a plain DID or a dynamic one put together from parts of plain ones
+bool EcuSimulator::readDID(Ecu &ecu, uint16_t did, std::vector<uint8_t> &value)
+{
+    auto plain = ecu.dids.find(did);
+    if (plain != ecu.dids.end())
+    {
+        value = plain->second;
+        return true;
+    }
+    auto dynamic = ecu.dynamic.find(did);
+    if (dynamic == ecu.dynamic.end()) return false;
+    value.clear();
+    const std::vector<uint8_t> &parts = dynamic->second;
+    for (size_t i = 0; i + 3 < parts.size(); i += 4)
+    {
+        const std::vector<uint8_t> &source = ecu.dids[(parts[i] << 8) | parts[i + 1]];
+        if (parts[i + 2] - 1 + parts[i + 3] > (int)source.size()) continue; //set shorter since
+        value.insert(value.end(), source.begin() + parts[i + 2] - 1, source.begin() + parts[i + 2] - 1 + parts[i + 3]);
+    }
+    return true;
+}
+
+//0x2C 01 appends parts of plain DIDs to a dynamic one, 0x2C 03 clears one or all of them
+uint8_t EcuSimulator::defineDynamic(Ecu &ecu, const std::vector<uint8_t> &request, std::vector<uint8_t> &reply)
+{
+    if (request.size() < 2) return NRC_BAD_LENGTH;
+    uint16_t did = (request.size() >= 4) ? (request[2] << 8) | request[3] : 0;
+    if (request[1] == 0x01)
+    {
+        if (request.size() < 8 || (request.size() - 4) % 4) return NRC_BAD_LENGTH;
+        if (did < 0xF200 || did > 0xF3FF) return NRC_OUT_OF_RANGE;
+        std::vector<uint8_t> parts = ecu.dynamic[did];
+        for (size_t i = 4; i < request.size(); i += 4)
+        {
+            auto source = ecu.dids.find((request[i] << 8) | request[i + 1]);
+            uint8_t position = request[i + 2], size = request[i + 3];
+            if (source == ecu.dids.end() || !position || !size || position - 1 + size > (int)source->second.size())
+            {
+                if (ecu.dynamic[did].empty()) ecu.dynamic.erase(did);
+                return NRC_OUT_OF_RANGE;
+            }
+            parts.insert(parts.end(), request.begin() + i, request.begin() + i + 4);
+        }
+        ecu.dynamic[did] = parts;
+        reply = {0x6C, 0x01, request[2], request[3]};
+    }
+    else if (request[1] == 0x03)
+    {
+        if (request.size() == 2) ecu.dynamic.clear();
+        else if (request.size() == 4 && ecu.dynamic.erase(did)) ecu.periodic.erase(did & 0xFF);
+        else if (request.size() == 4) return NRC_OUT_OF_RANGE;
+        else return NRC_BAD_LENGTH;
+        reply = {0x6C, 0x03};
+    }
+    else return NRC_SUBFUNCTION_NOT_SUPPORTED;
+    return 0;
+}
+
+//0x2A 01-03 sends DIDs F2xx slow, medium or fast, 0x2A 04 stops the ones listed or all
+uint8_t EcuSimulator::readPeriodic(Ecu &ecu, const std::vector<uint8_t> &request, std::vector<uint8_t> &reply)
+{
+    if (request.size() < 2) return NRC_BAD_LENGTH;
+    uint8_t mode = request[1];
+    if (mode == 0x04)
+    {
+        if (request.size() == 2) ecu.periodic.clear();
+        for (size_t i = 2; i < request.size(); i++) ecu.periodic.erase(request[i]);
+        ecu.periodicGeneration++;
+        reply = {0x6A};
+        return 0;
+    }
+    if (mode < 0x01 || mode > 0x03) return NRC_OUT_OF_RANGE;
+    if (request.size() < 3) return NRC_BAD_LENGTH;
+    if (ecu.session == 1) return NRC_NOT_IN_SESSION;
+    for (size_t i = 2; i < request.size(); i++)
+    {
+        std::vector<uint8_t> value;
+        if (!readDID(ecu, 0xF200 | request[i], value) || value.size() > 7) return NRC_OUT_OF_RANGE;
+    }
+    for (size_t i = 2; i < request.size(); i++) ecu.periodic[request[i]] = ecu.periodicRates[mode - 1];
+    ecu.periodicGeneration++; //everything still sent is queued again by handleRequest
+    reply = {0x6A};
+    return 0;
+}
+
+//back to the default session, which ends periodic sending and forgets the dynamic DIDs
+void EcuSimulator::endSession(Ecu &ecu)
+{
+    ecu.session = 1;
+    ecu.periodic.clear();
+    ecu.dynamic.clear();
+    ecu.periodicGeneration++;
+}
+
+void EcuSimulator::queueReply(int index, const std::vector<uint8_t> &payload, uint64_t due)
+{
+    Ecu &ecu = ecus[index];
+    uint8_t data[8];
+    if (payload.size() <= 7)
+    {
+        data[0] = payload.size();
+        std::copy(payload.begin(), payload.end(), data + 1);
+        queueFrame(index, due, data, payload.size() + 1, true);
+        return;
+    }
+    ecu.txPayload.assign(payload.begin(), payload.begin() + std::min<size_t>(payload.size(), 0xFFF));
+    ecu.txOffset = 6;
+    ecu.txSeq = 1;
+    ecu.txWaitFlow = true;
+    ecu.txLastDue = due;
+    data[0] = 0x10 | (ecu.txPayload.size() >> 8);
+    data[1] = ecu.txPayload.size() & 0xFF;
+    std::copy(payload.begin(), payload.begin() + 6, data + 2);
+    queueFrame(index, due, data, 8, true);
+}
+
+//queue consecutive frames up to the block size, then wait for the next flow control
+void EcuSimulator::queueConsecutive(int index, uint8_t blockSize, uint32_t separation)
+{
+    Ecu &ecu = ecus[index];
+    uint64_t due = std::max(nowMicros(), ecu.txLastDue);
+    int sent = 0;
+    while (ecu.txOffset < ecu.txPayload.size())
+    {
+        uint8_t data[8];
+        size_t count = std::min<size_t>(7, ecu.txPayload.size() - ecu.txOffset);
+        data[0] = 0x20 | (ecu.txSeq++ & 0xF);
+        std::copy(ecu.txPayload.begin() + ecu.txOffset, ecu.txPayload.begin() + ecu.txOffset + count, data + 1);
+        ecu.txOffset += count;
+        queueFrame(index, due, data, count + 1, false);
+        ecu.txLastDue = due;
+        due += separation;
+        if (blockSize && ++sent == blockSize && ecu.txOffset < ecu.txPayload.size())
+        {
+            ecu.txWaitFlow = true;
+            break;
+        }
+    }
+}
+
+//Frames are always 8 bytes, padded with AA
+void EcuSimulator::queueFrame(int index, uint64_t due, const uint8_t *data, int length, bool response)
+{
+    Event event;
+    event.ecu = index;
+    event.generation = ecus[index].generation;
+    event.response = response;
+    event.periodic = false;
+    event.frame.id = 0x7E8 + index;
+    event.frame.extended = 0;
+    event.frame.rtr = 0;
+    event.frame.length = 8;
+    for (int i = 0; i < 8; i++) event.frame.data.bytes[i] = (i < length) ? data[i] : 0xAA;
+    events.insert(std::make_pair(due, event));
+}
+
+//Periodic frames start with the low byte of the DID, there is no PCI byte
+void EcuSimulator::queuePeriodic(int index, uint8_t pdid, uint64_t due)
+{
+    Event event;
+    event.ecu = index;
+    event.generation = ecus[index].periodicGeneration;
+    event.response = false;
+    event.periodic = true;
+    event.frame.id = 0x7E8 + index;
+    event.frame.extended = 0;
+    event.frame.rtr = 0;
+    event.frame.length = 8;
+    event.frame.data.bytes[0] = pdid;
+    events.insert(std::make_pair(due, event));
+}
+
+void EcuSimulator::workerThread(EcuSimulator *sim)
+{
+    std::unique_lock<std::mutex> guard(sim->lock);
+    while (sim->running)
+    {
+        if (sim->events.empty())
+        {
+            sim->wake.wait(guard);
+            continue;
+        }
+        auto next = sim->events.begin();
+        uint64_t now = nowMicros();
+        if (next->first > now)
+        {
+            sim->wake.wait_for(guard, std::chrono::microseconds(next->first - now));
+            continue;
+        }
+        Event event = next->second;
+        uint64_t due = next->first;
+        sim->events.erase(next);
+        Ecu &ecu = sim->ecus[event.ecu];
+        if (event.periodic)
+        {
+            if (event.generation != ecu.periodicGeneration) continue;
+            if (ecu.session != 1 && now > ecu.sessionEnd)
+            {
+                sim->endSession(ecu);
+                continue;
+            }
+            uint8_t pdid = event.frame.data.bytes[0];
+            std::vector<uint8_t> value;
+            auto period = ecu.periodic.find(pdid);
+            if (period == ecu.periodic.end() || !sim->readDID(ecu, 0xF200 | pdid, value)) continue;
+            for (int i = 1; i < 8; i++) event.frame.data.bytes[i] = (i - 1 < (int)value.size()) ? value[i - 1] : 0xAA;
+            sim->events.insert(std::make_pair(due + period->second, event));
+            sim->periodicFrames++;
+        }
+        else if (event.generation != ecu.generation) continue; //a newer request replaced it
+        if (event.response) sim->responses++;
+        //the bus calls other nodes from this thread, they may answer straight back
+        guard.unlock();
+        sim->bus->send(sim, event.frame);
+        guard.lock();
+    }
+}
@@ -0,0 +1,171 @@
+/*
+ * EcuSimulator.h
+ *
+ * Simulated OBDII/UDS ECUs for the host build. It attaches to a CanBus as
+ * one more node and answers requests on 0x7E0 + n (and functional ones on
+ * 0x7DF) from 0x7E8 + n with scripted values, after a configurable delay.
+ * Replies longer than a single frame go out as ISO-TP with flow control, and
+ * multi frame requests are reassembled.
+ *
+ * Mode 01 and 09 answer from the PID table, the supported PID bitmaps are
+ * filled in from it. Modes 03/07/0A and UDS 0x19 report the DTC lists, 0x22
+ * reads DIDs (up to a per ECU count, more get 7F 22 13), 0x10, 0x11 and 0x3E are always answered. Any other request can
+ * be given a canned response. 0x2C defines dynamic DIDs (F200-F3FF) from
+ * parts of the others and, outside the default session, 0x2A sends them
+ * periodically until stopped or the session times out (S3, any request
+ * including 0x3E restarts it). Services without an answer get the negative
+ * response a real ECU would send, none for OBDII modes or functional requests.
+ *
+ * The script format is one directive per line, '#' starts a comment. ECU
+ * numbers, delays (microseconds), counts and block sizes are decimal, the
+ * rest is hex:
+ *   ecu <n> [physical]            ECU n answers, physical: not to 0x7DF
+ *   delay <n> <us> [jitter us]    time before each answer
+ *   pid <n> <mode> <pid> <data>   value for mode 01 or 09
+ *   did <n> <did> <data>          value for UDS 0x22
+ *   dtc <n> <service> <codes...>  DTCs for 03/07/0A (2 bytes) or 19 (3 bytes)
+ *   response <n> <request> <data> canned answer to requests starting with <request>
+ *   pending <n> <service> <count> send 7F <service> 78 that many times first
+ *   flow <n> <block size> <stmin> flow control sent for multi frame requests
+ *   didlimit <n> <count>          most DIDs one 0x22 request may ask for
+ *   periodic <n> <slow> <medium> <fast>  0x2A periods in microseconds
+ *   s3 <n> <us>                   time without requests before the session ends
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ECUSIMULATOR_H_
+#define ECUSIMULATOR_H_
+
+#include <esp32_can.h>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "CanBus.h"
+
+#define ECU_SIM_MAX_ECUS    8
+
+class EcuSimulator : public CanNode {
+public:
+    EcuSimulator();
+    ~EcuSimulator();
+    void attach(CanBus &bus);
+    void detach();
+
+    bool addEcu(int ecu, bool functional = true);
+    void setDelay(int ecu, uint32_t micros, uint32_t jitter = 0);
+    void setPID(int ecu, uint8_t mode, uint8_t pid, const std::vector<uint8_t> &data);
+    void setDID(int ecu, uint16_t did, const std::vector<uint8_t> &data);
+    void setDTCs(int ecu, uint8_t service, const std::vector<uint32_t> &codes);
+    void setResponse(int ecu, const std::vector<uint8_t> &request, const std::vector<uint8_t> &response);
+    void setPending(int ecu, uint8_t service, int count);
+    void setFlowControl(int ecu, uint8_t blockSize, uint8_t separationTime);
+    void setDIDLimit(int ecu, int count);
+    void setPeriodicRates(int ecu, uint32_t slow, uint32_t medium, uint32_t fast);
+    void setSessionTimeout(int ecu, uint32_t micros);
+    //errors go to stderr with the line number
+    bool loadScript(const char *path);
+    bool parseScript(const std::string &text, const char *name = "script");
+    //an engine and a transmission ECU with the common PIDs, a VIN and a few DTCs
+    bool loadDefault();
+
+    uint32_t getRequests() { return requests; }
+    uint32_t getResponses() { return responses; }
+    uint32_t getPeriodicFrames() { return periodicFrames; }
+    void frameReceived(const CAN_FRAME &frame) override;
+
+    static bool parseHex(const std::string &text, std::vector<uint8_t> &bytes);
+
+private:
+    struct Ecu {
+        bool present = false;
+        bool functional = true;
+        uint32_t delay = 0;
+        uint32_t jitter = 0;
+        std::map<uint16_t, std::vector<uint8_t>> pids;  //mode << 8 | pid
+        std::map<uint16_t, std::vector<uint8_t>> dids;
+        std::map<uint8_t, std::vector<uint32_t>> dtcs;  //by service
+        std::map<std::vector<uint8_t>, std::vector<uint8_t>> responses;
+        std::map<uint8_t, int> pending;
+        uint8_t session = 1;
+        uint8_t blockSize = 0;
+        uint8_t separationTime = 0;
+        int didLimit = 0;   //0 for any number
+        std::map<uint16_t, std::vector<uint8_t>> dynamic;   //source DID, position, size for each part
+        std::map<uint8_t, uint32_t> periodic;               //period of each periodic DID (low byte) being sent
+        uint32_t periodicRates[3] = {1000000, 200000, 50000};
+        uint32_t sessionTimeout = 5000000;
+        uint64_t sessionEnd = 0;
+        uint32_t periodicGeneration = 0;    //bumped when periodic DIDs are stopped or redefined
+
+        uint32_t generation = 0;            //bumped by every request, stale frames in the queue are skipped
+        std::vector<uint8_t> txPayload;     //multi frame reply being sent
+        size_t txOffset = 0;
+        uint8_t txSeq = 0;
+        bool txWaitFlow = false;
+        uint64_t txLastDue = 0;
+        std::vector<uint8_t> rxPayload;     //multi frame request being received
+        size_t rxLength = 0;
+        uint8_t rxSeq = 0;
+    };
+
+    struct Event {
+        int ecu;
+        uint32_t generation;
+        CAN_FRAME frame;
+        bool response;  //counts as an answer, not flow control or a consecutive frame
+        bool periodic;  //0x2A data, requeued after it is sent
+    };
+
+    static void workerThread(EcuSimulator *sim);
+    static uint64_t nowMicros();
+    bool checkEcu(int ecu);
+    void handleRequest(int ecu, const std::vector<uint8_t> &request, bool functional);
+    bool buildReply(Ecu &ecu, const std::vector<uint8_t> &request, bool functional, std::vector<uint8_t> &reply);
+    bool supportedPIDs(Ecu &ecu, uint8_t mode, uint8_t pid, std::vector<uint8_t> &reply);
+    uint8_t defineDynamic(Ecu &ecu, const std::vector<uint8_t> &request, std::vector<uint8_t> &reply);
+    uint8_t readPeriodic(Ecu &ecu, const std::vector<uint8_t> &request, std::vector<uint8_t> &reply);
+    bool readDID(Ecu &ecu, uint16_t did, std::vector<uint8_t> &value);
+    void endSession(Ecu &ecu);
+    void queueReply(int ecu, const std::vector<uint8_t> &payload, uint64_t due);
+    void queueConsecutive(int ecu, uint8_t blockSize, uint32_t separationMicros);
+    void queueFrame(int ecu, uint64_t due, const uint8_t *data, int length, bool response);
+    void queuePeriodic(int ecu, uint8_t pdid, uint64_t due);
+
+    Ecu ecus[ECU_SIM_MAX_ECUS];
+    std::multimap<uint64_t, Event> events;  //by due time
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread worker;
+    bool running;
+    CanBus *bus;
+    std::minstd_rand jitterRandom;
+    uint32_t requests;
+    uint32_t responses;
+    uint32_t periodicFrames;
+};
+
+#endif /* ECUSIMULATOR_H_ */
@@ -0,0 +1,149 @@
+/*
+ * ElmBench.cpp
+ *
+ * Round trips through the ELM327 emulator, see ElmBench.h
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "ElmBench.h"
+#include <chrono>
+#include "Hal.h"
+#include "Percentile.h"
+
+void setup();
+void loop();
+
+typedef std::chrono::steady_clock Clock;
+
+static void summarize(ElmBench::Result &result, std::vector<uint32_t> &samples)
+{
+    result.p50 = percentile(samples, 50);
+    result.p90 = percentile(samples, 90);
+    result.p99 = percentile(samples, 99);
+    result.max = percentile(samples, 100);
+}
+
+bool ElmBench::connect(const std::vector<std::string> &init)
+{
+    static bool started = false;
+    if (!started)
+    {
+        setup();
+        started = true;
+    }
+    //the radio comes up in its own task, the ELM port once loop() notices
+    uint32_t start = millis();
+    while (millis() - start < 2000 && !client.connect("127.0.0.1", Hal::mapPort(35000))) loop();
+    if (!client.connected()) return false;
+
+    std::string reply;
+    uint32_t micros;
+    for (const std::string &command : init)
+    {
+        if (!request(command, reply, micros)) return false;
+    }
+    return true;
+}
+
+//loop() has to run for the firmware to notice and take the next client
+void ElmBench::disconnect()
+{
+    client.stop();
+}
+
+bool ElmBench::request(const std::string &command, std::string &reply, uint32_t &micros, uint32_t timeout)
+{
+    reply.clear();
+    Clock::time_point start = Clock::now();
+    send(command);
+    uint32_t startMillis = millis();
+    while (millis() - startMillis < timeout)
+    {
+        loop();
+        while (client.available())
+        {
+            char c = client.read();
+            if (c == '>')
+            {
+                micros = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+                return true;
+            }
+            reply += c;
+        }
+    }
+    return false;
+}
+
+void ElmBench::send(const std::string &command)
+{
+    std::string line = command + "\r";
+    client.write((const uint8_t *)line.data(), line.size());
+}
+
+std::string ElmBench::receive(uint32_t millis)
+{
+    std::string data;
+    uint32_t start = ::millis();
+    while (::millis() - start < millis)
+    {
+        loop();
+        while (client.available()) data += (char)client.read();
+    }
+    return data;
+}
+
+std::vector<ElmBench::Result> ElmBench::run(const std::vector<std::string> &commands, uint32_t rounds)
+{
+    std::vector<Result> results(commands.size() + 1);
+    std::vector<std::vector<uint32_t>> samples(commands.size() + 1);
+    for (size_t i = 0; i < commands.size(); i++) results[i].command = commands[i];
+    results.back().command = "all";
+
+    for (uint32_t round = 0; round < rounds; round++)
+    {
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            std::string reply;
+            uint32_t micros = 0;
+            bool answered = request(commands[i], reply, micros);
+            for (size_t r : {i, commands.size()})
+            {
+                results[r].count++;
+                if (!answered || reply.find("NO DATA") != std::string::npos) results[r].noData++;
+                if (answered) samples[r].push_back(micros);
+            }
+        }
+    }
+    for (size_t i = 0; i < results.size(); i++) summarize(results[i], samples[i]);
+    return results;
+}
+
+void ElmBench::print(FILE *out, const std::vector<Result> &results)
+{
+    fprintf(out, "%-14s %7s %7s %9s %9s %9s %9s\n", "request", "count", "no data", "p50 us", "p90 us", "p99 us", "max us");
+    for (const Result &result : results)
+    {
+        fprintf(out, "%-14s %7u %7u %9u %9u %9u %9u\n", result.command.c_str(), result.count, result.noData,
+                result.p50, result.p90, result.p99, result.max);
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * ElmBench.h
+ *
+ * Drives the ELM327 emulator end to end the way a phone app does: a client on
+ * the ELM port sends a request line and waits for the prompt while loop()
+ * runs, the request goes out on CAN, EcuSimulator answers and the reply comes
+ * back through ELM327Emu. Round trip times are kept per request.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ELMBENCH_H_
+#define ELMBENCH_H_
+
+#include <WiFi.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+class ElmBench {
+public:
+    struct Result {
+        std::string command;
+        uint32_t count = 0;
+        uint32_t noData = 0;    //answered NO DATA or not at all
+        //microseconds from sending the line to the prompt
+        uint32_t p50 = 0, p90 = 0, p99 = 0, max = 0;
+    };
+
+    //setup() the first time, then a client on the ELM port that sends the init commands
+    bool connect(const std::vector<std::string> &init = {"atz", "ate0", "atl0"});
+    void disconnect();
+    //send a line and run loop() until the prompt comes back. The reply is without the prompt
+    bool request(const std::string &command, std::string &reply, uint32_t &micros, uint32_t timeout = 2000);
+    //send a line without waiting for an answer, STM never sends a prompt
+    void send(const std::string &command);
+    //run loop() for a while and return whatever the firmware sent
+    std::string receive(uint32_t millis);
+    //every command once per round, the last result is all of them together
+    std::vector<Result> run(const std::vector<std::string> &commands, uint32_t rounds);
+    static void print(FILE *out, const std::vector<Result> &results);
+
+private:
+    WiFiClient client;
+};
+
+#endif /* ELMBENCH_H_ */
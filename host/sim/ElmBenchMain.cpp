@@ -0,0 +1,80 @@
+/*
+ * ElmBenchMain.cpp
+ *
+ * Request round trip benchmark: the firmware on the host HAL with simulated
+ * ECUs on its CAN bus and a client on the ELM port. Prints round trip
+ * percentiles per request.
+ *   elm_bench [--script <file>] [--rounds <n>] [request ...]
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <unistd.h>
+#include "EcuSimulator.h"
+#include "ElmBench.h"
+#include "Hal.h"
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [--script <file>] [--rounds <n>] [request ...]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *script = NULL;
+    uint32_t rounds = 200;
+    std::vector<std::string> commands;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--script") && i + 1 < argc) script = argv[++i];
+        else if (!strcmp(argv[i], "--rounds") && i + 1 < argc) rounds = atoi(argv[++i]);
+        else if (argv[i][0] == '-') usage(argv[0]);
+        else commands.push_back(argv[i]);
+    }
+    if (rounds == 0) usage(argv[0]);
+    //what a dashboard app polls, a VIN read and a DTC read
+    if (commands.empty()) commands = {"010C", "010D", "0105", "0111", "0902", "22F190", "03"};
+
+    EcuSimulator sim;
+    if (script ? !sim.loadScript(script) : !sim.loadDefault()) return 1;
+    sim.attach(Hal::getDefaultCanBus());
+
+    //firmware console output would get mixed into the report
+    Hal::setPortOffset(20000 + getpid() % 10000);
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+
+    ElmBench bench;
+    if (!bench.connect())
+    {
+        fprintf(stderr, "The ELM327 port didn't come up\n");
+        return 1;
+    }
+    std::vector<ElmBench::Result> results = bench.run(commands, rounds);
+    fprintf(report, "%u rounds, %u requests answered by the simulated ECUs\n", rounds, sim.getResponses());
+    ElmBench::print(report, results);
+    fclose(report);
+    _exit(0); //the firmware's tasks never end
+}
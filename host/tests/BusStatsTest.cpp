@@ -0,0 +1,203 @@
+/*
+ * BusStatsTest.cpp
+ *
+ * Checks frame bit lengths, the per-ID statistics against values computed
+ * from the recorded arrival times, the bus load window and the GVRET query.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <math.h>
+#include <vector>
+#include "Check.h"
+#include "Frames.h"
+#include "BusStats.h"
+#include "FrameTable.h"
+#include "ElmBench.h"
+#include "Hal.h"
+
+extern FrameTable frameTable;
+
+static ElmBench elm;
+
+static void testFrameBits()
+{
+    //the textbook numbers: 111 to 135 bits for 8 data bytes and an 11 bit ID, 131 to 160 with a 29 bit one
+    CHECK(BusStats::frameBits(makeFrame(0x100, false, std::vector<uint8_t>(8)), false) == 111);
+    CHECK(BusStats::frameBits(makeFrame(0x100, false, std::vector<uint8_t>(8)), true) == 135);
+    CHECK(BusStats::frameBits(makeFrame(0x100, true, std::vector<uint8_t>(8)), false) == 131);
+    CHECK(BusStats::frameBits(makeFrame(0x100, true, std::vector<uint8_t>(8)), true) == 160);
+    CHECK(BusStats::frameBits(makeFrame(0x100, false, {}), false) == 47);
+    CAN_FRAME remote = makeFrame(0x100, false, std::vector<uint8_t>(8));
+    remote.rtr = 1;
+    CHECK(BusStats::frameBits(remote, false) == 47);
+}
+
+//mean and standard deviation of the periods worked out from the arrival times the table recorded
+static void testIdStats()
+{
+    BusStats stats;
+    std::vector<uint32_t> arrivals;
+    int changes = 0;
+    frameTable.clear();
+
+    for (int i = 0; i < 50; i++)
+    {
+        //DLC 8 down to 2 every eighth frame, data changing every third
+        CAN_FRAME frame = makeFrame(0x321, false, std::vector<uint8_t>(8 - i / 8, i / 3));
+        if (i == 0 || i % 8 == 0 || i % 3 == 0) changes++;
+        int entry = frameTable.processFrame(frame);
+        stats.processFrame(frame, entry);
+        arrivals.push_back(frameTable.get(entry)->micros);
+        delayMicroseconds(100 + (i % 5) * 150);
+    }
+
+    double sum = 0;
+    for (size_t i = 1; i < arrivals.size(); i++) sum += arrivals[i] - arrivals[i - 1];
+    double mean = sum / (arrivals.size() - 1);
+    double squares = 0;
+    for (size_t i = 1; i < arrivals.size(); i++) squares += pow(arrivals[i] - arrivals[i - 1] - mean, 2);
+    double stdDev = sqrt(squares / (arrivals.size() - 2));
+
+    IdStats id;
+    CHECK(stats.getStats(0, id));
+    printf("  period %.1fus sd %.1fus, expected %.1fus sd %.1fus\n", id.periodMean, id.periodStdDev, mean, stdDev);
+    CHECK(id.id == 0x321 && id.count == 50);
+    CHECK(fabs(id.periodMean - mean) < mean * 1e-3);
+    CHECK(fabs(id.periodStdDev - stdDev) < stdDev * 1e-2 + 0.5);
+    CHECK(id.dlcMin == 2 && id.dlcMax == 8 && id.changes == (uint32_t)changes);
+    CHECK(id.frameRate > 0 && id.changeRate > 0);
+
+    //an ID that only showed up once has no period yet
+    CAN_FRAME frame = makeFrame(0x1ABCDE, true, std::vector<uint8_t>(4));
+    stats.processFrame(frame, frameTable.processFrame(frame));
+    CHECK(stats.getStats(1, id) && id.id == (0x1ABCDE | 1ul << 31) && id.count == 1 && id.periodMean == 0 && id.periodStdDev == 0);
+
+    stats.reset();
+    CHECK(!stats.getStats(0, id));
+    //clearing the table hands entry 0 to another ID, which starts afresh
+    stats.processFrame(frame, frameTable.processFrame(frame));
+    frameTable.clear();
+    frame = makeFrame(0x555, false, std::vector<uint8_t>(1));
+    stats.processFrame(frame, frameTable.processFrame(frame));
+    CHECK(stats.getStats(0, id) && id.id == 0x555 && id.count == 1);
+}
+
+static void testLoad()
+{
+    uint32_t start = millis(); //before the window starts
+    BusStats stats;
+    BusLoad load;
+    for (int i = 0; i < 200; i++)
+    {
+        CAN_FRAME frame = makeFrame(0x100 + i % 4, false, std::vector<uint8_t>(8));
+        stats.processFrame(frame, -1);
+    }
+    stats.loop();
+    stats.getLoad(load);
+    CHECK(load.framesPerSecond == 0 && load.maxLoad == 0); //the window isn't over yet
+    delay(BUS_LOAD_WINDOW + 10);
+    stats.loop();
+    uint32_t elapsed = millis() - start;
+    stats.getLoad(load);
+    printf("  %u frames/s, load %.3f-%.3f%%\n", load.framesPerSecond, load.minLoad * 100, load.maxLoad * 100);
+    //200 frames of 111-135 bits at 500kbit/s in a bit over a second
+    CHECK(load.framesPerSecond <= 200 && load.framesPerSecond >= 200 * 1000 / elapsed);
+    CHECK(load.minLoad <= 200 * 111 / 500000.0f && load.minLoad >= 200 * 111 / (500.0f * elapsed));
+    CHECK(fabs(load.maxLoad / load.minLoad - 135.0f / 111) < 1e-4 && load.peakLoad == load.maxLoad);
+}
+
+static void testGvret()
+{
+#ifndef BLUETOOTH
+    WiFiClient client;
+    uint32_t start = millis();
+    while (millis() - start < 2000 && !client.connect("127.0.0.1", Hal::mapPort(23))) elm.receive(1);
+    CHECK(client.connected());
+    elm.receive(50);
+    while (client.available()) client.read();
+
+    frameTable.clear();
+    for (int i = 0; i < 5; i++)
+    {
+        CAN_FRAME frame = makeFrame(0x7A0, false, std::vector<uint8_t>(3, i));
+        Hal::getDefaultCanBus().send(NULL, frame);
+    }
+    elm.receive(100);
+    while (client.available()) client.read();
+
+    const uint8_t query[] = {0xF1, PROTO_GET_BUS_STATS};
+    client.write(query, sizeof(query));
+    std::vector<uint8_t> in;
+    start = millis();
+    while (millis() - start < 500 && in.size() < 14 + 22)
+    {
+        elm.receive(1);
+        while (client.available()) in.push_back(client.read());
+    }
+    CHECK(in.size() == 14 + 22 && in[0] == 0xF1 && in[1] == PROTO_GET_BUS_STATS);
+    if (in.size() == 14 + 22)
+    {
+        CHECK(in[12] == 1 && in[13] == 0);
+        const uint8_t *id = &in[14];
+        CHECK(id[0] == 0xA0 && id[1] == 0x07 && id[2] == 0 && id[3] == 0);
+        CHECK(id[4] == 5 && id[5] == 0);
+        CHECK(id[16] == 3 && id[17] == 3 && id[18] == 5);
+    }
+    client.stop();
+#endif
+}
+
+int main()
+{
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"frame bits", testFrameBits},
+        {"per ID statistics", testIdStats},
+        {"bus load", testLoad},
+        {"GVRET query", testGvret},
+    };
+
+    //keep clear of other instances and of anything already listening
+    Hal::setPortOffset(20000 + getpid() % 10000);
+
+    if (!elm.connect())
+    {
+        printf("Couldn't connect to the ELM327 port\n");
+        _exit(1);
+    }
+
+    for (auto &test : tests)
+    {
+        int before = failures;
+        printf("%s\n", test.name);
+        test.run();
+        printf("  %s\n", (failures == before) ? "ok" : "FAILED");
+    }
+    printf("%i check(s) failed\n", failures);
+    fflush(stdout);
+    _exit(failures ? 1 : 0); //background tasks are still running
+}
@@ -0,0 +1,174 @@
+/*
+ * CanReplayTest.cpp
+ *
+ * Parses each capture format CanLog knows and replays captures into the
+ * firmware at real time, faster and as fast as possible. Exits non-zero if any
+ * case fails.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <string>
+#include "CanLog.h"
+#include "CanReplay.h"
+#include "Check.h"
+#include "Hal.h"
+
+static std::vector<LoggedFrame> readAll(const std::string &text, CanLog::Format expected, uint32_t badLines = 0)
+{
+    CanLog log;
+    std::vector<LoggedFrame> frames;
+    LoggedFrame frame;
+    CHECK(log.openText(text.data(), text.size()));
+    CHECK(log.getFormat() == expected);
+    while (log.next(frame)) frames.push_back(frame);
+    CHECK(log.getBadLines() == badLines);
+    return frames;
+}
+
+static void testCandump()
+{
+    std::vector<LoggedFrame> frames = readAll(
+        "(1436509052.249713) vcan0 7E8#0641000000000000\n"
+        "(1436509052.250000) can1 18DAF110#10.14.49.02.01.31\n"
+        "(1436509052.3) can0 123#R\n"
+        "(1436509052.400001) can0 7DF   [3]  02 01 0C\n"
+        "(1436509052.5) can0 7DF#zz\n"
+        "(1436509052.6) can0 7DF##1112233\n", CanLog::Candump, 2);
+    CHECK(frames.size() == 4);
+    if (frames.size() != 4) return;
+    CHECK(frames[0].timeMicros == 1436509052249713ull);
+    CHECK(frames[0].frame.id == 0x7E8 && !frames[0].frame.extended && frames[0].frame.length == 8);
+    CHECK(frames[0].frame.data.bytes[0] == 6 && frames[0].frame.data.bytes[1] == 0x41);
+    CHECK(frames[1].frame.id == 0x18DAF110 && frames[1].frame.extended && frames[1].bus == 1);
+    CHECK(frames[1].frame.length == 6 && frames[1].frame.data.bytes[5] == 0x31);
+    CHECK(frames[2].timeMicros == 1436509052300000ull && frames[2].frame.rtr);
+    CHECK(frames[3].frame.id == 0x7DF && frames[3].frame.length == 3 && frames[3].frame.data.bytes[2] == 0x0C);
+}
+
+static void testGvretCsv()
+{
+    std::vector<LoggedFrame> frames = readAll(
+        "Time Stamp,ID,Extended,Bus,LEN,D1,D2,D3,D4,D5,D6,D7,D8\r\n"
+        "1000,000007E8,false,0,8,03,41,0D,32,00,00,00,00\r\n"
+        "2500,18DAF110,true,1,2,A,B\r\n"
+        "garbage\r\n", CanLog::GvretCsv, 1);
+    CHECK(frames.size() == 2);
+    if (frames.size() != 2) return;
+    CHECK(frames[0].timeMicros == 1000 && frames[0].frame.id == 0x7E8 && frames[0].frame.data.bytes[3] == 0x32);
+    CHECK(frames[1].frame.extended && frames[1].bus == 1 && frames[1].frame.length == 2 && frames[1].frame.data.bytes[1] == 0x0B);
+}
+
+static void testSavvyCsv()
+{
+    std::vector<LoggedFrame> frames = readAll(
+        "Time Stamp,ID,Extended,Dir,Bus,LEN,D1,D2,D3,D4,D5,D6,D7,D8\n"
+        "123456,0x7E8,false,Rx,0,8,3,41,5,7B,0,0,0,0\n"
+        "123457,7DF,false,Tx,0,3,2,1,5\n", CanLog::SavvyCsv);
+    CHECK(frames.size() == 2);
+    if (frames.size() != 2) return;
+    CHECK(frames[0].timeMicros == 123456 && frames[0].frame.id == 0x7E8 && frames[0].frame.data.bytes[3] == 0x7B);
+    CHECK(frames[1].frame.id == 0x7DF && frames[1].frame.length == 3);
+}
+
+//a file for the memory mapped and streamed readers, one frame every millisecond
+static std::string writeCapture(int frames)
+{
+    char path[] = "/tmp/canreplayXXXXXX";
+    int fd = mkstemp(path);
+    FILE *file = fdopen(fd, "w");
+    for (int i = 0; i < frames; i++) fprintf(file, "(1000.%06i) can0 %03X#%016X\n", i * 1000, 0x100 + (i % 16), i);
+    fclose(file);
+    return path;
+}
+
+static void testReplaySpeeds()
+{
+    std::string path = writeCapture(200);
+    CanReplay replay;
+    CanReplay::Options options;
+    CHECK(CanReplay::startFirmware(true));
+
+    //real time covers the 199ms the capture spans
+    CanLog mapped;
+    CHECK(mapped.open(path.c_str(), true));
+    CanReplay::Stats stats = replay.run(mapped, options);
+    stats.print(stdout);
+    CHECK(stats.frames == 200);
+    CHECK(stats.elapsedMicros >= 199000 && stats.elapsedMicros < 400000);
+#ifndef BLUETOOTH //no GVRET port in the Bluetooth build
+    CHECK(stats.gvretBytes == 200 * 20); //11 byte header, 8 data bytes and a checksum per frame
+#endif
+    CHECK(stats.gvretDiscards == 0);
+
+    //ten times faster, streamed, three times through
+    CanLog streamed;
+    CHECK(streamed.open(path.c_str(), false));
+    options.speed = 10;
+    options.loops = 3;
+    stats = replay.run(streamed, options);
+    stats.print(stdout);
+    CHECK(stats.frames == 600);
+    CHECK(stats.elapsedMicros >= 59000 && stats.elapsedMicros < 200000);
+
+    //as fast as possible
+    CHECK(mapped.rewind());
+    options.speed = 0;
+    options.loops = 50;
+    stats = replay.run(mapped, options);
+    stats.print(stdout);
+    CHECK(stats.frames == 10000);
+#ifndef BLUETOOTH
+    CHECK(stats.gvretBytes == 10000 * 20);
+#endif
+    CHECK(stats.framesPerSecond() > 5000);
+    CHECK(stats.latencyP50 > 0 && stats.latencyP50 <= stats.latencyP99 && stats.latencyP99 <= stats.latencyMax);
+    unlink(path.c_str());
+}
+
+int main()
+{
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"candump", testCandump},
+        {"GVRET CSV", testGvretCsv},
+        {"SavvyCAN CSV", testSavvyCsv},
+        {"replay speeds", testReplaySpeeds},
+    };
+
+    Hal::setPortOffset(20000 + getpid() % 10000);
+
+    for (auto &test : tests)
+    {
+        int before = failures;
+        printf("%s\n", test.name);
+        test.run();
+        printf("  %s\n", (failures == before) ? "ok" : "FAILED");
+    }
+    printf("%i check(s) failed\n", failures);
+    fflush(stdout);
+    _exit(failures ? 1 : 0); //background tasks are still running
+}
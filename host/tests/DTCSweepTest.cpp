@@ -0,0 +1,164 @@
+/*
+ * DTCSweepTest.cpp
+ *
+ * Tests for reading the DTCs of all simulated ECUs at once.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <set>
+#include <sstream>
+#include "Check.h"
+#include "DTCSweep.h"
+#include "EcuSimulator.h"
+#include "ElmBench.h"
+#include "Hal.h"
+
+static EcuSimulator sim;
+static ElmBench elm;
+
+//the order ECUs answer in varies, so compare the lines as a set
+static std::set<std::string> lines(const std::string &reply)
+{
+    std::set<std::string> result;
+    std::istringstream in(reply);
+    std::string line;
+    while (std::getline(in, line, '\r')) result.insert(line);
+    return result;
+}
+
+static void testFormat()
+{
+    char text[6];
+    DTCSweep::formatCode(0x0133, text);
+    CHECK(!strcmp(text, "P0133"));
+    DTCSweep::formatCode(0x4300, text);
+    CHECK(!strcmp(text, "C0300"));
+    DTCSweep::formatCode(0x9234, text);
+    CHECK(!strcmp(text, "B1234"));
+    DTCSweep::formatCode(0xC100, text);
+    CHECK(!strcmp(text, "U0100"));
+}
+
+//four ECUs, one of them with a multi frame answer, all in about one bus timeout
+static void testSweep()
+{
+    std::string reply;
+    uint32_t micros;
+    uint32_t requestsBefore = sim.getRequests();
+    CHECK(elm.request("stxdtc", reply, micros));
+    std::set<std::string> expected = {
+        "7E8 P0133 stored", "7E8 P0420 stored", "7E9 P0700 pending",
+        "7EA C0300 stored permanent", "7EA P0171 stored pending", "7EA P0300 pending",
+        "7EB P0128 permanent", "OK",
+    };
+    for (int i = 0; i < 16; i++)
+    {
+        char buff[32];
+        sprintf(buff, "7EA P%04X stored", 0x1000 + i);
+        expected.insert(buff);
+    }
+    std::set<std::string> got = lines(reply);
+    for (auto &line : got) if (!expected.count(line)) printf("  unexpected %s\n", line.c_str());
+    CHECK(got == expected);
+    printf("  %i DTCs in %uus, %u requests\n", (int)got.size() - 1, micros, sim.getRequests() - requestsBefore);
+    //the first service waits out the bus timeout, the others only until the same ECUs answered
+    CHECK(sim.getRequests() - requestsBefore == 12 && micros < 2 * PID_RESPONSE_TIMEOUT);
+}
+
+static void testUDS()
+{
+    std::string reply;
+    uint32_t micros;
+    CHECK(elm.request("stxdtcu", reply, micros));
+    std::set<std::string> got = lines(reply);
+    CHECK(got.count("7E8 P0133 stored uds:09"));
+    CHECK(got.count("7E8 P0420 stored uds:09"));
+    CHECK(got.count("7EA C0300-15 stored permanent uds:09"));
+    CHECK(got.count("7EA P0562-16 uds:09"));
+    CHECK(got.count("7E9 P0700 pending"));
+    printf("  %i DTCs in %uus\n", (int)got.size() - 1, micros);
+}
+
+static void testNoECUs()
+{
+    sim.detach();
+    std::string reply;
+    uint32_t micros;
+    CHECK(elm.request("stxdtc", reply, micros) && reply == "NO DATA\r");
+    CHECK(micros > PID_RESPONSE_TIMEOUT && micros < PID_RESPONSE_TIMEOUT + 100000);
+    sim.attach(Hal::getDefaultCanBus());
+}
+
+//a new line abandons the sweep, like it does any request
+static void testAbandoned()
+{
+    std::string reply;
+    uint32_t micros;
+    elm.send("stxdtc");
+    CHECK(elm.request("0105", reply, micros) && reply.find("41057B") != std::string::npos);
+    elm.receive(PID_RESPONSE_TIMEOUT / 1000);
+    CHECK(elm.request("stxdtc", reply, micros) && reply.find("7E8 P0133 stored\r") != std::string::npos);
+}
+
+int main()
+{
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"DTC format", testFormat},
+        {"sweep", testSweep},
+        {"sweep with UDS", testUDS},
+        {"no ECUs", testNoECUs},
+        {"abandoned sweep", testAbandoned},
+    };
+
+    //keep clear of other instances and of anything already listening
+    Hal::setPortOffset(20000 + getpid() % 10000);
+
+    CHECK(sim.loadDefault());
+    //ECU 2 has enough to need a multi frame answer, ECU 3 takes its time over Mode 0A
+    CHECK(sim.parseScript("ecu 2\ndelay 2 3000 2000\n"
+                          "dtc 2 03 4300 0171 1000 1001 1002 1003 1004 1005 1006 1007 1008 1009 100A 100B 100C 100D 100E 100F\n"
+                          "dtc 2 07 0171 0300\ndtc 2 0A 4300\ndtc 2 19 430015 056216\n"
+                          "ecu 3\ndelay 3 5000\ndtc 3 0A 0128\npending 3 0A 2\n"));
+    sim.attach(Hal::getDefaultCanBus());
+    if (!elm.connect())
+    {
+        printf("Couldn't connect to the ELM327 port\n");
+        _exit(1);
+    }
+
+    for (auto &test : tests)
+    {
+        int before = failures;
+        printf("%s\n", test.name);
+        test.run();
+        printf("  %s\n", (failures == before) ? "ok" : "FAILED");
+    }
+    printf("%i check(s) failed\n", failures);
+    fflush(stdout);
+    _exit(failures ? 1 : 0); //background tasks are still running
+}
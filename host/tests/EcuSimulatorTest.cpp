@@ -0,0 +1,347 @@
+/*
+ * EcuSimulatorTest.cpp
+ *
+ * Tests for the simulated ECUs, on their own and answering the ELM327
+ * emulator end to end.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <mutex>
+#include <vector>
+#include "Check.h"
+#include "EcuSimulator.h"
+#include "ElmBench.h"
+#include "ELM327_Emulator.h"
+#include "Hal.h"
+
+extern ELM327Emu elmEmulator;
+
+//The tester side, frames come in from the simulator's thread
+class Tester : public CanNode {
+public:
+    void frameReceived(const CAN_FRAME &frame) override
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        frames.push_back(frame);
+    }
+    //wait for the nth frame since the last clear()
+    bool waitFor(size_t count, uint32_t timeout = 500)
+    {
+        uint32_t start = millis();
+        while (millis() - start < timeout)
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (frames.size() >= count) return true;
+            }
+            delay(1);
+        }
+        return false;
+    }
+    CAN_FRAME get(size_t index)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return frames[index];
+    }
+    size_t size()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return frames.size();
+    }
+    void clear()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        frames.clear();
+    }
+
+private:
+    std::mutex lock;
+    std::vector<CAN_FRAME> frames;
+};
+
+static void send(MemoryCanBus &bus, Tester &tester, uint32_t id, std::vector<uint8_t> data)
+{
+    CAN_FRAME frame;
+    frame.id = id;
+    frame.extended = 0;
+    frame.rtr = 0;
+    frame.length = 8;
+    data.resize(8, 0xAA);
+    for (int i = 0; i < 8; i++) frame.data.bytes[i] = data[i];
+    bus.send(&tester, frame);
+}
+
+static bool frameIs(const CAN_FRAME &frame, uint32_t id, std::vector<uint8_t> start)
+{
+    if (frame.id != id) return false;
+    for (size_t i = 0; i < start.size(); i++) if (frame.data.bytes[i] != start[i]) return false;
+    return true;
+}
+
+static void testSingleFrame()
+{
+    MemoryCanBus bus;
+    Tester tester;
+    EcuSimulator sim;
+    bus.attach(&tester);
+    CHECK(sim.parseScript("ecu 0\npid 0 01 0C 1AF8\npid 0 01 0D 3C\npid 0 01 2F A0\n"));
+    sim.attach(bus);
+
+    send(bus, tester, 0x7E0, {0x02, 0x01, 0x0C});
+    CHECK(tester.waitFor(1));
+    if (tester.size()) CHECK(frameIs(tester.get(0), 0x7E8, {0x04, 0x41, 0x0C, 0x1A, 0xF8, 0xAA}));
+
+    //PIDs 0C, 0D and 20 (for 2F) supported
+    tester.clear();
+    send(bus, tester, 0x7DF, {0x02, 0x01, 0x00});
+    CHECK(tester.waitFor(1));
+    if (tester.size()) CHECK(frameIs(tester.get(0), 0x7E8, {0x06, 0x41, 0x00, 0x00, 0x18, 0x00, 0x01}));
+
+    //several PIDs in one request come back in one reply
+    tester.clear();
+    send(bus, tester, 0x7E0, {0x03, 0x01, 0x0D, 0x2F});
+    CHECK(tester.waitFor(1));
+    if (tester.size()) CHECK(frameIs(tester.get(0), 0x7E8, {0x05, 0x41, 0x0D, 0x3C, 0x2F, 0xA0}));
+
+    //no answer for a PID it doesn't have or from an ECU that doesn't exist
+    tester.clear();
+    send(bus, tester, 0x7E0, {0x02, 0x01, 0x0E});
+    send(bus, tester, 0x7E3, {0x02, 0x01, 0x0C});
+    CHECK(!tester.waitFor(1, 50));
+    CHECK(sim.getRequests() == 4 && sim.getResponses() == 3);
+}
+
+static void testMultiFrame()
+{
+    MemoryCanBus bus;
+    Tester tester;
+    EcuSimulator sim;
+    bus.attach(&tester);
+    CHECK(sim.loadDefault());
+    sim.attach(bus);
+
+    //VIN: first frame, nothing more until flow control, then the rest in sequence
+    send(bus, tester, 0x7E0, {0x02, 0x09, 0x02});
+    CHECK(tester.waitFor(1));
+    CHECK(!tester.waitFor(2, 50));
+    if (tester.size()) CHECK(frameIs(tester.get(0), 0x7E8, {0x10, 0x14, 0x49, 0x02, 0x01, 0x31, 0x47, 0x31}));
+    send(bus, tester, 0x7E0, {0x30, 0x00, 0x00});
+    CHECK(tester.waitFor(3));
+    if (tester.size() >= 3)
+    {
+        CHECK(frameIs(tester.get(1), 0x7E8, {0x21, 0x4A, 0x43, 0x35, 0x34, 0x34, 0x34, 0x52}));
+        CHECK(frameIs(tester.get(2), 0x7E8, {0x22, 0x37, 0x32, 0x35, 0x32, 0x33, 0x36, 0x37}));
+    }
+
+    //a block size of one needs flow control after every consecutive frame
+    tester.clear();
+    send(bus, tester, 0x7E0, {0x03, 0x22, 0xF1, 0x90});
+    CHECK(tester.waitFor(1));
+    send(bus, tester, 0x7E0, {0x30, 0x01, 0x00});
+    CHECK(tester.waitFor(2));
+    CHECK(!tester.waitFor(3, 50));
+    send(bus, tester, 0x7E0, {0x30, 0x01, 0x00});
+    CHECK(tester.waitFor(3));
+    if (tester.size() >= 3) CHECK(frameIs(tester.get(2), 0x7E8, {0x22}));
+
+    //a multi frame request gets flow control, then one reply for all of its DIDs
+    tester.clear();
+    send(bus, tester, 0x7E0, {0x10, 0x07, 0x22, 0xF1, 0x8C, 0xF1, 0x90, 0x12});
+    CHECK(tester.waitFor(1));
+    if (tester.size()) CHECK(frameIs(tester.get(0), 0x7E8, {0x30, 0x00, 0x00}));
+    send(bus, tester, 0x7E0, {0x21, 0x34});
+    CHECK(tester.waitFor(2));
+    if (tester.size() >= 2) CHECK(frameIs(tester.get(1), 0x7E8, {0x10, 0x20, 0x62, 0xF1, 0x8C, 0x4D}));
+}
+
+static void testNegativeResponses()
+{
+    MemoryCanBus bus;
+    Tester tester;
+    EcuSimulator sim;
+    bus.attach(&tester);
+    CHECK(sim.parseScript("ecu 0\ndelay 0 1000\ndid 0 F190 01\npending 0 22 2\nresponse 0 2701 6701 11 22 33 44\n"));
+    sim.attach(bus);
+
+    send(bus, tester, 0x7E0, {0x02, 0x27, 0x03});   //listed service, nothing scripted
+    CHECK(tester.waitFor(1));
+    if (tester.size()) CHECK(frameIs(tester.get(0), 0x7E8, {0x03, 0x7F, 0x27, 0x31}));
+    tester.clear();
+    send(bus, tester, 0x7E0, {0x02, 0x27, 0x01});   //canned
+    CHECK(tester.waitFor(1));
+    if (tester.size()) CHECK(frameIs(tester.get(0), 0x7E8, {0x06, 0x67, 0x01, 0x11, 0x22, 0x33, 0x44}));
+    tester.clear();
+    send(bus, tester, 0x7E0, {0x01, 0x99});         //not a service at all
+    CHECK(tester.waitFor(1));
+    if (tester.size()) CHECK(frameIs(tester.get(0), 0x7E8, {0x03, 0x7F, 0x99, 0x11}));
+
+    //functional requests aren't told what isn't supported
+    tester.clear();
+    send(bus, tester, 0x7DF, {0x02, 0x27, 0x03});
+    send(bus, tester, 0x7DF, {0x02, 0x3E, 0x80});
+    CHECK(!tester.waitFor(1, 50));
+
+    //response pending twice, then the answer
+    send(bus, tester, 0x7E0, {0x03, 0x22, 0xF1, 0x90});
+    CHECK(tester.waitFor(3));
+    if (tester.size() >= 3)
+    {
+        CHECK(frameIs(tester.get(0), 0x7E8, {0x03, 0x7F, 0x22, 0x78}));
+        CHECK(frameIs(tester.get(1), 0x7E8, {0x03, 0x7F, 0x22, 0x78}));
+        CHECK(frameIs(tester.get(2), 0x7E8, {0x04, 0x62, 0xF1, 0x90, 0x01}));
+    }
+
+    //periodic sending needs a session other than the default one
+    tester.clear();
+    send(bus, tester, 0x7E0, {0x03, 0x2A, 0x03, 0xF0});
+    CHECK(tester.waitFor(1));
+    if (tester.size()) CHECK(frameIs(tester.get(0), 0x7E8, {0x03, 0x7F, 0x2A, 0x7F}));
+    tester.clear();
+    send(bus, tester, 0x7E0, {0x04, 0x2C, 0x03, 0xF2, 0xF0}); //clearing a dynamic DID that isn't defined
+    CHECK(tester.waitFor(1));
+    if (tester.size()) CHECK(frameIs(tester.get(0), 0x7E8, {0x03, 0x7F, 0x2C, 0x31}));
+
+    //bad script lines are refused
+    CHECK(!sim.parseScript("ecu 9\n"));
+    CHECK(!sim.parseScript("pid 0 01 0C 1AF\n"));
+    CHECK(!sim.parseScript("frobnicate 0\n"));
+}
+
+static void testDelaysAndAddresses()
+{
+    MemoryCanBus bus;
+    Tester tester;
+    EcuSimulator sim;
+    bus.attach(&tester);
+    CHECK(sim.parseScript("ecu 0\ndelay 0 20000\npid 0 01 0D 3C\n"
+                          "ecu 1\ndelay 1 5000\npid 1 01 0D 3D\n"
+                          "ecu 2 physical\npid 2 01 0D 3E\n"));
+    sim.attach(bus);
+
+    uint32_t start = micros();
+    send(bus, tester, 0x7DF, {0x02, 0x01, 0x0D});
+    CHECK(tester.waitFor(2));
+    uint32_t elapsed = micros() - start;
+    CHECK(!tester.waitFor(3, 50)); //ECU 2 only answers to its own address
+    //the faster ECU answers first
+    if (tester.size() >= 2)
+    {
+        CHECK(frameIs(tester.get(0), 0x7E9, {0x03, 0x41, 0x0D, 0x3D}));
+        CHECK(frameIs(tester.get(1), 0x7E8, {0x03, 0x41, 0x0D, 0x3C}));
+    }
+    CHECK(elapsed >= 20000);
+
+    tester.clear();
+    send(bus, tester, 0x7E2, {0x02, 0x01, 0x0D});
+    CHECK(tester.waitFor(1));
+    if (tester.size()) CHECK(frameIs(tester.get(0), 0x7EA, {0x03, 0x41, 0x0D, 0x3E}));
+}
+
+static void testElmEndToEnd()
+{
+    EcuSimulator sim;
+    CHECK(sim.loadDefault());
+    sim.setDelay(0, 2000);
+    sim.attach(Hal::getDefaultCanBus());
+
+    ElmBench bench;
+    CHECK(bench.connect());
+    std::string reply;
+    uint32_t micros = 0;
+    CHECK(bench.request("010c", reply, micros));
+    CHECK(reply == "410C1AF8\r");
+    CHECK(micros >= 2000);
+
+    CHECK(bench.request("0902", reply, micros));
+    CHECK(reply == "014\r0:490201314731\r1:4A433534343452\r2:37323532333637\r");
+
+    CHECK(bench.request("22f18c", reply, micros));
+    CHECK(reply == "00D\r0:62F18C4D4143\r1:4348494E413031\r");
+
+    CHECK(bench.request("atsh7e1", reply, micros));
+    CHECK(bench.request("0105", reply, micros));
+    CHECK(reply == "41057E\r");
+    CHECK(bench.request("ath1", reply, micros));
+    CHECK(bench.request("0105", reply, micros));
+    CHECK(reply == "7E90341057E\r");
+    CHECK(bench.request("ath0", reply, micros));
+    CHECK(bench.request("atsh7e0", reply, micros));
+
+    //the latency profile times the real answer, not the "response pending" before it
+    elmEmulator.getPIDProfiler().reset();
+    sim.setPending(0, 0x22, 2);
+    CHECK(bench.request("22f18c", reply, micros));
+    CHECK(reply == "7F2278\r7F2278\r00D\r0:62F18C4D4143\r1:4348494E413031\r");
+    sim.setPending(0, 0x22, 0);
+    PIDLatency latency;
+    int idx = 0;
+    while (idx < PID_PROFILE_KEYS && !elmEmulator.getPIDProfiler().getLatency(idx, latency)) idx++;
+    CHECK(idx < PID_PROFILE_KEYS);
+    printf("  22 F1 answered after %uus\n", latency.max);
+    CHECK(latency.mode == 0x22 && latency.count == 1 && latency.min > 2 * 2000);
+
+    CHECK(bench.request("0142", reply, micros));
+    CHECK(reply == "NO DATA\r");
+    CHECK(bench.request("zz", reply, micros));
+    CHECK(reply == "?\r");
+
+    std::vector<ElmBench::Result> results = bench.run({"010C", "0902"}, 20);
+    CHECK(results.size() == 3);
+    if (results.size() == 3)
+    {
+        CHECK(results[2].count == 40 && results[2].noData == 0);
+        CHECK(results[0].p50 >= 2000 && results[0].p50 <= results[0].p99 && results[0].p99 <= results[0].max);
+    }
+    ElmBench::print(stdout, results);
+    sim.detach();
+}
+
+int main()
+{
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"single frame replies", testSingleFrame},
+        {"multi frame replies and requests", testMultiFrame},
+        {"negative responses", testNegativeResponses},
+        {"delays and ECU addresses", testDelaysAndAddresses},
+        {"ELM327 end to end", testElmEndToEnd},
+    };
+
+    //keep clear of other instances and of anything already listening
+    Hal::setPortOffset(20000 + getpid() % 10000);
+
+    for (auto &test : tests)
+    {
+        int before = failures;
+        printf("%s\n", test.name);
+        test.run();
+        printf("  %s\n", (failures == before) ? "ok" : "FAILED");
+    }
+    printf("%i check(s) failed\n", failures);
+    fflush(stdout);
+    _exit(failures ? 1 : 0); //background tasks are still running
+}
@@ -0,0 +1,259 @@
+/*
+ * FrameTableTest.cpp
+ *
+ * Checks the newest-frame-per-ID table and the coalesced monitors and
+ * snapshots on the ELM327 and GVRET ports.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "Check.h"
+#include "Frames.h"
+#include "FrameTable.h"
+#include "ElmBench.h"
+#include "Hal.h"
+
+extern FrameTable frameTable;
+
+static ElmBench elm;
+
+static void sendFrame(const CAN_FRAME &frame)
+{
+    Hal::getDefaultCanBus().send(NULL, frame);
+}
+
+static int countLines(const std::string &text, const std::string &prefix, std::string *last = NULL)
+{
+    int count = 0;
+    size_t pos = 0;
+    while ((pos = text.find(prefix, pos)) != std::string::npos)
+    {
+        if (pos == 0 || text[pos - 1] == '\r')
+        {
+            count++;
+            if (last) *last = text.substr(pos, text.find('\r', pos) - pos);
+        }
+        pos++;
+    }
+    return count;
+}
+
+static void testTable()
+{
+    FrameTable table;
+    CAN_FRAME frame = makeFrame(0x123, false, counting(1, 8));
+    table.processFrame(frame);
+    frame = makeFrame(0x123, false, counting(5, 4));
+    table.processFrame(frame);
+    //the same number as a 29 bit ID is another ID
+    frame = makeFrame(0x123, true, counting(9, 8));
+    table.processFrame(frame);
+
+    CHECK(table.getCount() == 2);
+    const LatestFrame *latest = table.find(0x123, false);
+    CHECK(latest && latest->count == 2 && latest->length == 4 && latest->data[0] == 5 && latest->data[3] == 8);
+    latest = table.find(0x123, true);
+    CHECK(latest && latest->id == (0x123 | 1ul << 31) && latest->count == 1 && latest->data[0] == 9);
+    CHECK(!table.find(0x124, false) && !table.find(0x124, true));
+
+    //fill it with 29 bit IDs, the hash must keep finding every one of them
+    for (uint32_t i = 0; table.getCount() < FRAME_TABLE_SIZE; i++)
+    {
+        frame = makeFrame(0x18DA0000 + i * 0x100, true, counting(i, 8));
+        table.processFrame(frame);
+    }
+    int found = 0;
+    for (uint32_t i = 0; i < FRAME_TABLE_SIZE - 2; i++)
+    {
+        latest = table.find(0x18DA0000 + i * 0x100, true);
+        if (latest && latest->data[0] == (uint8_t)i) found++;
+    }
+    CHECK(found == FRAME_TABLE_SIZE - 2);
+    frame = makeFrame(0x7FF, false, counting(0, 8));
+    table.processFrame(frame);
+    CHECK(table.getCount() == FRAME_TABLE_SIZE && !table.find(0x7FF, false));
+    table.clear();
+    CHECK(table.getCount() == 0 && !table.find(0x123, false));
+}
+
+static void testPending()
+{
+    FrameTable table;
+    CAN_FRAME frame = makeFrame(0x100, false, counting(0, 8));
+    table.processFrame(frame);
+    //nobody is taking frames yet
+    CHECK(table.nextPending(FrameTable::ElmMonitor, 0) == -1);
+
+    table.setActive(FrameTable::ElmMonitor, true);
+    table.markAll(FrameTable::ElmMonitor);
+    CHECK(table.nextPending(FrameTable::ElmMonitor, 0) == 0);
+    CHECK(table.nextPending(FrameTable::GvretMonitor, 0) == -1);
+    table.markSent(FrameTable::ElmMonitor, 0);
+    CHECK(table.nextPending(FrameTable::ElmMonitor, 0) == -1);
+
+    //many frames between two batches leave one pending entry with the newest data
+    for (int i = 0; i < 10; i++)
+    {
+        frame = makeFrame(0x200, false, counting(i, 8));
+        table.processFrame(frame);
+    }
+    CHECK(table.nextPending(FrameTable::ElmMonitor, 0) == 1 && table.nextPending(FrameTable::ElmMonitor, 2) == -1);
+    CHECK(table.get(1)->data[0] == 9 && table.get(1)->count == 10);
+
+    table.setActive(FrameTable::ElmMonitor, false);
+    CHECK(table.nextPending(FrameTable::ElmMonitor, 0) == -1);
+}
+
+static void testElmMonitor()
+{
+    std::string reply;
+    uint32_t micros;
+
+    frameTable.clear();
+    sendFrame(makeFrame(0x300, false, counting(0x10, 8)));
+    sendFrame(makeFrame(0x300, false, counting(0x20, 8)));
+    sendFrame(makeFrame(0x18FEF100, true, counting(0x30, 3)));
+    elm.receive(50);
+
+    //everything seen so far first, one line per ID with its newest frame
+    elm.send("stxcm100");
+    std::string out = elm.receive(50);
+    CHECK(countLines(out, "300") == 1 && out.find("3002021222324252627\r") != std::string::npos);
+    CHECK(out.find("18FEF100303132\r") != std::string::npos);
+
+    //a burst only shows up a few times, ending with the newest frame
+    for (int i = 0; i < 30; i++) sendFrame(makeFrame(0x300, false, counting(i, 8)));
+    out = elm.receive(350);
+    std::string last;
+    int lines = countLines(out, "300", &last);
+    printf("  30 frames, %i lines\n", lines);
+    CHECK(lines >= 1 && lines < 30 && last == "3001D1E1F2021222324");
+    CHECK(countLines(out, "18FEF100") == 0);
+
+    //a new line stops it
+    CHECK(elm.request("stxsnap300", reply, micros) && reply.find("3001D1E1F2021222324 32 ") == 0 && reply.find("\rOK\r") != std::string::npos);
+    CHECK(elm.request("stxsnap", reply, micros) && countLines(reply, "300") == 1 && countLines(reply, "18FEF100303132 1 ") == 1);
+    CHECK(elm.request("stxsnap7ff", reply, micros) && reply == "NO DATA\r");
+    CHECK(elm.request("stxcm1", reply, micros) && reply == "?\r");
+    sendFrame(makeFrame(0x300, false, counting(0x40, 8)));
+    CHECK(elm.receive(200).empty());
+}
+
+static void testGvret()
+{
+#ifndef BLUETOOTH
+    WiFiClient client;
+    uint32_t start = millis();
+    while (millis() - start < 2000 && !client.connect("127.0.0.1", Hal::mapPort(23))) elm.receive(1);
+    CHECK(client.connected());
+    std::vector<CAN_FRAME> frames;
+    std::vector<std::vector<uint8_t>> messages;
+    readGvret(elm, client, 100, frames, messages);
+
+    //every frame goes out until coalescing is asked for
+    frameTable.clear();
+    for (int i = 0; i < 10; i++) sendFrame(makeFrame(0x400, false, counting(i, 8)));
+    frames.clear();
+    readGvret(elm, client, 200, frames, messages);
+    CHECK(frames.size() == 10);
+
+    const uint8_t coalesce[] = {0xF1, PROTO_SET_COALESCE, 100, 0, 0};
+    client.write(coalesce, sizeof(coalesce));
+    frames.clear();
+    messages.clear();
+    readGvret(elm, client, 100, frames, messages);
+    CHECK(messages.size() == 1 && messages[0] == std::vector<uint8_t>({0xF1, PROTO_SET_COALESCE, 100, 0}));
+
+    for (int i = 0; i < 30; i++) sendFrame(makeFrame(0x400, false, counting(i, 8)));
+    sendFrame(makeFrame(0x1ABCDEF0, true, counting(0x55, 2)));
+    frames.clear();
+    readGvret(elm, client, 350, frames, messages);
+    int count = 0;
+    const CAN_FRAME *last = NULL;
+    for (auto &frame : frames)
+    {
+        if (frame.id != 0x400) continue;
+        count++;
+        last = &frame;
+    }
+    printf("  30 frames, %i sent\n", count);
+    CHECK(count >= 1 && count < 30 && last && last->data.bytes[0] == 29);
+
+    //snapshot: the newest of each ID, then F1 25 with how many
+    const uint8_t snapshot[] = {0xF1, PROTO_GET_SNAPSHOT};
+    client.write(snapshot, sizeof(snapshot));
+    frames.clear();
+    messages.clear();
+    readGvret(elm, client, 100, frames, messages);
+    CHECK(frames.size() == 2 && frames[0].id == 0x400 && frames[0].data.bytes[0] == 29);
+    CHECK(frames.size() == 2 && frames[1].id == 0x1ABCDEF0 && frames[1].extended &&
+          frames[1].length == 2 && frames[1].data.bytes[0] == 0x55 && frames[1].data.bytes[1] == 0x56);
+    CHECK(messages.size() == 1 && messages[0] == std::vector<uint8_t>({0xF1, PROTO_GET_SNAPSHOT, 2, 0}));
+
+    //0 goes back to every frame
+    const uint8_t off[] = {0xF1, PROTO_SET_COALESCE, 0, 0, 0};
+    client.write(off, sizeof(off));
+    readGvret(elm, client, 100, frames, messages);
+    for (int i = 0; i < 10; i++) sendFrame(makeFrame(0x400, false, counting(i, 8)));
+    frames.clear();
+    readGvret(elm, client, 200, frames, messages);
+    CHECK(frames.size() == 10);
+    client.stop();
+#endif
+}
+
+int main()
+{
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"table", testTable},
+        {"pending frames", testPending},
+        {"ELM327 coalesced monitor and snapshot", testElmMonitor},
+        {"GVRET coalesced frames and snapshot", testGvret},
+    };
+
+    //keep clear of other instances and of anything already listening
+    Hal::setPortOffset(20000 + getpid() % 10000);
+
+    if (!elm.connect())
+    {
+        printf("Couldn't connect to the ELM327 port\n");
+        _exit(1);
+    }
+
+    for (auto &test : tests)
+    {
+        int before = failures;
+        printf("%s\n", test.name);
+        test.run();
+        printf("  %s\n", (failures == before) ? "ok" : "FAILED");
+    }
+    printf("%i check(s) failed\n", failures);
+    fflush(stdout);
+    _exit(failures ? 1 : 0); //background tasks are still running
+}
@@ -0,0 +1,116 @@
+/*
+ * Frames.h
+ *
+ * Building CAN frames for the host tests and reading them back from the GVRET
+ * port, shared like Check.h.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FRAMES_H_
+#define FRAMES_H_
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <esp32_can.h>
+#include <vector>
+#include "config.h"
+#include "ElmBench.h"
+
+//length bytes counting up from first
+inline std::vector<uint8_t> counting(uint8_t first, int length)
+{
+    std::vector<uint8_t> data;
+    for (int i = 0; i < length; i++) data.push_back(first + i);
+    return data;
+}
+
+//a frame with these data bytes, stamped with the time it was made
+inline CAN_FRAME makeFrame(uint32_t id, bool extended, const std::vector<uint8_t> &data)
+{
+    CAN_FRAME frame;
+    frame.id = id;
+    frame.extended = extended;
+    frame.length = data.size();
+    for (size_t i = 0; i < data.size() && i < 8; i++) frame.data.bytes[i] = data[i];
+    frame.timestamp = micros();
+    return frame;
+}
+
+#ifndef BLUETOOTH
+//length of the GVRET replies the tests ask for, F1 and the command included
+inline size_t gvretReplyLength(uint8_t command)
+{
+    switch (command)
+    {
+    case PROTO_SET_COALESCE:
+    case PROTO_GET_SNAPSHOT:
+        return 4;
+    case PROTO_GET_RECORDING:
+        return 6;
+    case PROTO_GET_CAPTURE:
+        return 7;
+    case PROTO_PLAYBACK:
+        return 21;
+    }
+    return 0;
+}
+
+/*
+ * What the GVRET port sent within ms milliseconds while the firmware kept
+ * running. CAN frames go to frames, 29 bit ones with extended set. Replies go
+ * to replies with their F1 and command byte. Reading stops at anything else.
+ */
+inline void readGvret(ElmBench &elm, WiFiClient &client, uint32_t ms, std::vector<CAN_FRAME> &frames,
+                      std::vector<std::vector<uint8_t>> &replies)
+{
+    std::vector<uint8_t> in;
+    uint32_t start = millis();
+    while (millis() - start < ms)
+    {
+        elm.receive(1);
+        while (client.available()) in.push_back(client.read());
+    }
+    size_t pos = 0;
+    while (pos + 2 <= in.size() && in[pos] == 0xF1)
+    {
+        size_t length;
+        if (in[pos + 1] == 0) length = (pos + 11 <= in.size()) ? 12 + (in[pos + 10] & 0xF) : 12;
+        else length = gvretReplyLength(in[pos + 1]);
+        if (length == 0 || pos + length > in.size()) break;
+        if (in[pos + 1] == 0)
+        {
+            CAN_FRAME frame;
+            frame.id = in[pos + 6] | in[pos + 7] << 8 | in[pos + 8] << 16 | (uint32_t)in[pos + 9] << 24;
+            frame.extended = frame.id >> 31;
+            frame.id &= 0x1FFFFFFF;
+            frame.length = in[pos + 10] & 0xF;
+            memcpy(frame.data.bytes, &in[pos + 11], frame.length);
+            frames.push_back(frame);
+        }
+        else replies.push_back(std::vector<uint8_t>(in.begin() + pos, in.begin() + pos + length));
+        pos += length;
+    }
+}
+#endif
+
+#endif /* FRAMES_H_ */
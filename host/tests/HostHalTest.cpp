@@ -0,0 +1,222 @@
+/*
+ * HostHalTest.cpp
+ *
+ * Checks the host HAL on its own and then runs the firmware on it: frames
+ * from the in-process CAN bus have to come out of the GVRET port and ELM327
+ * requests typed into the ELM port, or the Bluetooth stand-in, have to go
+ * out on the bus. Exits non-zero if any case fails.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <esp32_can.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "Check.h"
+#include "Frames.h"
+#include "Hal.h"
+
+void setup();
+void loop();
+
+//Another node on the bus, keeps what it sees
+class TestNode : public CanNode {
+public:
+    void frameReceived(const CAN_FRAME &frame) override { frames.push_back(frame); }
+    std::vector<CAN_FRAME> frames;
+};
+
+//read what arrives within timeout milliseconds
+static std::vector<uint8_t> receive(WiFiClient &client, uint32_t timeout, std::vector<uint8_t> until = std::vector<uint8_t>())
+{
+    std::vector<uint8_t> data;
+    uint32_t start = millis();
+    while (millis() - start < timeout)
+    {
+        loop();
+        while (client.available()) data.push_back(client.read());
+        if (!until.empty() && data.size() >= until.size() && std::equal(until.begin(), until.end(), data.end() - until.size())) break;
+    }
+    return data;
+}
+
+static void testMemoryBus()
+{
+    MemoryCanBus bus;
+    TestNode node;
+    CAN_COMMON can;
+    can.attach(&bus);
+    bus.attach(&node);
+    can.begin(500000);
+
+    CAN_FRAME frame = makeFrame(0x123, false, counting(1, 8));
+    CHECK(bus.send(&node, frame));
+    CHECK(can.available() == 1);
+    CHECK(node.frames.empty()); //nobody hears their own frames
+    CAN_FRAME in;
+    CHECK(can.read(in) == 1);
+    CHECK(in.id == 0x123 && in.length == 8 && in.data.bytes[7] == 8);
+
+    CHECK(can.sendFrame(frame));
+    CHECK(node.frames.size() == 1);
+    can.setListenOnlyMode(true);
+    CHECK(!can.sendFrame(frame));
+    can.setListenOnlyMode(false);
+
+    for (int i = 0; i < CAN_HOST_RX_QUEUE + 10; i++) bus.send(&node, frame);
+    CHECK(can.available() == CAN_HOST_RX_QUEUE);
+    CHECK(can.getRxDrops() == 10);
+    while (can.read(in)) {}
+
+    can.watchFor(0x7E8, 0x7F8);
+    bus.send(&node, makeFrame(0x7E9, false, counting(0, 8)));
+    bus.send(&node, makeFrame(0x123, false, counting(0, 8)));
+    CHECK(can.available() == 1);
+    can.disable();
+    bus.send(&node, makeFrame(0x7E8, false, counting(0, 8)));
+    CHECK(can.available() == 1);
+    can.attach(NULL);
+}
+
+static void testLoopbackSockets()
+{
+    WiFiServer server(5000);
+    server.begin();
+    CHECK(!server.hasClient());
+
+    WiFiClient client;
+    CHECK(client.connect("127.0.0.1", Hal::mapPort(5000)));
+    delay(10);
+    CHECK(server.hasClient());
+    WiFiClient accepted = server.available();
+    CHECK(accepted.connected());
+
+    const char *hello = "hello";
+    CHECK(client.write((const uint8_t *)hello, 5) == 5);
+    delay(10);
+    CHECK(accepted.available() == 5);
+    CHECK(accepted.read() == 'h');
+    uint8_t buff[8];
+    CHECK(accepted.read(buff, sizeof(buff)) == 4);
+
+    //a large write gets through while the other side reads
+    std::vector<uint8_t> big(1 << 20, 0x5A);
+    size_t received = 0;
+    std::thread reader([&] {
+        uint8_t chunk[4096];
+        uint32_t start = millis();
+        while (received < big.size() && millis() - start < 5000)
+        {
+            int n = client.read(chunk, sizeof(chunk));
+            if (n > 0) received += n;
+        }
+    });
+    CHECK(accepted.write(big.data(), big.size()) == big.size());
+    reader.join();
+    CHECK(received == big.size());
+
+    WiFiClient copy = accepted;
+    copy.stop();
+    delay(10);
+    CHECK(!client.connected());
+    CHECK(!accepted.connected());
+    accepted = 0;
+    CHECK(!accepted);
+}
+
+static void testFirmwareOverLoopback()
+{
+    TestNode ecu;
+    Hal::getDefaultCanBus().attach(&ecu);
+    setup();
+
+    //the radio comes up in its own task, the servers once loop() notices
+    WiFiClient elm;
+    uint32_t start = millis();
+    while (millis() - start < 2000 && !elm.connect("127.0.0.1", Hal::mapPort(35000))) loop();
+    CHECK(elm.connected());
+
+#ifndef BLUETOOTH
+    WiFiClient gvret;
+    CHECK(gvret.connect("127.0.0.1", Hal::mapPort(23)));
+    receive(gvret, 50);
+
+    //binary mode, then a frame from the bus comes out as F1 00 <time> <id> <len> <data> <checksum>
+    gvret.write(0xE7);
+    receive(gvret, 20);
+    CAN_FRAME frame = makeFrame(0x7E8, false, counting(0x40, 8));
+    Hal::getDefaultCanBus().send(&ecu, frame);
+    std::vector<uint8_t> out = receive(gvret, 200);
+    CHECK(out.size() == 20);
+    if (out.size() == 20)
+    {
+        CHECK(out[0] == 0xF1 && out[1] == 0);
+        CHECK(out[6] == 0xE8 && out[7] == 0x07 && out[8] == 0 && out[9] == 0);
+        CHECK(out[10] == 8);
+        CHECK(out[11] == 0x40 && out[18] == 0x47);
+    }
+#endif
+
+    //an OBD request typed into the ELM port goes out on the bus as a single frame
+    ecu.frames.clear();
+    elm.print("atz\r");
+    std::vector<uint8_t> reply = receive(elm, 500, {'>'});
+    CHECK(std::string(reply.begin(), reply.end()).find("ELM327") != std::string::npos);
+    elm.print("010c\r");
+    receive(elm, 500, {'>'});
+    CHECK(ecu.frames.size() == 1);
+    if (!ecu.frames.empty())
+    {
+        CHECK(ecu.frames[0].id == 0x7E0);
+        CHECK(ecu.frames[0].data.bytes[0] == 2 && ecu.frames[0].data.bytes[1] == 1 && ecu.frames[0].data.bytes[2] == 0x0C);
+    }
+    Hal::getDefaultCanBus().detach(&ecu);
+}
+
+int main()
+{
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"memory bus", testMemoryBus},
+        {"loopback sockets", testLoopbackSockets},
+        {"firmware over loopback", testFirmwareOverLoopback},
+    };
+
+    //keep clear of other instances and of anything already listening
+    Hal::setPortOffset(20000 + getpid() % 10000);
+
+    for (auto &test : tests)
+    {
+        int before = failures;
+        printf("%s\n", test.name);
+        test.run();
+        printf("  %s\n", (failures == before) ? "ok" : "FAILED");
+    }
+    printf("%i check(s) failed\n", failures);
+    fflush(stdout);
+    _exit(failures ? 1 : 0); //background tasks are still running
+}
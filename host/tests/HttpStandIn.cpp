@@ -0,0 +1,199 @@
+/*
+ * HttpStandIn.cpp
+ *
+ * A tiny HTTP/1.1 file server behind the Client interface for host tests.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "HttpStandIn.h"
+
+void HttpStandIn::reset()
+{
+    faults = Faults();
+    requests.clear();
+    bodyBytesServed = 0;
+    connections = 0;
+    stop();
+}
+
+int HttpStandIn::connect(IPAddress ip, uint16_t port)
+{
+    return connect(ip.toString().c_str(), port);
+}
+
+int HttpStandIn::connect(const char *host, uint16_t port)
+{
+    (void)host; (void)port;
+    stop();
+    if (faults.failConnects > 0)
+    {
+        faults.failConnects--;
+        return 0;
+    }
+    open = true;
+    connections++;
+    return 1;
+}
+
+size_t HttpStandIn::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t HttpStandIn::write(const uint8_t *buf, size_t size)
+{
+    if (!open || closing) return 0;
+    request.append((const char *)buf, size);
+    if (response.empty() && request.find("\r\n\r\n") != std::string::npos) handleRequest();
+    return size;
+}
+
+/*
+ * Parse the request line and Range header and build the whole response up
+ * front. Faults are applied as the client reads it.
+ */
+void HttpStandIn::handleRequest()
+{
+    Request req;
+    char path[256] = {0};
+    const char *range;
+    std::string headers;
+
+    sscanf(request.c_str(), "GET %255s HTTP/1.1", path);
+    req.path = path;
+    range = strcasestr(request.c_str(), "\r\nRange: bytes=");
+    req.rangeStart = range ? atol(range + 15) : -1;
+
+    auto file = files.find(req.path);
+    if (file == files.end())
+    {
+        req.status = 404;
+        headers = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        response.assign(headers.begin(), headers.end());
+        bodyStart = response.size();
+    }
+    else
+    {
+        std::vector<uint8_t> content = file->second;
+        size_t start = 0;
+        char buff[256];
+
+        if (faults.corruptAt >= 0 && (size_t)faults.corruptAt < content.size()) content[faults.corruptAt] ^= 0xFF;
+        if (req.rangeStart >= 0 && !faults.ignoreRange && (size_t)req.rangeStart < content.size())
+        {
+            start = req.rangeStart;
+            req.status = 206;
+            snprintf(buff, sizeof(buff), "HTTP/1.1 206 Partial Content\r\nContent-Type: application/octet-stream\r\n"
+                     "Content-Length: %zu\r\nContent-Range: bytes %zu-%zu/%zu\r\nConnection: close\r\n\r\n",
+                     content.size() - start, start, content.size() - 1, content.size());
+        }
+        else
+        {
+            req.status = 200;
+            snprintf(buff, sizeof(buff), "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                     "Accept-Ranges: bytes\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", content.size());
+        }
+        headers = buff;
+        response.assign(headers.begin(), headers.end());
+        bodyStart = response.size();
+        response.insert(response.end(), content.begin() + start, content.end());
+    }
+    requests.push_back(req);
+    closing = true; //Connection: close, the server hangs up once it has sent everything
+}
+
+/*
+ * Make more of the response readable, subject to throttling, truncation and
+ * stalls. Headers are never held back.
+ */
+void HttpStandIn::release()
+{
+    if (response.empty()) return;
+
+    size_t limit = response.size();
+    bool truncating = faults.truncateAfter && (faults.truncateConnections < 0 || connections <= faults.truncateConnections);
+    bool stalling = faults.stallAfter && connections <= faults.stallConnections;
+    if (truncating) limit = std::min(limit, bodyStart + faults.truncateAfter);
+    if (stalling) limit = std::min(limit, bodyStart + faults.stallAfter);
+
+    if (released < bodyStart) released = bodyStart;
+    if (faults.bytesPerRead)
+    {
+        if (micros() - lastRelease < faults.throttleMicros) return;
+        lastRelease = micros();
+        if (readPos >= released) released = std::min(limit, released + faults.bytesPerRead);
+    }
+    else released = limit;
+    if (released > limit) released = limit;
+
+    //a truncated connection is dropped once the client has read up to the cut
+    if (truncating && !stalling && readPos >= limit && limit < response.size()) open = false;
+}
+
+int HttpStandIn::available()
+{
+    if (!open) return 0;
+    release();
+    return (readPos < released) ? released - readPos : 0;
+}
+
+int HttpStandIn::read()
+{
+    uint8_t c;
+    return (read(&c, 1) == 1) ? c : -1;
+}
+
+int HttpStandIn::read(uint8_t *buf, size_t size)
+{
+    size_t avail = available();
+    if (avail == 0) return -1;
+    if (size > avail) size = avail;
+    memcpy(buf, &response[readPos], size);
+    if (readPos + size > bodyStart) bodyBytesServed += readPos + size - std::max(readPos, bodyStart);
+    readPos += size;
+    return size;
+}
+
+int HttpStandIn::peek()
+{
+    return available() ? response[readPos] : -1;
+}
+
+void HttpStandIn::stop()
+{
+    open = false;
+    closing = false;
+    request.clear();
+    response.clear();
+    readPos = 0;
+    bodyStart = 0;
+    released = 0;
+}
+
+uint8_t HttpStandIn::connected()
+{
+    if (!open) return 0;
+    //once the server has hung up the connection only counts as open while unread data is left
+    if (closing && readPos >= response.size()) return 0;
+    return available() > 0 || !closing || readPos < response.size();
+}
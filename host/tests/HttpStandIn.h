@@ -0,0 +1,99 @@
+/*
+ * HttpStandIn.h
+ *
+ * A tiny HTTP/1.1 file server living behind the Client interface so the OTA
+ * updater can be driven without a network. It honours Range requests and can
+ * misbehave on purpose: drop connections part way through a body, stall
+ * without closing, trickle data out slowly, ignore Range, refuse connections
+ * or serve a corrupted copy of a file.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef HTTPSTANDIN_H_
+#define HTTPSTANDIN_H_
+
+#include <Client.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+class HttpStandIn : public Client {
+public:
+    //what the server does wrong, all off by default
+    struct Faults {
+        uint32_t truncateAfter = 0;     //close after this many body bytes per connection
+        int truncateConnections = -1;   //how many connections get truncated, -1 for all of them
+        uint32_t stallAfter = 0;        //stop sending without closing after this many body bytes
+        int stallConnections = 1;
+        uint32_t bytesPerRead = 0;      //at most this much becomes available at once
+        uint32_t throttleMicros = 0;    //and only this often
+        bool ignoreRange = false;       //answer 200 with the whole file even when asked for a range
+        int failConnects = 0;           //refuse this many connection attempts
+        int32_t corruptAt = -1;         //flip the bits of the byte at this offset of every file
+    };
+
+    struct Request {
+        std::string path;
+        int32_t rangeStart;             //-1 if no Range header
+        int status;
+    };
+
+    void addFile(const std::string &path, const std::vector<uint8_t> &content) { files[path] = content; }
+    void addFile(const std::string &path, const std::string &content) { files[path] = std::vector<uint8_t>(content.begin(), content.end()); }
+    void reset();
+
+    Faults faults;
+    std::vector<Request> requests;
+    uint32_t bodyBytesServed = 0;
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char *host, uint16_t port) override;
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buf, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t *buf, size_t size) override;
+    int peek() override;
+    void flush() override {}
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override { return open; }
+
+private:
+    std::map<std::string, std::vector<uint8_t>> files;
+    bool open = false;
+    bool closing = false;           //server side closed, whatever is left can still be read
+    std::string request;
+    std::vector<uint8_t> response;
+    size_t readPos = 0;
+    size_t bodyStart = 0;
+    size_t released = 0;            //bytes of response available to the client so far
+    uint32_t lastRelease = 0;
+    int connections = 0;
+
+    void handleRequest();
+    void release();
+};
+
+#endif /* HTTPSTANDIN_H_ */
@@ -0,0 +1,306 @@
+/*
+ * OTAUpdaterTest.cpp
+ *
+ * Runs OTAUpdater against HttpStandIn: clean downloads, dropped and stalled
+ * connections, slow links, servers that ignore Range, corrupted images and
+ * the ways an update has to fail, plus rate limiting, cancelling and the
+ * boot partition only switching on apply(). Exits non-zero if any case fails.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <Update.h>
+#include <mbedtls/sha256.h>
+#include "OTAUpdater.h"
+#include "Check.h"
+#include "HttpStandIn.h"
+#include <esp_ota_ops.h>
+#include <thread>
+
+static const char *imagePath = "/Macchina_A0_OBDII.ino.esp32.bin";
+static HttpStandIn server;
+static std::vector<uint8_t> image;
+static std::string sha256Hex(const std::vector<uint8_t> &data)
+{
+    uint8_t digest[32];
+    char hex[65];
+    mbedtls_sha256_ret(data.data(), data.size(), digest, 0);
+    for (int i = 0; i < 32; i++) sprintf(&hex[i * 2], "%02x", digest[i]);
+    return std::string(hex, 64);
+}
+
+//fresh server with the image and its sha256sum style digest file
+static void setupServer(bool withDigest = true)
+{
+    server = HttpStandIn();
+    server.addFile(imagePath, image);
+    if (withDigest) server.addFile(std::string(imagePath) + ".sha256", sha256Hex(image) + "  Macchina_A0_OBDII.ino.esp32.bin\n");
+    Update.reset();
+}
+
+static OTAUpdater::Result runUpdate(uint32_t timeout = 200)
+{
+    OTAUpdater updater(server);
+    updater.setServer("updates.local", 80, imagePath);
+    updater.setTimeout(timeout);
+    updater.setRetryDelay(0);
+    uint32_t start = millis();
+    OTAUpdater::Result result = updater.run();
+    printf("  -> %s, %u bytes, %u reconnects, %u requests, %u body bytes served, %u ms\n", OTAUpdater::getResultName(result),
+           updater.getBytesWritten(), updater.getReconnects(), (unsigned)server.requests.size(), server.bodyBytesServed, millis() - start);
+    return result;
+}
+
+static bool imageIntact()
+{
+    return Update.ended && Update.image == image;
+}
+
+static void testCleanDownload()
+{
+    setupServer();
+    CHECK(runUpdate() == OTAUpdater::Success);
+    CHECK(imageIntact());
+    CHECK(server.requests.size() == 2); //digest and image
+    CHECK(server.requests[1].rangeStart == -1);
+    CHECK(server.bodyBytesServed == image.size() + 64); //only the digest part of the .sha256 file is read
+}
+
+static void testTruncatedConnections()
+{
+    setupServer();
+    server.faults.truncateAfter = 30000;
+    CHECK(runUpdate() == OTAUpdater::Success);
+    CHECK(imageIntact());
+    //every connection after the first resumes exactly where the previous one stopped
+    uint32_t expected = 0;
+    for (size_t i = 1; i < server.requests.size(); i++)
+    {
+        CHECK(server.requests[i].rangeStart == (expected ? (int32_t)expected : -1));
+        CHECK(server.requests[i].status == (expected ? 206 : 200));
+        expected += 30000;
+    }
+    CHECK(expected >= image.size());
+    //nothing was downloaded twice
+    CHECK(server.bodyBytesServed == image.size() + 64);
+}
+
+static void testThrottledAndTruncated()
+{
+    setupServer();
+    server.faults.truncateAfter = 45000;
+    server.faults.truncateConnections = 3;
+    server.faults.bytesPerRead = 536;
+    server.faults.throttleMicros = 50;
+    CHECK(runUpdate() == OTAUpdater::Success);
+    CHECK(imageIntact());
+    //the first connection fetches the digest, the next two are cut off
+    CHECK(server.requests.size() == 4);
+}
+
+static void testStalledConnection()
+{
+    setupServer();
+    server.faults.stallAfter = 70000;
+    server.faults.stallConnections = 2; //the digest download and the first image download
+    server.addFile(std::string(imagePath) + ".sha256", sha256Hex(image));
+    CHECK(runUpdate(100) == OTAUpdater::Success);
+    CHECK(imageIntact());
+    CHECK(server.requests.back().rangeStart == 70000);
+}
+
+static void testServerIgnoresRange()
+{
+    setupServer();
+    server.faults.truncateAfter = 50000;
+    server.faults.truncateConnections = 2;
+    server.faults.ignoreRange = true;
+    CHECK(runUpdate() == OTAUpdater::Success);
+    CHECK(imageIntact());
+    CHECK(server.requests.back().status == 200);
+    CHECK(server.requests.back().rangeStart == 50000);
+}
+
+static void testNoDigestFile()
+{
+    setupServer(false);
+    server.faults.truncateAfter = 100000;
+    CHECK(runUpdate() == OTAUpdater::Success);
+    CHECK(imageIntact());
+}
+
+static void testCorruptImage()
+{
+    setupServer();
+    server.faults.corruptAt = 123456; //well past the end of the digest file
+    CHECK(runUpdate() == OTAUpdater::DigestMismatch);
+    CHECK(!Update.ended);
+    CHECK(!Update.isRunning());
+}
+
+static void testImageTooLarge()
+{
+    setupServer();
+    Update.partitionSize = image.size() - 1;
+    CHECK(runUpdate() == OTAUpdater::NoSpace);
+    Update.partitionSize = 0x1E0000;
+}
+
+static void testServerUnreachable()
+{
+    setupServer();
+    server.faults.failConnects = 1000;
+    CHECK(runUpdate() == OTAUpdater::TooManyRetries);
+    CHECK(server.requests.empty());
+}
+
+static void testRecoversAfterRefusedConnections()
+{
+    setupServer();
+    server.faults.failConnects = 3;
+    CHECK(runUpdate() == OTAUpdater::Success);
+    CHECK(imageIntact());
+    CHECK(server.requests[0].status == 200); //the digest was still checked
+}
+
+static void testMissingImage()
+{
+    setupServer();
+    server = HttpStandIn();
+    CHECK(runUpdate() == OTAUpdater::HttpError);
+    CHECK(!Update.ended);
+}
+
+static void testFlashWriteFailure()
+{
+    setupServer();
+    Update.failAt = 65536;
+    CHECK(runUpdate() == OTAUpdater::WriteFailed);
+    CHECK(!Update.ended);
+}
+
+static void testBootsOnlyAfterApply()
+{
+    setupServer();
+    OTAUpdater updater(server);
+    updater.setServer("updates.local", 80, imagePath);
+    updater.setRetryDelay(0);
+    CHECK(!updater.apply()); //nothing downloaded yet
+    CHECK(updater.run() == OTAUpdater::Success);
+    CHECK(imageIntact());
+    CHECK(updater.getState() == OTAUpdater::Ready);
+    CHECK(esp_ota_get_boot_partition() == esp_ota_get_running_partition());
+    CHECK(updater.apply());
+    CHECK(esp_ota_get_boot_partition() == esp_ota_get_next_update_partition(NULL));
+}
+
+static void testFailedUpdateCannotApply()
+{
+    setupServer();
+    server.faults.corruptAt = 200000;
+    OTAUpdater updater(server);
+    updater.setServer("updates.local", 80, imagePath);
+    updater.setRetryDelay(0);
+    CHECK(updater.run() == OTAUpdater::DigestMismatch);
+    CHECK(updater.getState() == OTAUpdater::Failed);
+    CHECK(!updater.apply());
+    CHECK(esp_ota_get_boot_partition() == esp_ota_get_running_partition());
+}
+
+static void testRateLimit()
+{
+    const uint32_t rate = 1000000;
+    setupServer();
+    OTAUpdater updater(server);
+    updater.setServer("updates.local", 80, imagePath);
+    updater.setRetryDelay(0);
+    updater.setRateLimit(rate);
+    uint32_t start = millis();
+    CHECK(updater.run() == OTAUpdater::Success);
+    uint32_t elapsed = millis() - start;
+    printf("  -> %u bytes in %u ms, %u bytes/s\n", updater.getBytesWritten(), elapsed, updater.getBytesPerSecond());
+    CHECK(imageIntact());
+    //up to 100ms of credit can be spent at the start, after that reads follow the limit
+    CHECK(elapsed + 100 >= image.size() * 1000 / rate);
+    CHECK(updater.getBytesPerSecond() <= rate + rate / 10);
+}
+
+static void testCancel()
+{
+    setupServer();
+    OTAUpdater updater(server);
+    updater.setServer("updates.local", 80, imagePath);
+    updater.setRetryDelay(0);
+    updater.setRateLimit(500000);
+    OTAUpdater::Result result = OTAUpdater::Success;
+    std::thread worker([&] { result = updater.run(); });
+    delay(200);
+    CHECK(updater.getState() == OTAUpdater::Downloading);
+    updater.cancel();
+    worker.join();
+    printf("  -> %s after %u bytes\n", OTAUpdater::getResultName(result), updater.getBytesWritten());
+    CHECK(result == OTAUpdater::Cancelled);
+    CHECK(updater.getBytesWritten() < image.size());
+    CHECK(!Update.ended);
+    CHECK(!Update.isRunning());
+    CHECK(!updater.apply());
+}
+
+int main()
+{
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"clean download", testCleanDownload},
+        {"truncated connections resume with Range", testTruncatedConnections},
+        {"throttled and truncated", testThrottledAndTruncated},
+        {"stalled connection times out and resumes", testStalledConnection},
+        {"server ignores Range", testServerIgnoresRange},
+        {"no digest file", testNoDigestFile},
+        {"corrupt image", testCorruptImage},
+        {"image too large", testImageTooLarge},
+        {"server unreachable", testServerUnreachable},
+        {"recovers after refused connections", testRecoversAfterRefusedConnections},
+        {"missing image", testMissingImage},
+        {"flash write failure", testFlashWriteFailure},
+        {"boot partition only switches on apply", testBootsOnlyAfterApply},
+        {"failed update cannot be applied", testFailedUpdateCannotApply},
+        {"rate limit", testRateLimit},
+        {"cancel", testCancel},
+    };
+
+    srand(1234);
+    image.resize(357280);
+    for (size_t i = 0; i < image.size(); i++) image[i] = rand();
+
+    for (auto &test : tests)
+    {
+        int before = failures;
+        printf("%s\n", test.name);
+        test.run();
+        printf("  %s\n", (failures == before) ? "ok" : "FAILED");
+    }
+    printf("%i check(s) failed\n", failures);
+    return failures ? 1 : 0;
+}
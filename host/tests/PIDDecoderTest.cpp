@@ -0,0 +1,171 @@
+/*
+ * PIDDecoderTest.cpp
+ *
+ * Tests for Mode 01 decoding and the stxdec/stxsub commands.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <cmath>
+#include "Check.h"
+#include "EcuSimulator.h"
+#include "ElmBench.h"
+#include "ELM327_Emulator.h"
+#include "Hal.h"
+#include "PIDDecoder.h"
+
+static bool near(float a, float b)
+{
+    return fabs(a - b) < 0.01f;
+}
+
+static CAN_FRAME response(uint32_t id, std::vector<uint8_t> data)
+{
+    CAN_FRAME frame;
+    frame.id = id;
+    frame.extended = 0;
+    frame.rtr = 0;
+    frame.length = 8;
+    data.insert(data.begin(), data.size());
+    data.resize(8, 0xAA);
+    for (int i = 0; i < 8; i++) frame.data.bytes[i] = data[i];
+    return frame;
+}
+
+static void testFormulas()
+{
+    uint32_t raw;
+    float value;
+    const uint8_t rpm[] = {0x1A, 0xF8};
+    CHECK(PIDDecoder::decode(0x0C, rpm, 2, raw, value) && raw == 0x1AF8 && near(value, 1726));
+    const uint8_t coolant[] = {0x7B};
+    CHECK(PIDDecoder::decode(0x05, coolant, 1, raw, value) && near(value, 83));
+    const uint8_t trim[] = {0x80};
+    CHECK(PIDDecoder::decode(0x06, trim, 1, raw, value) && near(value, 0));
+    const uint8_t evap[] = {0xFF, 0xFC}; //-4 * 0.25
+    CHECK(PIDDecoder::decode(0x32, evap, 2, raw, value) && near(value, -1));
+    const uint8_t o2[] = {0x64, 0x80}; //only A is the voltage
+    CHECK(PIDDecoder::decode(0x14, o2, 2, raw, value) && near(value, 0.5f));
+    CHECK(!PIDDecoder::decode(0x0C, rpm, 1, raw, value));  //too short
+    CHECK(!PIDDecoder::decode(0x90, rpm, 2, raw, value));  //not in the table
+    CHECK(PIDDecoder::getDefinition(0x00)->flags & PID_BITFIELD);
+    CHECK(!strcmp(PIDDecoder::getDefinition(0x0D)->unit, "km/h"));
+}
+
+static void testFrames()
+{
+    PIDDecoder decoder;
+    PIDValue values[3];
+    CAN_FRAME frame = response(0x7E8, {0x41, 0x0D, 0x3C, 0x0C, 0x1A, 0xF8});
+    CHECK(decoder.processFrame(frame, values, 3) == 2);
+    CHECK(values[0].pid == 0x0D && near(values[0].value, 60) && values[0].ecu == 0x7E8);
+    CHECK(values[1].pid == 0x0C && near(values[1].value, 1726));
+
+    frame = response(0x7E9, {0x41, 0x05, 0x7E});
+    CHECK(decoder.processFrame(frame, values, 3) == 1);
+    //a newer value replaces the old one for the same ECU
+    frame = response(0x7E8, {0x41, 0x0D, 0x3D});
+    CHECK(decoder.processFrame(frame, values, 3) == 1);
+    String text = decoder.toText("\r");
+    CHECK(text.length() == 52); //slot order follows the hash
+    CHECK(strstr(text.c_str(), "7E8 0C 1726.00 rpm\r") && strstr(text.c_str(), "7E8 0D 61.00 km/h\r"));
+    CHECK(decoder.toText("\r", 0x05) == "7E9 05 86.00 C\r");
+
+    //not Mode 01, not an ECU, a PID cut short
+    frame = response(0x7E8, {0x49, 0x0D, 0x3C});
+    CHECK(decoder.processFrame(frame, values, 3) == 0);
+    frame = response(0x123, {0x41, 0x0D, 0x3C});
+    CHECK(decoder.processFrame(frame, values, 3) == 0);
+    frame = response(0x7E8, {0x41, 0x0C, 0x1A});
+    CHECK(decoder.processFrame(frame, values, 3) == 0);
+}
+
+static void testCommandsAndFeed()
+{
+    EcuSimulator sim;
+    CHECK(sim.loadDefault());
+    sim.setDelay(0, 1000);
+    sim.attach(Hal::getDefaultCanBus());
+
+    ElmBench elm;
+    CHECK(elm.connect());
+    std::string reply;
+    uint32_t micros;
+    CHECK(elm.request("010c", reply, micros));
+    CHECK(elm.request("stxdec0c", reply, micros));
+    CHECK(reply == "7E8 0C 1726.00 rpm\rOK\r");
+    CHECK(elm.request("stxdec", reply, micros));
+    CHECK(reply.find("7E8 0C 1726.00 rpm\r") != std::string::npos);
+
+    //CSV feed of just speed: the RPM reply isn't fed, the speed one is
+    CHECK(elm.request("stxsubc,0d", reply, micros) && reply == "OK\r");
+    CHECK(elm.request("010c", reply, micros) && reply == "410C1AF8\r");
+    CHECK(elm.request("010d", reply, micros));
+    size_t comma = reply.find(',');
+    CHECK(comma != std::string::npos && reply.substr(comma) == ",7E8,0D,60.00\r410D3C\r");
+
+    //binary records
+    CHECK(elm.request("stxsubb", reply, micros));
+    CHECK(elm.request("0105", reply, micros));
+    CHECK(reply.size() == 12 + 7);
+    if (reply.size() == 19)
+    {
+        CHECK((uint8_t)reply[0] == PID_FEED_MAGIC && reply[1] == 0 && reply[2] == 0x05 && reply[3] == 0);
+        float value;
+        memcpy(&value, reply.data() + 4, 4);
+        CHECK(near(value, 83));
+        CHECK(reply.substr(12) == "41057B\r");
+    }
+    CHECK(elm.request("stxsub0", reply, micros) && reply == "OK\r");
+    CHECK(elm.request("0105", reply, micros) && reply == "41057B\r");
+    CHECK(elm.request("stxsubx", reply, micros) && reply == "?\r");
+    elm.disconnect();
+    sim.detach();
+}
+
+int main()
+{
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"formulas", testFormulas},
+        {"response frames", testFrames},
+        {"stxdec and stxsub", testCommandsAndFeed},
+    };
+
+    //keep clear of other instances and of anything already listening
+    Hal::setPortOffset(20000 + getpid() % 10000);
+
+    for (auto &test : tests)
+    {
+        int before = failures;
+        printf("%s\n", test.name);
+        test.run();
+        printf("  %s\n", (failures == before) ? "ok" : "FAILED");
+    }
+    printf("%i check(s) failed\n", failures);
+    fflush(stdout);
+    _exit(failures ? 1 : 0); //background tasks are still running
+}
@@ -0,0 +1,280 @@
+/*
+ * PIDPollerTest.cpp
+ *
+ * Tests for device side PID polling and the UDP value feed.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "Check.h"
+#include "EcuSimulator.h"
+#include "ElmBench.h"
+#include "ELM327_Emulator.h"
+#include "Hal.h"
+#include "PIDPoller.h"
+#include "SerialConsole.h"
+
+extern PIDPoller pidPoller;
+extern SerialConsole console;
+
+static EcuSimulator sim;
+static ElmBench elm;
+
+static bool command(const char *text)
+{
+    std::string reply;
+    uint32_t micros;
+    return elm.request(text, reply, micros) && reply == "OK\r";
+}
+
+static bool findStats(uint8_t pid, PollStats &stats)
+{
+    for (int i = 0; i < POLL_MAX_PIDS; i++)
+    {
+        if (pidPoller.getStats(i, stats) && stats.pid == pid) return true;
+    }
+    return false;
+}
+
+static void testPlan()
+{
+    CHECK(command("stxpollc"));
+    CHECK(command("stxpolla0c,100,2"));
+    CHECK(command("stxpolla0d,250"));
+    CHECK(!command("stxpolla00,100"));     //supported PID bitmap
+    CHECK(!command("stxpolla90,100"));     //not a PID the decoder knows
+    CHECK(!command("stxpolla0c,5"));       //below POLL_MIN_PERIOD
+    CHECK(!command("stxpolla0c,100,4"));   //priority out of range
+    CHECK(!command("stxpolli7f0"));
+    CHECK(command("stxpolli7e0"));
+
+    //the plan lives in settings so it's saved with them
+    int used = 0;
+    for (int i = 0; i < POLL_MAX_PIDS; i++)
+    {
+        PollPlanEntry &entry = settings.pollPlan[i];
+        if (!entry.periodMs) continue;
+        used++;
+        if (entry.pid == 0x0C) CHECK(entry.periodMs == 100 && entry.priority == 2);
+        if (entry.pid == 0x0D) CHECK(entry.periodMs == 250 && entry.priority == 1);
+    }
+    CHECK(used == 2);
+    CHECK(pidPoller.getDemand() == 14);
+
+    //changing a PID keeps its slot, removing frees it
+    CHECK(command("stxpolla0d,500,0"));
+    PollStats stats;
+    CHECK(findStats(0x0D, stats) && stats.periodMs == 500 && stats.priority == 0);
+    CHECK(command("stxpolld0d"));
+    CHECK(!findStats(0x0D, stats));
+    CHECK(!command("stxpolld0d"));
+
+    //the console sets the same plan
+    const char *line = "POLL=2f,1000,3\rPOLLBUDGET=7\r";
+    for (const char *c = line; *c; c++) console.rcvCharacter(*c);
+    CHECK(findStats(0x2F, stats) && stats.periodMs == 1000 && stats.priority == 3);
+    CHECK(settings.pollBudget == 7);
+    CHECK(command("stxpollc"));
+    CHECK(!findStats(0x0C, stats) && !findStats(0x2F, stats));
+}
+
+static void testPolling()
+{
+    CHECK(command("stxpollb50"));
+    CHECK(command("stxpolla0c,100,2"));
+    CHECK(command("stxpolla0d,100"));
+    CHECK(command("stxpolla05,500,0"));
+    pidPoller.resetStats();
+    uint32_t requestsBefore = sim.getRequests();
+    elm.receive(1050);
+    CHECK(command("stxpollb0"));
+    elm.receive(50);
+
+    PollStats rpm, speed, coolant;
+    CHECK(findStats(0x0C, rpm) && findStats(0x0D, speed) && findStats(0x05, coolant));
+    printf("  0C %u samples every %uus (%u-%u), 0D %u, 05 %u, %u requests\n", rpm.samples, rpm.intervalAvg,
+           rpm.intervalMin, rpm.intervalMax, speed.samples, coolant.samples, sim.getRequests() - requestsBefore);
+    CHECK(rpm.samples >= 9 && rpm.samples <= 12);
+    CHECK(rpm.intervalAvg > 90000 && rpm.intervalAvg < 110000);
+    CHECK(speed.samples >= 9 && coolant.samples >= 2 && coolant.samples <= 3);
+    CHECK(rpm.timeouts == 0 && rpm.missed == 0);
+    //PIDs due together go out together
+    CHECK(sim.getRequests() - requestsBefore < rpm.polls + speed.polls + coolant.polls);
+
+    //the answers were decoded like any others
+    std::string reply;
+    uint32_t micros;
+    CHECK(elm.request("stxdec0c", reply, micros) && reply == "7E8 0C 1726.00 rpm\rOK\r");
+    CHECK(elm.request("stxpolls", reply, micros) && reply.find("0C 100 2 ") == 0);
+    CHECK(command("stxpollc"));
+}
+
+//a budget too small for the plan goes to the higher priority PID
+static void testBudget()
+{
+    sim.setPID(0, 0x01, 0x24, {0x80, 0x00, 0x80, 0x00}); //too long to share a frame with 0C
+    CHECK(command("stxpollb10"));
+    CHECK(command("stxpolla0c,100,3"));
+    CHECK(command("stxpolla24,100,0"));
+    pidPoller.resetStats();
+    elm.receive(1000);
+    CHECK(command("stxpollb0"));
+    elm.receive(50);
+
+    PollStats rpm, lambda;
+    CHECK(findStats(0x0C, rpm) && findStats(0x24, lambda));
+    printf("  0C %u samples, 24 %u samples %u missed\n", rpm.samples, lambda.samples, lambda.missed);
+    CHECK(rpm.samples >= 8);
+    CHECK(lambda.samples <= 1 && lambda.missed >= 5);
+    CHECK(command("stxpollc"));
+}
+
+//client requests still get their own answers while the poller runs. The poller
+//waits for gaps between them and picks up its rate again afterward
+static void testSharedBus()
+{
+    CHECK(command("stxpollb50"));
+    CHECK(command("stxpolla0c,20,1"));
+    CHECK(command("stxpolla0d,20,1"));
+    elm.receive(100);
+    int good = 0;
+    for (int i = 0; i < 20; i++)
+    {
+        std::string reply;
+        uint32_t micros;
+        if (elm.request("0105", reply, micros) && reply == "41057B\r") good++;
+    }
+    CHECK(good == 20);
+    PollStats before, after;
+    CHECK(findStats(0x0C, before));
+    elm.receive(150);
+    CHECK(findStats(0x0C, after));
+    printf("  0C %u samples, %u after the client stopped, %u timeouts\n", before.samples, after.samples, after.timeouts);
+    CHECK(before.samples >= 4 && after.samples - before.samples >= 4 && after.timeouts == 0);
+    CHECK(command("stxpollb0"));
+    CHECK(command("stxpollc"));
+}
+
+//the simulated ECUs drop a request they're still working on when the next one
+//arrives. A client asking for the PID being polled must get the one answer
+static void testNewestRequestOnly()
+{
+    sim.setDelay(0, 15000);
+    CHECK(command("stxpollb100"));
+    CHECK(command("stxpolla0c,10,1"));
+    elm.receive(50);
+    int good = 0;
+    for (int i = 0; i < 10; i++)
+    {
+        std::string reply;
+        uint32_t micros;
+        if (elm.request("010c", reply, micros) && reply == "410C1AF8\r") good++;
+        elm.receive(5); //lets the poller get a request out in between
+    }
+    CHECK(good == 10);
+    CHECK(command("stxpollb0"));
+    CHECK(command("stxpollc"));
+    sim.setDelay(0, 1000);
+}
+
+static void testUDPFeed()
+{
+#ifndef BLUETOOTH
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(Hal::mapPort(4000));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    struct timeval timeout = {0, 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    CHECK(command("stxsubu4000"));
+    CHECK(command("stxpollb20"));
+    CHECK(command("stxpolla0c,100"));
+    int datagrams = 0;
+    bool wellFormed = true;
+    uint32_t start = millis();
+    while (millis() - start < 500)
+    {
+        elm.receive(10);
+        uint8_t buff[64];
+        ssize_t length;
+        while ((length = recv(fd, buff, sizeof(buff), 0)) > 0)
+        {
+            datagrams++;
+            if (length != 12 || buff[0] != PID_FEED_MAGIC || buff[1] != 0 || buff[2] != 0x0C) wellFormed = false;
+        }
+    }
+    CHECK(datagrams >= 4 && wellFormed);
+    CHECK(command("stxsubu0"));
+    CHECK(command("stxpollb0"));
+    CHECK(command("stxpollc"));
+    close(fd);
+#else
+    CHECK(!command("stxsubu4000"));
+#endif
+}
+
+int main()
+{
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"poll plan", testPlan},
+        {"polling", testPolling},
+        {"budget", testBudget},
+        {"client requests while polling", testSharedBus},
+        {"ECU answering only the newest request", testNewestRequestOnly},
+        {"UDP feed", testUDPFeed},
+    };
+
+    //keep clear of other instances and of anything already listening
+    Hal::setPortOffset(20000 + getpid() % 10000);
+
+    CHECK(sim.loadDefault());
+    sim.setDelay(0, 1000);
+    sim.setDelay(1, 1000);
+    sim.attach(Hal::getDefaultCanBus());
+    if (!elm.connect())
+    {
+        printf("Couldn't connect to the ELM327 port\n");
+        _exit(1);
+    }
+
+    for (auto &test : tests)
+    {
+        int before = failures;
+        printf("%s\n", test.name);
+        test.run();
+        printf("  %s\n", (failures == before) ? "ok" : "FAILED");
+    }
+    printf("%i check(s) failed\n", failures);
+    fflush(stdout);
+    _exit(failures ? 1 : 0); //background tasks are still running
+}
@@ -0,0 +1,347 @@
+/*
+ * PlayerTest.cpp
+ *
+ * Checks log playback: uploaded frames go out in order with their gaps scaled
+ * by the speed, ID filters, loop mode, playing the flight recording, and the
+ * ELM and GVRET controls. Timing is only checked against bounds that hold
+ * whatever the host scheduler does, widened by the jitter the player reports.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Check.h"
+#include "Frames.h"
+#include "Player.h"
+#include "Recorder.h"
+#include "ElmBench.h"
+#include "Hal.h"
+
+extern Player player;
+extern Recorder recorder;
+
+static ElmBench elm;
+
+//what the player puts on the bus, with when it arrived
+struct Listener : public CanNode {
+    std::mutex lock;
+    std::vector<CAN_FRAME> frames;
+    std::vector<uint32_t> times;
+
+    void frameReceived(const CAN_FRAME &frame) override
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        frames.push_back(frame);
+        times.push_back(micros());
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        frames.clear();
+        times.clear();
+    }
+
+    uint32_t span()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return times.empty() ? 0 : times.back() - times.front();
+    }
+};
+
+static Listener listener;
+
+//count frames gapMicros apart: IDs 0x100-0x103 in turn with the index in byte 0
+static void uploadFrames(int count, uint32_t gapMicros)
+{
+    player.clearUpload();
+    for (int i = 0; i < count; i++)
+    {
+        CAN_FRAME frame = makeFrame(0x100 + i % 4, false, {(uint8_t)i, 0x55});
+        //times that wrap around on the way are fine
+        CHECK(player.addUpload(frame, 0xFFFF0000ul + i * gapMicros));
+    }
+}
+
+static void waitDone(uint32_t ms)
+{
+    uint32_t start = millis();
+    while (player.isPlaying() && millis() - start < ms) elm.receive(2);
+    CHECK(!player.isPlaying());
+    elm.receive(5);
+}
+
+static bool inOrder(int count, int step)
+{
+    std::lock_guard<std::mutex> guard(listener.lock);
+    if ((int)listener.frames.size() != count) return false;
+    for (int i = 0; i < count; i++)
+        if (listener.frames[i].data.bytes[0] != i * step || listener.frames[i].id != 0x100 + (uint32_t)(i * step) % 4) return false;
+    return true;
+}
+
+static void testTiming()
+{
+    std::string reply;
+    uint32_t micros;
+    PlayerStats stats;
+
+    uploadFrames(40, 3000);
+    listener.clear();
+    CHECK(elm.request("stxplayu100", reply, micros) && reply == "OK\r");
+    waitDone(3000);
+    player.getStats(stats);
+    uint32_t span = listener.span();
+    printf("  40 frames 3ms apart took %.1fms, jitter avg %ius max %ius\n", span / 1000.0, stats.jitterAvg, stats.jitterMax);
+    CHECK(inOrder(40, 1) && stats.sent == 40 && stats.filtered == 0 && stats.underruns == 0);
+    //no frame goes out early, so the span is only short by how late the first one was
+    CHECK(span + stats.jitterMax + 1000 >= 39 * 3000);
+
+    //twice as fast, the span is only long by how late the last one was
+    listener.clear();
+    CHECK(elm.request("stxplayu200", reply, micros) && reply == "OK\r");
+    waitDone(3000);
+    player.getStats(stats);
+    span = listener.span();
+    printf("  at 200%% %.1fms, jitter avg %ius max %ius\n", span / 1000.0, stats.jitterAvg, stats.jitterMax);
+    CHECK(inOrder(40, 1) && span + stats.jitterMax + 1000 >= 39 * 1500 && span <= 39 * 1500 + stats.jitterMax + 10000);
+
+    CHECK(elm.request("stxplayu0", reply, micros) && reply == "?\r");
+    CHECK(elm.request("stxplayl", reply, micros) && reply.find("STOPPED 40 40 0 0 ") == 0);
+}
+
+static void testFilters()
+{
+    std::string reply;
+    uint32_t micros;
+    PlayerStats stats;
+
+    uploadFrames(40, 500);
+    CHECK(elm.request("stxplayf100,7ff", reply, micros) && reply == "0\rOK\r");
+    listener.clear();
+    CHECK(elm.request("stxplayu1000", reply, micros) && reply == "OK\r");
+    waitDone(3000);
+    player.getStats(stats);
+    CHECK(inOrder(10, 4) && stats.sent == 10 && stats.filtered == 30);
+
+    //0x100-0x103 but not 0x102, the first filter is gone
+    CHECK(elm.request("stxplayc", reply, micros) && reply == "OK\r");
+    CHECK(elm.request("stxplayf100,7fc", reply, micros) && reply == "0\rOK\r");
+    CHECK(elm.request("stxplayf102,7ff,x", reply, micros) && reply == "1\rOK\r");
+    //a 29 bit filter doesn't take 11 bit IDs
+    CHECK(elm.request("stxplayf00000100,1fffffff", reply, micros) && reply == "2\rOK\r");
+    CHECK(elm.request("stxplayl", reply, micros) && reply.find("0 100 7FC\r1 102 7FF X\r2 100 1FFFFFFF\rSTOPPED") == 0);
+    listener.clear();
+    CHECK(elm.request("stxplayu1000", reply, micros) && reply == "OK\r");
+    waitDone(3000);
+    player.getStats(stats);
+    CHECK(stats.sent == 30 && stats.filtered == 10);
+    {
+        std::lock_guard<std::mutex> guard(listener.lock);
+        bool noneExcluded = listener.frames.size() == 30;
+        for (auto &frame : listener.frames) noneExcluded &= frame.id != 0x102;
+        CHECK(noneExcluded);
+    }
+
+    //filters that leave nothing end the playback, in loop mode as well
+    CHECK(elm.request("stxplayc", reply, micros) && reply == "OK\r");
+    CHECK(elm.request("stxplayf200,7ff", reply, micros) && reply == "0\rOK\r");
+    CHECK(elm.request("stxplayu100,l", reply, micros) && reply == "OK\r");
+    waitDone(3000);
+    player.getStats(stats);
+    CHECK(stats.sent == 0 && stats.filtered == 40);
+    CHECK(elm.request("stxplayc", reply, micros) && reply == "OK\r");
+}
+
+static void testLoop()
+{
+    std::string reply;
+    uint32_t micros;
+    PlayerStats stats;
+
+    uploadFrames(4, 1000);
+    listener.clear();
+    CHECK(elm.request("stxplayu100,l", reply, micros) && reply == "OK\r");
+    uint32_t start = millis();
+    do
+    {
+        elm.receive(5);
+        player.getStats(stats);
+    } while (stats.sent < 14 && millis() - start < 5000);
+    CHECK(player.isPlaying());
+    CHECK(elm.request("stxplays", reply, micros) && reply == "OK\r");
+    elm.receive(5);
+    player.getStats(stats);
+    CHECK(!player.isPlaying() && stats.sent >= 14 && stats.loops >= 3);
+
+    std::lock_guard<std::mutex> guard(listener.lock);
+    bool cycles = listener.frames.size() == stats.sent;
+    for (size_t i = 0; i < listener.frames.size(); i++) cycles &= listener.frames[i].data.bytes[0] == i % 4;
+    CHECK(cycles);
+    //the passes are PLAYBACK_LOOP_GAP_MS apart
+    CHECK(listener.times.size() > 4 && listener.times[4] - listener.times[3] + stats.jitterMax + 1000 >= PLAYBACK_LOOP_GAP_MS * 1000);
+}
+
+static void testRecording()
+{
+    std::string reply;
+    uint32_t micros;
+    PlayerStats stats;
+
+    CHECK(Hal::setPartitionSize(RECORDER_PARTITION, 0x13F000));
+    recorder.setup();
+    CHECK(elm.request("stxplayr0,100", reply, micros) && reply == "?\r");
+
+    std::vector<CAN_FRAME> sent;
+    for (int i = 0; i < 20; i++)
+    {
+        CAN_FRAME frame = makeFrame((i & 1) ? 0x18FEF100 : 0x3F0, i & 1, {(uint8_t)i, 0, 0, 0, 0, 0, 0, 0});
+        sent.push_back(frame);
+        Hal::getDefaultCanBus().send(NULL, frame);
+        elm.receive(2);
+    }
+    listener.clear();
+    CHECK(elm.request("stxplayr0,500", reply, micros) && reply == "OK\r");
+    waitDone(3000);
+    player.getStats(stats);
+    CHECK(stats.sent == sent.size());
+    std::lock_guard<std::mutex> guard(listener.lock);
+    bool same = listener.frames.size() == sent.size();
+    for (size_t i = 0; same && i < sent.size(); i++)
+        same = listener.frames[i].id == sent[i].id && listener.frames[i].extended == sent[i].extended &&
+               listener.frames[i].data.value == sent[i].data.value;
+    CHECK(same);
+}
+
+#ifndef BLUETOOTH
+//the F1 2A answers that came in within the time, playing uploaded sent late avg max
+static std::vector<std::vector<uint32_t>> readStatus(WiFiClient &client, uint32_t ms)
+{
+    std::vector<CAN_FRAME> frames;
+    std::vector<std::vector<uint8_t>> replies;
+    std::vector<std::vector<uint32_t>> answers;
+    readGvret(elm, client, ms, frames, replies);
+    for (auto &reply : replies)
+    {
+        if (reply[1] != PROTO_PLAYBACK) continue;
+        const uint8_t *p = &reply[2];
+        std::vector<uint32_t> answer = {p[0], (uint32_t)(p[1] | p[2] << 8)};
+        for (int i = 3; i < 19; i += 4) answer.push_back(p[i] | p[i + 1] << 8 | p[i + 2] << 16 | (uint32_t)p[i + 3] << 24);
+        answers.push_back(answer);
+    }
+    return answers;
+}
+
+static void control(WiFiClient &client, uint8_t op, uint16_t speed, uint8_t flags)
+{
+    const uint8_t request[] = {0xF1, PROTO_PLAYBACK, op, (uint8_t)speed, (uint8_t)(speed >> 8), 0, 0, flags, 0};
+    client.write(request, sizeof(request));
+}
+#endif
+
+static void testGvret()
+{
+#ifndef BLUETOOTH
+    WiFiClient client;
+    uint32_t start = millis();
+    while (millis() - start < 2000 && !client.connect("127.0.0.1", Hal::mapPort(23))) elm.receive(1);
+    CHECK(client.connected());
+    readStatus(client, 100);
+
+    control(client, 4, 0, 0);
+    for (int i = 0; i < 3; i++)
+    {
+        //time, 29 bit ID 0x18DB33F1, bus 0, 3 bytes, checksum
+        const uint8_t upload[] = {0xF1, PROTO_PLAYBACK_UPLOAD, (uint8_t)(i * 2), 0x10, 0, 0, 0xF1, 0x33, 0xDB, 0x98, 0, 3,
+                                  0x02, 0x01, (uint8_t)i, 0};
+        client.write(upload, sizeof(upload));
+    }
+    control(client, 0, 0, 0);
+    std::vector<std::vector<uint32_t>> answers = readStatus(client, 100);
+    CHECK(answers.size() == 2 && answers[0][1] == 0 && answers[1][0] == 0 && answers[1][1] == 3);
+
+    listener.clear();
+    control(client, 1, 100, 0);
+    answers = readStatus(client, 100);
+    CHECK(answers.size() == 1 && answers[0][0] == 1);
+    waitDone(3000);
+    control(client, 0, 0, 0);
+    answers = readStatus(client, 100);
+    CHECK(answers.size() == 1 && answers[0][0] == 0 && answers[0][2] == 3);
+    {
+        std::lock_guard<std::mutex> guard(listener.lock);
+        CHECK(listener.frames.size() == 3 && listener.frames[2].id == 0x18DB33F1 && listener.frames[2].extended &&
+              listener.frames[2].length == 3 && listener.frames[2].data.bytes[2] == 2);
+    }
+
+    //a loop stopped over GVRET
+    control(client, 1, 100, 1);
+    elm.receive(50);
+    control(client, 3, 0, 0);
+    answers = readStatus(client, 100);
+    CHECK(answers.size() == 2 && answers[0][0] == 1 && answers[1][0] == 0 && !player.isPlaying());
+    control(client, 4, 0, 0);
+    answers = readStatus(client, 100);
+    CHECK(answers.size() == 1 && answers[0][1] == 0);
+    client.stop();
+    elm.receive(10);
+#endif
+}
+
+int main()
+{
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"timing and speed", testTiming},
+        {"ID filters", testFilters},
+        {"loop mode", testLoop},
+        {"flight recording", testRecording},
+        {"GVRET control", testGvret},
+    };
+
+    //keep clear of other instances and of anything already listening
+    Hal::setPortOffset(20000 + getpid() % 10000);
+
+    if (!elm.connect())
+    {
+        printf("Couldn't connect to the ELM327 port\n");
+        _exit(1);
+    }
+    Hal::getDefaultCanBus().attach(&listener);
+
+    for (auto &test : tests)
+    {
+        int before = failures;
+        printf("%s\n", test.name);
+        test.run();
+        printf("  %s\n", (failures == before) ? "ok" : "FAILED");
+    }
+    printf("%i check(s) failed\n", failures);
+    fflush(stdout);
+    _exit(failures ? 1 : 0); //background tasks are still running
+}
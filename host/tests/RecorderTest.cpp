@@ -0,0 +1,376 @@
+/*
+ * RecorderTest.cpp
+ *
+ * Checks the flight recorder: frames read back the way they were recorded,
+ * windows found through the time index, the log wrapping around, restarts and
+ * cut short writes, and the exports on the GVRET port and the console.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "Check.h"
+#include "Frames.h"
+#include "Recorder.h"
+#include "FrameTable.h"
+#include "SerialConsole.h"
+#include "ElmBench.h"
+#include "Hal.h"
+
+extern Recorder recorder;
+extern SerialConsole console;
+
+static ElmBench elm;
+//big enough to keep off the stack
+static Recorder rec;
+static FrameTable table;
+static RecorderCursor cursor;
+
+struct Recorded {
+    CAN_FRAME frame;
+    uint64_t time;
+};
+
+//a bit of everything: counters, a DLC that shrinks, 29 bit IDs, remote frames and IDs the table doesn't have
+static CAN_FRAME sampleFrame(int i)
+{
+    CAN_FRAME frame;
+    switch (i % 5)
+    {
+        case 0:
+            frame = makeFrame(0x100, false, {(uint8_t)i, 1, 2, 3, 4, 5, 6, 7});
+            break;
+        case 1:
+            frame = makeFrame(0x18FEF100, true, {0, 0, (uint8_t)(i >> 4), (uint8_t)i, 0, 0, 0, 0});
+            break;
+        case 2:
+            frame = makeFrame(0x7FF, false, counting(i * 7, 8 - (i / 5) % 6));
+            break;
+        case 3:
+            frame = makeFrame(0x123, false, std::vector<uint8_t>(4));
+            frame.rtr = 1;
+            break;
+        case 4:
+            frame = makeFrame(0x500 + i % 64, false, {0xAA, 0, 0});
+            break;
+    }
+    return frame;
+}
+
+//retried after a short wait if the writer task still has all chunks, so nothing is dropped
+static void record(Recorder &recorder, CAN_FRAME &frame, bool inTable)
+{
+    RecorderStats stats;
+    for (;;)
+    {
+        recorder.getStats(stats);
+        uint32_t drops = stats.drops;
+        recorder.processFrame(frame, inTable ? table.processFrame(frame) : -1);
+        recorder.getStats(stats);
+        if (stats.drops == drops) return;
+        delay(2);
+    }
+}
+
+//count frames gapMicros apart, from a little after the current time
+static std::vector<CAN_FRAME> recordFrames(Recorder &recorder, int first, int count, uint32_t gapMicros)
+{
+    std::vector<CAN_FRAME> sent;
+    uint32_t stamp = micros() + 1000;
+    for (int i = first; i < first + count; i++)
+    {
+        CAN_FRAME frame = sampleFrame(i);
+        frame.timestamp = stamp;
+        stamp += gapMicros;
+        record(recorder, frame, i % 5 != 4);
+        sent.push_back(frame);
+    }
+    return sent;
+}
+
+static std::vector<Recorded> exportFrames(Recorder &recorder, uint32_t seconds)
+{
+    std::vector<Recorded> frames;
+    Recorded recorded;
+    uint32_t start = millis();
+
+    if (!recorder.startExport(cursor, seconds)) return frames;
+    for (;;)
+    {
+        Recorder::ReadResult result = recorder.next(cursor, recorded.frame, recorded.time);
+        if (result == Recorder::Done) break;
+        if (result == Recorder::Wait)
+        {
+            if (millis() - start > 5000)
+            {
+                CHECK(!"export never finished");
+                break;
+            }
+            delay(1);
+            continue;
+        }
+        frames.push_back(recorded);
+    }
+    CHECK(cursor.frames == frames.size());
+    return frames;
+}
+
+static bool sameFrame(const CAN_FRAME &a, const CAN_FRAME &b)
+{
+    if (a.id != b.id || !a.extended != !b.extended || !a.rtr != !b.rtr || a.length != b.length) return false;
+    return a.rtr || !memcmp(a.data.bytes, b.data.bytes, a.length);
+}
+
+//the exported frames are the last ones sent, at the same distances from each other
+static bool matchesTail(const std::vector<Recorded> &exported, const std::vector<CAN_FRAME> &sent)
+{
+    if (exported.empty() || exported.size() > sent.size()) return false;
+    size_t skip = sent.size() - exported.size();
+    for (size_t i = 0; i < exported.size(); i++)
+    {
+        if (!sameFrame(exported[i].frame, sent[skip + i])) return false;
+        if (exported[i].time - exported[0].time != sent[skip + i].timestamp - sent[skip].timestamp) return false;
+    }
+    return true;
+}
+
+static void testRoundTrip()
+{
+    RecorderStats stats;
+    table.clear();
+    rec.setup();
+    CHECK(exportFrames(rec, 0).empty());
+
+    std::vector<CAN_FRAME> sent = recordFrames(rec, 0, 3000, 500);
+    std::vector<Recorded> exported = exportFrames(rec, 0);
+    CHECK(exported.size() == sent.size() && matchesTail(exported, sent));
+
+    rec.getStats(stats);
+    printf("  %i frames, %i retried, %i blocks, %i erases\n", stats.frames, stats.drops, stats.blocks, stats.erases);
+    CHECK(stats.frames == 3000 && stats.blocks > 1 && stats.blocks == stats.erases);
+    CHECK(stats.newestTime == exported.back().time && stats.oldestTime <= exported.front().time);
+    float perFrame = (float)stats.flashBytes / stats.frames;
+    printf("  %.2f record bytes, %.2f flash bytes per frame, 20 as GVRET\n", (float)stats.recordBytes / stats.frames, perFrame);
+    CHECK(perFrame < 10);
+    //what that comes to for the whole partition at 2000 frames per second
+    float tripSeconds = stats.sectors * RECORDER_SECTOR_SIZE / (perFrame * 2000);
+    printf("  at 2000 frames/s: %.0fs recorded, each sector erased %.0f times a day\n", tripSeconds, 86400 / tripSeconds);
+}
+
+static void testWindow()
+{
+    //30 seconds of recording time, the last 5 of them are 500 frames
+    table.clear();
+    rec.setup();
+    std::vector<CAN_FRAME> sent = recordFrames(rec, 0, 3000, 10000);
+    std::vector<Recorded> exported = exportFrames(rec, 5);
+    printf("  %i frames in the last 5s\n", (int)exported.size());
+    CHECK(exported.size() == 501 && matchesTail(exported, sent));
+    CHECK(exportFrames(rec, 1).size() == 101);
+    //the session before is further back
+    CHECK(exportFrames(rec, 29).size() == 2901);
+}
+
+static void testWrap()
+{
+    RecorderStats stats;
+    CHECK(Hal::setPartitionSize(RECORDER_PARTITION, RECORDER_OFFSET + 4 * RECORDER_SECTOR_SIZE));
+    table.clear();
+    rec.setup();
+    std::vector<CAN_FRAME> sent = recordFrames(rec, 0, 5000, 500);
+    std::vector<Recorded> exported = exportFrames(rec, 0);
+    rec.getStats(stats);
+    printf("  %i of %i frames kept in %i blocks after %i erases\n", (int)exported.size(), (int)sent.size(), stats.blocks, stats.erases);
+    CHECK(stats.sectors == 4 && stats.blocks == 4 && stats.erases > 4);
+    CHECK(exported.size() > 1000 && exported.size() < sent.size() && matchesTail(exported, sent));
+}
+
+static void testRestart()
+{
+    RecorderStats stats;
+    table.clear();
+    CHECK(Hal::setPartitionSize(RECORDER_PARTITION, RECORDER_OFFSET + 4 * RECORDER_SECTOR_SIZE));
+    rec.setup();
+    rec.getStats(stats);
+    CHECK(stats.session == 1 && stats.blocks == 0);
+    std::vector<CAN_FRAME> sent = recordFrames(rec, 0, 100, 1000);
+    rec.flush();
+
+    //what is in flash is found again and this session's time carries on a second after it
+    rec.setup();
+    rec.getStats(stats);
+    std::vector<Recorded> before = exportFrames(rec, 0);
+    CHECK(stats.session == 2 && stats.blocks == 1 && before.size() == 100 && matchesTail(before, sent));
+    CHECK(stats.newestTime == before.back().time);
+
+    //a reset in the middle of writing a chunk leaves it out and nothing else
+    Hal::setFlashWriteLimit(sizeof(uint32_t) * 6 + 10);
+    recordFrames(rec, 100, 100, 1000);
+    rec.flush();
+    rec.setup();
+    Hal::setFlashWriteLimit(-1);
+    rec.getStats(stats);
+    std::vector<Recorded> after = exportFrames(rec, 0);
+    CHECK(stats.session == 3 && stats.blocks == 2 && after.size() == 100 && matchesTail(after, sent));
+
+    std::vector<CAN_FRAME> more = recordFrames(rec, 200, 10, 1000);
+    after = exportFrames(rec, 0);
+    CHECK(after.size() == 110 && after[100].time >= before.back().time + 1000000 && sameFrame(after[109].frame, more[9]));
+    CHECK(Hal::setPartitionSize(RECORDER_PARTITION, 0x13F000));
+}
+
+#ifndef BLUETOOTH
+//frame count in the last F1 27 reply, -1 without one
+static int replyCount(const std::vector<std::vector<uint8_t>> &replies)
+{
+    int count = -1;
+    for (auto &reply : replies)
+    {
+        if (reply[1] == PROTO_GET_RECORDING) count = reply[2] | reply[3] << 8 | reply[4] << 16 | reply[5] << 24;
+    }
+    return count;
+}
+#endif
+
+//what the console prints while the command runs
+static std::string consoleOutput(const char *command, uint32_t ms)
+{
+    char path[] = "/tmp/recordertestXXXXXX";
+    int fd = mkstemp(path);
+    fflush(stdout);
+    int saved = dup(1);
+    dup2(fd, 1);
+    for (const char *c = command; *c; c++) console.rcvCharacter(*c);
+    elm.receive(ms);
+    fflush(stdout);
+    dup2(saved, 1);
+    close(saved);
+
+    std::string output;
+    char buffer[4096];
+    ssize_t length;
+    lseek(fd, 0, SEEK_SET);
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0) output.append(buffer, length);
+    close(fd);
+    unlink(path);
+    return output;
+}
+
+static void testExports()
+{
+    //the sketch's recorder, on the empty partition the last test left
+    recorder.setup();
+#ifndef BLUETOOTH
+    WiFiClient client;
+    uint32_t start = millis();
+    while (millis() - start < 2000 && !client.connect("127.0.0.1", Hal::mapPort(23))) elm.receive(1);
+    CHECK(client.connected());
+    std::vector<CAN_FRAME> frames;
+    std::vector<std::vector<uint8_t>> replies;
+    const uint8_t request[] = {0xF1, PROTO_GET_RECORDING, 0, 0, 0};
+    client.write(request, sizeof(request));
+    readGvret(elm, client, 100, frames, replies);
+    CHECK(frames.empty() && replyCount(replies) == 0);
+#endif
+
+    std::vector<CAN_FRAME> sent;
+    for (int i = 0; i < 40; i++)
+    {
+        sent.push_back(sampleFrame(i));
+        Hal::getDefaultCanBus().send(NULL, sent.back());
+        elm.receive(1);
+    }
+
+#ifndef BLUETOOTH
+    //the frames went out live as well, then come again from the recording
+    frames.clear();
+    replies.clear();
+    readGvret(elm, client, 100, frames, replies);
+    CHECK(frames.size() == sent.size());
+    frames.clear();
+    client.write(request, sizeof(request));
+    readGvret(elm, client, 200, frames, replies);
+    CHECK(frames.size() == sent.size() && replyCount(replies) == (int)sent.size());
+    for (size_t i = 0; i < frames.size() && i < sent.size(); i++)
+    {
+        //GVRET frames have no RTR flag
+        sent[i].rtr = 0;
+        CHECK(sameFrame(frames[i], sent[i]));
+    }
+    client.stop();
+    elm.receive(10);
+#endif
+
+    std::string dump = consoleOutput("RECDUMP=0\r", 200);
+    size_t lines = 0;
+    for (size_t pos = dump.find(") can0 "); pos != std::string::npos; pos = dump.find(") can0 ", pos + 1)) lines++;
+    CHECK(lines == sent.size() && dump.find("40 recorded frames") != std::string::npos);
+    CHECK(dump.find(" can0 100#0001020304050607") != std::string::npos && dump.find(" can0 100#0501020304050607") != std::string::npos);
+    CHECK(dump.find(" can0 18FEF100#0000000100000000") != std::string::npos && dump.find(" can0 123#R") != std::string::npos);
+
+    //switched off nothing more is recorded
+    RecorderStats stats;
+    consoleOutput("RECORD=0\r", 10);
+    Hal::getDefaultCanBus().send(NULL, sent[0]);
+    elm.receive(20);
+    recorder.getStats(stats);
+    CHECK(stats.frames == sent.size());
+    consoleOutput("RECORD=1\r", 10);
+    CHECK(consoleOutput("RECSTATUS\r", 10).find("Flight recorder on") != std::string::npos);
+}
+
+int main()
+{
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"round trip", testRoundTrip},
+        {"time window", testWindow},
+        {"wrap around", testWrap},
+        {"restart and cut short writes", testRestart},
+        {"GVRET and console exports", testExports},
+    };
+
+    //keep clear of other instances and of anything already listening
+    Hal::setPortOffset(20000 + getpid() % 10000);
+
+    if (!elm.connect())
+    {
+        printf("Couldn't connect to the ELM327 port\n");
+        _exit(1);
+    }
+
+    for (auto &test : tests)
+    {
+        int before = failures;
+        printf("%s\n", test.name);
+        test.run();
+        printf("  %s\n", (failures == before) ? "ok" : "FAILED");
+    }
+    printf("%i check(s) failed\n", failures);
+    fflush(stdout);
+    _exit(failures ? 1 : 0); //background tasks are still running
+}
@@ -0,0 +1,314 @@
+/*
+ * SettingsStoreTest.cpp
+ *
+ * Host tests for the settings store against the in-memory flash: slot rotation,
+ * the single sector fallback, CRC and torn write recovery and migration of records
+ * written by older layouts.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <esp_partition.h>
+#include <unistd.h>
+#include "Check.h"
+#include "Hal.h"
+#include "Metrics.h"
+#include "SettingsStore.h"
+
+//what SettingsStore writes ahead of every record
+struct TestHeader {
+    uint32_t magic;
+    uint32_t sequence;
+    uint16_t version;
+    uint16_t length;
+    uint32_t crc;
+};
+
+static const esp_partition_t *partition(const char *label = SETTINGS_PARTITION)
+{
+    return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t length)
+{
+    crc = ~crc;
+    while (length--)
+    {
+        crc ^= *data++;
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0xEDB88320ul & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
+
+//a record the way older firmware would have left it, in the settings sectors unless told otherwise
+static void storeRecord(uint32_t slot, uint32_t sequence, uint16_t version, const void *payload, uint16_t length,
+                        const char *label = SETTINGS_PARTITION, uint32_t base = SETTINGS_OFFSET)
+{
+    TestHeader header = {0x54455341, sequence, version, length, 0};
+    header.crc = crc32(crc32(0, (uint8_t *)&header, offsetof(TestHeader, crc)), (const uint8_t *)payload, length);
+    esp_partition_write(partition(label), base + slot * SETTINGS_SLOT_SIZE + sizeof(header), payload, length);
+    esp_partition_write(partition(label), base + slot * SETTINGS_SLOT_SIZE, &header, sizeof(header));
+}
+
+//a blank settings area and no records of older builds
+static void eraseFlash()
+{
+    CHECK(Hal::setPartitionSize(SETTINGS_PARTITION, RECORDER_OFFSET + SPI_FLASH_SEC_SIZE));
+    CHECK(Hal::setPartitionSize(SETTINGS_OLD_PARTITION, SPI_FLASH_SEC_SIZE));
+}
+
+static uint32_t erases()
+{
+    for (Metric *metric = Metric::getFirst(); metric; metric = metric->getNext())
+    {
+        if (!strcmp(metric->getName(), "settings.erases")) return ((MetricCounter *)metric)->get();
+    }
+    return 0;
+}
+
+//what a reboot sees. Stores are never freed since their background task keeps running. Anything
+//begin() marks dirty is written right away so that task has nothing left to do
+static SettingsStore *reboot(SettingsStore::LoadResult &result)
+{
+    SettingsStore *store = new SettingsStore();
+    result = store->begin();
+    store->commitNow();
+    return store;
+}
+
+static SettingsStore *freshFlash()
+{
+    SettingsStore::LoadResult result;
+    eraseFlash();
+    SettingsStore *store = reboot(result);
+    CHECK(result == SettingsStore::Defaults);
+    return store;
+}
+
+static void change(SettingsStore *store, uint32_t speed)
+{
+    settings.CAN0Speed = speed;
+    store->markDirty();
+    store->commitNow();
+}
+
+static uint32_t speedAfterReboot(SettingsStore::LoadResult expected = SettingsStore::Loaded)
+{
+    SettingsStore::LoadResult result;
+    settings.CAN0Speed = 0;
+    reboot(result);
+    CHECK(result == expected);
+    return settings.CAN0Speed;
+}
+
+static void testRotation()
+{
+    SettingsStore *store = freshFlash();
+    CHECK(store->getSlotCount() == 2 * SPI_FLASH_SEC_SIZE / SETTINGS_SLOT_SIZE);
+
+    //the defaults went into slot 0. Another lap and a bit erases sector 1, then sector 0 again
+    uint32_t before = erases();
+    for (uint32_t i = 1; i <= store->getSlotCount() + 4; i++) change(store, 1000 * i);
+    CHECK(erases() - before == 2);
+    CHECK(speedAfterReboot() == 1000 * (store->getSlotCount() + 4));
+
+    //the signal definitions before the two sectors and the recording after them are left alone
+    uint8_t signals[4], recording[4];
+    esp_partition_read(partition(), SETTINGS_OFFSET - sizeof(signals), signals, sizeof(signals));
+    esp_partition_read(partition(), RECORDER_OFFSET, recording, sizeof(recording));
+    CHECK(!memcmp(signals, "\xFF\xFF\xFF\xFF", 4) && !memcmp(recording, "\xFF\xFF\xFF\xFF", 4));
+}
+
+static void testOldPartition()
+{
+    //records older builds spread over the single 'eeprom' sector are picked up and moved
+    eraseFlash();
+    EEPROMSettings stored = settings;
+    stored.CAN0Speed = 33333;
+    storeRecord(3, 7, EEPROM_VER, &stored, sizeof(stored), SETTINGS_OLD_PARTITION, 0);
+    stored.CAN0Speed = 44444;
+    storeRecord(2, 6, EEPROM_VER, &stored, sizeof(stored), SETTINGS_OLD_PARTITION, 0);
+    CHECK(speedAfterReboot(SettingsStore::Migrated) == 33333);
+    CHECK(speedAfterReboot() == 33333);
+
+    //from then on the settings sectors are what counts
+    SettingsStore::LoadResult result;
+    SettingsStore *store = reboot(result);
+    change(store, 125000);
+    CHECK(speedAfterReboot() == 125000);
+}
+
+static void testNeverEraseCurrent()
+{
+    SettingsStore *store = freshFlash();
+    change(store, 250000);
+
+    //nothing verifies, so the attempts wrap around to the sector holding the current record
+    Hal::setFlashWriteLimit(0);
+    change(store, 125000);
+    Hal::setFlashWriteLimit(-1);
+    CHECK(speedAfterReboot() == 250000);
+}
+
+static void testCrcRejection()
+{
+    SettingsStore *store = freshFlash();
+    change(store, 250000);  //slot 1
+    change(store, 125000);  //slot 2
+
+    uint8_t zero = 0;
+    esp_partition_write(partition(), SETTINGS_OFFSET + 2 * SETTINGS_SLOT_SIZE + sizeof(TestHeader) + offsetof(EEPROMSettings, CAN0Speed), &zero, 1);
+    CHECK(speedAfterReboot() == 250000);
+}
+
+static void testTornWrite()
+{
+    SettingsStore *store = freshFlash();
+    change(store, 250000);
+
+    //cut off in the payload, so no header made it
+    Hal::setFlashWriteLimit(100);
+    change(store, 125000);
+    Hal::setFlashWriteLimit(-1);
+    CHECK(speedAfterReboot() == 250000);
+
+    //cut off in the header after the magic
+    store = freshFlash();
+    change(store, 250000);
+    Hal::setFlashWriteLimit(sizeof(EEPROMSettings) + 6);
+    change(store, 125000);
+    Hal::setFlashWriteLimit(-1);
+    SettingsStore::LoadResult result;
+    store = reboot(result);
+    CHECK(result == SettingsStore::Loaded && settings.CAN0Speed == 250000);
+
+    //the next write skips the half written slot
+    change(store, 500000);
+    CHECK(speedAfterReboot() == 500000);
+}
+
+static void testStoreDefaults()
+{
+    //what the console's R does: the settings in use stay until the next boot
+    SettingsStore *store = freshFlash();
+    change(store, 250000);
+    store->storeDefaults();
+    CHECK(settings.CAN0Speed == 250000);
+    CHECK(speedAfterReboot() == 500000);
+}
+
+//a full sized record of the given layout version, with junk past the fields that version had
+static void storeOldRecord(uint16_t version)
+{
+    EEPROMSettings old;
+    memset(&old, 0x5A, sizeof(old));
+    old.version = version;
+    old.CAN0Speed = 250000;
+    strcpy(old.softSSID, "OLDSSID");
+    strcpy(old.otaHost, "old.example.com");
+    old.otaRateLimit = 7;
+    eraseFlash();
+    storeRecord(0, 1, version, &old, sizeof(old));
+}
+
+static void testMigration()
+{
+    storeOldRecord(0x24);
+    CHECK(speedAfterReboot(SettingsStore::Migrated) == 250000);
+    CHECK(!strcmp(settings.softSSID, "OLDSSID"));
+    CHECK(!strcmp(settings.otaHost, "www.macchina.cc"));
+    CHECK(settings.otaPort == 80 && settings.otaRateLimit == 64);
+    CHECK(settings.version == EEPROM_VER);
+
+    storeOldRecord(0x25);
+    CHECK(speedAfterReboot(SettingsStore::Migrated) == 250000);
+    CHECK(!strcmp(settings.otaHost, "old.example.com"));
+    CHECK(settings.otaRateLimit == 64);
+
+    storeOldRecord(0x26);
+    CHECK(speedAfterReboot(SettingsStore::Migrated) == 250000);
+    CHECK(settings.otaRateLimit == 7);
+    CHECK(settings.pollPlan[0].pid == 0 && settings.pollPlan[POLL_MAX_PIDS - 1].periodMs == 0);
+    CHECK(settings.pollRequestId == 0x7E0 && settings.pollBudget == POLL_DEFAULT_BUDGET);
+
+    storeOldRecord(0x27);
+    CHECK(speedAfterReboot(SettingsStore::Migrated) == 250000);
+    CHECK(settings.recordFrames == 1);
+
+    //written back in the current layout
+    CHECK(speedAfterReboot() == 250000);
+    CHECK(settings.otaRateLimit == 7);
+
+    storeOldRecord(EEPROM_OLDEST_VER - 1);
+    CHECK(speedAfterReboot(SettingsStore::Defaults) == 500000);
+    storeOldRecord(EEPROM_VER + 1);
+    CHECK(speedAfterReboot(SettingsStore::Defaults) == 500000);
+}
+
+static void testLegacyEEPROM()
+{
+    //no record yet, so the struct older firmware wrote through the EEPROM library is used
+    EEPROMSettings old;
+    memset(&old, 0x5A, sizeof(old));
+    old.version = 0x25;
+    old.CAN0Speed = 125000;
+    eraseFlash();
+    EEPROM.begin(1024);
+    EEPROM.writeBytes(0, &old, sizeof(old));
+    CHECK(speedAfterReboot(SettingsStore::Migrated) == 125000);
+    CHECK(settings.otaRateLimit == 64);
+
+    //the partition has a record now and the EEPROM copy is no longer looked at
+    memset(&old, 0xFF, sizeof(old));
+    EEPROM.writeBytes(0, &old, sizeof(old));
+    CHECK(speedAfterReboot() == 125000);
+}
+
+int main()
+{
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"slot rotation", testRotation},
+        {"records of older builds", testOldPartition},
+        {"current record is never erased", testNeverEraseCurrent},
+        {"CRC rejection", testCrcRejection},
+        {"torn writes", testTornWrite},
+        {"factory defaults", testStoreDefaults},
+        {"migration", testMigration},
+        {"EEPROM library settings", testLegacyEEPROM},
+    };
+
+    for (auto &test : tests)
+    {
+        int before = failures;
+        printf("%s\n", test.name);
+        test.run();
+        printf("  %s\n", (failures == before) ? "ok" : "FAILED");
+    }
+    printf("%i check(s) failed\n", failures);
+    fflush(stdout);
+    _exit(failures ? 1 : 0); //background tasks are still running
+}
@@ -0,0 +1,255 @@
+/*
+ * SignalDBTest.cpp
+ *
+ * Checks signal extraction in both byte orders, that the compiled kernels
+ * agree with the plain extraction, the flash store and the ELM327 commands
+ * and feed.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include "Check.h"
+#include "SignalDB.h"
+#include "ElmBench.h"
+#include "Hal.h"
+
+static ElmBench elm;
+
+static SignalDef makeDef(uint32_t id, int startBit, int length, uint8_t flags, float scale, float offset, const char *name)
+{
+    SignalDef def;
+    memset(&def, 0, sizeof(def));
+    def.id = id;
+    def.startBit = startBit;
+    def.length = length;
+    def.flags = flags;
+    def.scale = scale;
+    def.offset = offset;
+    strncpy(def.name, name, SIGNAL_NAME_LEN - 1);
+    return def;
+}
+
+static void sendFrame(uint32_t id, bool extended, const uint8_t *data, int length)
+{
+    CAN_FRAME frame;
+    frame.id = id;
+    frame.extended = extended;
+    frame.length = length;
+    memcpy(frame.data.bytes, data, length);
+    Hal::getDefaultCanBus().send(NULL, frame);
+}
+
+static void testExtract()
+{
+    const uint8_t data[8] = {0xA4, 0x0B, 0x12, 0x34, 0xFE, 0x00, 0x00, 0x80};
+    uint32_t raw;
+    float value;
+
+    //Intel: 0x0BA4 and the byte straddling nibbles 0x4 and 0xB
+    CHECK(SignalDB::extract(makeDef(0x100, 0, 16, 0, 1, 0, "a"), data, 8, raw, value) && raw == 0x0BA4);
+    CHECK(SignalDB::extract(makeDef(0x100, 4, 8, 0, 1, 0, "a"), data, 8, raw, value) && raw == 0xBA);
+    //Motorola counts from the msb: bit 23 is the top of byte 2
+    CHECK(SignalDB::extract(makeDef(0x100, 23, 16, SIG_BIG_ENDIAN, 1, 0, "a"), data, 8, raw, value) && raw == 0x1234);
+    CHECK(SignalDB::extract(makeDef(0x100, 19, 8, SIG_BIG_ENDIAN, 1, 0, "a"), data, 8, raw, value) && raw == 0x23);
+    //signed with scale and offset: 0xFE is -2
+    CHECK(SignalDB::extract(makeDef(0x100, 32, 8, SIG_SIGNED, 0.5, 10, "a"), data, 8, raw, value) && value == 9);
+    CHECK(SignalDB::extract(makeDef(0x100, 32, 8, 0, 0.5, 10, "a"), data, 8, raw, value) && value == 137);
+    CHECK(SignalDB::extract(makeDef(0x100, 63, 1, 0, 1, 0, "a"), data, 8, raw, value) && raw == 1);
+    //past the frame's data or the 64 bits
+    CHECK(!SignalDB::extract(makeDef(0x100, 0, 16, 0, 1, 0, "a"), data, 1, raw, value));
+    CHECK(!SignalDB::extract(makeDef(0x100, 60, 8, 0, 1, 0, "a"), data, 8, raw, value));
+    CHECK(!SignalDB::extract(makeDef(0x100, 57, 8, SIG_BIG_ENDIAN, 1, 0, "a"), data, 8, raw, value));
+    CHECK(!SignalDB::extract(makeDef(0x800, 0, 8, 0, 1, 0, "a"), data, 8, raw, value));
+}
+
+//random definitions and frames, the kernels must give what the plain extraction does
+static void testKernels()
+{
+    SignalDB db;
+    SignalDef defs[SIGNAL_MAX];
+    const uint8_t zeros[8] = {0};
+    uint32_t raw;
+    float value;
+    srand(getpid());
+
+    for (int i = 0; i < SIGNAL_MAX; i++)
+    {
+        do
+        {
+            uint32_t id = (i % 3 == 2) ? (0x18FEF100 + i % 4) | SIG_EXTENDED : 0x100 + i % 5;
+            uint8_t flags = rand() % 4;
+            defs[i] = makeDef(id, rand() % 64, 1 + rand() % 32, flags, 0.5, -3, "r");
+        } while (!SignalDB::extract(defs[i], zeros, 8, raw, value));
+        CHECK(db.add(defs[i]) == i);
+    }
+    CHECK(db.add(defs[0]) == -1);
+
+    int mismatches = 0;
+    for (int round = 0; round < 2000; round++)
+    {
+        CAN_FRAME frame;
+        int pick = rand() % SIGNAL_MAX;
+        frame.id = defs[pick].id & ~SIG_EXTENDED;
+        frame.extended = (defs[pick].id & SIG_EXTENDED) != 0;
+        frame.length = rand() % 9;
+        for (int b = 0; b < 8; b++) frame.data.bytes[b] = rand();
+        uint8_t changed[SIGNAL_MAX];
+        SignalValue before[SIGNAL_MAX];
+        for (int i = 0; i < SIGNAL_MAX; i++) db.getValue(i, before[i]);
+        db.processFrame(frame, changed, SIGNAL_MAX);
+
+        for (int i = 0; i < SIGNAL_MAX; i++)
+        {
+            SignalValue after;
+            db.getValue(i, after);
+            bool inFrame = defs[i].id == defs[pick].id && SignalDB::extract(defs[i], frame.data.bytes, frame.length, raw, value);
+            if (inFrame != (after.updates == before[i].updates + 1) || (inFrame && (after.raw != raw || after.value != value)))
+                mismatches++;
+        }
+    }
+    CHECK(mismatches == 0);
+
+    //frames without signals go by untouched
+    uint8_t changed[SIGNAL_MAX];
+    CAN_FRAME other;
+    other.id = 0x7FF;
+    other.length = 8;
+    CHECK(db.processFrame(other, changed, SIGNAL_MAX) == 0);
+}
+
+static void testChanged()
+{
+    SignalDB db;
+    uint8_t changed[SIGNAL_MAX];
+    CAN_FRAME frame;
+    frame.id = 0x200;
+    frame.length = 2;
+    frame.data.bytes[0] = 1;
+    frame.data.bytes[1] = 2;
+
+    CHECK(db.add(makeDef(0x200, 0, 8, 0, 1, 0, "low")) == 0);
+    CHECK(db.add(makeDef(0x200, 8, 8, 0, 1, 0, "high")) == 1);
+    CHECK(db.processFrame(frame, changed, SIGNAL_MAX) == 2);
+    CHECK(db.processFrame(frame, changed, SIGNAL_MAX) == 0);
+    frame.data.bytes[1] = 3;
+    CHECK(db.processFrame(frame, changed, SIGNAL_MAX) == 1 && changed[0] == 1);
+    SignalValue value;
+    CHECK(db.getValue(1, value) && value.value == 3 && value.updates == 3);
+}
+
+static void testStore()
+{
+    SignalDB db;
+    db.setup();
+    db.clear();
+    CHECK(db.add(makeDef(0x3F0, 0, 16, 0, 0.25, 0, "rpm")) == 0);
+    CHECK(db.add(makeDef(0x18FEF100 | SIG_EXTENDED, 15, 16, SIG_BIG_ENDIAN | SIG_SIGNED, 0.1, -40, "temp")) == 1);
+    CHECK(db.save());
+
+    SignalDB loaded;
+    loaded.setup();
+    SignalDef def;
+    CHECK(loaded.getCount() == 2);
+    CHECK(loaded.getDef(1, def) && def.id == (0x18FEF100 | SIG_EXTENDED) && def.startBit == 15 && def.length == 16 &&
+          def.flags == (SIG_BIG_ENDIAN | SIG_SIGNED) && def.offset == -40 && !strcmp(def.name, "temp"));
+
+    //a reset while saving keeps the previous definitions
+    CHECK(db.add(makeDef(0x3F1, 0, 8, 0, 1, 0, "gear")) == 2);
+    Hal::setFlashWriteLimit(40);
+    CHECK(!db.save());
+    Hal::setFlashWriteLimit(-1);
+    loaded.setup();
+    CHECK(loaded.getCount() == 2);
+    CHECK(db.save());
+    loaded.setup();
+    CHECK(loaded.getCount() == 3 && loaded.getDef(2, def) && !strcmp(def.name, "gear"));
+
+    //without the partition the definitions still work, they just aren't kept
+    CHECK(Hal::setPartitionSize("spiffs", 0x1000));
+    loaded.setup();
+    CHECK(loaded.getCount() == 0 && loaded.add(def) == 0 && !loaded.save());
+    CHECK(Hal::setPartitionSize("spiffs", 0x13F000));
+}
+
+static void testElm()
+{
+    std::string reply;
+    uint32_t micros;
+    CHECK(elm.request("stxsigc", reply, micros) && reply == "OK\r");
+    CHECK(elm.request("stxsiga3f0,0,16,l,0.25,0,rpm", reply, micros) && reply == "0\rOK\r");
+    CHECK(elm.request("stxsiga18fef100,15,16,bs,0.1,-40,temp", reply, micros) && reply == "1\rOK\r");
+    CHECK(elm.request("stxsiga3f0,60,8,l,1,0,bad", reply, micros) && reply == "?\r");
+    CHECK(elm.request("stxsigl", reply, micros) && reply == "0 3F0 0 16 lu 0.25 0 rpm\r1 18FEF100 15 16 bs 0.1 -40 temp\rOK\r");
+
+    const uint8_t rpm[2] = {0xA0, 0x0F}; //4000 * 0.25
+    const uint8_t temp[3] = {0x00, 0x03, 0x20}; //800 * 0.1 - 40
+    CHECK(elm.request("stxsigs1", reply, micros) && reply == "OK\r");
+    CHECK(elm.request("stxsubc", reply, micros) && reply == "OK\r");
+    sendFrame(0x3F0, false, rpm, 2);
+    sendFrame(0x18FEF100, true, temp, 3);
+    std::string feed = elm.receive(100);
+    CHECK(feed.find(",S1,temp,40\r") != std::string::npos && feed.find("rpm") == std::string::npos);
+    //only changes go out
+    sendFrame(0x18FEF100, true, temp, 3);
+    CHECK(elm.receive(100).empty());
+    CHECK(elm.request("stxsub0", reply, micros) && reply == "OK\r");
+
+    CHECK(elm.request("stxsigv", reply, micros) && reply.find("0 rpm 1000 FA0 ") == 0 &&
+          reply.find("\r1 temp 40 320 ") != std::string::npos);
+}
+
+int main()
+{
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"extraction", testExtract},
+        {"kernels", testKernels},
+        {"changed signals", testChanged},
+        {"flash store", testStore},
+        {"ELM327 commands and feed", testElm},
+    };
+
+    //keep clear of other instances and of anything already listening
+    Hal::setPortOffset(20000 + getpid() % 10000);
+
+    if (!elm.connect())
+    {
+        printf("Couldn't connect to the ELM327 port\n");
+        _exit(1);
+    }
+
+    for (auto &test : tests)
+    {
+        int before = failures;
+        printf("%s\n", test.name);
+        test.run();
+        printf("  %s\n", (failures == before) ? "ok" : "FAILED");
+    }
+    printf("%i check(s) failed\n", failures);
+    fflush(stdout);
+    _exit(failures ? 1 : 0); //background tasks are still running
+}
@@ -0,0 +1,361 @@
+/*
+ * TriggerTest.cpp
+ *
+ * Checks the trigger engine: what each kind of trigger fires on, the window
+ * kept around the triggering frame, captures that fill the ring or end on a
+ * quiet bus, and setting triggers over ELM and pulling the capture over GVRET.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "Check.h"
+#include "Frames.h"
+#include "TriggerEngine.h"
+#include "SignalDB.h"
+#include "ElmBench.h"
+#include "Hal.h"
+
+extern TriggerEngine triggerEngine;
+extern SignalDB signalDB;
+
+static ElmBench elm;
+//big enough to keep off the stack
+static TriggerEngine engine;
+
+//the trigger a frame fires on its own, -1 for none
+static int fires(const CAN_FRAME &frame)
+{
+    CAN_FRAME copy = frame;
+    engine.setWindow(0, 0);
+    engine.rearm();
+    engine.processFrame(copy);
+    return (engine.getState() == TriggerEngine::Captured) ? engine.getFiredTrigger() : -1;
+}
+
+static TriggerDef dataTrigger(uint32_t id, const std::vector<uint8_t> &mask, const std::vector<uint8_t> &value)
+{
+    TriggerDef def;
+    memset(&def, 0, sizeof(def));
+    def.type = TriggerDef::Data;
+    def.id = id;
+    def.length = mask.size();
+    for (size_t i = 0; i < mask.size(); i++)
+    {
+        def.mask[i] = mask[i];
+        def.value[i] = value[i];
+    }
+    return def;
+}
+
+static void testMatching()
+{
+    TriggerDef def;
+
+    engine.clear();
+    CHECK(fires(makeFrame(0x200, false, {1})) == -1);
+    memset(&def, 0, sizeof(def));
+    def.type = TriggerDef::Id;
+    def.id = 0x200;
+    CHECK(engine.add(def) == 0);
+    def.id = 0x18FEF100 | TRIGGER_EXTENDED;
+    CHECK(engine.add(def) == 1);
+    def.id = 0x800; //not an 11 bit ID
+    CHECK(engine.add(def) == -1);
+    CHECK(engine.add(dataTrigger(0x300, {0x00, 0xF0}, {0x00, 0x40})) == 2);
+    CHECK(engine.add(dataTrigger(0x300, {0xFF}, {0x07})) == 3);
+
+    CHECK(fires(makeFrame(0x200, false, {})) == 0);
+    CHECK(fires(makeFrame(0x201, false, {1, 2})) == -1);
+    CHECK(fires(makeFrame(0x18FEF100, true, {1})) == 1);
+    CHECK(fires(makeFrame(0x200, true, {1})) == -1);
+    //the high nibble of byte 1 is all that counts for trigger 2
+    CHECK(fires(makeFrame(0x300, false, {0x12, 0x4F, 0x99})) == 2);
+    CHECK(fires(makeFrame(0x300, false, {0x12, 0x3F})) == -1);
+    CHECK(fires(makeFrame(0x300, false, {0x12})) == -1);
+    //both match, the first one defined wins
+    CHECK(fires(makeFrame(0x300, false, {0x07, 0x40})) == 2);
+    CHECK(fires(makeFrame(0x300, false, {0x07})) == 3);
+
+    //a signal trigger keeps the definition the signal had when it was set
+    SignalDef signal;
+    memset(&signal, 0, sizeof(signal));
+    signal.id = 0x3F0;
+    signal.length = 16;
+    signal.scale = 0.25f;
+    strcpy(signal.name, "rpm");
+    signalDB.clear();
+    CHECK(signalDB.add(signal) == 0);
+    memset(&def, 0, sizeof(def));
+    def.type = TriggerDef::Signal;
+    def.signal = 0;
+    def.above = true;
+    def.threshold = 3000;
+    CHECK(engine.add(def) == 4);
+    def.signal = 1;
+    CHECK(engine.add(def) == -1);
+    signalDB.clear();
+    CHECK(fires(makeFrame(0x3F0, false, {12004 & 0xFF, 12004 >> 8})) == 4);
+    CHECK(fires(makeFrame(0x3F0, false, {11996 & 0xFF, 11996 >> 8})) == -1);
+    CHECK(fires(makeFrame(0x3F0, false, {0xFF})) == -1);
+
+    CHECK(fires(makeFrame(0x7E8, false, {0x04, 0x43, 0x01, 0x01, 0x33})) == -1);
+    memset(&def, 0, sizeof(def));
+    def.type = TriggerDef::DTC;
+    CHECK(engine.add(def) == 5);
+    CHECK(engine.getCount() == 6);
+    CHECK(engine.toText("\r") == "0 ID 200\r1 ID 18FEF100\r2 DATA 300 00F0 0040\r3 DATA 300 FF 07\r4 SIGNAL 0 > 3000\r5 DTC\rARMED 0 0\r");
+}
+
+static void testDTCs()
+{
+    struct {
+        uint32_t id;
+        bool extended;
+        std::vector<uint8_t> data;
+        bool carries;
+    } frames[] = {
+        {0x7E8, false, {0x04, 0x43, 0x01, 0x01, 0x33}, true},
+        {0x7E8, false, {0x02, 0x43, 0x00, 0x55, 0x55, 0x55, 0x55, 0x55}, false},
+        {0x7EA, false, {0x04, 0x47, 0x01, 0x04, 0x20}, true},
+        {0x7E9, false, {0x10, 0x0A, 0x43, 0x04, 0x01, 0x33, 0x02, 0x44}, true},
+        {0x7E8, false, {0x03, 0x41, 0x0C, 0x10}, false},
+        {0x123, false, {0x04, 0x43, 0x01, 0x01, 0x33}, false},
+        {0x18DAF110, true, {0x07, 0x59, 0x02, 0xFF, 0x01, 0x23, 0x45, 0x08}, true},
+        {0x18DAF110, true, {0x03, 0x59, 0x02, 0xFF}, false},
+        {0x18DA10F1, true, {0x07, 0x59, 0x02, 0xFF, 0x01, 0x23, 0x45, 0x08}, false},
+        {0x18FECA00, true, {0x04, 0xFF, 0x6E, 0x00, 0x03, 0x01, 0xFF, 0xFF}, true},
+        {0x18FECA00, true, {0x00, 0xFF, 0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF}, false},
+        {0x1CECFF00, true, {0x20, 0x0E, 0x00, 0x02, 0xFF, 0xCA, 0xFE, 0x00}, true},
+        {0x1CECFF00, true, {0x20, 0x0E, 0x00, 0x02, 0xFF, 0xE3, 0xFE, 0x00}, false},
+    };
+
+    for (auto &test : frames)
+    {
+        CAN_FRAME frame = makeFrame(test.id, test.extended, test.data);
+        bool carries = TriggerEngine::carriesDTCs(frame);
+        if (carries != test.carries) printf("  %X: %s\n", test.id, carries ? "DTCs" : "none");
+        CHECK(carries == test.carries);
+    }
+}
+
+//frames 1ms apart from base: 0x100 with the count in byte 0, 0x200 at fireAt
+static void feed(int count, int fireAt, uint32_t base)
+{
+    for (int i = 0; i < count; i++)
+    {
+        CAN_FRAME frame = makeFrame((i == fireAt) ? 0x200 : 0x100, false, {(uint8_t)i, (uint8_t)(i >> 8)});
+        frame.timestamp = base + i * 1000;
+        engine.processFrame(frame);
+    }
+}
+
+static int capturedIndex(int n)
+{
+    const CapturedFrame *frame = engine.getCaptured(n);
+    return frame ? (frame->data[0] | frame->data[1] << 8) : -1;
+}
+
+static void testWindow()
+{
+    TriggerDef def;
+    memset(&def, 0, sizeof(def));
+    def.type = TriggerDef::Id;
+    def.id = 0x200;
+    engine.clear();
+    engine.add(def);
+
+    //10ms before and 20ms after the trigger, the frame after that ends it
+    CHECK(engine.setWindow(10, 20));
+    feed(50, -1, 1000000);
+    CHECK(engine.getState() == TriggerEngine::Armed && engine.getCaptureCount() == 0);
+    feed(100, 50, 1000000);
+    CHECK(engine.getState() == TriggerEngine::Captured && engine.getFiredTrigger() == 0);
+    CHECK(engine.getCaptureCount() == 31 && engine.getTriggerPosition() == 10);
+    bool inOrder = true;
+    for (int n = 0; n < 31; n++) inOrder &= capturedIndex(n) == 40 + n;
+    CHECK(inOrder && engine.getCaptured(10)->id == 0x200 && engine.getCaptured(10)->micros == 1050000);
+    CHECK(engine.getCaptured(31) == NULL);
+    //held until pulled, later triggers don't replace it
+    feed(100, 10, 2000000);
+    CHECK(engine.getCaptureCount() == 31 && capturedIndex(0) == 40);
+
+    //a window wider than the ring ends when the capture would overwrite its start
+    engine.rearm();
+    CHECK(engine.setWindow(60000, 60000));
+    feed(TRIGGER_RING_SIZE * 3, TRIGGER_RING_SIZE * 2, 3000000);
+    CHECK(engine.getState() == TriggerEngine::Captured && engine.getCaptureCount() == TRIGGER_RING_SIZE);
+    CHECK(engine.getTriggerPosition() == TRIGGER_RING_SIZE - 1 && capturedIndex(0) == TRIGGER_RING_SIZE + 1);
+    engine.rearm();
+    CHECK(engine.setWindow(1, 60000));
+    feed(TRIGGER_RING_SIZE * 3, 100, 10000000);
+    CHECK(engine.getCaptureCount() == TRIGGER_RING_SIZE && engine.getTriggerPosition() == 1);
+    CHECK(capturedIndex(0) == 99 && capturedIndex(TRIGGER_RING_SIZE - 1) == 99 + TRIGGER_RING_SIZE - 1);
+
+    //re-armed, frames from before don't make it into the next capture
+    engine.rearm();
+    CHECK(engine.setWindow(1000, 0));
+    feed(3, 2, 20000000);
+    CHECK(engine.getCaptureCount() == 3 && capturedIndex(0) == 0);
+
+    //with the bus quiet the post-trigger window ends in loop()
+    engine.rearm();
+    CHECK(engine.setWindow(0, 20));
+    CAN_FRAME frame = makeFrame(0x200, false, {});
+    engine.processFrame(frame);
+    CHECK(engine.getState() != TriggerEngine::Armed);
+    delay(30);
+    engine.loop();
+    CHECK(engine.getState() == TriggerEngine::Captured && engine.getCaptureCount() == 1);
+}
+
+static void testSpeed()
+{
+    TriggerDef def;
+    memset(&def, 0, sizeof(def));
+    def.type = TriggerDef::Id;
+    engine.clear();
+    for (int i = 0; i < TRIGGER_MAX - 1; i++)
+    {
+        def.id = (i & 1) ? (0x18FF0000 + i) | TRIGGER_EXTENDED : 0x600 + i;
+        engine.add(engine.getCount() & 2 ? dataTrigger(def.id, {0xFF}, {0xFF}) : def);
+    }
+    def.type = TriggerDef::DTC;
+    engine.add(def);
+    engine.setWindow(100, 100);
+
+    //a busy bus where nothing fires: IDs with and without triggers, 29 bit and diagnostic ones
+    const int count = 200000;
+    CAN_FRAME frames[8];
+    for (int i = 0; i < 8; i++)
+    {
+        frames[i] = makeFrame((i & 1) ? 0x18FF0000 + i * 2 : 0x600 + i * 2 + 1, i & 1, {0, 1, 2, 3, 4, 5, 6, 7});
+        if (i == 5) frames[i].id = 0x602;
+        if (i == 7) frames[i] = makeFrame(0x7E8, false, {0x03, 0x41, 0x0C, 0x10});
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++)
+    {
+        frames[i & 7].timestamp = i * 250;
+        engine.processFrame(frames[i & 7]);
+    }
+    double nanos = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    printf("  %.1fns per frame with %i triggers\n", nanos / count, engine.getCount());
+    CHECK(engine.getState() == TriggerEngine::Armed);
+}
+
+static void testPull()
+{
+    std::string reply;
+    uint32_t micros;
+
+    CHECK(elm.request("stxtrgc", reply, micros) && reply == "OK\r");
+    CHECK(elm.request("stxtrgb7e8,ffff,0443", reply, micros) && reply == "0\rOK\r");
+    CHECK(elm.request("stxtrgi18fef100", reply, micros) && reply == "1\rOK\r");
+    CHECK(elm.request("stxtrgs70,>,1", reply, micros) && reply == "?\r");
+    CHECK(elm.request("stxtrgb7e8,ff,0443", reply, micros) && reply == "?\r");
+    CHECK(elm.request("stxtrgd", reply, micros) && reply == "2\rOK\r");
+    CHECK(elm.request("stxtrgw5000,0", reply, micros) && reply == "OK\r");
+    CHECK(elm.request("stxtrgl", reply, micros) && reply == "0 DATA 7E8 FFFF 0443\r1 ID 18FEF100\r2 DTC\rARMED 5000 0\rOK\r");
+
+#ifndef BLUETOOTH
+    WiFiClient client;
+    uint32_t start = millis();
+    while (millis() - start < 2000 && !client.connect("127.0.0.1", Hal::mapPort(23))) elm.receive(1);
+    CHECK(client.connected());
+    std::vector<CAN_FRAME> frames;
+    std::vector<std::vector<uint8_t>> replies;
+    const uint8_t request[] = {0xF1, PROTO_GET_CAPTURE};
+    client.write(request, sizeof(request));
+    readGvret(elm, client, 100, frames, replies);
+    CHECK(frames.empty() && replies.size() == 1 && replies[0] == std::vector<uint8_t>({0xF1, PROTO_GET_CAPTURE, 0xFF, 0, 0, 0, 0}));
+#endif
+
+    //the DTC trigger comes first, it catches the answer before trigger 0 does
+    std::vector<CAN_FRAME> sent;
+    for (int i = 0; i < 30; i++)
+    {
+        sent.push_back(makeFrame(0x100 + i, false, {(uint8_t)i}));
+        if (i == 20) sent.back() = makeFrame(0x7E8, false, {0x04, 0x43, 0x01, 0x01, 0x33});
+        Hal::getDefaultCanBus().send(NULL, sent.back());
+        elm.receive(1);
+    }
+    CHECK(elm.request("stxtrgl", reply, micros) && reply.find("CAPTURED 2 21 20\r") != std::string::npos);
+
+#ifndef BLUETOOTH
+    //the live frames first, then the capture
+    frames.clear();
+    replies.clear();
+    readGvret(elm, client, 100, frames, replies);
+    CHECK(frames.size() == sent.size() && replies.empty());
+    frames.clear();
+    client.write(request, sizeof(request));
+    readGvret(elm, client, 200, frames, replies);
+    CHECK(frames.size() == 21 && replies.size() == 1 && replies[0] == std::vector<uint8_t>({0xF1, PROTO_GET_CAPTURE, 2, 21, 0, 20, 0}));
+    for (size_t i = 0; i < frames.size(); i++) CHECK(frames[i].id == sent[i].id && frames[i].data.bytes[0] == sent[i].data.bytes[0]);
+    //pulling it armed the triggers again
+    CHECK(triggerEngine.getState() == TriggerEngine::Armed);
+    client.stop();
+    elm.receive(10);
+#endif
+    CHECK(elm.request("stxtrgr", reply, micros) && reply == "OK\r");
+    CHECK(elm.request("stxtrgc", reply, micros) && reply == "OK\r");
+    CHECK(triggerEngine.getCount() == 0);
+}
+
+int main()
+{
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"matching", testMatching},
+        {"DTC frames", testDTCs},
+        {"capture window", testWindow},
+        {"matcher speed", testSpeed},
+        {"ELM commands and GVRET pull", testPull},
+    };
+
+    //keep clear of other instances and of anything already listening
+    Hal::setPortOffset(20000 + getpid() % 10000);
+
+    if (!elm.connect())
+    {
+        printf("Couldn't connect to the ELM327 port\n");
+        _exit(1);
+    }
+
+    for (auto &test : tests)
+    {
+        int before = failures;
+        printf("%s\n", test.name);
+        test.run();
+        printf("  %s\n", (failures == before) ? "ok" : "FAILED");
+    }
+    printf("%i check(s) failed\n", failures);
+    fflush(stdout);
+    _exit(failures ? 1 : 0); //background tasks are still running
+}
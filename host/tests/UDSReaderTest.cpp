@@ -0,0 +1,308 @@
+/*
+ * UDSReaderTest.cpp
+ *
+ * Tests for batched UDS DID reads over ISO-TP, through the ELM327 and GVRET
+ * ports, against the simulated ECUs.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <atomic>
+#include <WiFi.h>
+#include "CanBus.h"
+#include "Check.h"
+#include "EcuSimulator.h"
+#include "ElmBench.h"
+#include "Hal.h"
+#include "UDSReader.h"
+
+extern UDSReader udsReader;
+
+static EcuSimulator sim;
+static ElmBench elm;
+
+//DIDs 0100-0113 on ECU 2, two to five bytes long
+static std::string didList(int count, bool withLengths)
+{
+    std::string list;
+    char buff[16];
+    for (int i = 0; i < count; i++)
+    {
+        if (withLengths) sprintf(buff, ",%04X:%i", 0x100 + i, 2 + i % 4);
+        else sprintf(buff, ",%04X", 0x100 + i);
+        list += buff;
+    }
+    return list;
+}
+
+static std::string expected(int count)
+{
+    std::string text;
+    char buff[16];
+    for (int i = 0; i < count; i++)
+    {
+        sprintf(buff, "%04X:", 0x100 + i);
+        text += buff;
+        for (int b = 0; b < 2 + i % 4; b++)
+        {
+            sprintf(buff, "%02X", i + b);
+            text += buff;
+        }
+        text += "\r";
+    }
+    return text;
+}
+
+static bool read(const std::string &command, std::string &reply, uint32_t &micros, uint32_t &requests)
+{
+    uint32_t before = udsReader.getRequests();
+    bool answered = elm.request(command, reply, micros, 5000);
+    requests = udsReader.getRequests() - before;
+    return answered;
+}
+
+//the first read learns the lengths, so the second one asks for many DIDs at once
+static void testBatching()
+{
+    std::string reply;
+    uint32_t firstMicros, secondMicros, firstRequests, secondRequests;
+    CHECK(read("stxudsr2" + didList(20, false), reply, firstMicros, firstRequests));
+    CHECK(reply == expected(20));
+    CHECK(read("stxudsr2" + didList(20, false), reply, secondMicros, secondRequests));
+    CHECK(reply == expected(20));
+    printf("  20 DIDs: %u requests in %uus, then %u requests in %uus\n", firstRequests, firstMicros, secondRequests,
+           secondMicros);
+    CHECK(firstRequests == 20);
+    CHECK(secondRequests == 2);
+    CHECK(secondMicros < firstMicros);
+}
+
+//an ECU refusing long requests gets shorter ones until it takes them
+static void testDIDLimit()
+{
+    sim.setDIDLimit(3, 4);
+    std::string reply;
+    uint32_t micros, requests;
+    CHECK(read("stxudsr3" + didList(12, true), reply, micros, requests));
+    CHECK(reply == expected(12));
+    printf("  12 DIDs, 4 per request: %u requests\n", requests);
+    CHECK(requests == 6); //12 and 6 refused, then 3 at a time
+    //remembered for the next read
+    CHECK(read("stxudsr3" + didList(12, true), reply, micros, requests));
+    CHECK(reply == expected(12) && requests == 4);
+}
+
+static void testUnsupported()
+{
+    std::string reply;
+    uint32_t micros, requests;
+    //left out of a batch answer
+    CHECK(read("stxudsr2,0100:2,0777:2,0101:3", reply, micros, requests));
+    CHECK(reply == "0100:0001\r0777:7F31\r0101:010203\r" && requests == 1);
+    //asked alone
+    CHECK(read("stxudsr2,0777", reply, micros, requests));
+    CHECK(reply == "0777:7F31\r");
+    //a wrong length hint costs requests, not values
+    CHECK(read("stxudsr2,0102:9,0103:1,0104", reply, micros, requests));
+    CHECK(reply == "0102:02030405\r0103:0304050607\r0104:0405\r" && requests == 4);
+    //nonsense
+    CHECK(read("stxudsr2", reply, micros, requests) && reply == "?\r");
+    CHECK(read("stxudsr9,0100", reply, micros, requests) && reply == "?\r");
+}
+
+static void testResponsePending()
+{
+    sim.setPending(2, 0x22, 3);
+    std::string reply;
+    uint32_t micros, requests;
+    CHECK(read("stxudsr2" + didList(6, true), reply, micros, requests));
+    CHECK(reply == expected(6) && requests == 1);
+    sim.setPending(2, 0x22, 0);
+}
+
+//another tester on the bus reading F190 from ECU 2 ahead of every one of our requests
+struct Bystander : public CanNode {
+    std::atomic<bool> active{false};
+
+    void frameReceived(const CAN_FRAME &frame) override
+    {
+        if (!active || frame.id != 0x7E2 || frame.data.byte[1] != 0x22) return;
+        CAN_FRAME answer = frame;
+        answer.id = 0x7EA;
+        const uint8_t data[8] = {0x04, 0x62, 0xF1, 0x90, 0x41, 0, 0, 0};
+        memcpy(answer.data.bytes, data, 8);
+        Hal::getDefaultCanBus().send(this, answer);
+    }
+};
+
+//the answer to someone else's read is left alone, ours still comes in one request
+static void testForeignAnswer()
+{
+    Bystander bystander;
+    Hal::getDefaultCanBus().attach(&bystander);
+    bystander.active = true;
+    std::string reply;
+    uint32_t micros, requests;
+    CHECK(read("stxudsr2,0100:2,0101:3", reply, micros, requests));
+    CHECK(reply == "0100:0001\r0101:010203\r" && requests == 1);
+    bystander.active = false;
+    Hal::getDefaultCanBus().detach(&bystander);
+}
+
+static void testNoECU()
+{
+    std::string reply;
+    uint32_t micros, requests;
+    CHECK(read("stxudsr5,F190,F18C", reply, micros, requests));
+    CHECK(reply == "F190:NO DATA\rF18C:NO DATA\r");
+    CHECK(micros > PID_RESPONSE_TIMEOUT && micros < 2 * PID_RESPONSE_TIMEOUT);
+}
+
+//a new line abandons the read, like it does any request
+static void testAbandoned()
+{
+    std::string reply;
+    uint32_t micros;
+    elm.send("stxudsr2" + didList(8, false));
+    CHECK(elm.request("atrv", reply, micros) && reply.find("V") != std::string::npos);
+    CHECK(!udsReader.isBusy());
+}
+
+#ifndef BLUETOOTH
+//the next PROTO_UDS_READ reply, skipping the frames GVRET passes on
+static bool gvretReply(WiFiClient &client, std::vector<uint8_t> &reply, uint32_t timeout)
+{
+    std::vector<uint8_t> in;
+    uint32_t start = millis();
+    while (millis() - start < timeout)
+    {
+        elm.receive(1);
+        while (client.available()) in.push_back(client.read());
+        while (in.size() >= 11 && in[0] == 0xF1 && in[1] == 0 && in.size() >= 12u + (in[10] & 0xF))
+        {
+            in.erase(in.begin(), in.begin() + 12 + (in[10] & 0xF));
+        }
+        if (in.size() < 4 || in[0] != 0xF1 || in[1] != PROTO_UDS_READ) continue;
+        size_t length = 4;
+        for (int d = 0; d < in[3] && length + 4 <= in.size(); d++) length += 4 + in[length + 3];
+        if (in.size() < length) continue;
+        reply.assign(in.begin(), in.begin() + length);
+        return true;
+    }
+    return false;
+}
+#endif
+
+static void testGVRET()
+{
+#ifndef BLUETOOTH
+    WiFiClient client;
+    uint32_t start = millis();
+    while (millis() - start < 2000 && !client.connect("127.0.0.1", Hal::mapPort(23))) elm.receive(1);
+    CHECK(client.connected());
+
+    //ECU 2, three DIDs, the third one unknown to it
+    const uint8_t request[] = {0xF1, PROTO_UDS_READ, 2, 3, 0x01, 0x00, 2, 0x01, 0x01, 0, 0x07, 0x77, 0, 0};
+    client.write(request, sizeof(request));
+    const uint8_t expected[] = {0xF1, PROTO_UDS_READ, 2, 3, 0x01, 0x00, UDS_OK, 2, 0x00, 0x01,
+                                0x01, 0x01, UDS_OK, 3, 0x01, 0x02, 0x03, 0x07, 0x77, 0x31, 0};
+    std::vector<uint8_t> reply;
+    CHECK(gvretReply(client, reply, 2000));
+    CHECK(reply == std::vector<uint8_t>(expected, expected + sizeof(expected)));
+
+    //one read at a time, the ELM327 port gets refused while GVRET's runs
+    const uint8_t absent[] = {0xF1, PROTO_UDS_READ, 5, 1, 0xF1, 0x90, 0, 0};
+    client.write(absent, sizeof(absent));
+    elm.receive(5);
+    std::string text;
+    uint32_t micros;
+    CHECK(elm.request("stxudsr2,0100", text, micros) && text == "?\r");
+    client.write(absent, sizeof(absent));
+    const uint8_t refused[] = {0xF1, PROTO_UDS_READ, 0xFF, 0};
+    CHECK(gvretReply(client, reply, 200));
+    CHECK(reply == std::vector<uint8_t>(refused, refused + sizeof(refused)));
+    CHECK(gvretReply(client, reply, 1000));
+    CHECK(reply.size() == 8 && reply[2] == 5 && reply[6] == UDS_NO_ANSWER && reply[7] == 0);
+    client.stop();
+    elm.receive(5);
+#endif
+}
+
+int main()
+{
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"batching", testBatching},
+        {"ECU DID limit", testDIDLimit},
+        {"unsupported DIDs", testUnsupported},
+        {"response pending", testResponsePending},
+        {"foreign answer", testForeignAnswer},
+        {"no ECU", testNoECU},
+        {"abandoned read", testAbandoned},
+        {"GVRET", testGVRET},
+    };
+
+    //keep clear of other instances and of anything already listening
+    Hal::setPortOffset(20000 + getpid() % 10000);
+
+    CHECK(sim.loadDefault());
+    std::string script;
+    char buff[64];
+    for (int ecu = 2; ecu <= 3; ecu++)
+    {
+        sprintf(buff, "ecu %i physical\ndelay %i 2000\n", ecu, ecu);
+        script += buff;
+        for (int i = 0; i < 20; i++)
+        {
+            sprintf(buff, "did %i %04X", ecu, 0x100 + i);
+            script += buff;
+            for (int b = 0; b < 2 + i % 4; b++)
+            {
+                sprintf(buff, " %02X", i + b);
+                script += buff;
+            }
+            script += "\n";
+        }
+    }
+    CHECK(sim.parseScript(script));
+    sim.attach(Hal::getDefaultCanBus());
+    if (!elm.connect())
+    {
+        printf("Couldn't connect to the ELM327 port\n");
+        _exit(1);
+    }
+
+    for (auto &test : tests)
+    {
+        int before = failures;
+        printf("%s\n", test.name);
+        test.run();
+        printf("  %s\n", (failures == before) ? "ok" : "FAILED");
+    }
+    printf("%i check(s) failed\n", failures);
+    fflush(stdout);
+    _exit(failures ? 1 : 0); //background tasks are still running
+}
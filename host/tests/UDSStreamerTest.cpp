@@ -0,0 +1,203 @@
+/*
+ * UDSStreamerTest.cpp
+ *
+ * Tests for ECU side streaming with UDS 0x2C/0x2A against the simulated ECUs.
+ *
+ Copyright (c) 2019 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <unistd.h>
+#include "Check.h"
+#include "EcuSimulator.h"
+#include "ElmBench.h"
+#include "Hal.h"
+#include "UDSReader.h"
+#include "UDSStreamer.h"
+
+extern UDSStreamer udsStreamer;
+
+static EcuSimulator sim;
+static ElmBench elm;
+
+static bool command(const char *text)
+{
+    std::string reply;
+    uint32_t micros;
+    return elm.request(text, reply, micros) && reply == "OK\r";
+}
+
+static int countLines(const std::string &text, const char *part)
+{
+    int count = 0;
+    for (size_t pos = text.find(part); pos != std::string::npos; pos = text.find(part, pos + 1)) count++;
+    return count;
+}
+
+static void testStream()
+{
+    std::string reply;
+    uint32_t micros;
+    CHECK(command("stxsubc"));
+    uint32_t requestsBefore = sim.getRequests();
+    CHECK(elm.request("stxstra2,3,0100:1:2,0101:2:2", reply, micros) && reply == "0\rOK\r");
+    StreamStats stats;
+    uint32_t start = millis();
+    while (millis() - start < 500 && !(udsStreamer.getStats(0, stats) && stats.state == UDSStreamer::Running)) elm.receive(1);
+    uint32_t framesBefore = stats.frames;
+    std::string feed = elm.receive(500);
+    //the feed keeps coming until the reply to turning it off
+    CHECK(elm.request("stxsub0", reply, micros) && reply.size() >= 3 && reply.substr(reply.size() - 3) == "OK\r");
+    feed += reply;
+    int rpm = countLines(feed, ",7EA,0100,1\r");
+    int other = countLines(feed, ",7EA,0101,203\r");
+    printf("  %i and %i values in 500ms from %i requests\n", rpm, other, sim.getRequests() - requestsBefore);
+    //the set up, nothing after that
+    CHECK(sim.getRequests() - requestsBefore == 4);
+
+    CHECK(udsStreamer.getStats(0, stats));
+    CHECK(stats.state == UDSStreamer::Running);
+    CHECK(rpm >= 10 && rpm == (int)(stats.frames - framesBefore) && other == rpm);
+    CHECK(stats.intervalAvg > 15000 && stats.intervalAvg < 25000);
+    CHECK(elm.request("stxstrs", reply, micros) && reply.find("0 2 3 running 00 ") == 0);
+}
+
+//periodic frames share 7EA with the answers the client asks for
+static void testClientRequests()
+{
+    std::string reply;
+    uint32_t micros;
+    CHECK(command("atsh7e2"));
+    int good = 0;
+    for (int i = 0; i < 10; i++)
+    {
+        if (elm.request("220101", reply, micros) && reply == "620101010203\r") good++;
+    }
+    CHECK(good == 10);
+    CHECK(command("atsh7df"));
+    CHECK(elm.request("010c", reply, micros) && reply.find("410C1AF8") != std::string::npos);
+}
+
+//S3 is 2.5s on ECU 2, tester present keeps the session and the stream going
+static void testKeepAlive()
+{
+    StreamStats before, after;
+    CHECK(udsStreamer.getStats(0, before));
+    uint32_t requestsBefore = sim.getRequests();
+    elm.receive(3500);
+    CHECK(udsStreamer.getStats(0, after));
+    printf("  %u frames in 3.5s, %u requests\n", after.frames - before.frames, sim.getRequests() - requestsBefore);
+    CHECK(after.frames - before.frames >= 150 && after.restarts == 0);
+    CHECK(sim.getRequests() - requestsBefore <= 2);
+}
+
+//an ECU reset ends the session. The stream is set up again once it has been quiet
+static void testRestart()
+{
+    std::string reply;
+    uint32_t micros;
+    CHECK(command("atsh7e2"));
+    CHECK(elm.request("1101", reply, micros) && reply == "5101\r");
+    CHECK(command("atsh7df"));
+    StreamStats before, after;
+    CHECK(udsStreamer.getStats(0, before));
+    elm.receive(UDS_STREAM_STALL_MS + 300);
+    CHECK(udsStreamer.getStats(0, after));
+    printf("  %u restarts, %u frames since\n", after.restarts, after.frames - before.frames);
+    CHECK(after.restarts == 1 && after.state == UDSStreamer::Running && after.frames - before.frames >= 5);
+}
+
+static void testStop()
+{
+    std::string reply;
+    uint32_t micros;
+    CHECK(command("stxstrd0"));
+    elm.receive(100);
+    uint32_t framesBefore = sim.getPeriodicFrames();
+    elm.receive(200);
+    CHECK(sim.getPeriodicFrames() == framesBefore);
+    StreamStats stats;
+    CHECK(!udsStreamer.getStats(0, stats));
+    CHECK(elm.request("stxstrs", reply, micros) && reply == "OK\r");
+    CHECK(!command("stxstrd0"));
+}
+
+static void testRefused()
+{
+    std::string reply;
+    uint32_t micros;
+    //not a DID ECU 0 has
+    CHECK(elm.request("stxstra0,1,0999:1:1", reply, micros) && reply == "0\rOK\r");
+    //nobody there
+    CHECK(elm.request("stxstra5,1,F190:1:4", reply, micros) && reply == "1\rOK\r");
+    elm.receive(400);
+    StreamStats stats;
+    CHECK(udsStreamer.getStats(0, stats) && stats.state == UDSStreamer::Failed && stats.status == 0x31);
+    CHECK(udsStreamer.getStats(1, stats) && stats.state == UDSStreamer::Failed && stats.status == UDS_NO_ANSWER);
+    CHECK(command("stxstrd0"));
+    CHECK(command("stxstrd1"));
+
+    CHECK(elm.request("stxstra2,4,0100:1:2", reply, micros) && reply == "?\r");     //rate
+    CHECK(elm.request("stxstra2,1,0101:1:5", reply, micros) && reply == "?\r");     //part too long
+    CHECK(elm.request("stxstra2,1,0102:1:4,0103:1:4", reply, micros) && reply == "?\r"); //more than a frame
+    CHECK(elm.request("stxstra2,1", reply, micros) && reply == "?\r");
+}
+
+int main()
+{
+    struct {
+        const char *name;
+        void (*run)();
+    } tests[] = {
+        {"stream", testStream},
+        {"client requests while streaming", testClientRequests},
+        {"tester present", testKeepAlive},
+        {"set up again after a reset", testRestart},
+        {"stop", testStop},
+        {"refused", testRefused},
+    };
+
+    //keep clear of other instances and of anything already listening
+    Hal::setPortOffset(20000 + getpid() % 10000);
+
+    CHECK(sim.loadDefault());
+    CHECK(sim.parseScript("ecu 2 physical\ndelay 2 2000\nperiodic 2 200000 50000 20000\ns3 2 2500000\n"
+                          "did 2 0100 00 01\ndid 2 0101 01 02 03\ndid 2 0102 02 03 04 05\ndid 2 0103 03 04 05 06 07\n"));
+    sim.setDelay(0, 1000);
+    sim.attach(Hal::getDefaultCanBus());
+    if (!elm.connect())
+    {
+        printf("Couldn't connect to the ELM327 port\n");
+        _exit(1);
+    }
+
+    for (auto &test : tests)
+    {
+        int before = failures;
+        printf("%s\n", test.name);
+        test.run();
+        printf("  %s\n", (failures == before) ? "ok" : "FAILED");
+    }
+    printf("%i check(s) failed\n", failures);
+    fflush(stdout);
+    _exit(failures ? 1 : 0); //background tasks are still running
+}